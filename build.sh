@@ -5,10 +5,19 @@ set -e
 CFLAGS="-Wall -Wextra -Wswitch-enum -Wmissing-prototypes -Wimplicit-fallthrough -Wconversion -fno-strict-aliasing -O3 -std=c11 -pedantic"
 CC="/usr/bin/cc"
 LIBBASM="src/basm/libbasm.h"
+# The float instructions call into libm
+LDLIBS="-lm"
+
+# Tests that spawn fibers, only the VM schedules them so basm2elf and basm2nasm reject these
+VM_ONLY_TESTS="fibers threads channels"
 
 PLATFORM_WINDOWS="WINDOWS"
 PLATFORM_LINUX="LINUX"
 
+function vm_only() {
+  [[ " $VM_ONLY_TESTS " == *" $1 "* ]]
+}
+
 function make_image() {
     PLATFORM=$1
 
@@ -31,6 +40,48 @@ function compile_raw_tests() {
   done
 }
 
+function compile_optimized_tests() {
+  if [ ! -d ./test/temp ]
+  then
+      mkdir ./test/temp
+  fi
+
+  for FILE in ./test/src/*.basm
+  do
+    OUTPUT=./test/temp/`basename ${FILE%.*}`.opt
+    echo "./basm -O $FILE -o $OUTPUT"
+    ./basm -O $FILE -o $OUTPUT
+  done
+}
+
+function compile_cached_tests() {
+  rm -rf ./test/temp/cache
+
+  for FILE in ./test/src/*.basm
+  do
+    OUTPUT=./test/temp/`basename ${FILE%.*}`.cached
+    echo "./basm --cache ./test/temp/cache $FILE -o $OUTPUT"
+    ./basm --cache ./test/temp/cache $FILE -o $OUTPUT > /dev/null
+    # The second run has to come out of the cache and match the uncached image byte for byte
+    if ! ./basm --cache ./test/temp/cache $FILE -o $OUTPUT | grep -q "Cache hit"
+    then
+      echo "ERROR: '$FILE' missed the cache"
+      exit 1
+    fi
+    cmp $OUTPUT ${FILE%.*}
+  done
+}
+
+function compile_pgo_tests() {
+  for FILE in ./test/src/*.basm
+  do
+    OUTPUT=./test/temp/`basename ${FILE%.*}`
+    echo "./basm -O --profile-use $OUTPUT.profile $FILE -o $OUTPUT.pgo"
+    ./br -i $OUTPUT.opt -p $OUTPUT.profile > /dev/null
+    ./basm -O --profile-use $OUTPUT.profile $FILE -o $OUTPUT.pgo
+  done
+}
+
 function compile_elf_tests() {
       if [ ! -d ./test/temp ]
       then
@@ -43,8 +94,10 @@ function compile_elf_tests() {
       echo "./basm $FILE -o ./test/temp/code"
       ./basm $FILE -o ./code
       ld -r -b binary ./code -o ./test/temp/code.o
+      objcopy --rename-section .data=.rodata,alloc,load,readonly,data,contents \
+              --set-section-alignment .data=4096 ./test/temp/code.o
       mv ./code ./test/temp/code
-      $CC ./images/LINUX.o ./test/temp/code.o -o $OUTPUT.exe
+      $CC ./images/LINUX.o ./test/temp/code.o -o $OUTPUT.exe $LDLIBS
   done
 }
 
@@ -91,6 +144,209 @@ function run_raw_tests() {
   fi
 }
 
+function compile_fail_tests() {
+  for FILE in ./test/fail/*.basm
+  do
+    OUTPUT=${FILE%.*}
+    echo "./basm $FILE -o $OUTPUT"
+    ./basm $FILE -o $OUTPUT
+  done
+}
+
+# The programs in test/fail have to stop with the error in their expected file, they run with 256MB of address space
+# so that allocations the VM cannot make fail the same way everywhere
+function run_fail_tests() {
+  FAILS=0
+
+  for FILE in ./test/fail/*.basm
+  do
+    NEW=0
+    FILE=${FILE%.*}
+
+    printf "%-40s" "Test '$FILE' "
+
+    OUTPUT=$(ulimit -v 262144; if ./br -i $FILE 2>&1; then echo "ERROR: It did not fail"; fi)
+
+    if [ ! -f ./test/expected/`basename $FILE`.txt ]
+    then
+      NEW=1
+      echo "$OUTPUT" > ./test/expected/`basename $FILE`.txt
+    fi
+
+    EXPECTED=$(cat ./test/expected/`basename $FILE`.txt)
+
+    if [ "$EXPECTED" = "$OUTPUT" ]
+    then
+      printf "[OK]"
+    else
+      FAILS=1
+      printf "[FAILURE]"
+    fi
+
+    if [ $NEW = 1 ]
+    then
+      echo " [NEW]"
+    else
+      echo ""
+    fi
+  done
+
+  if [ $FAILS = 1 ]
+  then
+    echo "Errors occurred"
+    exit 1
+  fi
+}
+
+function run_optimized_tests() {
+  SUFFIX=$1
+  FAILS=0
+
+  for FILE in ./test/src/*.basm
+  do
+    NAME=`basename ${FILE%.*}`
+
+    printf "%-40s" "Test '$FILE' $SUFFIX "
+
+    OUTPUT=$(./br -i ./test/temp/$NAME.$SUFFIX)
+    EXPECTED=$(cat ./test/expected/$NAME.txt)
+
+    if [ "$EXPECTED" = "$OUTPUT" ]
+    then
+      echo "[OK]"
+    else
+      FAILS=1
+      echo "[FAILURE]"
+    fi
+  done
+
+  if [ $FAILS = 1 ]
+  then
+    echo "Errors occurred"
+    exit 1
+  fi
+}
+
+function compile_native_tests() {
+  for FILE in ./test/src/*.basm
+  do
+    if vm_only `basename ${FILE%.*}`
+    then
+      continue
+    fi
+
+    OUTPUT=./test/temp/`basename ${FILE%.*}`
+    echo "./basm2elf -o $OUTPUT.native $FILE"
+    ./basm2elf -o $OUTPUT.native $FILE
+  done
+}
+
+function compile_c_tests() {
+  for FILE in ./test/src/*.basm
+  do
+    OUTPUT=./test/temp/`basename ${FILE%.*}`
+    echo "./basm2c $FILE > $OUTPUT.c"
+    ./basm2c $FILE > $OUTPUT.c
+    $CC $CFLAGS -I./src/basm -o $OUTPUT.transpiled $OUTPUT.c $LDLIBS
+  done
+}
+
+function compile_nasm_tests() {
+  for FILE in ./test/src/*.basm
+  do
+    if vm_only `basename ${FILE%.*}`
+    then
+      continue
+    fi
+
+    OUTPUT=./test/temp/`basename ${FILE%.*}`
+    echo "./basm2nasm $FILE > $OUTPUT.asm"
+    ./basm2nasm $FILE > $OUTPUT.asm
+    nasm -felf64 $OUTPUT.asm -o $OUTPUT.nasm.o
+    ld $OUTPUT.nasm.o -o $OUTPUT.nasm
+  done
+}
+
+function run_native_tests() {
+  SUFFIX=$1
+  FAILS=0
+
+  for FILE in ./test/src/*.basm
+  do
+    NAME=`basename ${FILE%.*}`
+
+    printf "%-40s" "Test '$FILE' $SUFFIX "
+
+    if [ "$SUFFIX" != "transpiled" ] && vm_only $NAME
+    then
+      echo "[SKIPPED]"
+      continue
+    fi
+
+    OUTPUT=$(./test/temp/$NAME.$SUFFIX)
+    EXPECTED=$(cat ./test/expected/$NAME.txt)
+
+    if [ "$EXPECTED" = "$OUTPUT" ]
+    then
+      echo "[OK]"
+    else
+      FAILS=1
+      echo "[FAILURE]"
+    fi
+  done
+
+  if [ $FAILS = 1 ]
+  then
+    echo "Errors occurred"
+    exit 1
+  fi
+}
+
+# The hosts in test/embed link against libbyterunner like an embedding program does
+function run_embed_tests() {
+  FAILS=0
+
+  for FILE in ./test/embed/*.c
+  do
+    NEW=0
+    NAME=`basename ${FILE%.*}`
+
+    printf "%-40s" "Test '$FILE' "
+
+    $CC $CFLAGS -o ./test/temp/$NAME $FILE -L. -lbyterunner $LDLIBS
+    OUTPUT=$(LD_LIBRARY_PATH=. ./test/temp/$NAME)
+
+    if [ ! -f ./test/expected/$NAME.txt ]
+    then
+      NEW=1
+      echo "$OUTPUT" > ./test/expected/$NAME.txt
+    fi
+
+    EXPECTED=$(cat ./test/expected/$NAME.txt)
+
+    if [ "$EXPECTED" = "$OUTPUT" ]
+    then
+      printf "[OK]"
+    else
+      FAILS=1
+      printf "[FAILURE]"
+    fi
+
+    if [ $NEW = 1 ]
+    then
+      echo " [NEW]"
+    else
+      echo ""
+    fi
+  done
+
+  if [ $FAILS = 1 ]
+  then
+    echo "Errors occurred"
+    exit 1
+  fi
+}
+
 function run_elf_tests() {
   FAILS=0
 
@@ -139,22 +395,40 @@ echo "==              BUILDING                  =="
 echo "============================================"
 echo ""
 echo "Compile basm"
-$CC $CFLAGS -o basm src/basm/basm.c $LIBBASM
+$CC $CFLAGS -o basm src/basm/basm.c $LIBBASM $LDLIBS
 echo "Compile br"
-$CC $CFLAGS -o br src/basm/br.c $LIBBASM
+$CC $CFLAGS -o br src/basm/br.c $LIBBASM $LDLIBS
 echo "Compile dbasm"
-$CC $CFLAGS -o dbasm src/basm/dbasm.c $LIBBASM
+$CC $CFLAGS -o dbasm src/basm/dbasm.c $LIBBASM $LDLIBS
 echo "Compile basm2nasm"
-$CC $CFLAGS -o basm2nasm src/basm/basm2nasm.c $LIBBASM
+$CC $CFLAGS -o basm2nasm src/basm/basm2nasm.c $LIBBASM $LDLIBS
+echo "Compile basm2elf"
+$CC $CFLAGS -o basm2elf src/basm/basm2elf.c $LIBBASM $LDLIBS
+echo "Compile basm2c"
+$CC $CFLAGS -o basm2c src/basm/basm2c.c $LIBBASM $LDLIBS
+echo "Compile basmgen"
+$CC $CFLAGS -o basmgen src/basm/basmgen.c $LIBBASM $LDLIBS
+echo "Compile basmbench"
+$CC $CFLAGS -o basmbench src/basm/basmbench.c $LIBBASM $LDLIBS
 echo "Compile libbasm"
 $CC $CFLAGS -fPIC -c src/basm/wrapper.c -o ./libbyterunner.o
-$CC -shared ./libbyterunner.o -o libbyterunner.so
+$CC -shared ./libbyterunner.o -o libbyterunner.so $LDLIBS
 rm ./libbyterunner.o
 
 make_image $PLATFORM_LINUX
 
 compile_raw_tests
+compile_fail_tests
+compile_optimized_tests
+compile_cached_tests
+compile_pgo_tests
 compile_elf_tests
+compile_native_tests
+compile_c_tests
+if command -v nasm > /dev/null
+then
+  compile_nasm_tests
+fi
 
 echo ""
 echo ""
@@ -166,7 +440,67 @@ run_raw_tests
 echo ""
 echo ""
 echo "============================================"
+echo "==             FAILURE TESTS              =="
+echo "============================================"
+echo ""
+run_fail_tests
+echo ""
+echo ""
+echo "============================================"
+echo "==           OPTIMIZED TESTS              =="
+echo "============================================"
+echo ""
+run_optimized_tests opt
+echo ""
+echo ""
+echo "============================================"
+echo "==             CACHED TESTS               =="
+echo "============================================"
+echo ""
+run_optimized_tests cached
+echo ""
+echo ""
+echo "============================================"
+echo "==              PGO TESTS                 =="
+echo "============================================"
+echo ""
+run_optimized_tests pgo
+echo ""
+echo ""
+echo "============================================"
 echo "==              ELF TESTS                 =="
 echo "============================================"
 echo ""
 run_elf_tests
+echo ""
+echo ""
+echo "============================================"
+echo "==             NATIVE TESTS               =="
+echo "============================================"
+echo ""
+run_native_tests native
+echo ""
+echo ""
+echo "============================================"
+echo "==                C TESTS                 =="
+echo "============================================"
+echo ""
+run_native_tests transpiled
+echo ""
+echo ""
+echo "============================================"
+echo "==            EMBEDDING TESTS             =="
+echo "============================================"
+echo ""
+run_embed_tests
+
+if command -v nasm > /dev/null
+then
+  echo ""
+  echo ""
+  echo "============================================"
+  echo "==              NASM TESTS                =="
+  echo "============================================"
+  echo ""
+  run_native_tests nasm
+fi
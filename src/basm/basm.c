@@ -1,19 +1,43 @@
 #define BASM_UTILS
 #define BASM_CREATE
+#define BASM_CACHE
 
 #include "libbasm.h"
 
+#ifdef BASM_MMAP
+# include <sys/resource.h>
+#endif
+
 Basm basm = {0};
 MManager manager = {0};
+BasmCache cache = {0};
 
 static void usage(FILE *stream, const char *program) {
-    fprintf(stream, "Usage: %s [-o <output>] <input>\n", program);
+    fprintf(stream, "Usage: %s [-o <output>] [-O] [--profile-use <profile>] [--cache <dir>] [--cache-limit <bytes>] [--cache-stats] <input>\n",
+            program);
+}
+
+static uint64_t cache_key(const char *input_file_path, int optimize, const BrProfile *profile) {
+    const uint16_t versions[] = {BR_FILE_VERSION, BR_ASSEMBLER_VERSION, (uint16_t) optimize};
+    uint64_t key = basm_hash_bytes(0xCBF29CE484222325ULL, versions, sizeof(versions));
+    key = basm_hash_inst_table(key);
+    if (profile != NULL) {
+        key = basm_hash_bytes(key, &profile->fingerprint, sizeof(profile->fingerprint));
+        key = basm_hash_bytes(key, profile->executions, profile->size * sizeof(profile->executions[0]));
+        key = basm_hash_bytes(key, profile->taken, profile->size * sizeof(profile->taken[0]));
+    }
+    return basm_hash_source(&basm, &manager, cstr_as_sv(input_file_path), key, 0);
 }
 
 int main(int argc, char **argv) {
     char *program = shift(&argc, &argv);
     char *output_file_path = "a";
     char *input_file_path = NULL;
+    const char *cache_dir = NULL;
+    uint64_t cache_limit = BASM_CACHE_DEFAULT_LIMIT;
+    int cache_stats = 0;
+    int optimize = 0;
+    const char *profile_file_path = NULL;
 
     while (argc > 0) {
         char *flag = shift(&argc, &argv);
@@ -25,6 +49,43 @@ int main(int argc, char **argv) {
             }
 
             output_file_path = shift(&argc, &argv);
+        } else if (strcmp(flag, "-O") == 0) {
+            optimize = 1;
+        } else if (strcmp(flag, "--profile-use") == 0) {
+            if (argc == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                return 1;
+            }
+
+            profile_file_path = shift(&argc, &argv);
+        } else if (strcmp(flag, "--cache") == 0) {
+            if (argc == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                return 1;
+            }
+
+            cache_dir = shift(&argc, &argv);
+        } else if (strcmp(flag, "--cache-limit") == 0) {
+            if (argc == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                return 1;
+            }
+
+            // strtoull takes "-1" as the largest value, so a sign is rejected before it gets there
+            const char *value = shift(&argc, &argv);
+            char *endptr = NULL;
+            errno = 0;
+            cache_limit = strtoull(value, &endptr, 10);
+            if (!isdigit((unsigned char) *value) || *endptr != '\0' || errno == ERANGE) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: '%s' is not a size in bytes for flag '%s'\n", value, flag);
+                return 1;
+            }
+        } else if (strcmp(flag, "--cache-stats") == 0) {
+            cache_stats = 1;
         } else {
             if (input_file_path != NULL) {
                 usage(stderr, program);
@@ -37,11 +98,42 @@ int main(int argc, char **argv) {
     }
 
     if (input_file_path == NULL) {
+        if (cache_stats && cache_dir != NULL) {
+            basm_cache_open(&cache, cache_dir, cache_limit);
+            basm_cache_print_stats(stdout, &cache);
+            return 0;
+        }
+
         usage(stderr, program);
         fprintf(stderr, "ERROR: No input file specified\n");
         return 1;
     }
 
+    BrProfile profile = {0};
+    if (profile_file_path != NULL) {
+        basm_load_profile(&profile, profile_file_path);
+    }
+
+    uint64_t key = 0;
+    if (cache_dir != NULL) {
+        basm_cache_open(&cache, cache_dir, cache_limit);
+        key = cache_key(input_file_path, optimize, profile_file_path != NULL ? &profile : NULL);
+
+        BasmFileMeta meta = {0};
+        if (basm_cache_fetch(&cache, key, output_file_path, &meta)) {
+            basm_cache_save_stats(&cache);
+
+            printf("Cache hit %016" PRIx64 "\n", key);
+            printf("%zd bytes written to file\n",
+                   (size_t) (basm_file_memory_offset(meta.program_size) + meta.memory_size));
+            printf("Entry point at 0x%08X\n", (uint32_t) meta.entry);
+            if (cache_stats) {
+                basm_cache_print_stats(stdout, &cache);
+            }
+            return 0;
+        }
+    }
+
     basm_translate_source(cstr_as_sv(input_file_path), &basm, &manager);
 
     if (!basm.has_entry) {
@@ -53,12 +145,95 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // %inline requests are honoured always, -O also inlines every small enough subroutine
+    BasmInlineStats inline_stats = {0};
+    basm_inline(&basm, optimize ? BASM_INLINE_THRESHOLD : 0, &inline_stats);
+
+    BasmOptStats opt_stats = {0};
+    if (optimize) {
+        basm_optimize(&basm, &opt_stats);
+    }
+
+    // Runs before the layout, the profile was recorded on the fused program
+    size_t fused = basm_fuse_immediates(&basm);
+
+    // The profile was recorded by running the output of this same build, anything else would lay
+    // the blocks out by counts of different instructions
+    BasmLayoutStats layout_stats = {0};
+    if (profile_file_path != NULL) {
+        if (profile.size != basm.program_size
+            || profile.fingerprint != basm_hash_program(basm.program, basm.program_size)) {
+            fprintf(stderr,
+                    "%s: ERROR: Profile '%s' was recorded for a different program, record it again with the same flags\n",
+                    input_file_path, profile_file_path);
+            return 1;
+        }
+
+        basm_layout(&basm, &profile, &layout_stats);
+        br_profile_free(&profile);
+    }
+
     size_t written_size = basm_save_to_file(&basm, output_file_path);
 
+    if (cache_dir != NULL) {
+        basm_cache_store(&cache, key, output_file_path);
+        basm_cache_save_stats(&cache);
+    }
 
-    printf("%zd bytes of memory used\n", manager.arena_size);
+    // Every buffer only grows, but reallocations and the passes hold more for a moment than what is left at the end
+    printf("%zd bytes of memory held at the end (%zd bytes in %zd arena chunks)\n",
+           manager.arena_capacity
+           + basm.program_allocated * sizeof(basm.program[0])
+           + basm.memory_allocated * sizeof(basm.memory[0])
+           + basm.labels_capacity * sizeof(basm.labels[0])
+           + basm.unresolved_jmp_capacity * sizeof(basm.unresolved_jmps[0])
+           + basm.code_refs_capacity * sizeof(basm.code_refs[0])
+           + basm.table_entries_capacity * sizeof(basm.table_entries[0])
+           + basm.inlines_capacity * sizeof(basm.inlines[0]),
+           manager.arena_capacity,
+           manager.chunks_count);
+#ifdef BASM_MMAP
+    struct rusage usage = {0};
+    if (getrusage(RUSAGE_SELF, &usage) == 0) {
+#ifdef __APPLE__
+        long peak = usage.ru_maxrss / 1024;
+#else
+        long peak = usage.ru_maxrss;
+#endif
+        printf("%ld KB resident at the high-water mark\n", peak);
+    }
+#endif
+    if (inline_stats.call_sites > 0) {
+        printf("Inlined %zd call sites of %zd subroutines\n", inline_stats.call_sites, inline_stats.subroutines);
+    }
+    if (fused > 0) {
+        printf("Fused %zd instructions into immediate operands\n", fused);
+    }
+    if (optimize) {
+        printf("Optimized %zd instructions to %zd (%zd folded, %zd jumps threaded, %zd unreachable, %zd cancelled)\n",
+               opt_stats.instructions_before,
+               opt_stats.instructions_after,
+               opt_stats.folded,
+               opt_stats.threaded,
+               opt_stats.unreachable,
+               opt_stats.cancelled);
+    }
+    if (profile_file_path != NULL) {
+        printf("Laid out %zd blocks, %zd of them cold (%zd branches inverted, %zd jumps removed, %zd jumps added)\n",
+               layout_stats.blocks,
+               layout_stats.cold,
+               layout_stats.inverted,
+               layout_stats.jumps_removed,
+               layout_stats.jumps_added);
+    }
     printf("%zd bytes written to file\n", written_size);
     printf("Entry point at 0x%08X\n", (uint32_t) basm.entry);
+    if (cache_stats && cache_dir != NULL) {
+        basm_cache_print_stats(stdout, &cache);
+    }
+
+    basm_free(&basm);
+    basm_arena_free(&manager);
 
     return 0;
 }
@@ -0,0 +1,1065 @@
+#define BASM_UTILS
+#define BASM_CREATE
+#define BASM_VM
+
+#include "libbasm.h"
+#include "natives.h"
+
+// Above this distance dup and swap work on the BM's stack directly instead of loading every slot in between
+#define LOCALS_WINDOW 16
+#define VSTACK_CAPACITY (2 * BR_STACK_CAPACITY + LOCALS_WINDOW)
+// Above this many targets an indirect jump goes through the shared dispatch switch instead of one of its own
+#define SITE_TARGETS_CAPACITY 256
+
+static void usage(FILE *stream) {
+    fprintf(stream, "Usage: basm2c <input.basm>\n");
+}
+
+Basm basm = {0};
+MManager manager = {0};
+
+static const char *const inst_enum_names[SIZE] = {
+#define BASM2C_ENUM_NAME(type, name, has_operand, pops, pushes) #type,
+        BR_INST_LIST(BASM2C_ENUM_NAME)
+#undef BASM2C_ENUM_NAME
+};
+
+static uint8_t *leaders = NULL;
+
+static void find_leaders(void) {
+    size_t n = basm.program_size;
+    leaders = calloc(n + 1, sizeof(leaders[0]));
+    assert(leaders != NULL && "find_leaders: out of memory");
+
+    if (basm.entry < n) {
+        leaders[basm.entry] = 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        Inst inst = basm.program[i];
+        if (inst_targets_code(inst.type) && inst.operand.as_u64 < n) {
+            leaders[inst.operand.as_u64] = 1;
+        }
+        if (inst_targets_code(inst.type) || inst.type == INST_RET || inst.type == INST_HALT
+            || inst.type == INST_INT || inst.type == INST_YIELD || inst.type == INST_JOIN || inst.type == INST_TJOIN
+            || inst.type == INST_CHAN || inst.type == INST_ENTER || inst.type == INST_LEAVE
+            || inst.type == INST_JMPTABLE || inst.type == INST_CALLR) {
+            leaders[i + 1] = 1;
+        }
+    }
+    for (size_t i = 0; i < basm.code_refs_size; i++) {
+        uint64_t target = basm.program[basm.code_refs[i]].operand.as_u64;
+        if (target < n) {
+            leaders[target] = 1;
+        }
+    }
+    for (size_t i = 0; i < basm.table_entries_size; i++) {
+        uint64_t target = basm_table_target(&basm, i);
+        if (target < n) {
+            leaders[target] = 1;
+        }
+    }
+    leaders[0] = 1;
+    leaders[n] = 1;
+}
+
+// The code addresses the program pushes as values or keeps in tables, what a callr usually jumps to
+static uint64_t *address_taken = NULL;
+static size_t address_taken_size = 0;
+static uint8_t *site_marks = NULL;
+
+static void find_address_taken(void) {
+    size_t n = basm.program_size;
+    address_taken = malloc((basm.code_refs_size + basm.table_entries_size + 1) * sizeof(address_taken[0]));
+    site_marks = calloc(n + 1, sizeof(site_marks[0]));
+    assert(address_taken != NULL && site_marks != NULL && "find_address_taken: out of memory");
+
+    for (size_t i = 0; i < basm.code_refs_size + basm.table_entries_size; i++) {
+        uint64_t target = i < basm.code_refs_size ? basm.program[basm.code_refs[i]].operand.as_u64
+                                                  : basm_table_target(&basm, i - basm.code_refs_size);
+        if (target < n && !site_marks[target]) {
+            site_marks[target] = 1;
+            address_taken[address_taken_size++] = target;
+        }
+    }
+    for (size_t i = 0; i < address_taken_size; i++) {
+        site_marks[address_taken[i]] = 0;
+    }
+}
+
+static size_t block_end(size_t start) {
+    size_t end = start + 1;
+    while (!leaders[end]) {
+        end++;
+    }
+    return end;
+}
+
+static int block_falls_through(InstType type) {
+    return type != INST_JMP && type != INST_CALL && type != INST_CALLR && type != INST_RET && type != INST_HALT
+           && type != INST_SPAWN && type != INST_YIELD && type != INST_JOIN && type != INST_THREAD
+           && type != INST_TJOIN && type != INST_CHAN;
+}
+
+typedef struct {
+    size_t local;
+    int64_t home; // negative offset from sp of the slot the local was loaded from, 0 when it was computed
+} Slot;
+
+// The top vstack_size values of the BM's stack while a block is translated. Every value is an immutable local
+// of the generated function, and vstack_popped slots right below sp are already taken off the stack
+static Slot vstack[VSTACK_CAPACITY];
+static size_t vstack_size = 0;
+static size_t vstack_popped = 0;
+static size_t locals = 0;
+
+static size_t local_new(void) {
+    return locals++;
+}
+
+// Makes sure the vstack holds at least count values by loading the missing ones from the BM's stack
+static void vstack_load(size_t count) {
+    while (vstack_size < count) {
+        assert(vstack_size < VSTACK_CAPACITY && "vstack_load: vstack overflow");
+        memmove(&vstack[1], &vstack[0], vstack_size * sizeof(vstack[0]));
+        vstack_popped++;
+
+        Slot slot = {.local = local_new(), .home = -(int64_t) vstack_popped};
+        printf("    Word v%zu = stack[sp - %zu];\n", slot.local, vstack_popped);
+        vstack[0] = slot;
+        vstack_size++;
+    }
+}
+
+static Slot vstack_pop(void) {
+    vstack_load(1);
+    return vstack[--vstack_size];
+}
+
+static void vstack_push(Slot slot) {
+    assert(vstack_size < VSTACK_CAPACITY && "vstack_push: vstack overflow");
+    vstack[vstack_size++] = slot;
+}
+
+static size_t vstack_push_new(void) {
+    Slot slot = {.local = local_new(), .home = 0};
+    vstack_push(slot);
+    return slot.local;
+}
+
+static void emit_flush(void) {
+    for (size_t i = 0; i < vstack_size; i++) {
+        int64_t offset = (int64_t) i - (int64_t) vstack_popped;
+        if (vstack[i].home < 0 && vstack[i].home == offset) {
+            continue;
+        }
+        if (offset < 0) {
+            printf("    stack[sp - %"PRIi64"] = v%zu;\n", -offset, vstack[i].local);
+        } else {
+            printf("    stack[sp + %"PRIi64"] = v%zu;\n", offset, vstack[i].local);
+        }
+    }
+
+    if (vstack_size > vstack_popped) {
+        printf("    sp += %zu;\n", vstack_size - vstack_popped);
+    } else if (vstack_size < vstack_popped) {
+        printf("    sp -= %zu;\n", vstack_popped - vstack_size);
+    }
+}
+
+// Writes the vstack back to the BM's stack and moves sp past it
+static void vstack_flush(void) {
+    emit_flush();
+    vstack_size = 0;
+    vstack_popped = 0;
+}
+
+// Continues in the VM at the instruction, it reports the errors the translation does not handle itself
+static void emit_slow(uint64_t addr) {
+    printf("    br.ip = %"PRIu64";\n", addr);
+    printf("    goto slow;\n");
+}
+
+// Leaves the block for the VM at the instruction when the condition holds, the translation goes on otherwise
+static void emit_slow_if(const char *condition, uint64_t addr) {
+    printf("    if (%s) {\n", condition);
+    emit_flush();
+    emit_slow(addr);
+    printf("    }\n");
+}
+
+static void emit_goto(uint64_t target) {
+    if (target < basm.program_size) {
+        printf("    goto block_%"PRIu64";\n", target);
+    } else {
+        emit_slow(target);
+    }
+}
+
+// Continues at the instruction in br.ip. Every indirect jump switches over the targets it is known to have on
+// its own, so the C compiler gives each site a jump table or a few compares that predict like an inline cache
+// instead of funneling all of them through dispatch
+static void emit_site_dispatch(const char *indent, const uint64_t *targets, size_t count) {
+    if (count > SITE_TARGETS_CAPACITY) {
+        count = 0;
+    }
+
+    printf("%sswitch (br.ip) {\n", indent);
+    for (size_t i = 0; i < count; i++) {
+        if (targets[i] < basm.program_size && !site_marks[targets[i]]) {
+            site_marks[targets[i]] = 1;
+            printf("%s    case %"PRIu64": goto block_%"PRIu64";\n", indent, targets[i], targets[i]);
+        }
+    }
+    printf("%s    default: goto dispatch;\n", indent);
+    printf("%s}\n", indent);
+
+    for (size_t i = 0; i < count; i++) {
+        if (targets[i] < basm.program_size) {
+            site_marks[targets[i]] = 0;
+        }
+    }
+}
+
+static void emit_error(const char *condition, Err err) {
+    printf("    if (%s) {\n", condition);
+    printf("        err = %s;\n", err_as_cstr(err));
+    printf("        goto fail;\n");
+    printf("    }\n");
+}
+
+static void emit_binary(const char *output, const char *input, const char *op) {
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    size_t result = vstack_push_new();
+    printf("    Word v%zu = {.as_%s = v%zu.as_%s %s v%zu.as_%s};\n", result, output, a.local, input, op, b.local, input);
+}
+
+static void emit_shift(const char *op) {
+    // The VM shifts with the x86_64 semantics where only the low six bits of the count matter
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    size_t result = vstack_push_new();
+    printf("    Word v%zu = {.as_u64 = v%zu.as_u64 %s (v%zu.as_u64 & 63)};\n", result, a.local, op, b.local);
+}
+
+static void emit_binary_call(const char *fn) {
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    size_t result = vstack_push_new();
+    printf("    Word v%zu = {.as_u64 = %s(v%zu.as_u64, v%zu.as_u64)};\n", result, fn, a.local, b.local);
+}
+
+static void emit_unary(const char *output, const char *prefix, const char *input, const char *suffix) {
+    Slot a = vstack_pop();
+    size_t result = vstack_push_new();
+    printf("    Word v%zu = {.as_%s = %sv%zu.as_%s%s};\n", result, output, prefix, a.local, input, suffix);
+}
+
+// Pops the operands the address of a read or write is made of and returns the address
+static Slot emit_address(Inst inst) {
+    InstType form = inst_memory_form(inst.type);
+    if (inst.type == form) {
+        return vstack_pop();
+    }
+
+    size_t result = local_new();
+    if (inst.type == inst_indexed_form(form)) {
+        Slot index = vstack_pop();
+        Slot base = vstack_pop();
+        printf("    Word v%zu = {.as_u64 = v%zu.as_u64 + (v%zu.as_u64 << %"PRIu64") + UINT64_C(%"PRIu64")};\n", result,
+               base.local, index.local, BR_INDEX_SHIFT(inst.operand.as_u64), BR_INDEX_DISP(inst.operand.as_u64));
+    } else {
+        Slot base = vstack_pop();
+        printf("    Word v%zu = {.as_u64 = v%zu.as_u64 + UINT64_C(%"PRIu64")};\n", result, base.local,
+               inst.operand.as_u64);
+    }
+    return (Slot) {.local = result, .home = 0};
+}
+
+static void emit_read(Inst inst) {
+    int size = (int) inst_memory_width(inst.type);
+    Slot addr = emit_address(inst);
+    char condition[64];
+    snprintf(condition, sizeof(condition), "v%zu.as_u64 >= BR_MEMORY_CAPACITY - %d", addr.local, size - 1);
+    emit_error(condition, ERR_ILLEGAL_MEMORY_ACCESS);
+    size_t result = vstack_push_new();
+    printf("    Word v%zu = {.as_u64 = read%d(&memory[v%zu.as_u64])};\n", result, size * 8, addr.local);
+}
+
+static void emit_write(Inst inst) {
+    int size = (int) inst_memory_width(inst.type);
+    Slot value = vstack_pop();
+    Slot addr = emit_address(inst);
+    char condition[64];
+    snprintf(condition, sizeof(condition), "v%zu.as_u64 >= BR_MEMORY_CAPACITY", addr.local);
+    emit_error(condition, ERR_ILLEGAL_MEMORY_ACCESS);
+    printf("    write%d(&memory[v%zu.as_u64], v%zu.as_u64);\n", size * 8, addr.local, value.local);
+}
+
+static void emit_atomic(const char *op, int size) {
+    Slot desired = {0};
+    if (strcmp(op, "BR_ATOMIC_CAS") == 0) {
+        desired = vstack_pop();
+    }
+    Slot value = vstack_pop();
+    Slot addr = vstack_pop();
+    char condition[96];
+    snprintf(condition, sizeof(condition), "v%zu.as_u64 > BR_MEMORY_CAPACITY - %d || v%zu.as_u64 %% %d != 0",
+             addr.local, size, addr.local, size);
+    emit_error(condition, ERR_ILLEGAL_MEMORY_ACCESS);
+    size_t result = vstack_push_new();
+    printf("    Word v%zu = {.as_u64 = br_atomic(%s, &memory[v%zu.as_u64], %d, v%zu.as_u64, ",
+           result, op, addr.local, size, value.local);
+    if (strcmp(op, "BR_ATOMIC_CAS") == 0) {
+        printf("v%zu.as_u64)};\n", desired.local);
+    } else {
+        printf("0)};\n");
+    }
+}
+
+static void emit_channel_check(Slot id) {
+    char condition[64];
+    snprintf(condition, sizeof(condition), "v%zu.as_u64 >= br.channels_size", id.local);
+    emit_error(condition, ERR_ILLEGAL_OPERAND);
+}
+
+// A send or receive that would block leaves for the VM before the instruction, which waits for the channel
+static void emit_channel_send(size_t i) {
+    vstack_load(2);
+    Slot value = vstack[vstack_size - 1];
+    Slot id = vstack[vstack_size - 2];
+    emit_channel_check(id);
+    char condition[96];
+    snprintf(condition, sizeof(condition), "!br_channel_try_send(br.channels[v%zu.as_u64], v%zu)",
+             id.local, value.local);
+    emit_slow_if(condition, i);
+    vstack_size -= 2;
+}
+
+static void emit_channel_recv(size_t i) {
+    vstack_load(1);
+    Slot id = vstack[vstack_size - 1];
+    emit_channel_check(id);
+    size_t result = local_new();
+    printf("    Word v%zu;\n", result);
+    char condition[96];
+    snprintf(condition, sizeof(condition), "!br_channel_try_recv(br.channels[v%zu.as_u64], &v%zu)",
+             id.local, result);
+    emit_slow_if(condition, i);
+    vstack_size--;
+    vstack_push((Slot) {.local = result, .home = 0});
+}
+
+static void emit_inst(size_t i, Inst inst) {
+    uint64_t operand = inst.operand.as_u64;
+
+    switch (inst.type) {
+        case INST_NOP:
+            break;
+        case INST_DUP:
+            if (operand < LOCALS_WINDOW) {
+                vstack_load((size_t) operand + 1);
+                vstack_push(vstack[vstack_size - 1 - operand]);
+            } else {
+                vstack_flush();
+                printf("    stack[sp] = stack[sp - %"PRIu64"];\n", operand + 1);
+                printf("    sp += 1;\n");
+            }
+            break;
+        case INST_SWAP:
+            if (operand < LOCALS_WINDOW) {
+                vstack_load((size_t) operand + 1);
+                Slot t = vstack[vstack_size - 1];
+                vstack[vstack_size - 1] = vstack[vstack_size - 1 - operand];
+                vstack[vstack_size - 1 - operand] = t;
+            } else {
+                vstack_flush();
+                printf("    {\n");
+                printf("        Word t = stack[sp - 1];\n");
+                printf("        stack[sp - 1] = stack[sp - %"PRIu64"];\n", operand + 1);
+                printf("        stack[sp - %"PRIu64"] = t;\n", operand + 1);
+                printf("    }\n");
+            }
+            break;
+        case INST_ENTER: {
+            // The locals live on the BM's stack next to the frame pointer, a frame that does not fit goes to the VM
+            vstack_flush();
+            if (operand >= BR_STACK_CAPACITY) {
+                emit_slow(i);
+                break;
+            }
+            char condition[64];
+            snprintf(condition, sizeof(condition), "sp >= BR_STACK_CAPACITY - %"PRIu64, operand);
+            emit_slow_if(condition, i);
+            printf("    stack[sp].as_u64 = br.fp;\n");
+            printf("    sp += 1;\n");
+            printf("    br.fp = sp;\n");
+            if (operand > 0) {
+                printf("    memset(&stack[sp], 0, %"PRIu64" * sizeof(stack[0]));\n", operand);
+                printf("    sp += %"PRIu64";\n", operand);
+            }
+        }
+            break;
+        case INST_LEAVE:
+            vstack_flush();
+            emit_slow_if("br.fp == 0 || br.fp > sp || stack[br.fp - 1].as_u64 >= br.fp", i);
+            printf("    sp = br.fp - 1;\n");
+            printf("    br.fp = stack[sp].as_u64;\n");
+            break;
+        case INST_LOAD_LOCAL: {
+            // The frame may hold values the vstack has not written back yet
+            vstack_flush();
+            char condition[64];
+            snprintf(condition, sizeof(condition), "br.fp + UINT64_C(%"PRIu64") >= sp", operand);
+            emit_slow_if(condition, i);
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = stack[br.fp + UINT64_C(%"PRIu64")];\n", result, operand);
+        }
+            break;
+        case INST_STORE_LOCAL: {
+            vstack_flush();
+            char condition[64];
+            snprintf(condition, sizeof(condition), "br.fp + UINT64_C(%"PRIu64") >= sp - 1", operand);
+            emit_slow_if(condition, i);
+            printf("    stack[br.fp + UINT64_C(%"PRIu64")] = stack[sp - 1];\n", operand);
+            printf("    sp -= 1;\n");
+        }
+            break;
+        case INST_PUSH: {
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {.as_u64 = UINT64_C(%"PRIu64")};\n", result, operand);
+            break;
+        }
+        case INST_POP:
+            if (vstack_size > 0) {
+                vstack_size--;
+            } else {
+                vstack_popped++;
+            }
+            break;
+        case INST_PLUSI:
+            emit_binary("u64", "u64", "+");
+            break;
+        case INST_MINUSI:
+            emit_binary("u64", "u64", "-");
+            break;
+        case INST_MULTI:
+            emit_binary("u64", "u64", "*");
+            break;
+        case INST_DIVI: {
+            vstack_load(2);
+            char condition[64];
+            snprintf(condition, sizeof(condition), "v%zu.as_u64 == 0", vstack[vstack_size - 1].local);
+            emit_error(condition, ERR_DIV_BY_ZERO);
+            emit_binary("u64", "u64", "/");
+            break;
+        }
+        case INST_MODI: {
+            vstack_load(2);
+            char condition[64];
+            snprintf(condition, sizeof(condition), "v%zu.as_u64 == 0", vstack[vstack_size - 1].local);
+            emit_error(condition, ERR_DIV_BY_ZERO);
+            emit_binary("u64", "u64", "%");
+            break;
+        }
+        case INST_GEI:
+            emit_binary("u64", "u64", ">=");
+            break;
+        case INST_LEI:
+            emit_binary("u64", "u64", "<=");
+            break;
+        case INST_LI:
+            emit_binary("u64", "u64", "<");
+            break;
+        case INST_NEI:
+            emit_binary("u64", "u64", "!=");
+            break;
+        case INST_GI:
+            emit_binary("u64", "u64", ">");
+            break;
+        case INST_EQI:
+            emit_binary("u64", "u64", "==");
+            break;
+        case INST_PLUSF:
+            emit_binary("f64", "f64", "+");
+            break;
+        case INST_MINUSF:
+            emit_binary("f64", "f64", "-");
+            break;
+        case INST_MULTF:
+            emit_binary("f64", "f64", "*");
+            break;
+        case INST_DIVF:
+            emit_binary("f64", "f64", "/");
+            break;
+        case INST_GEF:
+            emit_binary("u64", "f64", ">=");
+            break;
+        case INST_GF:
+            emit_binary("u64", "f64", ">");
+            break;
+        case INST_LEF:
+            emit_binary("u64", "f64", "<=");
+            break;
+        case INST_LF:
+            emit_binary("u64", "f64", "<");
+            break;
+        case INST_NEF:
+            emit_binary("u64", "f64", "!=");
+            break;
+        case INST_EQF:
+            emit_binary("u64", "f64", "==");
+            break;
+        case INST_ANDB:
+            emit_binary("u64", "u64", "&");
+            break;
+        case INST_ORB:
+            emit_binary("u64", "u64", "|");
+            break;
+        case INST_XOR:
+            emit_binary("u64", "u64", "^");
+            break;
+        case INST_SHR:
+            emit_shift(">>");
+            break;
+        case INST_SHL:
+            emit_shift("<<");
+            break;
+        case INST_NOTB:
+            emit_unary("u64", "~", "u64", "");
+            break;
+        case INST_CALL: {
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {.as_u64 = %zu};\n", result, i);
+            vstack_flush();
+            emit_goto(operand);
+            break;
+        }
+        case INST_INT:
+            vstack_flush();
+            if (operand < BR_NATIVES_COUNT) {
+                printf("    br.stack_size = sp;\n");
+                printf("    br.native_context = br.native_contexts[%"PRIu64"];\n", operand);
+                printf("    err = br_natives[%"PRIu64"](&br);\n", operand);
+                printf("    if (err != ERR_OK) {\n");
+                printf("        goto fail;\n");
+                printf("    }\n");
+                printf("    sp = br.stack_size;\n");
+            } else {
+                emit_slow(i);
+            }
+            break;
+        case INST_JMP:
+            vstack_flush();
+            emit_goto(operand);
+            break;
+        case INST_JMP_IF: {
+            Slot condition = vstack_pop();
+            vstack_flush();
+            printf("    if (v%zu.as_u64) {\n", condition.local);
+            if (operand < basm.program_size) {
+                printf("        goto block_%"PRIu64";\n", operand);
+            } else {
+                printf("        br.ip = %"PRIu64";\n", operand);
+                printf("        goto slow;\n");
+            }
+            printf("    }\n");
+            break;
+        }
+        case INST_CALLR: {
+            Slot target = vstack_pop();
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {.as_u64 = %zu};\n", result, i);
+            vstack_flush();
+            printf("    br.ip = v%zu.as_u64;\n", target.local);
+            emit_site_dispatch("    ", address_taken, address_taken_size);
+            break;
+        }
+        case INST_JMPTABLE: {
+            if (operand >= BR_MEMORY_CAPACITY - 7) {
+                vstack_flush();
+                emit_slow(i);
+                break;
+            }
+
+            // The entries the table starts out with, the program may still change them
+            uint64_t count = 0;
+            if (operand + BR_WORD_SIZE <= basm.memory_size) {
+                memcpy(&count, &basm.memory[operand], sizeof(count));
+            }
+            uint64_t *targets = malloc((basm.table_entries_size + 1) * sizeof(targets[0]));
+            assert(targets != NULL);
+            size_t targets_size = 0;
+            for (size_t k = 0; k < basm.table_entries_size; k++) {
+                uint64_t offset = basm.table_entries[k].offset - operand - BR_WORD_SIZE;
+                if (basm.table_entries[k].offset >= operand + BR_WORD_SIZE && offset / BR_WORD_SIZE < count) {
+                    targets[targets_size++] = basm_table_target(&basm, k);
+                }
+            }
+
+            // An index past the entries falls out of the block into the next one
+            Slot index = vstack_pop();
+            vstack_flush();
+            printf("    if (v%zu.as_u64 < read64(&memory[%"PRIu64"])) {\n", index.local, operand);
+            printf("        if (v%zu.as_u64 >= %"PRIu64") {\n", index.local, (uint64_t) BR_JMPTABLE_LIMIT(operand));
+            printf("            err = ERR_ILLEGAL_MEMORY_ACCESS;\n");
+            printf("            goto fail;\n");
+            printf("        }\n");
+            printf("        br.ip = read64(&memory[%"PRIu64" + v%zu.as_u64 * BR_WORD_SIZE]);\n",
+                   operand + BR_WORD_SIZE, index.local);
+            emit_site_dispatch("        ", targets, targets_size);
+            printf("    }\n");
+            free(targets);
+            break;
+        }
+        case INST_RET: {
+            Slot addr = vstack_pop();
+            vstack_flush();
+            printf("    br.ip = v%zu.as_u64 + 1;\n", addr.local);
+            printf("    goto dispatch;\n");
+            break;
+        }
+        case INST_READ8:
+        case INST_READ16:
+        case INST_READ32:
+        case INST_READ64:
+        case INST_READ8_DISP:
+        case INST_READ16_DISP:
+        case INST_READ32_DISP:
+        case INST_READ64_DISP:
+        case INST_READ8_IDX:
+        case INST_READ16_IDX:
+        case INST_READ32_IDX:
+        case INST_READ64_IDX:
+            emit_read(inst);
+            break;
+        case INST_WRITE8:
+        case INST_WRITE16:
+        case INST_WRITE32:
+        case INST_WRITE64:
+        case INST_WRITE8_DISP:
+        case INST_WRITE16_DISP:
+        case INST_WRITE32_DISP:
+        case INST_WRITE64_DISP:
+        case INST_WRITE8_IDX:
+        case INST_WRITE16_IDX:
+        case INST_WRITE32_IDX:
+        case INST_WRITE64_IDX:
+            emit_write(inst);
+            break;
+        case INST_I2F:
+            emit_unary("f64", "(double) ", "i64", "");
+            break;
+        case INST_I2U:
+            emit_unary("u64", "(uint64_t) ", "i64", "");
+            break;
+        case INST_U2F:
+            emit_unary("f64", "(double) ", "u64", "");
+            break;
+        case INST_U2I:
+            emit_unary("i64", "(int32_t) ", "u64", "");
+            break;
+        case INST_F2I:
+            emit_unary("i64", "f2i(", "f64", ")");
+            break;
+        case INST_F2U:
+            emit_unary("u64", "(uint64_t) f2i(", "f64", ")");
+            break;
+        case INST_NOT:
+            emit_unary("u64", "!", "u64", "");
+            break;
+        case INST_CAS8:
+            emit_atomic("BR_ATOMIC_CAS", 1);
+            break;
+        case INST_CAS16:
+            emit_atomic("BR_ATOMIC_CAS", 2);
+            break;
+        case INST_CAS32:
+            emit_atomic("BR_ATOMIC_CAS", 4);
+            break;
+        case INST_CAS64:
+            emit_atomic("BR_ATOMIC_CAS", 8);
+            break;
+        case INST_XADD8:
+            emit_atomic("BR_ATOMIC_ADD", 1);
+            break;
+        case INST_XADD16:
+            emit_atomic("BR_ATOMIC_ADD", 2);
+            break;
+        case INST_XADD32:
+            emit_atomic("BR_ATOMIC_ADD", 4);
+            break;
+        case INST_XADD64:
+            emit_atomic("BR_ATOMIC_ADD", 8);
+            break;
+        case INST_XCHG8:
+            emit_atomic("BR_ATOMIC_XCHG", 1);
+            break;
+        case INST_XCHG16:
+            emit_atomic("BR_ATOMIC_XCHG", 2);
+            break;
+        case INST_XCHG32:
+            emit_atomic("BR_ATOMIC_XCHG", 4);
+            break;
+        case INST_XCHG64:
+            emit_atomic("BR_ATOMIC_XCHG", 8);
+            break;
+        case INST_FENCE:
+            printf("    atomic_thread_fence(memory_order_seq_cst);\n");
+            break;
+        case INST_SQRTF:
+            emit_unary("f64", "sqrt(", "f64", ")");
+            break;
+        case INST_ABSF:
+            emit_unary("f64", "fabs(", "f64", ")");
+            break;
+        case INST_FLOORF:
+            emit_unary("f64", "floor(", "f64", ")");
+            break;
+        case INST_CEILF:
+            emit_unary("f64", "ceil(", "f64", ")");
+            break;
+        case INST_ROUNDF:
+            emit_unary("f64", "round(", "f64", ")");
+            break;
+        case INST_SINF:
+            emit_unary("f64", "sin(", "f64", ")");
+            break;
+        case INST_COSF:
+            emit_unary("f64", "cos(", "f64", ")");
+            break;
+        case INST_EXPF:
+            emit_unary("f64", "exp(", "f64", ")");
+            break;
+        case INST_LOGF:
+            emit_unary("f64", "log(", "f64", ")");
+            break;
+        case INST_POPCNT:
+            emit_unary("u64", "br_popcnt(", "u64", ")");
+            break;
+        case INST_CLZ:
+            emit_unary("u64", "br_clz(", "u64", ")");
+            break;
+        case INST_CTZ:
+            emit_unary("u64", "br_ctz(", "u64", ")");
+            break;
+        case INST_BSWAP:
+            emit_unary("u64", "br_bswap(", "u64", ")");
+            break;
+        case INST_ROTL:
+            emit_binary_call("br_rotl");
+            break;
+        case INST_ROTR:
+            emit_binary_call("br_rotr");
+            break;
+        case INST_MULHU:
+            emit_binary_call("br_mulhu");
+            break;
+        case INST_MULHI:
+            emit_binary_call("br_mulhi");
+            break;
+        case INST_SEXT8:
+            emit_unary("i64", "(int8_t) ", "u64", "");
+            break;
+        case INST_SEXT16:
+            emit_unary("i64", "(int16_t) ", "u64", "");
+            break;
+        case INST_SEXT32:
+            emit_unary("i64", "(int32_t) ", "u64", "");
+            break;
+        case INST_MINF:
+        case INST_MAXF: {
+            // Not fmin and fmax, the VM keeps the deeper operand only when it compares strictly
+            Slot b = vstack_pop();
+            Slot a = vstack_pop();
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {.as_f64 = v%zu.as_f64 %s v%zu.as_f64 ? v%zu.as_f64 : v%zu.as_f64};\n", result,
+                   a.local, inst.type == INST_MINF ? "<" : ">", b.local, a.local, b.local);
+        }
+            break;
+        case INST_PLUSI_IMM:
+        case INST_MINUSI_IMM:
+        case INST_MULTI_IMM:
+        case INST_DIVI_IMM:
+        case INST_MODI_IMM:
+        case INST_GEI_IMM:
+        case INST_LEI_IMM:
+        case INST_LI_IMM:
+        case INST_NEI_IMM:
+        case INST_GI_IMM:
+        case INST_EQI_IMM:
+        case INST_PLUSF_IMM:
+        case INST_MINUSF_IMM:
+        case INST_MULTF_IMM:
+        case INST_DIVF_IMM:
+        case INST_GEF_IMM:
+        case INST_GF_IMM:
+        case INST_LEF_IMM:
+        case INST_LF_IMM:
+        case INST_NEF_IMM:
+        case INST_EQF_IMM:
+        case INST_ANDB_IMM:
+        case INST_ORB_IMM:
+        case INST_XOR_IMM:
+        case INST_SHR_IMM:
+        case INST_SHL_IMM:
+        {
+            // The operand becomes a constant local, a zero divisor is known here and goes straight to the VM
+            InstType binary = inst_binary_form(inst.type);
+            if ((binary == INST_DIVI || binary == INST_MODI) && operand == 0) {
+                vstack_flush();
+                emit_slow(i);
+                break;
+            }
+            size_t value = vstack_push_new();
+            printf("    Word v%zu = {.as_u64 = UINT64_C(%"PRIu64")};\n", value, operand);
+            emit_inst(i, (Inst) {.type = binary});
+        }
+            break;
+        case INST_FMAF: {
+            Slot c = vstack_pop();
+            Slot b = vstack_pop();
+            Slot a = vstack_pop();
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {.as_f64 = fma(v%zu.as_f64, v%zu.as_f64, v%zu.as_f64)};\n", result, a.local,
+                   b.local, c.local);
+        }
+            break;
+        case INST_SEND:
+            emit_channel_send(i);
+            break;
+        case INST_RECV:
+            emit_channel_recv(i);
+            break;
+        case INST_TRYSEND: {
+            Slot value = vstack_pop();
+            Slot id = vstack_pop();
+            emit_channel_check(id);
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {.as_u64 = (uint64_t) br_channel_try_send(br.channels[v%zu.as_u64], v%zu)};\n",
+                   result, id.local, value.local);
+        }
+            break;
+        case INST_TRYRECV: {
+            Slot id = vstack_pop();
+            emit_channel_check(id);
+            size_t value = vstack_push_new();
+            size_t result = vstack_push_new();
+            printf("    Word v%zu = {0};\n", value);
+            printf("    Word v%zu = {.as_u64 = (uint64_t) br_channel_try_recv(br.channels[v%zu.as_u64], &v%zu)};\n",
+                   result, id.local, value);
+        }
+            break;
+        case INST_SPAWN:
+        case INST_YIELD:
+        case INST_JOIN:
+        case INST_THREAD:
+        case INST_TJOIN:
+        case INST_CHAN:
+        case INST_HALT:
+            // Fibers, threads and the channels chan creates live in the VM, a switch lands on whichever block the
+            // next fiber continues at. Threads run interpreted, halt only ends the program in fiber 0
+            vstack_flush();
+            emit_slow(i);
+            break;
+        case SIZE:
+        default:
+            vstack_flush();
+            emit_slow(i);
+            break;
+    }
+}
+
+static void emit_block(size_t start, size_t end) {
+    // The deepest slot the block touches and the highest it grows the stack, relative to its entry
+    int64_t depth = 0;
+    int64_t need = 0;
+    int64_t grow = 0;
+    for (size_t i = start; i < end; i++) {
+        Inst inst = basm.program[i];
+        int64_t required = (int64_t) inst_stack_pops(inst.type);
+        if (inst.type == INST_DUP || inst.type == INST_SWAP) {
+            required = inst.operand.as_u64 < BR_STACK_CAPACITY ? (int64_t) inst.operand.as_u64 + 1
+                                                               : BR_STACK_CAPACITY + 1;
+        }
+        if (required - depth > need) {
+            need = required - depth;
+        }
+        depth += (int64_t) inst_stack_pushes(inst.type) - (int64_t) inst_stack_pops(inst.type);
+        if (depth > grow) {
+            grow = depth;
+        }
+    }
+
+    printf("\nblock_%zu: {\n", start);
+    if (need > BR_STACK_CAPACITY || grow > BR_STACK_CAPACITY) {
+        emit_slow(start);
+        printf("}\n");
+        return;
+    }
+
+    // A block that would leave the stack bounds runs in the VM, which reports the error at the right instruction
+    if (need > 0 || grow > 0) {
+        printf("    if (");
+        if (need > 0) {
+            printf("sp < %"PRIi64"%s", need, grow > 0 ? " || " : "");
+        }
+        if (grow > 0) {
+            printf("sp > BR_STACK_CAPACITY - %"PRIi64, grow);
+        }
+        printf(") {\n");
+        printf("        br.ip = %zu;\n", start);
+        printf("        goto slow;\n");
+        printf("    }\n");
+    }
+
+    for (size_t i = start; i < end; i++) {
+        Inst inst = basm.program[i];
+        if (inst_has_operand(inst.type)) {
+            printf("    // %s %"PRIu64"\n", inst_asm_name(inst.type), inst.operand.as_u64);
+        } else {
+            printf("    // %s\n", inst_asm_name(inst.type));
+        }
+        emit_inst(i, inst);
+    }
+    if (block_falls_through(basm.program[end - 1].type)) {
+        vstack_flush();
+    }
+    printf("}\n");
+}
+
+static void emit_program(const char *input_file_path) {
+    printf("// Translated by basm2c from %s, compile it with -I pointing at src/basm and -lm\n", input_file_path);
+    printf("#define BASM_UTILS\n");
+    printf("#define BASM_VM\n");
+    printf("#define BR_NATIVES\n");
+    printf("\n");
+    printf("#include \"libbasm.h\"\n");
+    printf("#include \"natives.h\"\n");
+    printf("\n");
+    printf("// Values the program drops stay behind as unused locals, the C compiler removes them\n");
+    printf("#if defined(__GNUC__)\n");
+    printf("# pragma GCC diagnostic ignored \"-Wunused-variable\"\n");
+    printf("#endif\n");
+    printf("\n");
+
+    printf("static const Inst program[] = {\n");
+    for (size_t i = 0; i < basm.program_size; i++) {
+        Inst inst = basm.program[i];
+        printf("        {%s, {.as_u64 = UINT64_C(%"PRIu64")}},\n", inst_enum_names[inst.type], inst.operand.as_u64);
+    }
+    if (basm.program_size == 0) {
+        printf("        {INST_HALT, {.as_u64 = 0}},\n");
+    }
+    printf("};\n");
+    printf("\n");
+
+    printf("static _Alignas(BR_WORD_SIZE) uint8_t memory[BR_MEMORY_CAPACITY + BR_WORD_SIZE] = {");
+    for (size_t i = 0; i < basm.memory_size; i++) {
+        printf("%s%u,", i % 16 == 0 ? "\n        " : " ", basm.memory[i]);
+    }
+    printf("%s};\n", basm.memory_size > 0 ? "\n" : "0");
+    printf("\n");
+
+    for (int bits = 8; bits <= 64; bits *= 2) {
+        printf("static inline uint64_t read%d(const uint8_t *addr) {\n", bits);
+        printf("    uint%d_t value;\n", bits);
+        printf("    memcpy(&value, addr, sizeof(value));\n");
+        printf("    return value;\n");
+        printf("}\n");
+        printf("\n");
+        printf("static inline void write%d(uint8_t *addr, uint64_t value) {\n", bits);
+        printf("    uint%d_t truncated = (uint%d_t) value;\n", bits, bits);
+        printf("    memcpy(addr, &truncated, sizeof(truncated));\n");
+        printf("}\n");
+        printf("\n");
+    }
+
+    // Out of range conversions are undefined in C, the VM gets the x86_64 answer for them
+    printf("static inline int64_t f2i(double value) {\n");
+    printf("    if (value >= -9223372036854775808.0 && value < 9223372036854775808.0) {\n");
+    printf("        return (int64_t) value;\n");
+    printf("    }\n");
+    printf("    return INT64_MIN;\n");
+    printf("}\n");
+    printf("\n");
+    printf("static ByteRunner br = {0};\n");
+    printf("\n");
+    printf("int main(void) {\n");
+    printf("    Word *const stack = br.stack;\n");
+    printf("    uint64_t sp = 0;\n");
+    printf("    Err err = ERR_OK;\n");
+    printf("\n");
+    printf("    br.program = program;\n");
+    printf("    br.program_size = %zu;\n", basm.program_size);
+    printf("    br.memory = memory;\n");
+    printf("    br_push_natives(&br);\n");
+    printf("\n");
+    printf("    br.ip = %"PRIu64";\n", basm.entry);
+    printf("    goto dispatch;\n");
+
+    for (size_t start = 0; start < basm.program_size;) {
+        size_t end = block_end(start);
+        emit_block(start, end);
+        start = end;
+    }
+    printf("\n");
+    emit_slow(basm.program_size);
+    printf("\n");
+
+    // Every block is a label, the rest of the instructions are only reachable through ret and run in the VM
+    printf("dispatch:\n");
+    printf("    switch (br.ip) {\n");
+    for (size_t i = 0; i < basm.program_size; i++) {
+        if (leaders[i]) {
+            printf("        case %zu: goto block_%zu;\n", i, i);
+        }
+    }
+    printf("        default: break;\n");
+    printf("    }\n");
+    printf("\n");
+    printf("slow:\n");
+    printf("    br.stack_size = sp;\n");
+    printf("    err = br_execute_inst(&br);\n");
+    printf("    if (err != ERR_OK) {\n");
+    printf("        goto fail;\n");
+    printf("    }\n");
+    printf("    if (br.halt) {\n");
+    printf("        goto done;\n");
+    printf("    }\n");
+    printf("    sp = br.stack_size;\n");
+    printf("    goto dispatch;\n");
+    printf("\n");
+    printf("fail:\n");
+    printf("    fprintf(stderr, \"ERROR: %%s\\n\", err_as_cstr(err));\n");
+    printf("    return 1;\n");
+    printf("\n");
+    printf("done:\n");
+    printf("    return 0;\n");
+    printf("}\n");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        usage(stderr);
+        fprintf(stderr, "ERROR: No input provided\n");
+        return 1;
+    }
+
+    basm_translate_source(cstr_as_sv(argv[1]), &basm, &manager);
+
+    BasmInlineStats inline_stats = {0};
+    basm_inline(&basm, 0, &inline_stats);
+
+    find_leaders();
+    find_address_taken();
+    emit_program(argv[1]);
+
+    free(site_marks);
+    free(address_taken);
+    free(leaders);
+    basm_free(&basm);
+    basm_arena_free(&manager);
+
+    return 0;
+}
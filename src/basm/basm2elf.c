@@ -0,0 +1,89 @@
+#define BASM_UTILS
+#define BASM_CREATE
+#define BASM_VM
+#define X86_64_NASM
+#define X86_64_ELF
+
+#include "libbasm.h"
+#include "x86_64.h"
+
+Basm basm = {0};
+MManager manager = {0};
+
+static void usage(FILE *stream, const char *program) {
+    fprintf(stream, "Usage: %s [-o <output>] [-S <assembly>] <input.basm>\n", program);
+}
+
+int main(int argc, char **argv) {
+    char *program = shift(&argc, &argv);
+    char *output_file_path = "a.out";
+    char *assembly_file_path = NULL;
+    char *input_file_path = NULL;
+
+    while (argc > 0) {
+        char *flag = shift(&argc, &argv);
+        if (strcmp(flag, "-o") == 0 || strcmp(flag, "-S") == 0) {
+            if (argc == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                return 1;
+            }
+
+            if (flag[1] == 'o') {
+                output_file_path = shift(&argc, &argv);
+            } else {
+                assembly_file_path = shift(&argc, &argv);
+            }
+        } else {
+            if (input_file_path != NULL) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: Unknown flag '%s'\n", flag);
+                return 1;
+            }
+
+            input_file_path = flag;
+        }
+    }
+
+    if (input_file_path == NULL) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No input file specified\n");
+        return 1;
+    }
+
+    basm_translate_source(cstr_as_sv(input_file_path), &basm, &manager);
+
+    BasmInlineStats inline_stats = {0};
+    basm_inline(&basm, 0, &inline_stats);
+
+    // The generator writes plain stdio, into memory here so its text goes to the assembler without a file
+    char *source = NULL;
+    size_t size = 0;
+    FILE *stream = open_memstream(&source, &size);
+    if (stream == NULL) {
+        fprintf(stderr, "ERROR: Could not open the assembly output : %s\n", strerror(errno));
+        return 1;
+    }
+    x86_64_generate(stream, &basm);
+    if (fclose(stream) != 0) {
+        fprintf(stderr, "ERROR: Could not generate the assembly : %s\n", strerror(errno));
+        return 1;
+    }
+
+    if (assembly_file_path != NULL) {
+        FILE *assembly = fopen(assembly_file_path, "w");
+        if (assembly == NULL || fwrite(source, 1, size, assembly) != size || fclose(assembly) != 0) {
+            fprintf(stderr, "ERROR: Could not write file '%s' : %s\n", assembly_file_path, strerror(errno));
+            return 1;
+        }
+    }
+
+    x86_64_assemble((StringView) {.count = size, .data = source},
+                    assembly_file_path != NULL ? assembly_file_path : "<generated assembly>", output_file_path);
+
+    free(source);
+    basm_free(&basm);
+    basm_arena_free(&manager);
+
+    return 0;
+}
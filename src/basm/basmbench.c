@@ -0,0 +1,117 @@
+#define BASM_UTILS
+#define BASM_CREATE
+
+#include "libbasm.h"
+#include <time.h>
+#include <sys/resource.h>
+
+// Times the two assembler phases separately on one input
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec * 1e-9;
+}
+
+static void usage(FILE *stream, const char *program) {
+    fprintf(stream, "Usage: %s [-r <runs>] [-o <output>] <input.basm>\n", program);
+}
+
+int main(int argc, char **argv) {
+    char *program = shift(&argc, &argv);
+    const char *input_file_path = NULL;
+    const char *output_file_path = "bench.br";
+    int runs = 5;
+
+    while (argc > 0) {
+        const char *flag = shift(&argc, &argv);
+        if (strcmp(flag, "-r") == 0 || strcmp(flag, "-o") == 0) {
+            if (argc == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                return 1;
+            }
+
+            if (strcmp(flag, "-r") == 0) {
+                runs = atoi(shift(&argc, &argv));
+            } else {
+                output_file_path = shift(&argc, &argv);
+            }
+        } else if (input_file_path == NULL) {
+            input_file_path = flag;
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown flag '%s'\n", flag);
+            return 1;
+        }
+    }
+
+    if (input_file_path == NULL) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No input file specified\n");
+        return 1;
+    }
+
+    if (runs < 1) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: The number of runs must be at least 1\n");
+        return 1;
+    }
+
+    double translate_best = 0.0;
+    double translate_total = 0.0;
+    double save_best = 0.0;
+    double save_total = 0.0;
+    size_t lines = 0;
+    size_t instructions = 0;
+    size_t written_size = 0;
+    size_t arena_peak = 0;
+
+    for (int run = 0; run < runs; run++) {
+        Basm basm = {0};
+        MManager manager = {0};
+
+        double start = now_seconds();
+        basm_translate_source(cstr_as_sv(input_file_path), &basm, &manager);
+        double translated = now_seconds();
+        written_size = basm_save_to_file(&basm, output_file_path);
+        double saved = now_seconds();
+
+        double translate = translated - start;
+        double save = saved - translated;
+        translate_total += translate;
+        save_total += save;
+        if (run == 0 || translate < translate_best) {
+            translate_best = translate;
+        }
+        if (run == 0 || save < save_best) {
+            save_best = save;
+        }
+
+        lines = basm.lines;
+        instructions = basm.program_size;
+        if (manager.arena_capacity > arena_peak) {
+            arena_peak = manager.arena_capacity;
+        }
+
+        basm_free(&basm);
+        basm_arena_free(&manager);
+    }
+
+    struct rusage usage_stats;
+    getrusage(RUSAGE_SELF, &usage_stats);
+
+    printf("Input:                %s\n", input_file_path);
+    printf("Lines:                %zu\n", lines);
+    printf("Instructions:         %zu\n", instructions);
+    printf("Output:               %zu bytes\n", written_size);
+    printf("Runs:                 %d\n", runs);
+    printf("basm_translate_source best %10.3f ms   mean %10.3f ms   %12.0f lines/s\n",
+           translate_best * 1e3, translate_total / runs * 1e3, (double) lines / translate_best);
+    printf("basm_save_to_file     best %10.3f ms   mean %10.3f ms   %12.0f bytes/s\n",
+           save_best * 1e3, save_total / runs * 1e3, (double) written_size / save_best);
+    printf("Peak arena:           %zu bytes\n", arena_peak);
+    printf("Peak RSS:             %ld KiB\n", usage_stats.ru_maxrss);
+
+    return 0;
+}
@@ -0,0 +1,240 @@
+#define BASM_UTILS
+
+#include "libbasm.h"
+
+// Generates synthetic BASM programs for measuring the assembler
+
+typedef struct {
+    uint64_t instructions;
+    double label_density;
+    double forward_ratio;
+    size_t include_depth;
+    uint64_t data_directives;
+    uint64_t seed;
+    const char *output_file_path;
+} GenConfig;
+
+static uint64_t rng_state = 0;
+
+static uint64_t rng_next(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_unit(void) {
+    return (double) (rng_next() >> 11) / (double) (1ULL << 53);
+}
+
+static uint64_t rng_below(uint64_t n) {
+    return n == 0 ? 0 : rng_next() % n;
+}
+
+static void usage(FILE *stream, const char *program) {
+    fprintf(stream, "Usage: %s [-n <instructions>] [-l <label density>] [-f <forward ratio>] "
+                    "[-i <include depth>] [-d <data directives>] [-s <seed>] -o <output.basm>\n", program);
+    fprintf(stream, "    -n  number of instructions in the main file (default 10000)\n");
+    fprintf(stream, "    -l  fraction of instructions carrying a label, 0..1 (default 0.1)\n");
+    fprintf(stream, "    -f  fraction of jumps that reference a label defined later, 0..1 (default 0.5)\n");
+    fprintf(stream, "    -i  depth of the %%include chain (default 1, at most %d)\n", BR_ASSEMBLY_MAX_INCLUDE_LEVEL - 1);
+    fprintf(stream, "    -d  number of %%byte/%%word/%%dword/%%qword directives (default 100)\n");
+}
+
+static FILE *open_output(const char *file_path) {
+    FILE *f = fopen(file_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    return f;
+}
+
+static void generate_includes(const GenConfig *config) {
+    static const char *const directives[] = {"byte", "word", "dword", "qword"};
+    char path[FILENAME_MAX];
+
+    for (size_t level = 1; level <= config->include_depth; level++) {
+        snprintf(path, sizeof(path), "%s.%zu.hasm", config->output_file_path, level);
+        FILE *f = open_output(path);
+
+        fprintf(f, "; generated include level %zu\n", level);
+        if (level < config->include_depth) {
+            fprintf(f, "%%include \"%s.%zu.hasm\"\n", config->output_file_path, level + 1);
+        }
+
+        for (size_t i = 0; i < 16; i++) {
+            fprintf(f, "%%define CONST_%zu_%zu %" PRIu64 "\n", level, i, rng_below(1000));
+        }
+
+        // Spread the data directives over the include files
+        uint64_t from = config->data_directives * (level - 1) / config->include_depth;
+        uint64_t to = config->data_directives * level / config->include_depth;
+        for (uint64_t i = from; i < to; i++) {
+            if (rng_below(8) == 0) {
+                fprintf(f, "%%byte DATA_%" PRIu64 " \"generated string %" PRIu64 "\"\n", i, i);
+            } else {
+                fprintf(f, "%%%s DATA_%" PRIu64 " %" PRIu64 "\n", directives[rng_below(4)], i, rng_below(256));
+            }
+        }
+
+        fclose(f);
+    }
+}
+
+static void generate_main(const GenConfig *config) {
+    FILE *f = open_output(config->output_file_path);
+    uint64_t n = config->instructions;
+
+    // Decide up front which instructions carry a label, so jumps can reference
+    // labels in front of and behind them
+    uint64_t *labels = malloc((n + 1) * sizeof(labels[0]));
+    if (labels == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate labels for %" PRIu64 " instructions : %s\n", n, strerror(errno));
+        exit(1);
+    }
+    uint64_t labels_size = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        if (i == 0 || rng_unit() < config->label_density) {
+            labels[labels_size++] = i;
+        }
+    }
+
+    fprintf(f, "; generated by basmgen -n %" PRIu64 " -l %g -f %g -i %zu -d %" PRIu64 " -s %" PRIu64 "\n",
+            config->instructions, config->label_density, config->forward_ratio, config->include_depth,
+            config->data_directives, config->seed);
+    fprintf(f, "%%entry main\n");
+    if (config->include_depth > 0) {
+        fprintf(f, "%%include \"%s.1.hasm\"\n", config->output_file_path);
+    }
+    if (config->include_depth == 0) {
+        for (uint64_t i = 0; i < config->data_directives; i++) {
+            fprintf(f, "%%qword DATA_%" PRIu64 " %" PRIu64 "\n", i, rng_below(256));
+        }
+    }
+    fprintf(f, "\nmain:\n");
+
+    uint64_t next_label = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        const char *indent = "    ";
+        if (next_label < labels_size && labels[next_label] == i) {
+            fprintf(f, "L%" PRIu64 ":\n", next_label);
+            next_label++;
+        }
+
+        uint64_t kind = rng_below(100);
+        if (kind < 10 && labels_size > 1) {
+            // Jumps, calls and conditional jumps
+            uint64_t target = 0;
+            if (next_label < labels_size && rng_unit() < config->forward_ratio) {
+                target = next_label + rng_below(labels_size - next_label);
+            } else {
+                target = next_label == 0 ? 0 : rng_below(next_label);
+            }
+
+            static const char *const jumps[] = {"jmp", "jmpif", "call"};
+            fprintf(f, "%s%s L%" PRIu64 "\n", indent, jumps[rng_below(3)], target);
+        } else if (kind < 40) {
+            if (config->include_depth > 0 && rng_below(4) == 0) {
+                fprintf(f, "%spush CONST_%" PRIu64 "_%" PRIu64 "\n", indent,
+                        1 + rng_below(config->include_depth), rng_below(16));
+            } else if (config->data_directives > 0 && rng_below(4) == 0) {
+                fprintf(f, "%spush DATA_%" PRIu64 "\n", indent, rng_below(config->data_directives));
+            } else if (rng_below(4) == 0) {
+                fprintf(f, "%spush %" PRIu64 ".5\n", indent, rng_below(1000));
+            } else {
+                fprintf(f, "%spush %" PRIu64 "    ; constant\n", indent, rng_below(100000));
+            }
+        } else if (kind < 55) {
+            fprintf(f, "%s%s %" PRIu64 "\n", indent, rng_below(2) ? "dup" : "swap", rng_below(4));
+        } else {
+            static const InstType ops[] = {
+                    INST_PLUSI, INST_MINUSI, INST_MULTI, INST_DIVI, INST_EQI, INST_GEI, INST_LI,
+                    INST_PLUSF, INST_MULTF, INST_ANDB, INST_XOR, INST_SHR, INST_NOT, INST_POP,
+                    INST_READ8, INST_WRITE64, INST_I2F, INST_F2I,
+            };
+            fprintf(f, "%s%s\n", indent, inst_asm_name(ops[rng_below(sizeof(ops) / sizeof(ops[0]))]));
+        }
+    }
+
+    fprintf(f, "    halt\n");
+    fclose(f);
+    free(labels);
+}
+
+int main(int argc, char **argv) {
+    char *program = shift(&argc, &argv);
+    GenConfig config = {
+            .instructions = 10000,
+            .label_density = 0.1,
+            .forward_ratio = 0.5,
+            .include_depth = 1,
+            .data_directives = 100,
+            .seed = 69420,
+            .output_file_path = NULL,
+    };
+
+    while (argc > 0) {
+        const char *flag = shift(&argc, &argv);
+        if (strcmp(flag, "-h") == 0) {
+            usage(stdout, program);
+            return 0;
+        }
+
+        if (argc == 0) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+            return 1;
+        }
+
+        const char *value = shift(&argc, &argv);
+        if (strcmp(flag, "-n") == 0) {
+            // Every instruction may carry a label, their table has to fit into memory
+            char *endptr = NULL;
+            errno = 0;
+            config.instructions = strtoull(value, &endptr, 10);
+            if (!isdigit((unsigned char) *value) || *endptr != '\0' || errno == ERANGE
+                || config.instructions >= SIZE_MAX / sizeof(uint64_t)) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: '%s' is not a valid instruction count for flag '%s'\n", value, flag);
+                return 1;
+            }
+        } else if (strcmp(flag, "-l") == 0) {
+            config.label_density = strtod(value, NULL);
+        } else if (strcmp(flag, "-f") == 0) {
+            config.forward_ratio = strtod(value, NULL);
+        } else if (strcmp(flag, "-i") == 0) {
+            config.include_depth = (size_t) strtoull(value, NULL, 10);
+        } else if (strcmp(flag, "-d") == 0) {
+            config.data_directives = strtoull(value, NULL, 10);
+        } else if (strcmp(flag, "-s") == 0) {
+            config.seed = strtoull(value, NULL, 10);
+        } else if (strcmp(flag, "-o") == 0) {
+            config.output_file_path = value;
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: Unknown flag '%s'\n", flag);
+            return 1;
+        }
+    }
+
+    if (config.output_file_path == NULL) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: No output file specified\n");
+        return 1;
+    }
+
+    if (config.include_depth >= BR_ASSEMBLY_MAX_INCLUDE_LEVEL) {
+        fprintf(stderr, "ERROR: Include depth %zu exceeds the maximum include level %d\n",
+                config.include_depth, BR_ASSEMBLY_MAX_INCLUDE_LEVEL - 1);
+        return 1;
+    }
+
+    rng_state = config.seed == 0 ? 1 : config.seed;
+    generate_includes(&config);
+    generate_main(&config);
+
+    return 0;
+}
@@ -1,124 +1,12 @@
 #define BASM_UTILS
 #define BASM_VM
+#define BR_NATIVES
 
 #include "libbasm.h"
-
-static Err br_alloc(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    br->stack[br->stack_size - 1].as_ptr = malloc(br->stack[br->stack_size - 1].as_u64);
-
-    return ERR_OK;
-}
-
-static Err br_free(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    free(br->stack[br->stack_size - 1].as_ptr);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_f64(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%lf\n", br->stack[br->stack_size - 1].as_f64);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_i64(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%"PRIi64"\n", br->stack[br->stack_size - 1].as_i64);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_u64(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%"PRIu64"\n", br->stack[br->stack_size - 1].as_u64);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_ptr(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%p\n", br->stack[br->stack_size - 1].as_ptr);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_dump_memory(ByteRunner *br) {
-    if (br->stack_size < 2) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
-    uint64_t count = br->stack[br->stack_size - 1].as_u64;
-
-    if (addr >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
-    }
-
-    if (addr + count < addr || addr + count >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
-    }
-
-
-    for (uint64_t i = 0; i < count; i++) {
-        printf("%02X ", br->memory[i]);
-    }
-    printf("\n");
-
-    br->stack_size -= 2;
-
-    return ERR_OK;
-}
-
-static Err br_write(ByteRunner *br) {
-    if (br->stack_size < 2) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
-    uint64_t count = br->stack[br->stack_size - 1].as_u64;
-
-    if (addr >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
-    }
-
-    if (addr + count < addr || addr + count >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
-    }
-
-    fwrite(&br->memory[addr], sizeof(br->memory[0]), count, stdout);
-    br->stack_size -= 2;
-
-    return ERR_OK;
-}
+#include "natives.h"
 
 static void usage(FILE *stream, const char *program) {
-    fprintf(stream, "Usage: %s -i <program> [-l <limit>] [-h]\n", program);
+    fprintf(stream, "Usage: %s -i <program> [-l <limit>] [-p <profile>] [-h]\n", program);
 }
 
 ByteRunner br = {0};
@@ -126,6 +14,7 @@ ByteRunner br = {0};
 int main(int argc, char **argv) {
     char *program = shift(&argc, &argv);
     const char *program_file_path = NULL;
+    const char *profile_file_path = NULL;
     int limit = -1;
     int debug = 0;
 
@@ -147,6 +36,14 @@ int main(int argc, char **argv) {
             }
 
             limit = atoi(shift(&argc, &argv));
+        } else if (strcmp(flag, "-p") == 0) {
+            if (argc == 0) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: No argument is provided for flag '%s'\n", flag);
+                return 1;
+            }
+
+            profile_file_path = shift(&argc, &argv);
         } else if (strcmp(flag, "-h") == 0) {
             usage(stdout, program);
             return 0;
@@ -166,16 +63,20 @@ int main(int argc, char **argv) {
     }
 
     br_load_program_from_file(&br, program_file_path);
-    br_push_native(&br, br_alloc);
-    br_push_native(&br, br_free);
-    br_push_native(&br, br_print_f64);
-    br_push_native(&br, br_print_i64);
-    br_push_native(&br, br_print_u64);
-    br_push_native(&br, br_print_ptr);
-    br_push_native(&br, br_dump_memory);
-    br_push_native(&br, br_write);
-
-    if (!debug) {
+    br_push_natives(&br);
+
+    if (profile_file_path != NULL) {
+        // The profile is written even when the program fails, the blocks up to the error still count
+        BrProfile profile = {0};
+        br_profile_init(&profile, &br);
+        Err err = br_execute_program_profiled(&br, limit, &profile);
+        br_save_profile(&profile, profile_file_path);
+        br_profile_free(&profile);
+        if (err != ERR_OK) {
+            fprintf(stderr, "ERROR: %s\n", err_as_cstr(err));
+            return 1;
+        }
+    } else if (!debug) {
         Err err = br_execute_program(&br, limit);
         if (err != ERR_OK) {
             fprintf(stderr, "ERROR: %s\n", err_as_cstr(err));
@@ -1,154 +1,84 @@
 #define BASM_UTILS
 #define BASM_VM
+#define BR_NATIVES
 
 #include "libbasm.h"
+#include "natives.h"
 
-static Err br_alloc(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    br->stack[br->stack_size - 1].as_ptr = malloc(br->stack[br->stack_size - 1].as_u64);
-
-    return ERR_OK;
-}
-
-static Err br_free(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    free(br->stack[br->stack_size - 1].as_ptr);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_f64(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%lf\n", br->stack[br->stack_size - 1].as_f64);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_i64(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%"PRIi64"\n", br->stack[br->stack_size - 1].as_i64);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_u64(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%"PRIu64"\n", br->stack[br->stack_size - 1].as_u64);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_print_ptr(ByteRunner *br) {
-    if (br->stack_size < 1) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    printf("%p\n", br->stack[br->stack_size - 1].as_ptr);
-    br->stack_size--;
-
-    return ERR_OK;
-}
-
-static Err br_dump_memory(ByteRunner *br) {
-    if (br->stack_size < 2) {
-        return ERR_STACK_UNDERFLOW;
-    }
-
-    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
-    uint64_t count = br->stack[br->stack_size - 1].as_u64;
-
-    if (addr >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
-    }
-
-    if (addr + count < addr || addr + count >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
-    }
-
-
-    for (uint64_t i = 0; i < count; i++) {
-        printf("%02X ", br->memory[i]);
-    }
-    printf("\n");
-
-    br->stack_size -= 2;
-
-    return ERR_OK;
-}
+ByteRunner br = {0};
 
-static Err br_write(ByteRunner *br) {
-    if (br->stack_size < 2) {
-        return ERR_STACK_UNDERFLOW;
-    }
+extern const char _binary___code_start[];
+extern const char _binary___code_end[];
 
-    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
-    uint64_t count = br->stack[br->stack_size - 1].as_u64;
+static _Alignas(BR_FILE_PAGE_SIZE) uint8_t image_memory[BR_MEMORY_CAPACITY + BR_WORD_SIZE];
 
-    if (addr >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
+// Maps the whole pages of the static memory copy-on-write from the executable that embeds it, which keeps the
+// startup independent of the data size. Returns how many bytes were mapped, the rest has to be copied
+static uint64_t image_map_memory(const uint8_t *data, uint64_t size) {
+#if defined(BASM_MMAP) && defined(__linux__)
+    uint64_t pages = size & ~((uint64_t) BR_FILE_PAGE_SIZE - 1);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages == 0 || page_size <= 0 || BR_FILE_PAGE_SIZE % page_size != 0 ||
+        (uintptr_t) data % BR_FILE_PAGE_SIZE != 0) {
+        return 0;
     }
 
-    if (addr + count < addr || addr + count >= BR_MEMORY_CAPACITY) {
-        return ERR_ILLEGAL_MEMORY_ACCESS;
+    int fd = open("/proc/self/exe", O_RDONLY);
+    FILE *maps = fopen("/proc/self/maps", "r");
+    struct stat st;
+    if (fd < 0 || maps == NULL || fstat(fd, &st) != 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (maps != NULL) {
+            fclose(maps);
+        }
+        return 0;
     }
 
-    fwrite(&br->memory[addr], sizeof(br->memory[0]), count, stdout);
-    br->stack_size -= 2;
-
-    return ERR_OK;
-}
-
-
-ByteRunner br = {0};
-
-extern char _binary___code_start[];
-extern char _binary___code_end[];
-
-
-static size_t read_buf(void *dst, size_t item_size, size_t count, const void *buf) {
-    size_t retrieved = 0;
-    for (size_t i = 0; i < count; i++) {
-
-        if (buf + item_size * count > dst + item_size * count) {
-            return 0;
+    uint64_t mapped = 0;
+    char line[BR_FILE_PAGE_SIZE];
+    while (fgets(line, sizeof(line), maps) != NULL) {
+        uintptr_t begin = 0, end = 0;
+        uint64_t offset = 0, inode = 0;
+        if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " %*s %" SCNx64 " %*s %" SCNu64, &begin, &end, &offset,
+                   &inode) != 4) {
+            continue;
         }
 
-        memcpy(dst, buf, item_size * count);
-        retrieved++;
+        if ((uintptr_t) data >= begin && (uintptr_t) data < end) {
+            if (inode == (uint64_t) st.st_ino) {
+                off_t file_offset = (off_t) (offset + ((uintptr_t) data - begin));
+                void *addr = mmap(image_memory, pages, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd,
+                                  file_offset);
+                if (addr != MAP_FAILED) {
+                    mapped = pages;
+                }
+            }
+            break;
+        }
     }
 
-    return retrieved;
+    fclose(maps);
+    close(fd);
+    return mapped;
+#else
+    (void) data;
+    (void) size;
+    return 0;
+#endif
 }
 
 int main(int argc, char **argv) {
+    (void) argc;
     const char *program = argv[0];
-    // unsigned int _binary___print_i64_size = (unsigned int) ((unsigned int) &_binary___print_i64_end -
-    //                                                         (unsigned int) &_binary___print_i64_start);
-
-    char *ptr = _binary___code_start;
+    const char *image = _binary___code_start;
+    uint64_t image_size = (uint64_t) (_binary___code_end - _binary___code_start);
 
     BasmFileMeta meta = {0};
-    read_buf(&meta, sizeof(BasmFileMeta), 1, ptr);
-    ptr += sizeof(meta);
+    if (image_size >= sizeof(meta)) {
+        memcpy(&meta, image, sizeof(meta));
+    }
 
     if (meta.magic != BR_FILE_MAGIC) {
         fprintf(stderr, "ERROR: '%s' does not appear to be a valid file. "
@@ -161,13 +91,6 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
-    if (meta.program_size > BR_PROGRAM_CAPACITY) {
-        fprintf(stderr,
-                "ERROR: '%s': program section is too large. The file contains %" PRIu64 " program instructions. But the capacity is %"  PRIu64 "\n",
-                program, meta.program_size, (uint64_t) BR_PROGRAM_CAPACITY);
-        exit(1);
-    }
-
     if (meta.memory_capacity > BR_MEMORY_CAPACITY) {
         fprintf(stderr,
                 "ERROR: '%s': memory section is too large. The file wants %" PRIu64 "bytes. But the capacity is %"  PRIu64 "bytes \n",
@@ -181,30 +104,35 @@ int main(int argc, char **argv) {
                 program, meta.memory_size, meta.memory_capacity);
         exit(1);
     }
-    br.ip = meta.entry;
 
-    br.program_size = read_buf(&br.program, sizeof(br.program[0]), meta.program_size, ptr);
-    ptr += br.program_size * sizeof(br.program[0]);
-
-    if (br.program_size != meta.program_size) {
-        fprintf(stderr, "ERROR: '%s', read %zd program instructions, but expected %" PRIu64 "\n",
-                program, br.program_size, meta.program_size);
+    uint64_t memory_offset = basm_file_memory_offset(meta.program_size);
+    if (meta.program_size > image_size / sizeof(Inst) || memory_offset + meta.memory_size > image_size) {
+        fprintf(stderr, "ERROR: '%s': the image is truncated, it has %" PRIu64 " bytes\n", program, image_size);
+        exit(1);
     }
 
-    size_t n = read_buf(&br.memory, sizeof(br.memory[0]), meta.memory_size, ptr);
-    if (n != meta.memory_size) {
-        fprintf(stderr, "ERROR: '%s', read %zd bytes of memory section, but expected %" PRIu64 " bytes\n",
-                program, n, meta.memory_size);
+    // The instructions run straight from the image, it is only copied when it was linked without alignment
+    const Inst *code = (const Inst *) (image + basm_file_program_offset());
+    if ((uintptr_t) code % _Alignof(Inst) != 0) {
+        Inst *copy = malloc(meta.program_size * sizeof(Inst));
+        if (copy == NULL && meta.program_size > 0) {
+            fprintf(stderr, "ERROR: '%s': could not allocate the program : %s\n", program, strerror(errno));
+            exit(1);
+        }
+        memcpy(copy, code, meta.program_size * sizeof(Inst));
+        code = copy;
     }
 
-    br_push_native(&br, br_alloc);
-    br_push_native(&br, br_free);
-    br_push_native(&br, br_print_f64);
-    br_push_native(&br, br_print_i64);
-    br_push_native(&br, br_print_u64);
-    br_push_native(&br, br_print_ptr);
-    br_push_native(&br, br_dump_memory);
-    br_push_native(&br, br_write);
+    br.ip = meta.entry;
+    br.program = code;
+    br.program_size = meta.program_size;
+
+    const uint8_t *data = (const uint8_t *) image + memory_offset;
+    uint64_t mapped = image_map_memory(data, meta.memory_size);
+    memcpy(image_memory + mapped, data + mapped, meta.memory_size - mapped);
+    br.memory = image_memory;
+
+    br_push_natives(&br);
 
     Err err = br_execute_program(&br, -1);
     if (err != ERR_OK) {
@@ -2,18 +2,46 @@
 // define BASM_CREATE for implementing create function
 // define BASM_VM for implementing the vm
 
+// define BASM_CACHE for implementing the assembly cache (POSIX only)
+
 #ifndef BYTERUNNER_LIBBASM_H
 #define BYTERUNNER_LIBBASM_H
 
+#if !defined(_POSIX_C_SOURCE) && !defined(_WIN32)
+# define _POSIX_C_SOURCE 200809L
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
+#include <setjmp.h>
 #include <assert.h>
 #include <memory.h>
 #include <errno.h>
 #include <string.h>
 #include <inttypes.h>
 #include <ctype.h>
+#include <math.h>
+#include <stdatomic.h>
+
+#if !defined(__STDC_NO_THREADS__)
+# define BR_THREADS
+# include <threads.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+# define BASM_MMAP
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <unistd.h>
+#endif
+
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+# define BASM_SSE2
+# include <emmintrin.h>
+#endif
 
 // FROM https://stackoverflow.com/a/3312896
 #if defined(__GNUC__) || defined(__clang__)
@@ -27,15 +55,28 @@
 
 #define BR_STACK_CAPACITY 1024
 #define BR_WORD_SIZE 8
-#define BR_PROGRAM_CAPACITY 1024
-#define BR_LABEL_CAPACITY 1024
-#define BR_UNRESOLVED_JMPS_CAPACITY 1024
 #define BR_NATIVE_CAPACITY 1024
+#define BR_CHANNELS_CAPACITY 256
+// 16M words, a channel's cells take 256MB at most
+#define BR_CHANNEL_CAPACITY_MAX (1ULL << 24)
+#define BR_CACHE_LINE_SIZE 64
 #define BR_MEMORY_CAPACITY (640 * 1000)
-#define BR_ASSEMBLY_MEMORY_CAPACITY (1000 * 1000 * 1000)
+#define BR_ASSEMBLY_CHUNK_SIZE (64 * 1024)
+#define BASM_PHASH_CAPACITY 512
+#define BASM_PHASH_BUCKETS 128
+#define BASM_INLINE_THRESHOLD 8
+#define BASM_ERROR_CAPACITY 512
 
 #define BR_FILE_MAGIC 0x5242
-#define BR_FILE_VERSION 1
+#define BR_FILE_VERSION 2
+// The program section starts aligned for Inst, the memory section starts on a page so it can be mapped
+#define BR_FILE_ALIGNMENT 16
+#define BR_FILE_PAGE_SIZE 4096
+#define BR_ASSEMBLER_VERSION 7
+
+#define BASM_CACHE_DEFAULT_LIMIT (64 * 1024 * 1024)
+#define BASM_CACHE_STATS_FILE "stats"
+#define BASM_CACHE_PATH_CAPACITY 4096
 
 #define WORD_U64(u64)((Word) { .as_u64 = u64 })
 #define WORD_I64(i64)((Word) { .as_i64 = i64 })
@@ -58,6 +99,17 @@
     break;                                                                                       \
 }
 
+#define BINARY_IMM_OP(br, operand, in, out, op)                                                  \
+{                                                                                                \
+    if ((br)->stack_size < 1) {                                                                  \
+        return ERR_STACK_UNDERFLOW;                                                              \
+    }                                                                                            \
+    (br)->stack[(br)->stack_size - 1].as_##out =                                                 \
+        (br)->stack[(br)->stack_size - 1].as_##in op (operand).as_##in;                          \
+    (br)->ip++;                                                                                  \
+    break;                                                                                       \
+}
+
 #define CAST_OP(br, from, to, cast)                                                              \
 {                                                                                                \
     if ((br)->stack_size < 1) {                                                                  \
@@ -68,6 +120,38 @@
     break;                                                                                       \
 }
 
+#define MATH_OP(br, fn)                                                                          \
+{                                                                                                \
+    if ((br)->stack_size < 1) {                                                                  \
+        return ERR_STACK_UNDERFLOW;                                                              \
+    }                                                                                            \
+    (br)->stack[(br)->stack_size - 1].as_f64 = fn((br)->stack[(br)->stack_size - 1].as_f64);     \
+    (br)->ip++;                                                                                  \
+    break;                                                                                       \
+}
+
+#define BITS_OP(br, fn)                                                                          \
+{                                                                                                \
+    if ((br)->stack_size < 1) {                                                                  \
+        return ERR_STACK_UNDERFLOW;                                                              \
+    }                                                                                            \
+    (br)->stack[(br)->stack_size - 1].as_u64 = fn((br)->stack[(br)->stack_size - 1].as_u64);     \
+    (br)->ip++;                                                                                  \
+    break;                                                                                       \
+}
+
+#define BINARY_BITS_OP(br, fn)                                                                   \
+{                                                                                                \
+    if ((br)->stack_size < 2) {                                                                  \
+        return ERR_STACK_UNDERFLOW;                                                              \
+    }                                                                                            \
+    (br)->stack[(br)->stack_size - 2].as_u64 =                                                   \
+        fn((br)->stack[(br)->stack_size - 2].as_u64, (br)->stack[(br)->stack_size - 1].as_u64);  \
+    (br)->stack_size--;                                                                          \
+    (br)->ip++;                                                                                  \
+    break;                                                                                       \
+}
+
 /// ========================================
 /// STRING VIEW
 /// ========================================
@@ -88,6 +172,8 @@ StringView sv_trim(StringView sv);
 
 StringView sv_chop_by_delim(StringView *sv, char delim);
 
+StringView sv_chop_line(StringView *sv);
+
 int sv_eq(StringView a, StringView b);
 
 int sv_to_int(StringView sv);
@@ -108,7 +194,11 @@ typedef enum {
     ERR_DIV_BY_ZERO,
     ERR_ILLEGAL_INS_ACCESS,
     ERR_ILLEGAL_OPERAND,
-    ERR_ILLEGAL_MEMORY_ACCESS
+    ERR_ILLEGAL_MEMORY_ACCESS,
+    ERR_DEADLOCK,
+    ERR_THREAD_FAILED,
+    ERR_YIELDED,
+    ERR_OUT_OF_MEMORY
 } Err;
 
 typedef uint64_t InstAddr;
@@ -123,68 +213,160 @@ typedef union {
 
 static_assert(sizeof(Word) == BR_WORD_SIZE, "The Word union is expected to be 64 bits");
 
+// X(type, name, has_operand, pops, pushes)
+#define BR_INST_LIST(X)                 \
+    X(INST_NOP,     "nop",     0, 0, 0) \
+    X(INST_DUP,     "dup",     1, 0, 1) \
+    X(INST_SWAP,    "swap",    1, 0, 0) \
+    X(INST_PUSH,    "push",    1, 0, 1) \
+    X(INST_POP,     "pop",     0, 1, 0) \
+    X(INST_PLUSI,   "plusi",   0, 2, 1) \
+    X(INST_MINUSI,  "minusi",  0, 2, 1) \
+    X(INST_MULTI,   "multi",   0, 2, 1) \
+    X(INST_DIVI,    "divi",    0, 2, 1) \
+    X(INST_MODI,    "modi",    0, 2, 1) \
+    X(INST_GEI,     "gei",     0, 2, 1) \
+    X(INST_LEI,     "lei",     0, 2, 1) \
+    X(INST_LI,      "li",      0, 2, 1) \
+    X(INST_NEI,     "nei",     0, 2, 1) \
+    X(INST_GI,      "gi",      0, 2, 1) \
+    X(INST_EQI,     "eqi",     0, 2, 1) \
+    X(INST_PLUSF,   "plusf",   0, 2, 1) \
+    X(INST_MINUSF,  "minusf",  0, 2, 1) \
+    X(INST_MULTF,   "multf",   0, 2, 1) \
+    X(INST_DIVF,    "divf",    0, 2, 1) \
+    X(INST_GEF,     "gef",     0, 2, 1) \
+    X(INST_GF,      "gf",      0, 2, 1) \
+    X(INST_LEF,     "lef",     0, 2, 1) \
+    X(INST_LF,      "lf",      0, 2, 1) \
+    X(INST_NEF,     "nef",     0, 2, 1) \
+    X(INST_EQF,     "eqf",     0, 2, 1) \
+    X(INST_ANDB,    "andb",    0, 2, 1) \
+    X(INST_ORB,     "orb",     0, 2, 1) \
+    X(INST_XOR,     "xor",     0, 2, 1) \
+    X(INST_SHR,     "shr",     0, 2, 1) \
+    X(INST_SHL,     "shl",     0, 2, 1) \
+    X(INST_NOTB,    "notb",    0, 1, 1) \
+    X(INST_CALL,    "call",    1, 0, 1) \
+    X(INST_INT,     "int",     1, 0, 0) \
+    X(INST_JMP,     "jmp",     1, 0, 0) \
+    X(INST_JMP_IF,  "jmpif",   1, 1, 0) \
+    X(INST_RET,     "ret",     0, 1, 0) \
+    X(INST_READ8,   "read8",   0, 1, 1) \
+    X(INST_READ16,  "read16",  0, 1, 1) \
+    X(INST_READ32,  "read32",  0, 1, 1) \
+    X(INST_READ64,  "read64",  0, 1, 1) \
+    X(INST_WRITE8,  "write8",  0, 2, 0) \
+    X(INST_WRITE16, "write16", 0, 2, 0) \
+    X(INST_WRITE32, "write32", 0, 2, 0) \
+    X(INST_WRITE64, "write64", 0, 2, 0) \
+    X(INST_I2F,     "i2f",     0, 1, 1) \
+    X(INST_I2U,     "i2u",     0, 1, 1) \
+    X(INST_U2F,     "u2f",     0, 1, 1) \
+    X(INST_U2I,     "u2i",     0, 1, 1) \
+    X(INST_F2I,     "f2i",     0, 1, 1) \
+    X(INST_F2U,     "f2u",     0, 1, 1) \
+    X(INST_NOT,     "not",     0, 1, 1) \
+    X(INST_SPAWN,   "spawn",   1, 1, 1) \
+    X(INST_YIELD,   "yield",   0, 0, 0) \
+    X(INST_JOIN,    "join",    0, 1, 1) \
+    X(INST_THREAD,  "thread",  1, 1, 1) \
+    X(INST_TJOIN,   "tjoin",   0, 1, 1) \
+    X(INST_CAS8,    "cas8",    0, 3, 1) \
+    X(INST_CAS16,   "cas16",   0, 3, 1) \
+    X(INST_CAS32,   "cas32",   0, 3, 1) \
+    X(INST_CAS64,   "cas64",   0, 3, 1) \
+    X(INST_XADD8,   "xadd8",   0, 2, 1) \
+    X(INST_XADD16,  "xadd16",  0, 2, 1) \
+    X(INST_XADD32,  "xadd32",  0, 2, 1) \
+    X(INST_XADD64,  "xadd64",  0, 2, 1) \
+    X(INST_XCHG8,   "xchg8",   0, 2, 1) \
+    X(INST_XCHG16,  "xchg16",  0, 2, 1) \
+    X(INST_XCHG32,  "xchg32",  0, 2, 1) \
+    X(INST_XCHG64,  "xchg64",  0, 2, 1) \
+    X(INST_FENCE,   "fence",   0, 0, 0) \
+    X(INST_CHAN,    "chan",    1, 0, 1) \
+    X(INST_SEND,    "send",    0, 2, 0) \
+    X(INST_RECV,    "recv",    0, 1, 1) \
+    X(INST_TRYSEND, "trysend", 0, 2, 1) \
+    X(INST_TRYRECV, "tryrecv", 0, 1, 2) \
+    X(INST_SQRTF,   "sqrtf",   0, 1, 1) \
+    X(INST_ABSF,    "absf",    0, 1, 1) \
+    X(INST_FLOORF,  "floorf",  0, 1, 1) \
+    X(INST_CEILF,   "ceilf",   0, 1, 1) \
+    X(INST_ROUNDF,  "roundf",  0, 1, 1) \
+    X(INST_MINF,    "minf",    0, 2, 1) \
+    X(INST_MAXF,    "maxf",    0, 2, 1) \
+    X(INST_FMAF,    "fmaf",    0, 3, 1) \
+    X(INST_SINF,    "sinf",    0, 1, 1) \
+    X(INST_COSF,    "cosf",    0, 1, 1) \
+    X(INST_EXPF,    "expf",    0, 1, 1) \
+    X(INST_LOGF,    "logf",    0, 1, 1) \
+    X(INST_PLUSI_IMM,  "plusi.imm",  1, 1, 1) \
+    X(INST_MINUSI_IMM, "minusi.imm", 1, 1, 1) \
+    X(INST_MULTI_IMM,  "multi.imm",  1, 1, 1) \
+    X(INST_DIVI_IMM,   "divi.imm",   1, 1, 1) \
+    X(INST_MODI_IMM,   "modi.imm",   1, 1, 1) \
+    X(INST_GEI_IMM,    "gei.imm",    1, 1, 1) \
+    X(INST_LEI_IMM,    "lei.imm",    1, 1, 1) \
+    X(INST_LI_IMM,     "li.imm",     1, 1, 1) \
+    X(INST_NEI_IMM,    "nei.imm",    1, 1, 1) \
+    X(INST_GI_IMM,     "gi.imm",     1, 1, 1) \
+    X(INST_EQI_IMM,    "eqi.imm",    1, 1, 1) \
+    X(INST_PLUSF_IMM,  "plusf.imm",  1, 1, 1) \
+    X(INST_MINUSF_IMM, "minusf.imm", 1, 1, 1) \
+    X(INST_MULTF_IMM,  "multf.imm",  1, 1, 1) \
+    X(INST_DIVF_IMM,   "divf.imm",   1, 1, 1) \
+    X(INST_GEF_IMM,    "gef.imm",    1, 1, 1) \
+    X(INST_GF_IMM,     "gf.imm",     1, 1, 1) \
+    X(INST_LEF_IMM,    "lef.imm",    1, 1, 1) \
+    X(INST_LF_IMM,     "lf.imm",     1, 1, 1) \
+    X(INST_NEF_IMM,    "nef.imm",    1, 1, 1) \
+    X(INST_EQF_IMM,    "eqf.imm",    1, 1, 1) \
+    X(INST_ANDB_IMM,   "andb.imm",   1, 1, 1) \
+    X(INST_ORB_IMM,    "orb.imm",    1, 1, 1) \
+    X(INST_XOR_IMM,    "xor.imm",    1, 1, 1) \
+    X(INST_SHR_IMM,    "shr.imm",    1, 1, 1) \
+    X(INST_SHL_IMM,    "shl.imm",    1, 1, 1) \
+    X(INST_ENTER,       "enter",       1, 0, 0) \
+    X(INST_LEAVE,       "leave",       0, 0, 0) \
+    X(INST_LOAD_LOCAL,  "load.local",  1, 0, 1) \
+    X(INST_STORE_LOCAL, "store.local", 1, 1, 0) \
+    X(INST_READ8_DISP,   "read8.disp",   1, 1, 1) \
+    X(INST_READ16_DISP,  "read16.disp",  1, 1, 1) \
+    X(INST_READ32_DISP,  "read32.disp",  1, 1, 1) \
+    X(INST_READ64_DISP,  "read64.disp",  1, 1, 1) \
+    X(INST_WRITE8_DISP,  "write8.disp",  1, 2, 0) \
+    X(INST_WRITE16_DISP, "write16.disp", 1, 2, 0) \
+    X(INST_WRITE32_DISP, "write32.disp", 1, 2, 0) \
+    X(INST_WRITE64_DISP, "write64.disp", 1, 2, 0) \
+    X(INST_READ8_IDX,    "read8.idx",    1, 2, 1) \
+    X(INST_READ16_IDX,   "read16.idx",   1, 2, 1) \
+    X(INST_READ32_IDX,   "read32.idx",   1, 2, 1) \
+    X(INST_READ64_IDX,   "read64.idx",   1, 2, 1) \
+    X(INST_WRITE8_IDX,   "write8.idx",   1, 3, 0) \
+    X(INST_WRITE16_IDX,  "write16.idx",  1, 3, 0) \
+    X(INST_WRITE32_IDX,  "write32.idx",  1, 3, 0) \
+    X(INST_WRITE64_IDX,  "write64.idx",  1, 3, 0) \
+    X(INST_JMPTABLE,     "jmptable",     1, 1, 0) \
+    X(INST_CALLR,        "callr",        0, 1, 1) \
+    X(INST_POPCNT,  "popcnt",  0, 1, 1) \
+    X(INST_CLZ,     "clz",     0, 1, 1) \
+    X(INST_CTZ,     "ctz",     0, 1, 1) \
+    X(INST_BSWAP,   "bswap",   0, 1, 1) \
+    X(INST_ROTL,    "rotl",    0, 2, 1) \
+    X(INST_ROTR,    "rotr",    0, 2, 1) \
+    X(INST_MULHU,   "mulhu",   0, 2, 1) \
+    X(INST_MULHI,   "mulhi",   0, 2, 1) \
+    X(INST_SEXT8,   "sext8",   0, 1, 1) \
+    X(INST_SEXT16,  "sext16",  0, 1, 1) \
+    X(INST_SEXT32,  "sext32",  0, 1, 1) \
+    X(INST_HALT,    "halt",    0, 0, 0)
+
 typedef enum {
-    INST_NOP = 0,
-    INST_DUP,
-    INST_SWAP,
-    INST_PUSH,
-    INST_POP,
-
-    INST_PLUSI,
-    INST_MINUSI,
-    INST_MULTI,
-    INST_DIVI,
-    INST_MODI,
-    INST_GEI,
-    INST_LEI,
-    INST_LI,
-    INST_NEI,
-    INST_GI,
-    INST_EQI,
-
-    INST_PLUSF,
-    INST_MINUSF,
-    INST_MULTF,
-    INST_DIVF,
-    INST_GEF,
-    INST_GF,
-    INST_LEF,
-    INST_LF,
-    INST_NEF,
-    INST_EQF,
-
-    INST_ANDB,
-    INST_ORB,
-    INST_XOR,
-    INST_SHR,
-    INST_SHL,
-    INST_NOTB,
-
-    INST_CALL,
-    INST_INT,
-    INST_JMP,
-    INST_JMP_IF,
-    INST_RET,
-
-    INST_READ8,
-    INST_READ16,
-    INST_READ32,
-    INST_READ64,
-
-    INST_WRITE8,
-    INST_WRITE16,
-    INST_WRITE32,
-    INST_WRITE64,
-
-    INST_I2F,
-    INST_I2U,
-    INST_U2F,
-    INST_U2I,
-    INST_F2I,
-    INST_F2U,
-
-    INST_NOT,
-    INST_HALT,
+#define BR_INST_ENUM(type, name, has_operand, pops, pushes) type,
+    BR_INST_LIST(BR_INST_ENUM)
+#undef BR_INST_ENUM
     SIZE
 } InstType;
 
@@ -193,29 +375,165 @@ typedef struct {
     Word operand;
 } Inst;
 
+// X(directive, name, data_size)
+#define BASM_DIRECTIVE_LIST(X)             \
+    X(DIRECTIVE_DEFINE,  "define",  0)     \
+    X(DIRECTIVE_BYTE,    "byte",    1)     \
+    X(DIRECTIVE_WORD,    "word",    2)     \
+    X(DIRECTIVE_DWORD,   "dword",   4)     \
+    X(DIRECTIVE_QWORD,   "qword",   8)     \
+    X(DIRECTIVE_INCLUDE, "include", 0)     \
+    X(DIRECTIVE_ENTRY,   "entry",   0)     \
+    X(DIRECTIVE_INLINE,  "inline",  0)     \
+    X(DIRECTIVE_TABLE,   "table",   8)
+
+typedef enum {
+#define BASM_DIRECTIVE_ENUM(directive, name, data_size) directive,
+    BASM_DIRECTIVE_LIST(BASM_DIRECTIVE_ENUM)
+#undef BASM_DIRECTIVE_ENUM
+    DIRECTIVE_SIZE
+} BasmDirective;
+
+typedef struct {
+    uint32_t displacements[BASM_PHASH_BUCKETS];
+    int16_t slots[BASM_PHASH_CAPACITY];
+    int ready;
+} BasmPerfectHash;
+
 typedef struct ByteRunner ByteRunner;
 
 typedef Err (*Br_Native)(ByteRunner *);
 
+#define BR_FIBER_NONE UINT64_MAX
+
+typedef enum {
+    BR_FIBER_READY = 0,
+    BR_FIBER_RUNNING,
+    BR_FIBER_JOINING,
+    BR_FIBER_DONE,
+} BrFiberState;
+
+typedef struct {
+    BrFiberState state;
+    InstAddr ip;
+
+    // Only the words in use are kept while the fiber is switched out, the buffer grows with the fiber's stack
+    Word *stack;
+    uint64_t stack_size;
+    uint64_t stack_capacity;
+    uint64_t fp;
+
+    // The fiber this one waits for, and the list of fibers waiting for this one
+    uint64_t joining;
+    uint64_t waiters;
+    uint64_t next_waiter;
+
+    Word result;
+} BrFiber;
+
+typedef struct BrThread BrThread;
+
+typedef struct {
+    _Atomic uint64_t sequence;
+    Word value;
+} BrChannelCell;
+
+// Bounded ring of words that any number of VMs or host threads can send to and receive from without locks.
+// Each cell carries a sequence number that tells whether it is free for the next send or holds the next message
+typedef struct BrChannel BrChannel;
+
+struct BrChannel {
+    // The senders and the receivers each update a cache line of their own
+    _Alignas(BR_CACHE_LINE_SIZE) _Atomic uint64_t tail;
+    _Alignas(BR_CACHE_LINE_SIZE) _Atomic uint64_t head;
+    _Alignas(BR_CACHE_LINE_SIZE) uint64_t mask;
+    BrChannelCell *cells;
+
+#ifdef BR_THREADS
+    // Threads blocked in send or recv sleep on changed, a send or recv only takes the lock while one does
+    _Atomic uint64_t sleepers;
+    mtx_t lock;
+    cnd_t changed;
+#endif
+
+    // The channels a VM created with chan, it frees them with the VM
+    BrChannel *next_owned;
+};
+
+typedef enum {
+    BR_ATOMIC_CAS = 0,
+    BR_ATOMIC_ADD,
+    BR_ATOMIC_XCHG,
+} BrAtomicOp;
+
 struct ByteRunner {
     Word stack[BR_STACK_CAPACITY];
     uint64_t stack_size;
 
-    Inst program[BR_PROGRAM_CAPACITY];
+    // Index of the first local of the innermost frame, the word below it holds the frame pointer enter saved.
+    // It is 0 outside of any frame, so the locals address the bottom of the stack there
+    uint64_t fp;
+
+    // Both point to storage owned by whoever loaded the program. The writes only check their first byte, so
+    // memory spans BR_MEMORY_CAPACITY + BR_WORD_SIZE bytes
+    const Inst *program;
     uint64_t program_size;
     InstAddr ip;
 
     Br_Native natives[BR_NATIVE_CAPACITY];
     size_t natives_size;
 
-    uint8_t memory[BR_MEMORY_CAPACITY];
+    // The pointer each native was registered with, native_context holds the one of the native being called
+    void *native_contexts[BR_NATIVE_CAPACITY];
+    void *native_context;
+
+    uint8_t *memory;
 
     int halt;
+
+    // Fibers started by spawn, fiber 0 is the one that ran the entry point. The running fiber works on stack
+    // above. Nothing is allocated until the first spawn
+    BrFiber *fibers;
+    size_t fibers_size;
+    size_t fibers_capacity;
+    uint64_t fiber;
+
+    // Ring of the fibers waiting for their turn, it has room for every fiber
+    uint64_t *ready;
+    size_t ready_begin;
+    size_t ready_size;
+
+    // OS threads started by thread, each runs a ByteRunner of its own over this program, memory and natives.
+    // The ids are only valid in the VM that started them
+    BrThread **threads;
+    size_t threads_size;
+    size_t threads_capacity;
+
+    // Channels by id, attached by the host or created by chan. The threads a VM starts get a copy of the table
+    BrChannel *channels[BR_CHANNELS_CAPACITY];
+    size_t channels_size;
+    BrChannel *owned_channels;
+
+    // Channel waits in a row without a fiber getting anywhere, once every ready fiber had one the thread sleeps
+    uint64_t channel_waits;
+
+    // How many instructions run in a straight line from each address before control may go elsewhere,
+    // br_execute_budget builds it on its first call
+    uint64_t *run_lengths;
+};
+
+struct BrThread {
+    ByteRunner br;
+#ifdef BR_THREADS
+    thrd_t handle;
+#endif
+    Err err;
 };
 
 typedef struct {
     StringView name;
     Word word;
+    int code;
 } Label;
 
 typedef struct {
@@ -224,29 +542,117 @@ typedef struct {
 } UnresolvedJmp;
 
 typedef struct {
-    Label labels[BR_LABEL_CAPACITY];
+    StringView label;
+    StringView file_path;
+    int line_number;
+} BasmInline;
+
+typedef struct {
+    MemoryAddr offset;
+    StringView label;
+} BasmTableEntry;
+
+typedef struct {
+    Label *labels;
     size_t labels_size;
+    size_t labels_capacity;
+    size_t *label_slots;
+    size_t label_slots_capacity;
 
-    UnresolvedJmp unresolved_jmps[BR_UNRESOLVED_JMPS_CAPACITY];
+    UnresolvedJmp *unresolved_jmps;
     size_t unresolved_jmp_size;
+    size_t unresolved_jmp_capacity;
 
-    Inst program[BR_PROGRAM_CAPACITY];
+    Inst *program;
     size_t program_size;
+    size_t program_allocated;
     InstAddr entry;
     int has_entry;
 
-    uint8_t memory[BR_MEMORY_CAPACITY];
+    BasmInline *inlines;
+    size_t inlines_size;
+    size_t inlines_capacity;
+
+    // Instructions outside of jmp/jmpif/call whose operand is an instruction address
+    InstAddr *code_refs;
+    size_t code_refs_size;
+    size_t code_refs_capacity;
+
+    // The words of the %table directives in memory, each one holds an instruction address once the labels are resolved
+    BasmTableEntry *table_entries;
+    size_t table_entries_size;
+    size_t table_entries_capacity;
+
+    uint8_t *memory;
     size_t memory_size;
     size_t memory_capacity;
+    size_t memory_allocated;
 
     size_t inc_level;
+    size_t lines;
+
+    // Errors exit the process unless error_jump is set, then the message lands in error and the assembler
+    // jumps back to whoever set it
+    jmp_buf *error_jump;
+    char error[BASM_ERROR_CAPACITY];
 } Basm;
 
+typedef struct MChunk MChunk;
+
+typedef struct MMapping MMapping;
+
+struct MMapping {
+    MMapping *next;
+    void *addr;
+    size_t size;
+};
+
+struct MChunk {
+    MChunk *next;
+    size_t size;
+    size_t capacity;
+    char data[];
+};
+
 typedef struct {
-    char arena[BR_ASSEMBLY_MEMORY_CAPACITY];
+    MChunk *chunks;
+    MMapping *mappings;
+    size_t chunks_count;
     size_t arena_size;
+    size_t arena_capacity;
 } MManager;
 
+typedef struct {
+    size_t subroutines;
+    size_t call_sites;
+} BasmInlineStats;
+
+typedef struct {
+    size_t instructions_before;
+    size_t instructions_after;
+    size_t folded;
+    size_t threaded;
+    size_t unreachable;
+    size_t cancelled;
+} BasmOptStats;
+
+typedef struct {
+    size_t blocks;
+    size_t cold;
+    size_t inverted;
+    size_t jumps_removed;
+    size_t jumps_added;
+} BasmLayoutStats;
+
+// How often every instruction ran and how often it sent ip anywhere but to the next instruction. The
+// fingerprint ties the counts to the exact program they were recorded for
+typedef struct {
+    uint64_t fingerprint;
+    size_t size;
+    uint64_t *executions;
+    uint64_t *taken;
+} BrProfile;
+
 PACK(struct BasmFileMeta {
          uint16_t magic;
          uint16_t version;
@@ -266,14 +672,72 @@ typedef struct BasmFileMeta BasmFileMeta;
 
 void *basm_alloc(MManager *manager, size_t size);
 
+void basm_arena_free(MManager *manager);
+
+int basm_try_reserve(void **items, size_t *capacity, size_t item_size, size_t count);
+
+void *basm_reserve(Basm *basm, void *items, size_t *capacity, size_t item_size, size_t count);
+
+void basm_free(Basm *basm);
+
+_Noreturn void basm_fail(Basm *basm, const char *format, ...);
+
 size_t basm_save_to_file(Basm *basm, const char *file_path);
 
+size_t basm_image_size(const Basm *basm);
+
+void basm_write_image(const Basm *basm, uint8_t *image);
+
+uint64_t basm_file_program_offset(void);
+
+uint64_t basm_file_memory_offset(uint64_t program_size);
+
+uint64_t basm_hash_bytes(uint64_t hash, const void *data, size_t size);
+
+uint64_t basm_hash_program(const Inst *program, size_t size);
+
+uint64_t basm_hash_inst_table(uint64_t hash);
+
+void br_profile_free(BrProfile *profile);
+
+const Label *basm_find_label(const Basm *basm, StringView name);
+
 int basm_resolve_label(const Basm *basm, StringView name, Word *output);
 
 int basm_bind_label(Basm *basm, StringView name, Word word);
 
 void basm_bind_unresolved(Basm *basm, InstAddr addr, StringView label);
 
+void basm_bind_code_ref(Basm *basm, InstAddr addr);
+
+// The instruction address held by the i-th %table entry
+InstAddr basm_table_target(const Basm *basm, size_t i);
+
+int inst_targets_code(InstType type);
+
+// The `.imm` form of a binary instruction, which takes the second operand from its own operand, or SIZE
+InstType inst_immediate_form(InstType type);
+
+// The binary instruction behind an `.imm` form, or SIZE
+InstType inst_binary_form(InstType type);
+
+void basm_optimize(Basm *basm, BasmOptStats *stats);
+
+void basm_inline(Basm *basm, size_t threshold, BasmInlineStats *stats);
+
+// Turns every push in front of a binary instruction into the operand of its `.imm` form, then folds the address
+// arithmetic in front of reads and writes into their `.disp` and `.idx` forms. Returns how many instructions
+// it removed
+size_t basm_fuse_immediates(Basm *basm);
+
+void basm_load_profile(BrProfile *profile, const char *file_path);
+
+void basm_layout(Basm *basm, const BrProfile *profile, BasmLayoutStats *stats);
+
+InstAddr basm_relocate_addr(const InstAddr *new_addrs, size_t old_size, size_t new_size, InstAddr addr);
+
+void basm_relocate(Basm *basm, const InstAddr *new_addrs, size_t new_program_size);
+
 Word basm_push_string_to_memory(Basm *basm, StringView sv);
 
 Word basm_push_word_to_memory(Basm *basm, Word value, size_t size);
@@ -282,7 +746,13 @@ int basm_translate_literal(Basm *basm, StringView sv, Word *output);
 
 void basm_translate_source(StringView input_file_path, Basm *basm, MManager *manager);
 
-StringView basm_slurp_file(MManager *manager, StringView file_path);
+void basm_translate_buffer(StringView input_file_path, StringView source, Basm *basm, MManager *manager);
+
+int basm_assemble_memory(StringView name, StringView source, Basm *basm, MManager *manager);
+
+int basm_read_file(MManager *manager, const char *file_path, StringView *output);
+
+StringView basm_slurp_file(Basm *basm, MManager *manager, StringView file_path);
 
 // endregion
 /// ========================================
@@ -292,257 +762,658 @@ StringView basm_slurp_file(MManager *manager, StringView file_path);
 
 int inst_has_operand(InstType type);
 
+size_t inst_stack_pops(InstType type);
+
+size_t inst_stack_pushes(InstType type);
+
+// The `.disp` and `.idx` forms of a read or write, which add a displacement or a scaled index to the address, or SIZE
+InstType inst_displacement_form(InstType type);
+
+InstType inst_indexed_form(InstType type);
+
+// The read or write behind any of its forms, or SIZE
+InstType inst_memory_form(InstType type);
+
+// How many bytes a read or write of any form accesses, 0 for the other instructions
+uint64_t inst_memory_width(InstType type);
+
+// The operand of an `.idx` form keeps log2 of the scale of the index in its low two bits and the displacement,
+// which may be negative, in the rest
+#define BR_INDEX_OPERAND(shift, disp) ((uint64_t) (disp) << 2 | (uint64_t) (shift))
+#define BR_INDEX_SHIFT(operand) ((operand) & 3)
+#define BR_INDEX_DISP(operand) ((uint64_t) ((int64_t) (operand) >> 2))
+
+// A jmptable operand is the address of a word with the number of entries, the entries follow it. This is how
+// many of them fit into the memory for a table whose count word does
+#define BR_JMPTABLE_LIMIT(table) ((BR_MEMORY_CAPACITY - BR_WORD_SIZE - (table)) / BR_WORD_SIZE)
+
+// The bit instructions, clz and ctz of 0 are 64 and the rotations only use the low 6 bits of the count. mulhu and
+// mulhi return the high 64 bits of the unsigned and the signed 128-bit product
+uint64_t br_popcnt(uint64_t value);
+
+uint64_t br_clz(uint64_t value);
+
+uint64_t br_ctz(uint64_t value);
+
+uint64_t br_bswap(uint64_t value);
+
+uint64_t br_shl(uint64_t value, uint64_t count);
+
+uint64_t br_shr(uint64_t value, uint64_t count);
+
+uint64_t br_rotl(uint64_t value, uint64_t count);
+
+uint64_t br_rotr(uint64_t value, uint64_t count);
+
+uint64_t br_mulhu(uint64_t lhs, uint64_t rhs);
+
+uint64_t br_mulhi(uint64_t lhs, uint64_t rhs);
+
 const char *inst_asm_name(InstType type);
 
 int inst_by_name(StringView *name, InstType *output);
 
+uint32_t basm_phash_key(StringView name);
+
+void basm_phash_build(BasmPerfectHash *hash, const char *const *names, size_t count);
+
+int basm_phash_find(const BasmPerfectHash *hash, const char *const *names, StringView name);
+
+int basm_directive_by_name(StringView name, BasmDirective *output);
+
+size_t basm_directive_data_size(BasmDirective directive);
+
 const char *err_as_cstr(Err err);
 
 Err br_execute_inst(ByteRunner *br);
 
 Err br_execute_program(ByteRunner *br, int limit);
 
-void br_push_native(ByteRunner *br, Br_Native native);
+Err br_execute_budget(ByteRunner *br, uint64_t *budget);
+
+void br_profile_init(BrProfile *profile, const ByteRunner *br);
+
+Err br_execute_program_profiled(ByteRunner *br, int limit, BrProfile *profile);
+
+void br_save_profile(const BrProfile *profile, const char *file_path);
+
+Err br_push_native(ByteRunner *br, Br_Native native);
+
+Err br_push_native_with_context(ByteRunner *br, Br_Native native, void *context);
+
+const char *br_load_program_from_memory(ByteRunner *br, const uint8_t *image, size_t image_size);
+
+void br_free_fibers(ByteRunner *br);
+
+void br_free_threads(ByteRunner *br);
+
+uint64_t br_atomic(BrAtomicOp op, uint8_t *location, uint64_t size, uint64_t value, uint64_t desired);
+
+BrChannel *br_channel_new(uint64_t capacity);
+
+void br_channel_free(BrChannel *channel);
+
+int br_channel_try_send(BrChannel *channel, Word value);
+
+int br_channel_try_recv(BrChannel *channel, Word *value);
+
+uint64_t br_attach_channel(ByteRunner *br, BrChannel *channel);
+
+void br_free_channels(ByteRunner *br);
+
+void br_release(ByteRunner *br);
 
 void br_dump_stack(FILE *stream, const ByteRunner *br);
 
 void br_load_program_from_file(ByteRunner *br, const char *file_path);
 
+/// endregion
+/// ========================================
+/// BASM cache
+/// ========================================
+/// region
+
+typedef struct {
+    const char *dir;
+    uint64_t limit;
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t bytes_saved;
+
+    // The counts when the cache was opened. Saving adds what happened since to the file as it is by then,
+    // so assemblies sharing the cache do not overwrite each other's counts
+    uint64_t opened_hits;
+    uint64_t opened_misses;
+    uint64_t opened_bytes_saved;
+} BasmCache;
+
+uint64_t basm_hash_source(Basm *basm, MManager *manager, StringView file_path, uint64_t hash, size_t level);
+
+void basm_cache_open(BasmCache *cache, const char *dir, uint64_t limit);
+
+int basm_cache_fetch(BasmCache *cache, uint64_t key, const char *output_file_path, BasmFileMeta *meta);
+
+void basm_cache_store(BasmCache *cache, uint64_t key, const char *output_file_path);
+
+void basm_cache_evict(BasmCache *cache);
+
+void basm_cache_save_stats(BasmCache *cache);
+
+void basm_cache_print_stats(FILE *stream, const BasmCache *cache);
+
 /// endregion
 #endif
 #ifdef BASM_UTILS
 
 void *basm_alloc(MManager *manager, size_t size) {
-    assert(manager->arena_size + size <= BR_ASSEMBLY_MEMORY_CAPACITY);
+    size = (size + BR_WORD_SIZE - 1) & ~((size_t) BR_WORD_SIZE - 1);
+
+    MChunk *chunk = manager->chunks;
+    if (chunk == NULL || chunk->capacity - chunk->size < size) {
+        size_t capacity = size > BR_ASSEMBLY_CHUNK_SIZE ? size : BR_ASSEMBLY_CHUNK_SIZE;
+        chunk = malloc(sizeof(MChunk) + capacity);
+        if (chunk == NULL) {
+            return NULL;
+        }
+
+        chunk->size = 0;
+        chunk->capacity = capacity;
+        chunk->next = manager->chunks;
+        manager->chunks = chunk;
+        manager->chunks_count++;
+        manager->arena_capacity += sizeof(MChunk) + capacity;
+    }
 
-    void *result = manager->arena + manager->arena_size;
+    void *result = chunk->data + chunk->size;
+    chunk->size += size;
     manager->arena_size += size;
     return result;
 }
 
-const char *inst_asm_name(InstType type) {
-    switch (type) {
-        case INST_NOP:
-            return "nop";
-        case INST_DUP:
-            return "dup";
-        case INST_SWAP:
-            return "swap";
-        case INST_POP:
-            return "pop";
-        case INST_PUSH:
-            return "push";
-        case INST_PLUSI:
-            return "plusi";
-        case INST_MINUSI:
-            return "minusi";
-        case INST_MULTI:
-            return "multi";
-        case INST_DIVI:
-            return "divi";
-        case INST_MODI:
-            return "modi";
-        case INST_PLUSF:
-            return "plusf";
-        case INST_MINUSF:
-            return "minusf";
-        case INST_MULTF:
-            return "multf";
-        case INST_DIVF:
-            return "divf";
-        case INST_EQF:
-            return "eqf";
-        case INST_GEF:
-            return "gef";
-        case INST_NEF:
-            return "nef";
-        case INST_GEI:
-            return "gei";
-        case INST_CALL:
-            return "call";
-        case INST_INT:
-            return "int";
-        case INST_JMP:
-            return "jmp";
-        case INST_JMP_IF:
-            return "jmpif";
-        case INST_RET:
-            return "ret";
-        case INST_EQI:
-            return "eqi";
-        case INST_NOT:
-            return "not";
-        case INST_HALT:
-            return "halt";
-        case INST_ANDB:
-            return "andb";
-        case INST_ORB:
-            return "orb";
-        case INST_XOR:
-            return "xor";
-        case INST_SHR:
-            return "shr";
-        case INST_SHL:
-            return "shl";
-        case INST_NOTB:
-            return "notb";
-        case INST_READ8:
-            return "read8";
-        case INST_READ16:
-            return "read16";
-        case INST_READ32:
-            return "read32";
-        case INST_READ64:
-            return "read64";
-        case INST_WRITE8:
-            return "write8";
-        case INST_WRITE16:
-            return "write16";
-        case INST_WRITE32:
-            return "write32";
-        case INST_WRITE64:
-            return "write64";
-        case INST_LEI:
-            return "lei";
-        case INST_LI:
-            return "li";
-        case INST_NEI:
-            return "nei";
-        case INST_GI:
-            return "gi";
-        case INST_GF:
-            return "gf";
-        case INST_LEF:
-            return "lef";
-        case INST_LF:
-            return "lf";
-        case INST_I2F:
-            return "i2f";
-        case INST_I2U:
-            return "i2u";
-        case INST_U2F:
-            return "u2f";
-        case INST_U2I:
-            return "u2i";
-        case INST_F2I:
-            return "f2i";
-        case INST_F2U:
-            return "f2u";
-        case SIZE:
-        default:
-            assert(0 && "inst_asm_name: Unreachable");
-            return "";
+void basm_arena_free(MManager *manager) {
+#ifdef BASM_MMAP
+    // The mapping records live inside the chunks, so unmap before releasing them
+    for (MMapping *mapping = manager->mappings; mapping != NULL; mapping = mapping->next) {
+        munmap(mapping->addr, mapping->size);
     }
-}
+#endif
+    manager->mappings = NULL;
 
-int inst_by_name(StringView *name, InstType *output) {
-    for (InstType type = (InstType) 0; type < SIZE; type++) {
-        if (sv_eq(*name, cstr_as_sv(inst_asm_name(type)))) {
-            *output = type;
-            return 1;
-        }
+    MChunk *chunk = manager->chunks;
+    while (chunk != NULL) {
+        MChunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
     }
 
-    return 0;
+    manager->chunks = NULL;
+    manager->chunks_count = 0;
+    manager->arena_size = 0;
+    manager->arena_capacity = 0;
 }
 
-int inst_has_operand(InstType type) {
-    switch (type) {
-        case INST_NOP:
-        case INST_POP:
-        case INST_PLUSI:
-        case INST_MINUSI:
-        case INST_MULTI:
-        case INST_DIVI:
-        case INST_MODI:
-        case INST_GEI:
-        case INST_PLUSF:
-        case INST_MINUSF:
-        case INST_MULTF:
-        case INST_DIVF:
-        case INST_EQF:
-        case INST_GEF:
-        case INST_EQI:
-        case INST_NOT:
-        case INST_HALT:
-        case INST_RET:
-        case INST_ANDB:
-        case INST_ORB:
-        case INST_XOR:
-        case INST_SHR:
-        case INST_SHL:
-        case INST_NOTB:
-        case INST_READ8:
-        case INST_READ16:
-        case INST_READ32:
-        case INST_READ64:
-        case INST_WRITE8:
-        case INST_WRITE16:
-        case INST_WRITE32:
-        case INST_WRITE64:
-        case INST_LEI:
-        case INST_LI:
-        case INST_NEI:
-        case INST_GI:
-        case INST_GF:
-        case INST_LEF:
-        case INST_LF:
-        case INST_NEF:
-        case INST_I2F:
-        case INST_I2U:
-        case INST_U2F:
-        case INST_U2I:
-        case INST_F2I:
-        case INST_F2U:
-            return 0;
+#if defined(__GNUC__) || defined(__clang__)
 
-        case INST_DUP:
-        case INST_SWAP:
-        case INST_PUSH:
-        case INST_CALL:
-        case INST_INT:
-        case INST_JMP:
-        case INST_JMP_IF:
-            return 1;
-        case SIZE:
-        default:
-            assert(0 && "inst_has_operand: Unreachable");
-            return 0;
-    }
+uint64_t br_popcnt(uint64_t value) {
+    return (uint64_t) __builtin_popcountll(value);
 }
 
-Word basm_push_string_to_memory(Basm *basm, StringView sv) {
-    assert(basm->memory_size + sv.count <= BR_MEMORY_CAPACITY);
+uint64_t br_clz(uint64_t value) {
+    return value == 0 ? 64 : (uint64_t) __builtin_clzll(value);
+}
 
-    Word result = WORD_U64(basm->memory_size);
-    memcpy(basm->memory + basm->memory_size, sv.data, sv.count);
-    basm->memory_size += sv.count;
+uint64_t br_ctz(uint64_t value) {
+    return value == 0 ? 64 : (uint64_t) __builtin_ctzll(value);
+}
 
-    if (basm->memory_size > basm->memory_capacity) {
-        basm->memory_capacity = basm->memory_size;
-    }
+uint64_t br_bswap(uint64_t value) {
+    return __builtin_bswap64(value);
+}
 
-    return result;
+#else
+
+uint64_t br_popcnt(uint64_t value) {
+    value = value - ((value >> 1) & 0x5555555555555555);
+    value = (value & 0x3333333333333333) + ((value >> 2) & 0x3333333333333333);
+    value = (value + (value >> 4)) & 0x0F0F0F0F0F0F0F0F;
+    return (value * 0x0101010101010101) >> 56;
 }
 
-Word basm_push_word_to_memory(Basm *basm, Word value, size_t size) {
-    assert(basm->memory_size + BR_WORD_SIZE <= BR_MEMORY_CAPACITY);
-    Word result = WORD_U64(basm->memory_size);
-    for (size_t i = 0; i < size; i++) {
-        basm->memory[basm->memory_size++] = (value.as_u64 >> i * 8) & 0xFF;
+uint64_t br_clz(uint64_t value) {
+    uint64_t count = 0;
+    for (uint64_t bit = (uint64_t) 1 << 63; bit != 0 && (value & bit) == 0; bit >>= 1) {
+        count++;
     }
+    return count;
+}
 
-    if (basm->memory_size > basm->memory_capacity) {
-        basm->memory_capacity = basm->memory_size;
+uint64_t br_ctz(uint64_t value) {
+    uint64_t count = 0;
+    for (uint64_t bit = 1; bit != 0 && (value & bit) == 0; bit <<= 1) {
+        count++;
     }
+    return count;
+}
 
+uint64_t br_bswap(uint64_t value) {
+    uint64_t result = 0;
+    for (int i = 0; i < 8; i++) {
+        result = result << 8 | (value & 0xFF);
+        value >>= 8;
+    }
     return result;
 }
 
-/// ========================================
-/// STRING VIEW
-/// ========================================
-/// region
+#endif
+
+#if defined(__SIZEOF_INT128__)
+
+__extension__ typedef unsigned __int128 BrUInt128;
+__extension__ typedef __int128 BrInt128;
+
+uint64_t br_mulhu(uint64_t lhs, uint64_t rhs) {
+    return (uint64_t) (((BrUInt128) lhs * rhs) >> 64);
+}
+
+uint64_t br_mulhi(uint64_t lhs, uint64_t rhs) {
+    return (uint64_t) (((BrInt128) (int64_t) lhs * (int64_t) rhs) >> 64);
+}
+
+#else
+
+uint64_t br_mulhu(uint64_t lhs, uint64_t rhs) {
+    // Schoolbook multiplication of the 32-bit halves
+    const uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+    const uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+    const uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+    const uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+    const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    return hi_hi + (hi_lo >> 32) + (cross >> 32);
+}
+
+uint64_t br_mulhi(uint64_t lhs, uint64_t rhs) {
+    // The signed product differs from the unsigned one by the other factor for every negative factor
+    uint64_t result = br_mulhu(lhs, rhs);
+    if ((int64_t) lhs < 0) {
+        result -= rhs;
+    }
+    if ((int64_t) rhs < 0) {
+        result -= lhs;
+    }
+    return result;
+}
+
+#endif
+
+uint64_t br_shl(uint64_t value, uint64_t count) {
+    return value << (count & 63);
+}
+
+uint64_t br_shr(uint64_t value, uint64_t count) {
+    return value >> (count & 63);
+}
+
+uint64_t br_rotl(uint64_t value, uint64_t count) {
+    count &= 63;
+    return count == 0 ? value : value << count | value >> (64 - count);
+}
+
+uint64_t br_rotr(uint64_t value, uint64_t count) {
+    count &= 63;
+    return count == 0 ? value : value >> count | value << (64 - count);
+}
+
+int basm_try_reserve(void **items, size_t *capacity, size_t item_size, size_t count) {
+    if (count <= *capacity) {
+        return 1;
+    }
+
+    size_t new_capacity = *capacity == 0 ? 256 : *capacity;
+    while (new_capacity < count) {
+        new_capacity *= 2;
+    }
+
+    // The old items stay where they are on failure, so whoever owns them can still free them
+    void *new_items = NULL;
+    if (new_capacity <= SIZE_MAX / item_size) {
+        new_items = realloc(*items, new_capacity * item_size);
+    }
+    if (new_items == NULL) {
+        return 0;
+    }
+
+    *items = new_items;
+    *capacity = new_capacity;
+    return 1;
+}
+
+void *basm_reserve(Basm *basm, void *items, size_t *capacity, size_t item_size, size_t count) {
+    if (!basm_try_reserve(&items, capacity, item_size, count)) {
+        basm_fail(basm, "ERROR: Could not allocate %zu items of %zu bytes : %s\n", count, item_size, strerror(errno));
+    }
+
+    return items;
+}
+
+void basm_free(Basm *basm) {
+    free(basm->labels);
+    free(basm->label_slots);
+    free(basm->code_refs);
+    free(basm->table_entries);
+    free(basm->inlines);
+    free(basm->unresolved_jmps);
+    free(basm->program);
+    free(basm->memory);
+    memset(basm, 0, sizeof(*basm));
+}
+
+void basm_fail(Basm *basm, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (basm == NULL || basm->error_jump == NULL) {
+        vfprintf(stderr, format, args);
+        va_end(args);
+        exit(1);
+    }
+
+    vsnprintf(basm->error, sizeof(basm->error), format, args);
+    va_end(args);
+
+    size_t length = strlen(basm->error);
+    if (length > 0 && basm->error[length - 1] == '\n') {
+        basm->error[length - 1] = '\0';
+    }
+    longjmp(*basm->error_jump, 1);
+}
+
+static const char *const inst_names[SIZE] = {
+#define BR_INST_NAME(type, name, has_operand, pops, pushes) [type] = name,
+        BR_INST_LIST(BR_INST_NAME)
+#undef BR_INST_NAME
+};
+
+static const int inst_operands[SIZE] = {
+#define BR_INST_OPERAND(type, name, has_operand, pops, pushes) [type] = has_operand,
+        BR_INST_LIST(BR_INST_OPERAND)
+#undef BR_INST_OPERAND
+};
+
+static const size_t inst_pops[SIZE] = {
+#define BR_INST_POPS(type, name, has_operand, pops, pushes) [type] = pops,
+        BR_INST_LIST(BR_INST_POPS)
+#undef BR_INST_POPS
+};
+
+static const size_t inst_pushes[SIZE] = {
+#define BR_INST_PUSHES(type, name, has_operand, pops, pushes) [type] = pushes,
+        BR_INST_LIST(BR_INST_PUSHES)
+#undef BR_INST_PUSHES
+};
+
+static const char *const directive_names[DIRECTIVE_SIZE] = {
+#define BASM_DIRECTIVE_NAME(directive, name, data_size) [directive] = name,
+        BASM_DIRECTIVE_LIST(BASM_DIRECTIVE_NAME)
+#undef BASM_DIRECTIVE_NAME
+};
+
+static const size_t directive_data_sizes[DIRECTIVE_SIZE] = {
+#define BASM_DIRECTIVE_DATA_SIZE(directive, name, data_size) [directive] = data_size,
+        BASM_DIRECTIVE_LIST(BASM_DIRECTIVE_DATA_SIZE)
+#undef BASM_DIRECTIVE_DATA_SIZE
+};
+
+static BasmPerfectHash inst_hash = {0};
+static BasmPerfectHash directive_hash = {0};
+
+// Both are built on first use, which may happen on several threads of an embedding host at once
+static atomic_int basm_hashes_ready = 0;
+#ifdef BR_THREADS
+static once_flag basm_hashes_once = ONCE_FLAG_INIT;
+#endif
+
+static void basm_build_hashes(void) {
+    basm_phash_build(&inst_hash, inst_names, SIZE);
+    basm_phash_build(&directive_hash, directive_names, DIRECTIVE_SIZE);
+    atomic_store_explicit(&basm_hashes_ready, 1, memory_order_release);
+}
+
+static void basm_require_hashes(void) {
+    if (!atomic_load_explicit(&basm_hashes_ready, memory_order_acquire)) {
+#ifdef BR_THREADS
+        call_once(&basm_hashes_once, basm_build_hashes);
+#else
+        basm_build_hashes();
+#endif
+    }
+}
+
+uint32_t basm_phash_key(StringView name) {
+    // FNV-1a
+    uint32_t key = 0x811C9DC5u;
+    for (size_t i = 0; i < name.count; i++) {
+        key ^= (uint8_t) name.data[i];
+        key *= 0x01000193u;
+    }
+
+    return key;
+}
+
+static uint32_t basm_phash_slot(uint32_t key, uint32_t displacement) {
+    uint32_t h = key ^ (displacement * 0x9E3779B9u);
+    h ^= h >> 16;
+    h *= 0x85EBCA6Bu;
+    h ^= h >> 13;
+    return h & (BASM_PHASH_CAPACITY - 1);
+}
+
+void basm_phash_build(BasmPerfectHash *hash, const char *const *names, size_t count) {
+    assert(count * 2 <= BASM_PHASH_CAPACITY);
+
+    uint32_t keys[BASM_PHASH_CAPACITY];
+    size_t bucket_sizes[BASM_PHASH_BUCKETS] = {0};
+    for (size_t i = 0; i < count; i++) {
+        keys[i] = basm_phash_key(cstr_as_sv(names[i]));
+        bucket_sizes[keys[i] % BASM_PHASH_BUCKETS]++;
+    }
+
+    for (size_t i = 0; i < BASM_PHASH_CAPACITY; i++) {
+        hash->slots[i] = -1;
+    }
+
+    // Hash and displace: place the fullest buckets first, each with the
+    // first displacement that sends all of its names to free slots
+    for (size_t bucket_size = count; bucket_size > 0; bucket_size--) {
+        for (uint32_t bucket = 0; bucket < BASM_PHASH_BUCKETS; bucket++) {
+            if (bucket_sizes[bucket] != bucket_size) {
+                continue;
+            }
+
+            for (uint32_t displacement = 0;; displacement++) {
+                uint32_t taken[BASM_PHASH_CAPACITY];
+                size_t taken_size = 0;
+                int fits = 1;
+
+                for (size_t i = 0; i < count && fits; i++) {
+                    if (keys[i] % BASM_PHASH_BUCKETS != bucket) {
+                        continue;
+                    }
+
+                    uint32_t slot = basm_phash_slot(keys[i], displacement);
+                    if (hash->slots[slot] >= 0) {
+                        fits = 0;
+                    }
+                    for (size_t j = 0; j < taken_size && fits; j++) {
+                        fits = taken[j] != slot;
+                    }
+                    taken[taken_size++] = slot;
+                }
+
+                if (fits) {
+                    hash->displacements[bucket] = displacement;
+                    for (size_t i = 0; i < count; i++) {
+                        if (keys[i] % BASM_PHASH_BUCKETS == bucket) {
+                            hash->slots[basm_phash_slot(keys[i], displacement)] = (int16_t) i;
+                        }
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    hash->ready = 1;
+}
+
+int basm_phash_find(const BasmPerfectHash *hash, const char *const *names, StringView name) {
+    uint32_t key = basm_phash_key(name);
+    int16_t index = hash->slots[basm_phash_slot(key, hash->displacements[key % BASM_PHASH_BUCKETS])];
+    if (index < 0 || !sv_eq(name, cstr_as_sv(names[index]))) {
+        return -1;
+    }
+
+    return index;
+}
+
+const char *inst_asm_name(InstType type) {
+    assert(type < SIZE && "inst_asm_name: Unreachable");
+    return inst_names[type];
+}
+
+int inst_by_name(StringView *name, InstType *output) {
+    basm_require_hashes();
+
+    int index = basm_phash_find(&inst_hash, inst_names, *name);
+    if (index < 0) {
+        return 0;
+    }
+
+    *output = (InstType) index;
+    return 1;
+}
+
+int inst_has_operand(InstType type) {
+    assert(type < SIZE && "inst_has_operand: Unreachable");
+    return inst_operands[type];
+}
+
+size_t inst_stack_pops(InstType type) {
+    assert(type < SIZE && "inst_stack_pops: Unreachable");
+    return inst_pops[type];
+}
+
+size_t inst_stack_pushes(InstType type) {
+    assert(type < SIZE && "inst_stack_pushes: Unreachable");
+    return inst_pushes[type];
+}
+
+static const InstType inst_memory_forms[][3] = {
+        {INST_READ8, INST_READ8_DISP, INST_READ8_IDX},
+        {INST_READ16, INST_READ16_DISP, INST_READ16_IDX},
+        {INST_READ32, INST_READ32_DISP, INST_READ32_IDX},
+        {INST_READ64, INST_READ64_DISP, INST_READ64_IDX},
+        {INST_WRITE8, INST_WRITE8_DISP, INST_WRITE8_IDX},
+        {INST_WRITE16, INST_WRITE16_DISP, INST_WRITE16_IDX},
+        {INST_WRITE32, INST_WRITE32_DISP, INST_WRITE32_IDX},
+        {INST_WRITE64, INST_WRITE64_DISP, INST_WRITE64_IDX},
+};
+
+static const InstType *inst_memory_row(InstType type) {
+    for (size_t i = 0; i < sizeof(inst_memory_forms) / sizeof(inst_memory_forms[0]); i++) {
+        if (inst_memory_forms[i][0] == type || inst_memory_forms[i][1] == type || inst_memory_forms[i][2] == type) {
+            return inst_memory_forms[i];
+        }
+    }
+    return NULL;
+}
+
+InstType inst_displacement_form(InstType type) {
+    const InstType *row = inst_memory_row(type);
+    return row != NULL && row[0] == type ? row[1] : SIZE;
+}
+
+InstType inst_indexed_form(InstType type) {
+    const InstType *row = inst_memory_row(type);
+    return row != NULL && row[0] == type ? row[2] : SIZE;
+}
+
+InstType inst_memory_form(InstType type) {
+    const InstType *row = inst_memory_row(type);
+    return row != NULL ? row[0] : SIZE;
+}
+
+uint64_t inst_memory_width(InstType type) {
+    InstType form = inst_memory_form(type);
+    if (form == INST_READ8 || form == INST_WRITE8) {
+        return 1;
+    }
+    if (form == INST_READ16 || form == INST_WRITE16) {
+        return 2;
+    }
+    if (form == INST_READ32 || form == INST_WRITE32) {
+        return 4;
+    }
+    return form == SIZE ? 0 : 8;
+}
+
+int basm_directive_by_name(StringView name, BasmDirective *output) {
+    basm_require_hashes();
+
+    int index = basm_phash_find(&directive_hash, directive_names, name);
+    if (index < 0) {
+        return 0;
+    }
+
+    *output = (BasmDirective) index;
+    return 1;
+}
+
+size_t basm_directive_data_size(BasmDirective directive) {
+    assert(directive < DIRECTIVE_SIZE && "basm_directive_data_size: Unreachable");
+    return directive_data_sizes[directive];
+}
+
+Word basm_push_string_to_memory(Basm *basm, StringView sv) {
+    if (basm->memory_size + sv.count > BR_MEMORY_CAPACITY) {
+        basm_fail(basm, "ERROR: The static memory does not fit into %d bytes\n", BR_MEMORY_CAPACITY);
+    }
+    basm->memory = basm_reserve(basm, basm->memory, &basm->memory_allocated, sizeof(basm->memory[0]),
+                                basm->memory_size + sv.count);
+
+    Word result = WORD_U64(basm->memory_size);
+    memcpy(basm->memory + basm->memory_size, sv.data, sv.count);
+    basm->memory_size += sv.count;
+
+    if (basm->memory_size > basm->memory_capacity) {
+        basm->memory_capacity = basm->memory_size;
+    }
+
+    return result;
+}
+
+Word basm_push_word_to_memory(Basm *basm, Word value, size_t size) {
+    if (basm->memory_size + size > BR_MEMORY_CAPACITY) {
+        basm_fail(basm, "ERROR: The static memory does not fit into %d bytes\n", BR_MEMORY_CAPACITY);
+    }
+    basm->memory = basm_reserve(basm, basm->memory, &basm->memory_allocated, sizeof(basm->memory[0]),
+                                basm->memory_size + size);
+
+    Word result = WORD_U64(basm->memory_size);
+    for (size_t i = 0; i < size; i++) {
+        basm->memory[basm->memory_size++] = (value.as_u64 >> i * 8) & 0xFF;
+    }
+
+    if (basm->memory_size > basm->memory_capacity) {
+        basm->memory_capacity = basm->memory_size;
+    }
+
+    return result;
+}
+
+/// ========================================
+/// STRING VIEW
+/// ========================================
+/// region
 
 StringView cstr_as_sv(const char *cstr) {
     return (StringView) {
@@ -601,6 +1472,56 @@ StringView sv_chop_by_delim(StringView *sv, char delim) {
     return result;
 }
 
+StringView sv_chop_line(StringView *sv) {
+    // Finds the end of the code part of the next line, that is the first newline or comment. Only this scan is
+    // vectorized, it is the one that passes over every byte of the source. Trimming stops after an indentation of
+    // a few bytes and a directive is told apart by the first byte of its token, neither is long enough for 16 bytes
+    // at a time to pay off
+    size_t i = 0;
+    int found = 0;
+
+#ifdef BASM_SSE2
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i comment = _mm_set1_epi8(BR_ASSEMBLY_COMMENT);
+    while (i + 16 <= sv->count) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (sv->data + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, newline),
+                                                  _mm_cmpeq_epi8(chunk, comment)));
+        if (mask != 0) {
+            i += (size_t) __builtin_ctz((unsigned int) mask);
+            found = 1;
+            break;
+        }
+        i += 16;
+    }
+#endif
+
+    if (!found) {
+        while (i < sv->count && sv->data[i] != '\n' && sv->data[i] != BR_ASSEMBLY_COMMENT) {
+            i++;
+        }
+    }
+
+    StringView result = {
+            .count = i,
+            .data = sv->data
+    };
+
+    if (i < sv->count && sv->data[i] == BR_ASSEMBLY_COMMENT) {
+        const char *end = memchr(sv->data + i, '\n', sv->count - i);
+        i = end != NULL ? (size_t) (end - sv->data) : sv->count;
+    }
+
+    if (i < sv->count) {
+        i++;
+    }
+
+    sv->count -= i;
+    sv->data += i;
+
+    return result;
+}
+
 int sv_eq(StringView a, StringView b) {
     if (a.count != b.count) {
         return 0;
@@ -630,54 +1551,125 @@ char *shift(int *argc, char ***argv) {
     return result;
 }
 
+uint64_t basm_file_program_offset(void) {
+    return (sizeof(BasmFileMeta) + BR_FILE_ALIGNMENT - 1) & ~((uint64_t) BR_FILE_ALIGNMENT - 1);
+}
+
+uint64_t basm_file_memory_offset(uint64_t program_size) {
+    uint64_t end = basm_file_program_offset() + program_size * sizeof(Inst);
+    return (end + BR_FILE_PAGE_SIZE - 1) & ~((uint64_t) BR_FILE_PAGE_SIZE - 1);
+}
+
+uint64_t basm_hash_bytes(uint64_t hash, const void *data, size_t size) {
+    // FNV-1a
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001B3ULL;
+    }
+
+    return hash;
+}
+
+uint64_t basm_hash_program(const Inst *program, size_t size) {
+    // Field by field, the padding inside of Inst holds whatever the allocator left there
+    uint64_t hash = basm_hash_bytes(0xCBF29CE484222325ULL, &size, sizeof(size));
+    for (size_t i = 0; i < size; i++) {
+        uint32_t type = (uint32_t) program[i].type;
+        hash = basm_hash_bytes(hash, &type, sizeof(type));
+        hash = basm_hash_bytes(hash, &program[i].operand, sizeof(program[i].operand));
+    }
+
+    return hash;
+}
+
+uint64_t basm_hash_inst_table(uint64_t hash) {
+    // Opcodes are numbered by their position in BR_INST_LIST and the optimizer trusts their stack effects,
+    // so an image is only valid for the table it was made with
+    for (InstType type = 0; type < SIZE; type++) {
+        const char *name = inst_asm_name(type);
+        uint8_t shape[] = {
+            (uint8_t) inst_has_operand(type),
+            (uint8_t) inst_stack_pops(type),
+            (uint8_t) inst_stack_pushes(type),
+        };
+        hash = basm_hash_bytes(hash, name, strlen(name) + 1);
+        hash = basm_hash_bytes(hash, shape, sizeof(shape));
+    }
+
+    return hash;
+}
+
+void br_profile_free(BrProfile *profile) {
+    free(profile->executions);
+    free(profile->taken);
+    memset(profile, 0, sizeof(*profile));
+}
+
 /// endregion
 #endif
 #ifdef BASM_CREATE
 
-StringView basm_slurp_file(MManager *manager, StringView file_path) {
-    char *cstr = basm_alloc(manager, file_path.count + 1);
-    if (cstr == NULL) {
-        fprintf(stderr, "ERROR: Could not allocate memory for file path: %.*s\n",
-                (int) file_path.count,
-                file_path.data);
-        exit(1);
+int basm_read_file(MManager *manager, const char *file_path, StringView *output) {
+#ifdef BASM_MMAP
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
     }
 
-    memcpy(cstr, file_path.data, file_path.count);
-    cstr[file_path.count] = '\0';
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = (size_t) st.st_size;
+        void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        // Sources with carriage returns still go through the copy below which strips them
+        if (addr != MAP_FAILED && memchr(addr, '\r', size) == NULL) {
+            MMapping *mapping = basm_alloc(manager, sizeof(MMapping));
+            if (mapping == NULL) {
+                munmap(addr, size);
+                close(fd);
+                errno = ENOMEM;
+                return 0;
+            }
 
-    FILE *f = fopen(cstr, "r");
+            mapping->addr = addr;
+            mapping->size = size;
+            mapping->next = manager->mappings;
+            manager->mappings = mapping;
+            close(fd);
 
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: Could not read file '%s' : %s\n", cstr, strerror(errno));
-        exit(1);
-    }
+            *output = (StringView) {
+                    .count = size,
+                    .data = addr
+            };
+            return 1;
+        }
 
-    if (fseek(f, 0L, SEEK_END) < 0) {
-        fprintf(stderr, "ERROR: Could not read file '%.*s' : %s\n",
-                (int) file_path.count,
-                file_path.data,
-                strerror(errno));
-        exit(1);
+        if (addr != MAP_FAILED) {
+            munmap(addr, size);
+        }
     }
+    close(fd);
+#endif
 
-    long m = ftell(f);
-    if (m < 0) {
-        fprintf(stderr, "ERROR: Could not read file '%s' : %s\n", cstr, strerror(errno));
-        exit(1);
+    FILE *f = fopen(file_path, "r");
+    if (f == NULL) {
+        return 0;
     }
 
-    if (fseek(f, 0L, SEEK_SET) < 0) {
-        fprintf(stderr, "ERROR: Could not read file '%s' : %s\n", cstr, strerror(errno));
-        exit(1);
+    long m = -1;
+    if (fseek(f, 0L, SEEK_END) < 0 || (m = ftell(f)) < 0 || fseek(f, 0L, SEEK_SET) < 0) {
+        int error = errno;
+        fclose(f);
+        errno = error;
+        return 0;
     }
 
     char *buffer = basm_alloc(manager, (size_t) m + 1);
     if (buffer == NULL) {
         fclose(f);
-        fprintf(stderr, "ERROR: Could not allocate memory for file '%s' : %s\n", cstr,
-                strerror(errno));
-        exit(1);
+        errno = ENOMEM;
+        return 0;
     }
 
     size_t len = fread(buffer, 1, (size_t) m, f);
@@ -692,15 +1684,43 @@ StringView basm_slurp_file(MManager *manager, StringView file_path) {
     }
     buffer[j] = '\0';
     fclose(f);
-    return (StringView) {
+
+    *output = (StringView) {
             .count = j,
             .data = buffer
     };
+    return 1;
 }
 
-int basm_translate_literal(Basm *basm, StringView sv, Word *output) {
-    if (sv.count >= 2 && *sv.data == '"' && sv.data[sv.count - 1] == '"') {
-        sv.data += 1;
+// The path as a C string that lives as long as the manager
+static char *basm_path_cstr(MManager *manager, StringView file_path) {
+    char *cstr = basm_alloc(manager, file_path.count + 1);
+    if (cstr != NULL) {
+        memcpy(cstr, file_path.data, file_path.count);
+        cstr[file_path.count] = '\0';
+    }
+    return cstr;
+}
+
+StringView basm_slurp_file(Basm *basm, MManager *manager, StringView file_path) {
+    char *cstr = basm_path_cstr(manager, file_path);
+    if (cstr == NULL) {
+        basm_fail(basm, "ERROR: Could not allocate memory for file path: %.*s\n",
+                  (int) file_path.count,
+                  file_path.data);
+    }
+
+    StringView source = {0};
+    if (!basm_read_file(manager, cstr, &source)) {
+        basm_fail(basm, "ERROR: Could not read file '%s' : %s\n", cstr, strerror(errno));
+    }
+
+    return source;
+}
+
+int basm_translate_literal(Basm *basm, StringView sv, Word *output) {
+    if (sv.count >= 2 && *sv.data == '"' && sv.data[sv.count - 1] == '"') {
+        sv.data += 1;
         sv.count -= 2;
         *output = basm_push_string_to_memory(basm, sv);
     } else {
@@ -724,9 +1744,83 @@ int basm_translate_literal(Basm *basm, StringView sv, Word *output) {
     return 1;
 }
 
+// Turns a read or write with an operand like `[8]`, `[*4]` or `[*4 + 8]` into its `.disp` or `.idx` form. The base
+// of the address comes from the stack, `*scale` takes an index from the top of the stack and scales it by 1, 2, 4
+// or 8. Returns what is wrong with the operand or NULL
+static const char *basm_translate_address(Basm *basm, StringView sv, Inst *inst) {
+    sv = sv_trim(sv);
+    if (sv.count < 2 || sv.data[sv.count - 1] != ']') {
+        return "Expected a closing ']'";
+    }
+    StringView inner = sv_trim((StringView) {.count = sv.count - 2, .data = sv.data + 1});
+
+    int indexed = inner.count > 0 && *inner.data == '*';
+    int negative = 0;
+    uint64_t shift = 0;
+    StringView disp = inner;
+    if (indexed) {
+        inner.data++;
+        inner.count--;
+        StringView scale = inner;
+        scale.count = 0;
+        while (scale.count < inner.count && isdigit((unsigned char) scale.data[scale.count])) {
+            scale.count++;
+        }
+        int factor = scale.count == 1 ? *scale.data - '0' : 0;
+        if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+            return "The scale of the index must be 1, 2, 4 or 8";
+        }
+        while ((UINT64_C(1) << shift) < (uint64_t) factor) {
+            shift++;
+        }
+
+        disp = sv_trim((StringView) {.count = inner.count - scale.count, .data = inner.data + scale.count});
+        if (disp.count > 0) {
+            if (*disp.data != '+' && *disp.data != '-') {
+                return "Expected '+' or '-' in front of the displacement";
+            }
+            negative = *disp.data == '-';
+            disp = sv_trim((StringView) {.count = disp.count - 1, .data = disp.data + 1});
+            if (disp.count == 0) {
+                return "Expected a displacement";
+            }
+        }
+    } else if (disp.count == 0) {
+        return "Expected a displacement";
+    }
+
+    inst->type = indexed ? inst_indexed_form(inst->type) : inst_displacement_form(inst->type);
+    Word value = {0};
+    if (disp.count > 0 && !basm_translate_literal(basm, disp, &value)) {
+        if (negative) {
+            return "Only a number can be subtracted from the address";
+        }
+        // The label fills the displacement in once it is known, the scale stays in the low bits
+        basm_bind_unresolved(basm, basm->program_size, disp);
+    }
+    if (negative) {
+        value.as_u64 = 0 - value.as_u64;
+    }
+    inst->operand.as_u64 = indexed ? BR_INDEX_OPERAND(shift, value.as_u64) : value.as_u64;
+    return NULL;
+}
+
+InstAddr basm_table_target(const Basm *basm, size_t i) {
+    uint64_t target = 0;
+    memcpy(&target, &basm->memory[basm->table_entries[i].offset], sizeof(target));
+    return target;
+}
+
+static void basm_set_table_target(Basm *basm, size_t i, InstAddr target) {
+    memcpy(&basm->memory[basm->table_entries[i].offset], &target, sizeof(target));
+}
+
 void basm_translate_source(StringView input_file_path, Basm *basm, MManager *manager) {
-    StringView original_source = basm_slurp_file(manager, input_file_path);
-    StringView source = original_source;
+    StringView source = basm_slurp_file(basm, manager, input_file_path);
+    basm_translate_buffer(input_file_path, source, basm, manager);
+}
+
+void basm_translate_buffer(StringView input_file_path, StringView source, Basm *basm, MManager *manager) {
     StringView entry_label = {0};
     Word entry = {0};
     basm->program_size = 0;
@@ -734,9 +1828,9 @@ void basm_translate_source(StringView input_file_path, Basm *basm, MManager *man
 
     // Parse pre-processor directives, instructions and store labels
     while (source.count > 0) {
-        StringView line = sv_trim(sv_chop_by_delim(&source, '\n'));
-        line = sv_trim(sv_chop_by_delim(&line, BR_ASSEMBLY_COMMENT));
+        StringView line = sv_trim(sv_chop_line(&source));
         line_number++;
+        basm->lines++;
 
         if (line.count > 0) {
             StringView token = sv_trim(sv_chop_by_delim(&line, ' '));
@@ -745,283 +1839,211 @@ void basm_translate_source(StringView input_file_path, Basm *basm, MManager *man
             if (token.count > 0 && *token.data == BR_ASSEMBLY_PREPROCESSOR) {
                 token.count -= 1;
                 token.data += 1;
-                if (sv_eq(token, cstr_as_sv("define"))) {
-                    line = sv_trim(line);
-                    StringView label = sv_chop_by_delim(&line, ' ');
-                    if (label.count > 0) {
-                        line = sv_trim(line);
-                        StringView value = line;
-                        Word word = {0};
-                        if (!basm_translate_literal(basm, value, &word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: `%.*s` is not a number\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) value.count,
-                                    value.data);
-                            exit(1);
-                        }
+                BasmDirective directive = DIRECTIVE_SIZE;
+                if (!basm_directive_by_name(token, &directive)) {
+                    basm_fail(basm, "%.*s:%d: ERROR: Unknown pre-processor directive '%.*s'\n",
+                              (int) input_file_path.count,
+                              input_file_path.data,
+                              line_number,
+                              (int) token.count,
+                              token.data);
+                }
 
-                        if (!basm_bind_label(basm, label, word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) label.count,
-                                    label.data);
-                            exit(1);
-                        }
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
-                    }
-                } else if (sv_eq(token, cstr_as_sv("byte"))) {
-                    line = sv_trim(line);
-                    StringView label = sv_chop_by_delim(&line, ' ');
-                    if (label.count > 0) {
-                        StringView value = line;
-                        Word word = {0};
-
-                        if (!basm_translate_literal(basm, value, &word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: `%.*s` is not a number\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) value.count,
-                                    value.data);
-                            exit(1);
-                        }
+                switch (directive) {
+                    case DIRECTIVE_DEFINE: {
+                        line = sv_trim(line);
+                        StringView label = sv_chop_by_delim(&line, ' ');
+                        if (label.count > 0) {
+                            line = sv_trim(line);
+                            StringView value = line;
+                            Word word = {0};
+                            if (!basm_translate_literal(basm, value, &word)) {
+                                basm_fail(basm,
+                                          "%.*s:%d: ERROR: `%.*s` is not a number\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number,
+                                          (int) value.count,
+                                          value.data);
+                            }
 
-                        if (value.data[0] == '"' && value.data[value.count - 1] == '"') {
-                            value.data++;
-                            value.count -= 2;
-                            word = basm_push_string_to_memory(basm, value);
+                            if (!basm_bind_label(basm, label, word)) {
+                                basm_fail(basm,
+                                          "%.*s:%d: ERROR: label `%.*s` is already defined\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number,
+                                          (int) label.count,
+                                          label.data);
+                            }
                         } else {
-                            basm_translate_literal(basm, value, &word);
-                            word = basm_push_word_to_memory(basm, word, 1);
-                        }
-
-                        if (!basm_bind_label(basm, label, word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) label.count,
-                                    label.data);
-                            exit(1);
+                            basm_fail(basm, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number);
                         }
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
+                        break;
                     }
+                    case DIRECTIVE_BYTE:
+                    case DIRECTIVE_WORD:
+                    case DIRECTIVE_DWORD:
+                    case DIRECTIVE_QWORD: {
+                        line = sv_trim(line);
+                        StringView label = sv_chop_by_delim(&line, ' ');
+                        if (label.count > 0) {
+                            StringView value = line;
+                            Word word = {0};
+
+                            if (!basm_translate_literal(basm, value, &word)) {
+                                basm_fail(basm,
+                                          "%.*s:%d: ERROR: `%.*s` is not a number\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number,
+                                          (int) value.count,
+                                          value.data);
+                            }
 
-                } else if (sv_eq(token, cstr_as_sv("word"))) {
-                    line = sv_trim(line);
-                    StringView label = sv_chop_by_delim(&line, ' ');
-                    if (label.count > 0) {
-                        StringView value = line;
-                        Word word = {0};
-
-                        if (!basm_translate_literal(basm, value, &word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: `%.*s` is not a number\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) value.count,
-                                    value.data);
-                            exit(1);
-                        }
+                            if (value.data[0] == '"' && value.data[value.count - 1] == '"') {
+                                value.data++;
+                                value.count -= 2;
+                                word = basm_push_string_to_memory(basm, value);
+                            } else {
+                                basm_translate_literal(basm, value, &word);
+                                word = basm_push_word_to_memory(basm, word, basm_directive_data_size(directive));
+                            }
 
-                        if (value.data[0] == '"' && value.data[value.count - 1] == '"') {
-                            value.data++;
-                            value.count -= 2;
-                            word = basm_push_string_to_memory(basm, value);
+                            if (!basm_bind_label(basm, label, word)) {
+                                basm_fail(basm,
+                                          "%.*s:%d: ERROR: label `%.*s` is already defined\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number,
+                                          (int) label.count,
+                                          label.data);
+                            }
                         } else {
-                            basm_translate_literal(basm, value, &word);
-                            word = basm_push_word_to_memory(basm, word, 2);
-                        }
-
-                        if (!basm_bind_label(basm, label, word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) label.count,
-                                    label.data);
-                            exit(1);
+                            basm_fail(basm, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number);
                         }
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
+                        break;
                     }
-
-                } else if (sv_eq(token, cstr_as_sv("dword"))) {
-                    line = sv_trim(line);
-                    StringView label = sv_chop_by_delim(&line, ' ');
-                    if (label.count > 0) {
-                        StringView value = line;
-                        Word word = {0};
-
-                        if (!basm_translate_literal(basm, value, &word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: `%.*s` is not a number\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) value.count,
-                                    value.data);
-                            exit(1);
-                        }
-
-                        if (value.data[0] == '"' && value.data[value.count - 1] == '"') {
-                            value.data++;
-                            value.count -= 2;
-                            word = basm_push_string_to_memory(basm, value);
+                    case DIRECTIVE_INCLUDE: {
+                        line = sv_trim(line);
+                        if (line.count > 0) {
+                            if (*line.data == '"' && line.data[line.count - 1] == '"') {
+                                line.data++;
+                                line.count -= 2;
+
+                                if (basm->inc_level + 1 >= BR_ASSEMBLY_MAX_INCLUDE_LEVEL) {
+                                    basm_fail(basm, "%.*s:%d: ERROR: Exceeded maximum include level\n",
+                                              (int) input_file_path.count,
+                                              input_file_path.data,
+                                              line_number);
+                                }
+                                basm->inc_level++;
+                                basm_translate_source(line, basm, manager);
+                                basm->inc_level--;
+                            } else {
+                                basm_fail(basm,
+                                          "%.*s:%d: ERROR: Pre-processor include path has to be surrounded with quotation marks\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number);
+                            }
                         } else {
-                            basm_translate_literal(basm, value, &word);
-                            word = basm_push_word_to_memory(basm, word, 4);
-                        }
-
-                        if (!basm_bind_label(basm, label, word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) label.count,
-                                    label.data);
-                            exit(1);
+                            basm_fail(basm,
+                                      "%.*s:%d: ERROR: Pre-processor include path is not provided\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number);
                         }
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
+                        break;
                     }
-
-                } else if (sv_eq(token, cstr_as_sv("qword"))) {
-                    line = sv_trim(line);
-                    StringView label = sv_chop_by_delim(&line, ' ');
-                    if (label.count > 0) {
-                        StringView value = line;
-                        Word word = {0};
-
-                        if (!basm_translate_literal(basm, value, &word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: `%.*s` is not a number\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) value.count,
-                                    value.data);
-                            exit(1);
-                        }
-
-                        if (value.data[0] == '"' && value.data[value.count - 1] == '"') {
-                            value.data++;
-                            value.count -= 2;
-                            word = basm_push_string_to_memory(basm, value);
+                    case DIRECTIVE_ENTRY: {
+                        line = sv_trim(line);
+                        if (line.count > 0) {
+                            if (basm_translate_literal(basm, line, &entry)) {
+                                basm->entry = entry.as_u64;
+                                basm->has_entry = 1;
+                            } else {
+                                if (basm_resolve_label(basm, line, &entry)) {
+                                    basm->entry = entry.as_u64;
+                                    basm->has_entry = 1;
+                                } else {
+                                    entry_label = line;
+                                }
+                            }
                         } else {
-                            basm_translate_literal(basm, value, &word);
-                            word = basm_push_word_to_memory(basm, word, 8);
+                            basm_fail(basm, "%.*s:%d: ERROR: Pre-processor entry address is not provided\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number);
                         }
-
-                        if (!basm_bind_label(basm, label, word)) {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: label `%.*s` is already defined\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number,
-                                    (int) label.count,
-                                    label.data);
-                            exit(1);
+                        break;
+                    }
+                    case DIRECTIVE_INLINE: {
+                        line = sv_trim(line);
+                        if (line.count == 0) {
+                            basm_fail(basm, "%.*s:%d: ERROR: Pre-processor inline label is not provided\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number);
                         }
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
+
+                        basm->inlines = basm_reserve(basm, basm->inlines, &basm->inlines_capacity,
+                                                     sizeof(basm->inlines[0]), basm->inlines_size + 1);
+                        basm->inlines[basm->inlines_size++] = (BasmInline) {
+                                .label = line,
+                                .file_path = input_file_path,
+                                .line_number = line_number
+                        };
+                        break;
                     }
+                    case DIRECTIVE_TABLE: {
+                        // A word with the number of entries followed by the entries, the labels resolve at the end
+                        line = sv_trim(line);
+                        StringView label = sv_chop_by_delim(&line, ' ');
+                        if (label.count == 0) {
+                            basm_fail(basm, "%.*s:%d: ERROR: Pre-processor name is not provided\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number);
+                        }
 
-                } else if (sv_eq(token, cstr_as_sv("include"))) {
-                    line = sv_trim(line);
-                    if (line.count > 0) {
-                        if (*line.data == '"' && line.data[line.count - 1] == '"') {
-                            line.data++;
-                            line.count -= 2;
-
-                            if (basm->inc_level + 1 >= BR_ASSEMBLY_MAX_INCLUDE_LEVEL) {
-                                fprintf(stderr, "%.*s:%d: ERROR: Exceeded maximum include level\n",
-                                        (int) input_file_path.count,
-                                        input_file_path.data,
-                                        line_number);
-                                exit(1);
-                            }
-                            basm->inc_level++;
-                            basm_translate_source(line, basm, manager);
-                            basm->inc_level--;
-                        } else {
-                            fprintf(stderr,
-                                    "%.*s:%d: ERROR: Pre-processor include path has to be surrounded with quotation marks\n",
-                                    (int) input_file_path.count,
-                                    input_file_path.data,
-                                    line_number);
-                            exit(1);
+                        Word table = basm_push_word_to_memory(basm, WORD_U64(0), BR_WORD_SIZE);
+                        uint64_t count = 0;
+                        for (line = sv_trim(line); line.count > 0; line = sv_trim(line)) {
+                            StringView entry = sv_chop_by_delim(&line, ' ');
+                            Word offset = basm_push_word_to_memory(basm, WORD_U64(0), BR_WORD_SIZE);
+                            basm->table_entries = basm_reserve(basm, basm->table_entries, &basm->table_entries_capacity,
+                                                               sizeof(basm->table_entries[0]),
+                                                               basm->table_entries_size + 1);
+                            basm->table_entries[basm->table_entries_size++] = (BasmTableEntry) {
+                                    .offset = offset.as_u64,
+                                    .label = entry
+                            };
+                            count++;
                         }
-                    } else {
-                        fprintf(stderr,
-                                "%.*s:%d: ERROR: Pre-processor include path is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
-                    }
-                } else if (sv_eq(token, cstr_as_sv("entry"))) {
-                    line = sv_trim(line);
-                    if (line.count > 0) {
-                        if (basm_translate_literal(basm, line, &entry)) {
-                            basm->entry = entry.as_u64;
-                            basm->has_entry = 1;
-                        } else {
-                            if (basm_resolve_label(basm, line, &entry)) {
-                                basm->entry = entry.as_u64;
-                                basm->has_entry = 1;
-                            } else {
-                                entry_label = line;
-                            }
+                        memcpy(&basm->memory[table.as_u64], &count, sizeof(count));
+
+                        if (!basm_bind_label(basm, label, table)) {
+                            basm_fail(basm,
+                                      "%.*s:%d: ERROR: label `%.*s` is already defined\n",
+                                      (int) input_file_path.count,
+                                      input_file_path.data,
+                                      line_number,
+                                      (int) label.count,
+                                      label.data);
                         }
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Pre-processor entry address is not provided\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number);
-                        exit(1);
+                        break;
                     }
-                } else {
-                    fprintf(stderr, "%.*s:%d: ERROR: Unknown pre-processor directive '%.*s'\n",
-                            (int) input_file_path.count,
-                            input_file_path.data,
-                            line_number,
-                            (int) token.count,
-                            token.data);
-                    exit(1);
+                    case DIRECTIVE_SIZE:
+                    default:
+                        assert(0 && "basm_translate_source: Unreachable");
+                        break;
                 }
             } else {
                 // Label
@@ -1032,95 +2054,2038 @@ void basm_translate_source(StringView input_file_path, Basm *basm, MManager *man
                     };
 
                     if (!basm_bind_label(basm, label, WORD_U64(basm->program_size))) {
-                        fprintf(stderr, "%.*s:%d: ERROR: Label '%.*s' is already defined\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number,
-                                (int) label.count,
-                                label.data);
-                        exit(1);
+                        basm_fail(basm, "%.*s:%d: ERROR: Label '%.*s' is already defined\n",
+                                  (int) input_file_path.count,
+                                  input_file_path.data,
+                                  line_number,
+                                  (int) label.count,
+                                  label.data);
+                    }
+                    basm->labels[basm->labels_size - 1].code = 1;
+
+                    token = sv_trim(sv_chop_by_delim(&line, ' '));
+                }
 
+                // Instruction
+                if (token.count > 0) {
+                    StringView operand = line;
+                    InstType inst_type = INST_NOP;
+
+                    if (inst_by_name(&token, &inst_type)) {
+                        basm->program = basm_reserve(basm, basm->program, &basm->program_allocated,
+                                                     sizeof(basm->program[0]), basm->program_size + 1);
+                        memset(&basm->program[basm->program_size], 0, sizeof(basm->program[0]));
+                        basm->program[basm->program_size].type = inst_type;
+
+                        if (operand.count > 0 && *operand.data == '[' && inst_displacement_form(inst_type) != SIZE) {
+                            const char *error = basm_translate_address(basm, operand,
+                                                                       &basm->program[basm->program_size]);
+                            if (error != NULL) {
+                                basm_fail(basm, "%.*s:%d: ERROR: %s in '%.*s'\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number,
+                                          error,
+                                          (int) operand.count,
+                                          operand.data);
+                            }
+                        } else if (inst_has_operand(inst_type)) {
+                            if (operand.count == 0) {
+                                basm_fail(basm,
+                                          "%.*s:%d: ERROR: Instruction '%.*s' requires an operand\n",
+                                          (int) input_file_path.count,
+                                          input_file_path.data,
+                                          line_number,
+                                          (int) token.count,
+                                          token.data);
+                            }
+
+                            if (!basm_translate_literal(basm, operand,
+                                                        &basm->program[basm->program_size].operand)) {
+                                basm_bind_unresolved(basm, basm->program_size, operand);
+                            }
+                        }
+
+                        basm->program_size++;
+                    } else {
+                        basm_fail(basm, "%.*s:%d: ERROR: Unknown instruction '%.*s'\n",
+                                  (int) input_file_path.count,
+                                  input_file_path.data,
+                                  line_number,
+                                  (int) token.count,
+                                  token.data);
                     }
+                }
+            }
+        }
+    }
+
+    // Replace label parameters with actual offset
+    for (size_t i = 0; i < basm->unresolved_jmp_size; i++) {
+        StringView label = basm->unresolved_jmps[i].label;
+        InstAddr addr = basm->unresolved_jmps[i].addr;
+        const Label *resolved = basm_find_label(basm, label);
+
+        if (resolved == NULL) {
+            basm_fail(basm, "%.*s: ERROR: Unknown label '%.*s'\n",
+                      (int) input_file_path.count,
+                      input_file_path.data,
+                      (int) label.count,
+                      label.data);
+        }
+
+        Inst *inst = &basm->program[addr];
+        if (inst->type == inst_indexed_form(inst_memory_form(inst->type))) {
+            inst->operand.as_u64 = BR_INDEX_OPERAND(BR_INDEX_SHIFT(inst->operand.as_u64), resolved->word.as_u64);
+            continue;
+        }
+        inst->operand = resolved->word;
+
+        // Included files resolve early, remember code addresses only once at the top level
+        if (basm->inc_level == 0 && resolved->code && !inst_targets_code(inst->type)) {
+            basm_bind_code_ref(basm, addr);
+        }
+    }
+
+    // A table may name code of the file that included it, so its entries wait for the top level
+    for (size_t i = 0; basm->inc_level == 0 && i < basm->table_entries_size; i++) {
+        StringView label = basm->table_entries[i].label;
+        const Label *resolved = basm_find_label(basm, label);
+
+        if (resolved == NULL || !resolved->code) {
+            basm_fail(basm, "%.*s: ERROR: Table entry '%.*s' is not a code label\n",
+                      (int) input_file_path.count,
+                      input_file_path.data,
+                      (int) label.count,
+                      label.data);
+        }
+
+        basm_set_table_target(basm, i, resolved->word.as_u64);
+    }
+
+    // Replace entry point label with instruction offset
+    if (!basm->has_entry && entry_label.count != 0) {
+        if (basm_resolve_label(basm, entry_label, &entry)) {
+            basm->entry = entry.as_u64;
+            basm->has_entry = 1;
+        } else {
+            basm_fail(basm, "%.*s: ERROR: Unknown label '%.*s'\n",
+                      (int) input_file_path.count,
+                      input_file_path.data,
+                      (int) entry_label.count,
+                      entry_label.data);
+        }
+    }
+}
+
+int basm_assemble_memory(StringView name, StringView source, Basm *basm, MManager *manager) {
+    jmp_buf jump;
+    basm->error_jump = &jump;
+    if (setjmp(jump) != 0) {
+        basm->error_jump = NULL;
+        basm->inc_level = 0;
+        return 0;
+    }
+
+    basm_translate_buffer(name, source, basm, manager);
+
+    BasmInlineStats inline_stats = {0};
+    basm_inline(basm, 0, &inline_stats);
+    basm_fuse_immediates(basm);
+
+    basm->error_jump = NULL;
+    return 1;
+}
+
+const Label *basm_find_label(const Basm *basm, StringView name) {
+    if (basm->label_slots_capacity == 0) {
+        return NULL;
+    }
+
+    size_t mask = basm->label_slots_capacity - 1;
+    for (size_t slot = basm_phash_key(name) & mask; basm->label_slots[slot] != 0; slot = (slot + 1) & mask) {
+        const Label *label = &basm->labels[basm->label_slots[slot] - 1];
+        if (sv_eq(label->name, name)) {
+            return label;
+        }
+    }
+
+    return NULL;
+}
+
+int basm_resolve_label(const Basm *basm, StringView name, Word *output) {
+    const Label *label = basm_find_label(basm, name);
+    if (label == NULL) {
+        return 0;
+    }
+
+    *output = label->word;
+    return 1;
+}
+
+static void basm_insert_label_slot(Basm *basm, size_t index) {
+    size_t mask = basm->label_slots_capacity - 1;
+    size_t slot = basm_phash_key(basm->labels[index].name) & mask;
+    while (basm->label_slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+
+    basm->label_slots[slot] = index + 1;
+}
+
+int basm_bind_label(Basm *basm, StringView name, Word word) {
+    Word ignore = {0};
+    if (basm_resolve_label(basm, name, &ignore)) {
+        return 0;
+    }
+
+    basm->labels = basm_reserve(basm, basm->labels, &basm->labels_capacity, sizeof(basm->labels[0]),
+                                basm->labels_size + 1);
+    basm->labels[basm->labels_size++] = (Label) {.name = name, .word = word};
+
+    // Keep the open addressing index at most half full
+    if (basm->labels_size * 2 > basm->label_slots_capacity) {
+        free(basm->label_slots);
+        basm->label_slots_capacity = basm->label_slots_capacity == 0 ? 256 : basm->label_slots_capacity * 2;
+        basm->label_slots = calloc(basm->label_slots_capacity, sizeof(basm->label_slots[0]));
+        if (basm->label_slots == NULL) {
+            basm->label_slots_capacity = 0;
+            basm_fail(basm, "ERROR: Could not allocate label index : %s\n", strerror(errno));
+        }
+
+        for (size_t i = 0; i < basm->labels_size; i++) {
+            basm_insert_label_slot(basm, i);
+        }
+    } else {
+        basm_insert_label_slot(basm, basm->labels_size - 1);
+    }
+
+    return 1;
+}
+
+void basm_bind_unresolved(Basm *basm, InstAddr addr, StringView label) {
+    basm->unresolved_jmps = basm_reserve(basm, basm->unresolved_jmps, &basm->unresolved_jmp_capacity,
+                                         sizeof(basm->unresolved_jmps[0]), basm->unresolved_jmp_size + 1);
+    basm->unresolved_jmps[basm->unresolved_jmp_size++] = (UnresolvedJmp) {.addr = addr, .label = label};
+}
+
+void basm_bind_code_ref(Basm *basm, InstAddr addr) {
+    basm->code_refs = basm_reserve(basm, basm->code_refs, &basm->code_refs_capacity, sizeof(basm->code_refs[0]),
+                                   basm->code_refs_size + 1);
+    basm->code_refs[basm->code_refs_size++] = addr;
+}
+
+int inst_targets_code(InstType type) {
+    return type == INST_JMP || type == INST_JMP_IF || type == INST_CALL || type == INST_SPAWN || type == INST_THREAD;
+}
+
+static const InstType inst_immediate_forms[][2] = {
+        {INST_PLUSI, INST_PLUSI_IMM},
+        {INST_MINUSI, INST_MINUSI_IMM},
+        {INST_MULTI, INST_MULTI_IMM},
+        {INST_DIVI, INST_DIVI_IMM},
+        {INST_MODI, INST_MODI_IMM},
+        {INST_GEI, INST_GEI_IMM},
+        {INST_LEI, INST_LEI_IMM},
+        {INST_LI, INST_LI_IMM},
+        {INST_NEI, INST_NEI_IMM},
+        {INST_GI, INST_GI_IMM},
+        {INST_EQI, INST_EQI_IMM},
+        {INST_PLUSF, INST_PLUSF_IMM},
+        {INST_MINUSF, INST_MINUSF_IMM},
+        {INST_MULTF, INST_MULTF_IMM},
+        {INST_DIVF, INST_DIVF_IMM},
+        {INST_GEF, INST_GEF_IMM},
+        {INST_GF, INST_GF_IMM},
+        {INST_LEF, INST_LEF_IMM},
+        {INST_LF, INST_LF_IMM},
+        {INST_NEF, INST_NEF_IMM},
+        {INST_EQF, INST_EQF_IMM},
+        {INST_ANDB, INST_ANDB_IMM},
+        {INST_ORB, INST_ORB_IMM},
+        {INST_XOR, INST_XOR_IMM},
+        {INST_SHR, INST_SHR_IMM},
+        {INST_SHL, INST_SHL_IMM},
+};
+
+InstType inst_immediate_form(InstType type) {
+    for (size_t i = 0; i < sizeof(inst_immediate_forms) / sizeof(inst_immediate_forms[0]); i++) {
+        if (inst_immediate_forms[i][0] == type) {
+            return inst_immediate_forms[i][1];
+        }
+    }
+    return SIZE;
+}
+
+InstType inst_binary_form(InstType type) {
+    for (size_t i = 0; i < sizeof(inst_immediate_forms) / sizeof(inst_immediate_forms[0]); i++) {
+        if (inst_immediate_forms[i][1] == type) {
+            return inst_immediate_forms[i][0];
+        }
+    }
+    return SIZE;
+}
+
+static int basm_fold_unary(InstType type, Word a, Word *output) {
+    if (type == INST_NOT) {
+        output->as_u64 = !a.as_u64;
+    } else if (type == INST_NOTB) {
+        output->as_u64 = ~a.as_u64;
+    } else if (type == INST_I2F) {
+        output->as_f64 = (double) a.as_i64;
+    } else if (type == INST_I2U) {
+        output->as_u64 = (uint64_t) a.as_i64;
+    } else if (type == INST_U2F) {
+        output->as_f64 = (double) a.as_u64;
+    } else if (type == INST_U2I) {
+        output->as_i64 = (int32_t) a.as_u64;
+    } else if (type == INST_F2I) {
+        output->as_i64 = (int64_t) a.as_f64;
+    } else if (type == INST_F2U) {
+        output->as_u64 = (uint64_t) (int64_t) a.as_f64;
+    } else if (type == INST_SQRTF) {
+        output->as_f64 = sqrt(a.as_f64);
+    } else if (type == INST_ABSF) {
+        output->as_f64 = fabs(a.as_f64);
+    } else if (type == INST_FLOORF) {
+        output->as_f64 = floor(a.as_f64);
+    } else if (type == INST_CEILF) {
+        output->as_f64 = ceil(a.as_f64);
+    } else if (type == INST_ROUNDF) {
+        output->as_f64 = round(a.as_f64);
+    } else if (type == INST_POPCNT) {
+        output->as_u64 = br_popcnt(a.as_u64);
+    } else if (type == INST_CLZ) {
+        output->as_u64 = br_clz(a.as_u64);
+    } else if (type == INST_CTZ) {
+        output->as_u64 = br_ctz(a.as_u64);
+    } else if (type == INST_BSWAP) {
+        output->as_u64 = br_bswap(a.as_u64);
+    } else if (type == INST_SEXT8) {
+        output->as_i64 = (int8_t) a.as_u64;
+    } else if (type == INST_SEXT16) {
+        output->as_i64 = (int16_t) a.as_u64;
+    } else if (type == INST_SEXT32) {
+        output->as_i64 = (int32_t) a.as_u64;
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static int basm_fold_binary(InstType type, Word a, Word b, Word *output) {
+    // Mirrors BINARY_OP in br_execute_inst, a is the deeper operand
+    if ((type == INST_DIVI || type == INST_MODI) && b.as_u64 == 0) {
+        return 0;
+    }
+
+    if (type == INST_PLUSI) {
+        output->as_u64 = a.as_u64 + b.as_u64;
+    } else if (type == INST_MINUSI) {
+        output->as_u64 = a.as_u64 - b.as_u64;
+    } else if (type == INST_MULTI) {
+        output->as_u64 = a.as_u64 * b.as_u64;
+    } else if (type == INST_DIVI) {
+        output->as_u64 = a.as_u64 / b.as_u64;
+    } else if (type == INST_MODI) {
+        output->as_u64 = a.as_u64 % b.as_u64;
+    } else if (type == INST_GEI) {
+        output->as_u64 = a.as_u64 >= b.as_u64;
+    } else if (type == INST_LEI) {
+        output->as_u64 = a.as_u64 <= b.as_u64;
+    } else if (type == INST_LI) {
+        output->as_u64 = a.as_u64 < b.as_u64;
+    } else if (type == INST_NEI) {
+        output->as_u64 = a.as_u64 != b.as_u64;
+    } else if (type == INST_GI) {
+        output->as_u64 = a.as_u64 > b.as_u64;
+    } else if (type == INST_EQI) {
+        output->as_u64 = a.as_u64 == b.as_u64;
+    } else if (type == INST_PLUSF) {
+        output->as_f64 = a.as_f64 + b.as_f64;
+    } else if (type == INST_MINUSF) {
+        output->as_f64 = a.as_f64 - b.as_f64;
+    } else if (type == INST_MULTF) {
+        output->as_f64 = a.as_f64 * b.as_f64;
+    } else if (type == INST_DIVF) {
+        output->as_f64 = a.as_f64 / b.as_f64;
+    } else if (type == INST_GEF) {
+        output->as_u64 = a.as_f64 >= b.as_f64;
+    } else if (type == INST_GF) {
+        output->as_u64 = a.as_f64 > b.as_f64;
+    } else if (type == INST_LEF) {
+        output->as_u64 = a.as_f64 <= b.as_f64;
+    } else if (type == INST_LF) {
+        output->as_u64 = a.as_f64 < b.as_f64;
+    } else if (type == INST_NEF) {
+        output->as_u64 = a.as_f64 != b.as_f64;
+    } else if (type == INST_EQF) {
+        output->as_u64 = a.as_f64 == b.as_f64;
+    } else if (type == INST_ANDB) {
+        output->as_u64 = a.as_u64 & b.as_u64;
+    } else if (type == INST_ORB) {
+        output->as_u64 = a.as_u64 | b.as_u64;
+    } else if (type == INST_XOR) {
+        output->as_u64 = a.as_u64 ^ b.as_u64;
+    } else if (type == INST_SHR) {
+        output->as_u64 = a.as_u64 >> (b.as_u64 & 63);
+    } else if (type == INST_SHL) {
+        output->as_u64 = a.as_u64 << (b.as_u64 & 63);
+    } else if (type == INST_MINF) {
+        output->as_f64 = a.as_f64 < b.as_f64 ? a.as_f64 : b.as_f64;
+    } else if (type == INST_MAXF) {
+        output->as_f64 = a.as_f64 > b.as_f64 ? a.as_f64 : b.as_f64;
+    } else if (type == INST_ROTL) {
+        output->as_u64 = br_rotl(a.as_u64, b.as_u64);
+    } else if (type == INST_ROTR) {
+        output->as_u64 = br_rotr(a.as_u64, b.as_u64);
+    } else if (type == INST_MULHU) {
+        output->as_u64 = br_mulhu(a.as_u64, b.as_u64);
+    } else if (type == INST_MULHI) {
+        output->as_u64 = br_mulhi(a.as_u64, b.as_u64);
+    } else {
+        return 0;
+    }
+
+    return 1;
+}
+
+static size_t basm_next_live(const uint8_t *removed, size_t n, size_t i) {
+    do {
+        i++;
+    } while (i < n && removed[i]);
+
+    return i;
+}
+
+static size_t basm_live_at(const uint8_t *removed, size_t n, size_t i) {
+    // A removed instruction behaves like the next live one
+    return i < n && removed[i] ? basm_next_live(removed, n, i) : i;
+}
+
+static void basm_mark_leaders(const Basm *basm, const uint8_t *removed, uint8_t *leaders) {
+    size_t n = basm->program_size;
+    memset(leaders, 0, n + 1);
+
+    if (basm->entry < n) {
+        leaders[basm_live_at(removed, n, basm->entry)] = 1;
+    }
+
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        InstAddr addr = basm->code_refs[i];
+        if (!removed[addr] && basm->program[addr].operand.as_u64 < n) {
+            leaders[basm_live_at(removed, n, basm->program[addr].operand.as_u64)] = 1;
+        }
+    }
+
+    for (size_t i = 0; i < basm->table_entries_size; i++) {
+        InstAddr target = basm_table_target(basm, i);
+        if (target < n) {
+            leaders[basm_live_at(removed, n, target)] = 1;
+        }
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (removed[i]) {
+            continue;
+        }
+
+        Inst inst = basm->program[i];
+        if (inst_targets_code(inst.type) && inst.operand.as_u64 < n) {
+            leaders[basm_live_at(removed, n, inst.operand.as_u64)] = 1;
+        }
+
+        // The return address of a call points at the instruction behind it
+        if (inst_targets_code(inst.type) || inst.type == INST_RET || inst.type == INST_HALT
+            || inst.type == INST_JMPTABLE || inst.type == INST_CALLR) {
+            leaders[basm_next_live(removed, n, i)] = 1;
+        }
+    }
+}
+
+static size_t basm_remove_unreachable(const Basm *basm, uint8_t *removed) {
+    size_t n = basm->program_size;
+    uint8_t *reachable = calloc(n + 1, 1);
+    InstAddr *work = malloc((n + 1) * sizeof(work[0]));
+    size_t work_size = 0;
+    assert(reachable != NULL && work != NULL);
+
+#define BASM_REACH(addr)                                        \
+    do {                                                        \
+        InstAddr reach_addr = (addr);                           \
+        if (reach_addr < n && !reachable[reach_addr]) {         \
+            reachable[reach_addr] = 1;                          \
+            work[work_size++] = reach_addr;                     \
+        }                                                       \
+    } while (0)
+
+    BASM_REACH(basm->entry);
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        if (!removed[basm->code_refs[i]]) {
+            BASM_REACH(basm->program[basm->code_refs[i]].operand.as_u64);
+        }
+    }
+    for (size_t i = 0; i < basm->table_entries_size; i++) {
+        BASM_REACH(basm_table_target(basm, i));
+    }
+
+    while (work_size > 0) {
+        InstAddr addr = work[--work_size];
+        if (removed[addr]) {
+            BASM_REACH(basm_next_live(removed, n, addr));
+            continue;
+        }
+
+        Inst inst = basm->program[addr];
+        if (inst_targets_code(inst.type)) {
+            BASM_REACH(inst.operand.as_u64);
+        }
+        if (inst.type != INST_JMP && inst.type != INST_RET && inst.type != INST_HALT) {
+            BASM_REACH(basm_next_live(removed, n, addr));
+        }
+    }
+#undef BASM_REACH
+
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (!removed[i] && !reachable[i]) {
+            removed[i] = 1;
+            count++;
+        }
+    }
+
+    free(work);
+    free(reachable);
+    return count;
+}
+
+InstAddr basm_relocate_addr(const InstAddr *new_addrs, size_t old_size, size_t new_size, InstAddr addr) {
+    return addr <= old_size ? new_addrs[addr] : addr - old_size + new_size;
+}
+
+void basm_relocate(Basm *basm, const InstAddr *new_addrs, size_t new_program_size) {
+    // new_addrs maps every old address (and the old program size) to its new address. The program
+    // and the code_refs positions must already be rewritten, only the code addresses they hold are moved
+    size_t n = basm->program_size;
+
+    basm->entry = basm_relocate_addr(new_addrs, n, new_program_size, basm->entry);
+
+    for (size_t i = 0; i < basm->labels_size; i++) {
+        if (basm->labels[i].code) {
+            basm->labels[i].word.as_u64 = basm_relocate_addr(new_addrs, n, new_program_size,
+                                                             basm->labels[i].word.as_u64);
+        }
+    }
+
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        Inst *inst = &basm->program[basm->code_refs[i]];
+        inst->operand.as_u64 = basm_relocate_addr(new_addrs, n, new_program_size, inst->operand.as_u64);
+    }
+
+    for (size_t i = 0; i < basm->table_entries_size; i++) {
+        basm_set_table_target(basm, i, basm_relocate_addr(new_addrs, n, new_program_size,
+                                                          basm_table_target(basm, i)));
+    }
+
+    basm->program_size = new_program_size;
+}
+
+typedef enum {
+    BASM_INLINE_PLAIN = 0,
+    BASM_INLINE_RELATIVE,
+    BASM_INLINE_CODE_REF,
+} BasmInlineOperand;
+
+typedef struct {
+    Inst *program;
+    uint8_t *operands;
+    size_t size;
+    size_t uses;
+} BasmInlineBody;
+
+// Allocated once per basm_inline, a walk only resets the entries it visited so every call target costs
+// the size of its own body instead of the size of the whole program
+typedef struct {
+    int64_t *depths;
+    InstAddr *work;
+    size_t work_size;
+    InstAddr *seen;
+    size_t seen_size;
+} BasmInlineScratch;
+
+static const char *basm_inline_flow(BasmInlineScratch *scratch, size_t n, InstAddr start, InstAddr *end,
+                                    InstAddr addr, int64_t depth) {
+    if (addr >= n) {
+        return "its body runs past the end of the program";
+    }
+    if (addr < start) {
+        return "it jumps in front of its own label";
+    }
+
+    if (scratch->depths[addr] < 0) {
+        scratch->depths[addr] = depth;
+        scratch->work[scratch->work_size++] = addr;
+        scratch->seen[scratch->seen_size++] = addr;
+        if (addr > *end) {
+            *end = addr;
+        }
+    } else if (scratch->depths[addr] != depth) {
+        return "its stack depth differs between two paths";
+    }
+
+    return NULL;
+}
+
+static void basm_inline_scratch_reset(BasmInlineScratch *scratch) {
+    for (size_t i = 0; i < scratch->seen_size; i++) {
+        scratch->depths[scratch->seen[i]] = -1;
+    }
+    scratch->work_size = 0;
+    scratch->seen_size = 0;
+}
+
+static const char *basm_inline_body(const Basm *basm, const uint8_t *code_refs, BasmInlineScratch *scratch,
+                                    InstAddr start, size_t limit, BasmInlineBody *body) {
+    // Walks the subroutine while tracking how many values lie above the return address, the body can
+    // be copied into a call site only if it never touches the return address besides returning through it
+    size_t n = basm->program_size;
+    if (start >= n) {
+        return "it does not point at an instruction";
+    }
+
+    const int64_t *depths = scratch->depths;
+    InstAddr end = start;
+    const char *reason = basm_inline_flow(scratch, n, start, &end, start, 0);
+
+    while (reason == NULL && scratch->work_size > 0) {
+        // Every visited address lies between start and end, so this also bounds the walk by the threshold
+        if (end - start + 1 > limit) {
+            break;
+        }
+
+        InstAddr addr = scratch->work[--scratch->work_size];
+        Inst inst = basm->program[addr];
+        int64_t depth = depths[addr];
+        uint64_t k = inst.operand.as_u64;
+
+        if (inst.type == INST_CALL || inst.type == INST_CALLR || inst.type == INST_INT || inst.type == INST_SPAWN
+            || inst.type == INST_THREAD) {
+            reason = "it calls other code";
+        } else if (inst.type == INST_JMPTABLE) {
+            // The entries of the table would still point into the original
+            reason = "it jumps through a table";
+        } else if (inst.type == INST_ENTER || inst.type == INST_LEAVE || inst.type == INST_LOAD_LOCAL
+                   || inst.type == INST_STORE_LOCAL) {
+            // The locals are addressed from the frame pointer, which the copy would not keep apart from the caller's
+            reason = "it uses a stack frame";
+        } else if (inst.type == INST_RET) {
+            if (depth != 0) {
+                reason = "it returns with values above the return address";
+            }
+        } else if (inst.type == INST_HALT) {
+            // No successor
+        } else if (inst.type == INST_DUP) {
+            if (k == (uint64_t) depth) {
+                reason = "it copies the return address";
+            } else {
+                reason = basm_inline_flow(scratch, n, start, &end, addr + 1, depth + 1);
+            }
+        } else if (inst.type == INST_SWAP) {
+            if (k > 2 && (depth == 0 || k == (uint64_t) depth)) {
+                reason = "it moves the return address below more than two values";
+            } else {
+                int64_t next = depth;
+                if (depth == 0) {
+                    next = (int64_t) k;
+                } else if (k == (uint64_t) depth) {
+                    next = 0;
+                }
+                reason = basm_inline_flow(scratch, n, start, &end, addr + 1, next);
+            }
+        } else if (inst_stack_pops(inst.type) > (size_t) depth) {
+            reason = "it consumes the return address";
+        } else {
+            int64_t next = depth - (int64_t) inst_stack_pops(inst.type) + (int64_t) inst_stack_pushes(inst.type);
+            if (inst.type == INST_JMP || inst.type == INST_JMP_IF) {
+                reason = basm_inline_flow(scratch, n, start, &end, k, next);
+            }
+            if (reason == NULL && inst.type != INST_JMP) {
+                reason = basm_inline_flow(scratch, n, start, &end, addr + 1, next);
+            }
+        }
+    }
+
+    if (reason == NULL && end - start + 1 > limit) {
+        reason = "it is larger than the inline threshold";
+    }
+
+    for (InstAddr i = start; reason == NULL && i <= end; i++) {
+        if (depths[i] < 0) {
+            reason = "its body is not contiguous";
+        }
+    }
+
+    if (reason != NULL) {
+        basm_inline_scratch_reset(scratch);
+        return reason;
+    }
+
+    size_t count = end - start + 1;
+    size_t *map = malloc((count + 1) * sizeof(map[0]));
+    body->program = malloc(count * sizeof(body->program[0]));
+    body->operands = malloc(count * sizeof(body->operands[0]));
+    body->size = 0;
+    if (map == NULL || body->program == NULL || body->operands == NULL) {
+        free(map);
+        free(body->program);
+        free(body->operands);
+        body->program = NULL;
+        body->operands = NULL;
+        basm_inline_scratch_reset(scratch);
+        return "there is not enough memory";
+    }
+
+    for (InstAddr i = start; i <= end; i++) {
+        Inst inst = basm->program[i];
+        uint64_t depth = (uint64_t) depths[i];
+        uint64_t k = inst.operand.as_u64;
+        uint8_t operand = code_refs[i] ? BASM_INLINE_CODE_REF : BASM_INLINE_PLAIN;
+
+        map[i - start] = body->size;
+
+        // The return address is gone, so stack slots below it move up by one
+        if (inst.type == INST_DUP && k > depth) {
+            inst.operand.as_u64 = k - 1;
+        } else if (inst.type == INST_SWAP) {
+            if (depth == 0 || k == depth) {
+                // Swapping the return address with the value one or two below it only reorders those values
+                if (k <= 1) {
+                    continue;
+                }
+                inst.operand.as_u64 = 1;
+            } else if (k > depth) {
+                inst.operand.as_u64 = k - 1;
+            }
+        } else if (inst.type == INST_RET) {
+            if (i == end) {
+                continue;
+            }
+            inst.type = INST_JMP;
+            inst.operand.as_u64 = count;
+            operand = BASM_INLINE_RELATIVE;
+        } else if (inst.type == INST_JMP || inst.type == INST_JMP_IF) {
+            inst.operand.as_u64 = k - start;
+            operand = BASM_INLINE_RELATIVE;
+        }
+
+        body->program[body->size] = inst;
+        body->operands[body->size] = operand;
+        body->size++;
+    }
+    map[count] = body->size;
+
+    for (size_t i = 0; i < body->size; i++) {
+        if (body->operands[i] == BASM_INLINE_RELATIVE) {
+            body->program[i].operand.as_u64 = map[body->program[i].operand.as_u64];
+        }
+    }
+
+    free(map);
+    basm_inline_scratch_reset(scratch);
+    return NULL;
+}
+
+static void basm_inline_release(BasmInlineScratch *scratch, BasmInlineBody *bodies, size_t n, void *new_addrs,
+                                void *decided, void *code_refs) {
+    for (size_t i = 0; bodies != NULL && i < n; i++) {
+        free(bodies[i].program);
+        free(bodies[i].operands);
+    }
+    free(scratch->seen);
+    free(scratch->work);
+    free(scratch->depths);
+    free(new_addrs);
+    free(bodies);
+    free(decided);
+    free(code_refs);
+}
+
+void basm_inline(Basm *basm, size_t threshold, BasmInlineStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (basm->inlines_size == 0 && threshold == 0) {
+        return;
+    }
+
+    // Nothing is allocated yet when a request turns out to be wrong
+    for (size_t i = 0; i < basm->inlines_size; i++) {
+        BasmInline request = basm->inlines[i];
+        const Label *label = basm_find_label(basm, request.label);
+        if (label == NULL || !label->code) {
+            basm_fail(basm, "%.*s:%d: ERROR: Cannot inline '%.*s', it is not a code label\n",
+                      (int) request.file_path.count,
+                      request.file_path.data,
+                      request.line_number,
+                      (int) request.label.count,
+                      request.label.data);
+        }
+    }
+
+    size_t n = basm->program_size;
+    uint8_t *code_refs = calloc(n + 1, 1);
+    uint8_t *decided = calloc(n + 1, 1);
+    BasmInlineBody *bodies = calloc(n + 1, sizeof(bodies[0]));
+    InstAddr *new_addrs = malloc((n + 1) * sizeof(new_addrs[0]));
+    BasmInlineScratch scratch = {
+        .depths = malloc((n + 1) * sizeof(scratch.depths[0])),
+        .work = malloc((n + 1) * sizeof(scratch.work[0])),
+        .seen = malloc((n + 1) * sizeof(scratch.seen[0])),
+    };
+    if (code_refs == NULL || decided == NULL || bodies == NULL || new_addrs == NULL
+        || scratch.depths == NULL || scratch.work == NULL || scratch.seen == NULL) {
+        basm_inline_release(&scratch, bodies, n, new_addrs, decided, code_refs);
+        basm_fail(basm, "ERROR: Could not allocate memory for inlining %zu instructions\n", n);
+    }
+
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        code_refs[basm->code_refs[i]] = 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        scratch.depths[i] = -1;
+    }
+
+    for (size_t i = 0; i < basm->inlines_size; i++) {
+        BasmInline request = basm->inlines[i];
+        const Label *label = basm_find_label(basm, request.label);
+        InstAddr addr = label->word.as_u64;
+        if (decided[addr]) {
+            continue;
+        }
+
+        const char *reason = basm_inline_body(basm, code_refs, &scratch, addr, SIZE_MAX, &bodies[addr]);
+        if (reason != NULL) {
+            basm_inline_release(&scratch, bodies, n, new_addrs, decided, code_refs);
+            basm_fail(basm, "%.*s:%d: ERROR: Cannot inline '%.*s', %s\n",
+                      (int) request.file_path.count,
+                      request.file_path.data,
+                      request.line_number,
+                      (int) request.label.count,
+                      request.label.data,
+                      reason);
+        }
+        decided[addr] = 1;
+    }
+
+    size_t new_size = 0;
+    for (size_t i = 0; i < n; i++) {
+        new_addrs[i] = new_size;
+
+        Inst inst = basm->program[i];
+        if (inst.type == INST_CALL && inst.operand.as_u64 < n) {
+            InstAddr target = inst.operand.as_u64;
+            if (!decided[target] && threshold > 0) {
+                basm_inline_body(basm, code_refs, &scratch, target, threshold, &bodies[target]);
+                decided[target] = 1;
+            }
+
+            if (bodies[target].program != NULL) {
+                if (bodies[target].uses++ == 0) {
+                    stats->subroutines++;
+                }
+                stats->call_sites++;
+                new_size += bodies[target].size;
+                continue;
+            }
+        }
+
+        new_size++;
+    }
+    new_addrs[n] = new_size;
+
+    if (stats->call_sites > 0) {
+        size_t program_allocated = new_size > 0 ? new_size : 1;
+        Inst *program = malloc(program_allocated * sizeof(program[0]));
+        InstAddr *new_code_refs = NULL;
+        size_t new_code_refs_size = 0;
+        size_t new_code_refs_capacity = 0;
+        int allocated = program != NULL;
+
+        for (size_t i = 0; allocated && i < n; i++) {
+            Inst inst = basm->program[i];
+            InstAddr base = new_addrs[i];
+
+            if (inst.type == INST_CALL && inst.operand.as_u64 < n && bodies[inst.operand.as_u64].program != NULL) {
+                const BasmInlineBody *body = &bodies[inst.operand.as_u64];
+                for (size_t j = 0; j < body->size; j++) {
+                    program[base + j] = body->program[j];
+                    if (body->operands[j] == BASM_INLINE_RELATIVE) {
+                        program[base + j].operand.as_u64 += base;
+                    } else if (body->operands[j] == BASM_INLINE_CODE_REF) {
+                        allocated = allocated && basm_try_reserve((void **) &new_code_refs, &new_code_refs_capacity,
+                                                                  sizeof(new_code_refs[0]), new_code_refs_size + 1);
+                        if (allocated) {
+                            new_code_refs[new_code_refs_size++] = base + j;
+                        }
+                    }
+                }
+                continue;
+            }
+
+            if (inst_targets_code(inst.type)) {
+                inst.operand.as_u64 = basm_relocate_addr(new_addrs, n, new_size, inst.operand.as_u64);
+            } else if (code_refs[i]) {
+                allocated = basm_try_reserve((void **) &new_code_refs, &new_code_refs_capacity,
+                                             sizeof(new_code_refs[0]), new_code_refs_size + 1);
+                if (!allocated) {
+                    break;
+                }
+                new_code_refs[new_code_refs_size++] = base;
+            }
+            program[base] = inst;
+        }
+
+        if (!allocated) {
+            free(new_code_refs);
+            free(program);
+            basm_inline_release(&scratch, bodies, n, new_addrs, decided, code_refs);
+            basm_fail(basm, "ERROR: Could not allocate memory for the inlined program of %zu instructions\n",
+                      new_size);
+        }
+
+        free(basm->program);
+        basm->program = program;
+        basm->program_allocated = program_allocated;
+
+        free(basm->code_refs);
+        basm->code_refs = new_code_refs;
+        basm->code_refs_size = new_code_refs_size;
+        basm->code_refs_capacity = new_code_refs_capacity;
+
+        basm_relocate(basm, new_addrs, new_size);
+    }
+
+    basm_inline_release(&scratch, bodies, n, new_addrs, decided, code_refs);
+}
+
+// Drops the removed instructions and moves every code address along, the removal marks are freed either way
+// so that running out of memory here can fail the whole assembly
+static size_t basm_compact(Basm *basm, uint8_t *removed) {
+    size_t n = basm->program_size;
+    InstAddr *new_addrs = malloc((n + 1) * sizeof(new_addrs[0]));
+    if (new_addrs == NULL) {
+        free(removed);
+        basm_fail(basm, "ERROR: Could not allocate memory for compacting %zu instructions\n", n);
+    }
+
+    size_t new_size = 0;
+    for (size_t i = 0; i < n; i++) {
+        new_addrs[i] = new_size;
+        if (!removed[i]) {
+            new_size++;
+        }
+    }
+    new_addrs[n] = new_size;
+
+    size_t code_refs_size = 0;
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        if (!removed[basm->code_refs[i]]) {
+            basm->code_refs[code_refs_size++] = new_addrs[basm->code_refs[i]];
+        }
+    }
+    basm->code_refs_size = code_refs_size;
+
+    for (size_t i = 0; i < n; i++) {
+        if (removed[i]) {
+            continue;
+        }
+
+        Inst inst = basm->program[i];
+        if (inst_targets_code(inst.type)) {
+            inst.operand.as_u64 = basm_relocate_addr(new_addrs, n, new_size, inst.operand.as_u64);
+        }
+        basm->program[new_addrs[i]] = inst;
+    }
+
+    basm_relocate(basm, new_addrs, new_size);
+
+    free(new_addrs);
+    free(removed);
+    return new_size;
+}
+
+void basm_optimize(Basm *basm, BasmOptStats *stats) {
+    size_t n = basm->program_size;
+    uint8_t *removed = calloc(n + 1, 1);
+    uint8_t *leaders = calloc(n + 1, 1);
+    uint8_t *pinned = calloc(n + 1, 1);
+    if (removed == NULL || leaders == NULL || pinned == NULL) {
+        free(pinned);
+        free(leaders);
+        free(removed);
+        basm_fail(basm, "ERROR: Could not allocate memory for optimizing %zu instructions\n", n);
+    }
+
+    memset(stats, 0, sizeof(*stats));
+    stats->instructions_before = n;
+
+    // Operands holding code addresses are relocated later, they must not be folded into other values
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        pinned[basm->code_refs[i]] = 1;
+    }
+
+    for (int changed = 1; changed;) {
+        changed = 0;
+
+        // Jump threading
+        for (size_t i = 0; i < n; i++) {
+            Inst *inst = &basm->program[i];
+            if (removed[i] || !inst_targets_code(inst->type)) {
+                continue;
+            }
+
+            InstAddr target = inst->operand.as_u64;
+            for (size_t hops = 0; target < n && !removed[target] && basm->program[target].type == INST_JMP
+                                  && hops < n; hops++) {
+                if (basm->program[target].operand.as_u64 == target) {
+                    break;
+                }
+                target = basm->program[target].operand.as_u64;
+            }
+
+            if (target != inst->operand.as_u64) {
+                inst->operand.as_u64 = target;
+                stats->threaded++;
+                changed = 1;
+            }
+
+            if ((inst->type == INST_JMP || inst->type == INST_JMP_IF) && basm_next_live(removed, n, i) == target) {
+                if (inst->type == INST_JMP) {
+                    removed[i] = 1;
+                } else {
+                    inst->type = INST_POP;
+                    inst->operand.as_u64 = 0;
+                }
+                stats->threaded++;
+                changed = 1;
+            }
+        }
+
+        basm_mark_leaders(basm, removed, leaders);
+
+        // Constant folding and cancellation inside of basic blocks
+        for (size_t i = 0; i < n; i++) {
+            if (removed[i]) {
+                continue;
+            }
+
+            Inst *a = &basm->program[i];
+            size_t j = basm_next_live(removed, n, i);
+
+            if (a->type == INST_NOP || (a->type == INST_SWAP && a->operand.as_u64 == 0)) {
+                removed[i] = 1;
+                stats->cancelled++;
+                changed = 1;
+                continue;
+            }
+
+            if (j >= n || leaders[j]) {
+                continue;
+            }
+
+            Inst *b = &basm->program[j];
+            size_t k = basm_next_live(removed, n, j);
+            Word result = {0};
+
+            if ((a->type == INST_PUSH || a->type == INST_DUP) && b->type == INST_POP) {
+                removed[i] = 1;
+                removed[j] = 1;
+                stats->cancelled += 2;
+                changed = 1;
+            } else if (pinned[i] || pinned[j]) {
+                continue;
+            } else if (a->type == INST_NOTB && b->type == INST_NOTB) {
+                removed[i] = 1;
+                removed[j] = 1;
+                stats->cancelled += 2;
+                changed = 1;
+            } else if (a->type == INST_NOT && b->type == INST_NOT && k < n
+                       && basm->program[k].type == INST_JMP_IF) {
+                // The double negation only normalizes the value to 0 or 1, which jmpif does not care about
+                removed[i] = 1;
+                removed[j] = 1;
+                stats->cancelled += 2;
+                changed = 1;
+            } else if (a->type == INST_PUSH && b->type == INST_JMP_IF) {
+                if (a->operand.as_u64 != 0) {
+                    a->type = INST_JMP;
+                    a->operand = b->operand;
+                } else {
+                    removed[i] = 1;
+                }
+                removed[j] = 1;
+                stats->folded++;
+                changed = 1;
+            } else if (a->type == INST_PUSH && inst_binary_form(b->type) != SIZE
+                       && basm_fold_binary(inst_binary_form(b->type), a->operand, b->operand, &result)) {
+                a->operand = result;
+                removed[j] = 1;
+                stats->folded++;
+                changed = 1;
+            } else if (a->type == INST_PUSH && basm_fold_unary(b->type, a->operand, &result)) {
+                a->operand = result;
+                removed[j] = 1;
+                stats->folded++;
+                changed = 1;
+            } else if (a->type == INST_PUSH && b->type == INST_PUSH && k < n && !leaders[k] && !pinned[k]
+                       && basm_fold_binary(basm->program[k].type, a->operand, b->operand, &result)) {
+                a->operand = result;
+                removed[j] = 1;
+                removed[k] = 1;
+                stats->folded++;
+                changed = 1;
+            }
+        }
+
+        size_t unreachable = basm_remove_unreachable(basm, removed);
+        if (unreachable > 0) {
+            stats->unreachable += unreachable;
+            changed = 1;
+        }
+    }
+
+    free(pinned);
+    free(leaders);
+    stats->instructions_after = basm_compact(basm, removed);
+}
+
+// Only the first instruction of a run that gets fused may be a jump target, and none may hold a code address
+static int basm_fused_run(const uint8_t *leaders, const uint8_t *pinned, size_t begin, size_t end) {
+    for (size_t i = begin; i <= end; i++) {
+        if ((i > begin && leaders[i]) || pinned[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static size_t basm_fuse_addresses(Basm *basm) {
+    size_t n = basm->program_size;
+    uint8_t *removed = calloc(n + 1, 1);
+    uint8_t *leaders = calloc(n + 1, 1);
+    uint8_t *pinned = calloc(n + 1, 1);
+    if (removed == NULL || leaders == NULL || pinned == NULL) {
+        free(pinned);
+        free(leaders);
+        free(removed);
+        basm_fail(basm, "ERROR: Could not allocate memory for optimizing %zu instructions\n", n);
+    }
+
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        pinned[basm->code_refs[i]] = 1;
+    }
+    basm_mark_leaders(basm, removed, leaders);
+
+    // `multi.imm scale plusi` adds a scaled index and `plusi.imm disp` a displacement to the address of the read
+    // right after them, or of the write right after the push of the value
+    size_t fused = 0;
+    for (size_t i = 0; i < n; i++) {
+        size_t j = i;
+        uint64_t shift = 4;
+        if (j + 1 < n && basm->program[j + 1].type == INST_PLUSI) {
+            uint64_t k = basm->program[j].operand.as_u64;
+            if (basm->program[j].type == INST_MULTI_IMM && (k == 1 || k == 2 || k == 4 || k == 8)) {
+                shift = k == 8 ? 3 : k == 4 ? 2 : k == 2 ? 1 : 0;
+            } else if (basm->program[j].type == INST_SHL_IMM && k <= 3) {
+                shift = k;
+            }
+            if (shift < 4) {
+                j += 2;
+            }
+        }
+
+        uint64_t disp = 0;
+        if (j < n && basm->program[j].type == INST_PLUSI_IMM) {
+            disp = basm->program[j].operand.as_u64;
+            j++;
+        }
+
+        size_t access = j;
+        if (j + 1 < n && basm->program[j].type == INST_PUSH) {
+            access = j + 1;
+        }
+        if (j == i || access >= n || !basm_fused_run(leaders, pinned, i, access)) {
+            continue;
+        }
+
+        Inst *inst = &basm->program[access];
+        int write = inst->type == INST_WRITE8 || inst->type == INST_WRITE16 || inst->type == INST_WRITE32
+                    || inst->type == INST_WRITE64;
+        if (inst_displacement_form(inst->type) == SIZE || write != (access != j)) {
+            continue;
+        }
+
+        if (shift < 4) {
+            inst->type = inst_indexed_form(inst->type);
+            inst->operand.as_u64 = BR_INDEX_OPERAND(shift, disp);
+        } else {
+            inst->type = inst_displacement_form(inst->type);
+            inst->operand.as_u64 = disp;
+        }
+        for (size_t k = i; k < j; k++) {
+            removed[k] = 1;
+            fused++;
+        }
+        i = access;
+    }
+
+    free(pinned);
+    free(leaders);
+    if (fused > 0) {
+        basm_compact(basm, removed);
+    } else {
+        free(removed);
+    }
+    return fused;
+}
+
+size_t basm_fuse_immediates(Basm *basm) {
+    size_t n = basm->program_size;
+    uint8_t *removed = calloc(n + 1, 1);
+    uint8_t *leaders = calloc(n + 1, 1);
+    uint8_t *pinned = calloc(n + 1, 1);
+    if (removed == NULL || leaders == NULL || pinned == NULL) {
+        free(pinned);
+        free(leaders);
+        free(removed);
+        basm_fail(basm, "ERROR: Could not allocate memory for optimizing %zu instructions\n", n);
+    }
+
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        pinned[basm->code_refs[i]] = 1;
+    }
+    basm_mark_leaders(basm, removed, leaders);
+
+    // The push may be a jump target, the instruction taking over its operand must not be one
+    size_t fused = 0;
+    for (size_t i = 0; i + 1 < n; i++) {
+        Inst *push = &basm->program[i];
+        Inst *binary = &basm->program[i + 1];
+        InstType immediate = inst_immediate_form(binary->type);
+        if (push->type == INST_PUSH && !pinned[i] && !leaders[i + 1] && immediate != SIZE) {
+            binary->type = immediate;
+            binary->operand = push->operand;
+            removed[i] = 1;
+            fused++;
+            i++;
+        }
+    }
+
+    free(pinned);
+    free(leaders);
+    if (fused > 0) {
+        basm_compact(basm, removed);
+    } else {
+        free(removed);
+    }
+    return fused + basm_fuse_addresses(basm);
+}
+
+void basm_load_profile(BrProfile *profile, const char *file_path) {
+    FILE *f = fopen(file_path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    unsigned long long fingerprint = 0;
+    size_t size = 0;
+    if (fscanf(f, "br-profile 1 %zu %llx", &size, &fingerprint) != 2) {
+        fprintf(stderr, "ERROR: File '%s' is not a profile written by br\n", file_path);
+        exit(1);
+    }
+
+    profile->fingerprint = fingerprint;
+    profile->size = size;
+    profile->executions = calloc(size + 1, sizeof(profile->executions[0]));
+    profile->taken = calloc(size + 1, sizeof(profile->taken[0]));
+    assert(profile->executions != NULL && profile->taken != NULL);
+
+    size_t addr = 0;
+    unsigned long long executions = 0;
+    unsigned long long taken = 0;
+    int scanned = 0;
+    while ((scanned = fscanf(f, "%zu %llu %llu", &addr, &executions, &taken)) == 3) {
+        if (addr >= size || taken > executions) {
+            fprintf(stderr, "ERROR: File '%s' has an invalid record for address %zu\n", file_path, addr);
+            exit(1);
+        }
+
+        profile->executions[addr] = executions;
+        profile->taken[addr] = taken;
+    }
+
+    if (scanned != EOF || ferror(f)) {
+        fprintf(stderr, "ERROR: Could not read profile '%s'\n", file_path);
+        exit(1);
+    }
+
+    fclose(f);
+}
+
+static int basm_inverse_condition(InstType type, InstType *inverse) {
+    static const InstType pairs[][2] = {
+            {INST_EQI, INST_NEI},
+            {INST_LI,  INST_GEI},
+            {INST_GI,  INST_LEI},
+            // lf and gef are not each other's inverse once a NaN shows up, eqf and nef are
+            {INST_EQF, INST_NEF},
+            {INST_EQI_IMM, INST_NEI_IMM},
+            {INST_LI_IMM,  INST_GEI_IMM},
+            {INST_GI_IMM,  INST_LEI_IMM},
+            {INST_EQF_IMM, INST_NEF_IMM},
+    };
+
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        for (size_t j = 0; j < 2; j++) {
+            if (pairs[i][j] == type) {
+                *inverse = pairs[i][1 - j];
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+typedef struct {
+    uint64_t weight;
+    size_t block;
+} BasmLayoutSeed;
+
+static int basm_compare_seeds(const void *a, const void *b) {
+    const BasmLayoutSeed *x = a;
+    const BasmLayoutSeed *y = b;
+    if (x->weight != y->weight) {
+        return x->weight < y->weight ? 1 : -1;
+    }
+    return x->block < y->block ? -1 : x->block > y->block;
+}
+
+void basm_layout(Basm *basm, const BrProfile *profile, BasmLayoutStats *stats) {
+    // Chains the blocks into traces along their most frequent successor, starting at the entry and
+    // then at the hottest block left, so the common path falls through instead of dispatching a
+    // jump. Blocks that never ran go last in source order. The profile must come from this exact program, the caller checks the fingerprint
+    size_t n = basm->program_size;
+    assert(profile->size == n);
+    memset(stats, 0, sizeof(*stats));
+    if (n == 0) {
+        return;
+    }
+
+    uint8_t *removed = calloc(n + 1, 1);
+    uint8_t *leaders = calloc(n + 1, 1);
+    size_t *starts = malloc((n + 1) * sizeof(starts[0]));
+    size_t *block_of = malloc((n + 1) * sizeof(block_of[0]));
+    assert(removed != NULL && leaders != NULL && starts != NULL && block_of != NULL);
+
+    basm_mark_leaders(basm, removed, leaders);
+    leaders[0] = 1;
+
+    size_t blocks = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (leaders[i]) {
+            starts[blocks++] = i;
+        }
+        block_of[i] = blocks - 1;
+    }
+    starts[blocks] = n;
+    block_of[n] = blocks;
+
+    uint8_t *placed = calloc(blocks, 1);
+    uint8_t *invert = calloc(blocks, 1);
+    size_t *order = malloc(blocks * sizeof(order[0]));
+    BasmLayoutSeed *seeds = malloc(blocks * sizeof(seeds[0]));
+    assert(placed != NULL && invert != NULL && order != NULL && seeds != NULL);
+
+    size_t seeds_size = 0;
+    for (size_t b = 0; b < blocks; b++) {
+        uint64_t weight = profile->executions[starts[b]];
+        if (weight > 0) {
+            seeds[seeds_size++] = (BasmLayoutSeed) {.weight = weight, .block = b};
+        } else {
+            stats->cold++;
+        }
+    }
+    qsort(seeds, seeds_size, sizeof(seeds[0]), basm_compare_seeds);
+
+    // The first trace starts at the entry, otherwise the entry block gets a jump into the loop it sets up
+    size_t entry_block = basm->entry < n ? block_of[basm->entry] : blocks;
+    for (size_t s = 0; s < seeds_size; s++) {
+        if (seeds[s].block == entry_block) {
+            memmove(&seeds[1], &seeds[0], s * sizeof(seeds[0]));
+            seeds[0] = (BasmLayoutSeed) {.weight = profile->executions[starts[entry_block]], .block = entry_block};
+            break;
+        }
+    }
+    for (size_t b = 0; b < blocks; b++) {
+        if (profile->executions[starts[b]] == 0) {
+            seeds[seeds_size++] = (BasmLayoutSeed) {.weight = 0, .block = b};
+        }
+    }
+
+    // A hot block only pulls a hot successor into its trace, the cold ones wait for the end
+#define BASM_LAYOUT_FOLLOWS(addr)                                       \
+    ((addr) < n && leaders[(addr)] && !placed[block_of[(addr)]]         \
+     && (weight == 0 || profile->executions[(addr)] > 0))
+
+    size_t order_size = 0;
+    for (size_t s = 0; s < seeds_size; s++) {
+        size_t block = seeds[s].block;
+        while (block < blocks && !placed[block]) {
+            placed[block] = 1;
+            order[order_size++] = block;
+
+            size_t start = starts[block];
+            size_t end = starts[block + 1];
+            uint64_t weight = profile->executions[start];
+            Inst last = basm->program[end - 1];
+            InstAddr target = last.operand.as_u64;
+            size_t next = blocks;
+
+            if (last.type == INST_JMP) {
+                if (BASM_LAYOUT_FOLLOWS(target)) {
+                    next = block_of[target];
+                }
+            } else if (last.type == INST_JMP_IF) {
+                uint64_t taken = profile->taken[end - 1];
+                uint64_t not_taken = profile->executions[end - 1] - taken;
+
+                // Only flip the jump when the condition in front of it can be inverted for free
+                InstType inverse = INST_NOP;
+                int invertible = end - 1 > start
+                                 && (basm->program[end - 2].type == INST_NOT
+                                     || basm_inverse_condition(basm->program[end - 2].type, &inverse));
+
+                if (invertible && BASM_LAYOUT_FOLLOWS(target)
+                    && (taken > not_taken || !BASM_LAYOUT_FOLLOWS(end))) {
+                    invert[block] = 1;
+                    next = block_of[target];
+                } else if (BASM_LAYOUT_FOLLOWS(end)) {
+                    next = block_of[end];
+                } else if (BASM_LAYOUT_FOLLOWS(target)) {
+                    next = block_of[target];
+                }
+            } else if (last.type != INST_RET && last.type != INST_HALT) {
+                // Calls and everything else continue into the next block no matter how often it ran
+                if (end < n && !placed[block_of[end]]) {
+                    next = block_of[end];
+                }
+            }
+
+            block = next;
+        }
+    }
+#undef BASM_LAYOUT_FOLLOWS
+    assert(order_size == blocks);
+
+    // Every block gains at most one jump to where it used to fall through
+    Inst *program = malloc((n + blocks) * sizeof(program[0]));
+    InstAddr *new_addrs = malloc((n + 1) * sizeof(new_addrs[0]));
+    assert(program != NULL && new_addrs != NULL);
+
+    size_t size = 0;
+    for (size_t k = 0; k < order_size; k++) {
+        size_t block = order[k];
+        size_t start = starts[block];
+        size_t end = starts[block + 1];
+        size_t next_start = k + 1 < order_size ? starts[order[k + 1]] : n;
+        int falls_through = 1;
+        InstAddr fallthrough = end;
+
+        for (size_t i = start; i < end; i++) {
+            new_addrs[i] = size;
+            Inst inst = basm->program[i];
+
+            if (invert[block] && i == end - 2) {
+                if (inst.type == INST_NOT) {
+                    continue;
+                }
+                basm_inverse_condition(inst.type, &inst.type);
+            }
+
+            if (i == end - 1) {
+                if (inst.type == INST_JMP || inst.type == INST_RET || inst.type == INST_HALT) {
+                    falls_through = 0;
+                }
+
+                if (inst.type == INST_JMP && inst.operand.as_u64 == next_start) {
+                    stats->jumps_removed++;
+                    continue;
+                }
+
+                if (inst.type == INST_JMP_IF && invert[block]) {
+                    fallthrough = inst.operand.as_u64;
+                    inst.operand.as_u64 = end;
+                    stats->inverted++;
+                }
+            }
+
+            program[size++] = inst;
+        }
+
+        if (falls_through && fallthrough != next_start) {
+            program[size++] = (Inst) {.type = INST_JMP, .operand = {.as_u64 = fallthrough}};
+            stats->jumps_added++;
+        }
+    }
+    new_addrs[n] = size;
+
+    for (size_t i = 0; i < size; i++) {
+        if (inst_targets_code(program[i].type)) {
+            program[i].operand.as_u64 = basm_relocate_addr(new_addrs, n, size, program[i].operand.as_u64);
+        }
+    }
+
+    for (size_t i = 0; i < basm->code_refs_size; i++) {
+        basm->code_refs[i] = new_addrs[basm->code_refs[i]];
+    }
+
+    free(basm->program);
+    basm->program = program;
+    basm->program_allocated = n + blocks;
+    basm_relocate(basm, new_addrs, size);
+    stats->blocks = blocks;
+
+    free(new_addrs);
+    free(seeds);
+    free(order);
+    free(invert);
+    free(placed);
+    free(block_of);
+    free(starts);
+    free(leaders);
+    free(removed);
+}
+
+size_t basm_save_to_file(Basm *basm, const char *file_path) {
+    FILE *f = fopen(file_path, "wb");
+    size_t written_size = 0;
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    BasmFileMeta meta = {
+            .magic = BR_FILE_MAGIC,
+            .version = BR_FILE_VERSION,
+            .program_size = basm->program_size,
+            .memory_size = basm->memory_size,
+            .memory_capacity = basm->memory_capacity,
+            .entry = basm->entry
+    };
+
+    static const uint8_t padding[BR_FILE_PAGE_SIZE] = {0};
+
+    written_size += fwrite(&meta, sizeof(meta), 1, f) * sizeof(meta);
+    written_size += fwrite(padding, 1, basm_file_program_offset() - written_size, f);
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    written_size += fwrite(basm->program, sizeof(basm->program[0]), basm->program_size, f) * sizeof(basm->program[0]);
+    written_size += fwrite(padding, 1, basm_file_memory_offset(basm->program_size) - written_size, f);
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    written_size += fwrite(basm->memory, sizeof(basm->memory[0]), basm->memory_size, f) * sizeof(basm->memory[0]);
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    fclose(f);
+    return written_size;
+}
+
+size_t basm_image_size(const Basm *basm) {
+    return basm_file_memory_offset(basm->program_size) + basm->memory_size;
+}
+
+// Lays the program out exactly like basm_save_to_file does, image has room for basm_image_size bytes
+void basm_write_image(const Basm *basm, uint8_t *image) {
+    BasmFileMeta meta = {
+            .magic = BR_FILE_MAGIC,
+            .version = BR_FILE_VERSION,
+            .program_size = basm->program_size,
+            .memory_size = basm->memory_size,
+            .memory_capacity = basm->memory_capacity,
+            .entry = basm->entry
+    };
+
+    memset(image, 0, basm_file_memory_offset(basm->program_size));
+    memcpy(image, &meta, sizeof(meta));
+    if (basm->program_size > 0) {
+        memcpy(image + basm_file_program_offset(), basm->program, basm->program_size * sizeof(basm->program[0]));
+    }
+    if (basm->memory_size > 0) {
+        memcpy(image + basm_file_memory_offset(basm->program_size), basm->memory, basm->memory_size);
+    }
+}
+
+#endif
+#ifdef BASM_VM
+
+const char *err_as_cstr(Err err) {
+    switch (err) {
+        case ERR_OK:
+            return "ERR_OK";
+        case ERR_STACK_OVERFLOW:
+            return "ERR_STACK_OVERFLOW";
+        case ERR_STACK_UNDERFLOW:
+            return "ERR_STACK_UNDERFLOW";
+        case ERR_ILLEGAL_INS:
+            return "ERR_ILLEGAL_INS";
+        case ERR_DIV_BY_ZERO:
+            return "ERR_DIV_BY_ZERO";
+        case ERR_ILLEGAL_INS_ACCESS:
+            return "ERR_ILLEGAL_INS_ACCESS";
+        case ERR_ILLEGAL_OPERAND:
+            return "ERR_ILLEGAL_OPERAND";
+        case ERR_ILLEGAL_MEMORY_ACCESS:
+            return "ERR_ILLEGAL_MEMORY_ACCESS";
+        case ERR_DEADLOCK:
+            return "ERR_DEADLOCK";
+        case ERR_THREAD_FAILED:
+            return "ERR_THREAD_FAILED";
+        case ERR_YIELDED:
+            return "ERR_YIELDED";
+        case ERR_OUT_OF_MEMORY:
+            return "ERR_OUT_OF_MEMORY";
+        default:
+            assert(0 && "err_as_cstr: Unreachable");
+            break;
+    }
+
+    return "";
+}
+
+void br_load_program_from_file(ByteRunner *br, const char *file_path) {
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    BasmFileMeta meta = {0};
+    size_t n = fread(&meta, sizeof(meta), 1, f);
+    if (n < 1) {
+        fprintf(stderr, "ERROR: Could not read meta data from file '%s': %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    if (meta.magic != BR_FILE_MAGIC) {
+        fprintf(stderr, "ERROR: '%s' does not appear to be a valid file. "
+                        "Unexpected magic %04X. Expected %04X\n", file_path, meta.magic, BR_FILE_MAGIC);
+        exit(1);
+    }
+
+    if (meta.version != BR_FILE_VERSION) {
+        fprintf(stderr, "ERROR: Unsupported version %d, Expected version %d\n", meta.version, BR_FILE_VERSION);
+        exit(1);
+    }
+
+    // The program is allocated to its size, only a size no allocation can hold is rejected here
+    if (meta.program_size > SIZE_MAX / sizeof(Inst)) {
+        fprintf(stderr, "ERROR: '%s': program section of %" PRIu64 " instructions is too large\n",
+                file_path, meta.program_size);
+        exit(1);
+    }
+
+    br->ip = meta.entry;
+
+    if (meta.memory_capacity > BR_MEMORY_CAPACITY) {
+        fprintf(stderr,
+                "ERROR: '%s': memory section is too large. The file wants %" PRIu64 "bytes. But the capacity is %"  PRIu64 "bytes \n",
+                file_path, meta.memory_capacity, (uint64_t) BR_MEMORY_CAPACITY);
+        exit(1);
+    }
+
+    if (meta.memory_size > meta.memory_capacity) {
+        fprintf(stderr,
+                "ERROR: '%s': memory size %" PRIu64 " is greater than the declared memory capacity %" PRIu64 "\n",
+                file_path, meta.memory_size, meta.memory_capacity);
+        exit(1);
+    }
+
+    Inst *program = malloc(meta.program_size * sizeof(Inst));
+    br->memory = calloc(BR_MEMORY_CAPACITY + BR_WORD_SIZE, 1);
+    if ((program == NULL && meta.program_size > 0) || br->memory == NULL) {
+        fprintf(stderr, "ERROR: Could not allocate memory for '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    fseek(f, (long) basm_file_program_offset(), SEEK_SET);
+    br->program_size = fread(program, sizeof(program[0]), meta.program_size, f);
+    br->program = program;
+
+    if (br->program_size != meta.program_size) {
+        fprintf(stderr, "ERROR: '%s', read %zd program instructions, but expected %" PRIu64 "\n",
+                file_path, br->program_size, meta.program_size);
+    }
+
+    fseek(f, (long) basm_file_memory_offset(meta.program_size), SEEK_SET);
+    n = fread(br->memory, sizeof(br->memory[0]), meta.memory_size, f);
+
+    if (n != meta.memory_size) {
+        fprintf(stderr, "ERROR: '%s', read %zd bytes of memory section, but expected %" PRIu64 " bytes\n",
+                file_path, n, meta.memory_size);
+    }
+
+
+    fclose(f);
+}
+
+Err br_push_native(ByteRunner *br, Br_Native native) {
+    return br_push_native_with_context(br, native, NULL);
+}
+
+Err br_push_native_with_context(ByteRunner *br, Br_Native native, void *context) {
+    if (br->natives_size >= BR_NATIVE_CAPACITY) {
+        return ERR_OUT_OF_MEMORY;
+    }
+
+    br->native_contexts[br->natives_size] = context;
+    br->natives[br->natives_size++] = native;
+    return ERR_OK;
+}
+
+const char *br_load_program_from_memory(ByteRunner *br, const uint8_t *image, size_t image_size) {
+    BasmFileMeta meta = {0};
+    if (image_size < basm_file_program_offset()) {
+        return "the image is too small to hold the meta data";
+    }
+    memcpy(&meta, image, sizeof(meta));
+
+    if (meta.magic != BR_FILE_MAGIC) {
+        return "the image does not start with the magic of a program";
+    }
+
+    if (meta.version != BR_FILE_VERSION) {
+        return "the image has an unsupported version";
+    }
+
+    if (meta.memory_capacity > BR_MEMORY_CAPACITY || meta.memory_size > meta.memory_capacity) {
+        return "the memory section of the image does not fit into the memory of the VM";
+    }
+
+    if (meta.program_size > (image_size - basm_file_program_offset()) / sizeof(Inst) ||
+        basm_file_memory_offset(meta.program_size) + meta.memory_size > image_size) {
+        return "the image is truncated";
+    }
+
+    // The instructions run straight from the image, which therefore has to outlive the VM
+    const Inst *program = (const Inst *) (const void *) (image + basm_file_program_offset());
+    if ((uintptr_t) program % _Alignof(Inst) != 0) {
+        return "the image is not aligned for the instructions";
+    }
+
+    br->program = program;
+    br->program_size = meta.program_size;
+    br->ip = meta.entry;
+
+    // The memory belongs to the VM, everything past the static data starts zeroed
+    memcpy(br->memory, image + basm_file_memory_offset(meta.program_size), meta.memory_size);
+    memset(br->memory + meta.memory_size, 0, BR_MEMORY_CAPACITY + BR_WORD_SIZE - meta.memory_size);
+    return NULL;
+}
+
+void br_free_threads(ByteRunner *br) {
+    for (size_t i = 0; i < br->threads_size; i++) {
+        if (br->threads[i] != NULL) {
+#ifdef BR_THREADS
+            thrd_join(br->threads[i]->handle, NULL);
+#endif
+            free(br->threads[i]);
+        }
+    }
+    free(br->threads);
+
+    br->threads = NULL;
+    br->threads_size = 0;
+    br->threads_capacity = 0;
+}
+
+void br_free_fibers(ByteRunner *br) {
+    for (size_t i = 0; i < br->fibers_size; i++) {
+        free(br->fibers[i].stack);
+    }
+    free(br->fibers);
+    free(br->ready);
+
+    br->fibers = NULL;
+    br->fibers_size = 0;
+    br->fibers_capacity = 0;
+    br->fiber = 0;
+    br->ready = NULL;
+    br->ready_begin = 0;
+    br->ready_size = 0;
+}
+
+void br_dump_stack(FILE *stream, const ByteRunner *br) {
+    fprintf(stream, "Stack:\n");
+    if (br->stack_size > 0) {
+        for (InstAddr i = 0; i < br->stack_size; i++) {
+            fprintf(stream, "  u64: %-20" PRIu64 "|   i64: %-20" PRId64 "|   f64: %-25lf|   ptr: %-20p\n",
+                    br->stack[i].as_u64,
+                    br->stack[i].as_i64,
+                    br->stack[i].as_f64,
+                    br->stack[i].as_ptr
+            );
+        }
+    } else {
+        fprintf(stream, "  [EMPTY]\n");
+    }
+
+}
+
+Err br_execute_program(ByteRunner *br, int limit) {
+    while (limit != 0 && !br->halt) {
+        Err err = br_execute_inst(br);
+        if (err != ERR_OK) {
+            return err;
+        }
+
+        if (limit > 0) {
+            limit--;
+        }
+    }
+
+    return ERR_OK;
+}
+
+// Control may leave the straight line after these, or a fiber switch may continue somewhere else
+static int br_ends_run(InstType type) {
+    return type == INST_JMP || type == INST_JMP_IF || type == INST_CALL || type == INST_RET || type == INST_HALT
+           || type == INST_JMPTABLE || type == INST_CALLR || type == INST_YIELD || type == INST_JOIN || type == INST_SEND || type == INST_RECV;
+}
+
+Err br_execute_budget(ByteRunner *br, uint64_t *budget) {
+    if (br->run_lengths == NULL) {
+        br->run_lengths = malloc((br->program_size + 1) * sizeof(br->run_lengths[0]));
+        if (br->run_lengths == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+
+        br->run_lengths[br->program_size] = 1;
+        for (size_t i = br->program_size; i-- > 0;) {
+            br->run_lengths[i] = br_ends_run(br->program[i].type) ? 1 : br->run_lengths[i + 1] + 1;
+        }
+    }
+
+    // The budget is charged once per straight line, a line longer than what is left runs up to the budget and
+    // the next call picks it up at the instruction it stopped at. Inside of a line ip only ever steps to the next
+    // instruction, so it runs until ip reaches the last one without counting, and an error refunds what is left
+    while (!br->halt) {
+        if (*budget == 0) {
+            return ERR_YIELDED;
+        }
+
+        InstAddr start = br->ip;
+        uint64_t length = br->run_lengths[start < br->program_size ? start : br->program_size];
+        if (length > *budget) {
+            length = *budget;
+        }
+        *budget -= length;
+
+        InstAddr last = start + length - 1;
+        for (;;) {
+            int at_last = br->ip == last;
+            Err err = br_execute_inst(br);
+            if (err != ERR_OK) {
+                *budget += length - (br->ip - start);
+                return err;
+            }
+            if (at_last) {
+                break;
+            }
+        }
+    }
+
+    return ERR_OK;
+}
+
+void br_profile_init(BrProfile *profile, const ByteRunner *br) {
+    profile->fingerprint = basm_hash_program(br->program, br->program_size);
+    profile->size = br->program_size;
+    profile->executions = calloc(br->program_size + 1, sizeof(profile->executions[0]));
+    profile->taken = calloc(br->program_size + 1, sizeof(profile->taken[0]));
+    assert(profile->executions != NULL && profile->taken != NULL);
+}
+
+Err br_execute_program_profiled(ByteRunner *br, int limit, BrProfile *profile) {
+    while (limit != 0 && !br->halt) {
+        InstAddr ip = br->ip;
+        Err err = br_execute_inst(br);
+        if (err != ERR_OK) {
+            return err;
+        }
+
+        // The instruction ran, so ip was inside of the program
+        profile->executions[ip]++;
+        if (br->ip != ip + 1 && !br->halt) {
+            profile->taken[ip]++;
+        }
+
+        if (limit > 0) {
+            limit--;
+        }
+    }
+
+    return ERR_OK;
+}
+
+void br_save_profile(const BrProfile *profile, const char *file_path) {
+    FILE *f = fopen(file_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+
+    fprintf(f, "br-profile 1 %zu %016llx\n", profile->size, (unsigned long long) profile->fingerprint);
+    for (size_t i = 0; i < profile->size; i++) {
+        if (profile->executions[i] > 0) {
+            fprintf(f, "%zu %llu %llu\n", i,
+                    (unsigned long long) profile->executions[i], (unsigned long long) profile->taken[i]);
+        }
+    }
+
+    if (ferror(f)) {
+        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
+        exit(1);
+    }
+    fclose(f);
+}
+
+static void br_fiber_enqueue(ByteRunner *br, uint64_t id) {
+    assert(br->ready_size < br->fibers_capacity);
+    br->ready[(br->ready_begin + br->ready_size) % br->fibers_capacity] = id;
+    br->ready_size++;
+}
 
-                    token = sv_trim(sv_chop_by_delim(&line, ' '));
-                }
+static uint64_t br_fiber_dequeue(ByteRunner *br) {
+    assert(br->ready_size > 0);
+    uint64_t id = br->ready[br->ready_begin];
+    br->ready_begin = (br->ready_begin + 1) % br->fibers_capacity;
+    br->ready_size--;
+    return id;
+}
 
-                // Instruction
-                if (token.count > 0) {
-                    StringView operand = line;
-                    InstType inst_type = INST_NOP;
+static Err br_fiber_reserve(BrFiber *fiber, uint64_t size) {
+    if (size <= fiber->stack_capacity) {
+        return ERR_OK;
+    }
 
-                    if (inst_by_name(&token, &inst_type)) {
-                        assert(basm->program_size < BR_PROGRAM_CAPACITY);
-                        basm->program[basm->program_size].type = inst_type;
+    uint64_t capacity = fiber->stack_capacity > 0 ? fiber->stack_capacity : 4;
+    while (capacity < size) {
+        capacity *= 2;
+    }
 
-                        if (inst_has_operand(inst_type)) {
-                            if (operand.count == 0) {
-                                fprintf(stderr,
-                                        "%.*s:%d: ERROR: Instruction '%.*s' requires an operand\n",
-                                        (int) input_file_path.count,
-                                        input_file_path.data,
-                                        line_number,
-                                        (int) token.count,
-                                        token.data);
-                                exit(1);
-                            }
+    Word *stack = realloc(fiber->stack, capacity * sizeof(stack[0]));
+    if (stack == NULL) {
+        return ERR_OUT_OF_MEMORY;
+    }
 
-                            if (!basm_translate_literal(basm, operand,
-                                                        &basm->program[basm->program_size].operand)) {
-                                basm_bind_unresolved(basm, basm->program_size, operand);
-                            }
-                        }
+    fiber->stack = stack;
+    fiber->stack_capacity = capacity;
+    return ERR_OK;
+}
 
-                        basm->program_size++;
-                    } else {
-                        fprintf(stderr, "%.*s:%d: ERROR: Unknown instruction '%.*s'\n",
-                                (int) input_file_path.count,
-                                input_file_path.data,
-                                line_number,
-                                (int) token.count,
-                                token.data);
-                        exit(1);
-                    }
-                }
-            }
+static Err br_fiber_switch(ByteRunner *br, uint64_t id) {
+    // The stacks are copied in and out instead of being pointed at, so a switch costs as much as the words
+    // the two fibers hold and the ByteRunner keeps its single fixed stack for everything else
+    BrFiber *current = &br->fibers[br->fiber];
+    if (current->state != BR_FIBER_DONE) {
+        Err err = br_fiber_reserve(current, br->stack_size);
+        if (err != ERR_OK) {
+            return err;
         }
+        memcpy(current->stack, br->stack, br->stack_size * sizeof(br->stack[0]));
+        current->stack_size = br->stack_size;
+        current->fp = br->fp;
+        current->ip = br->ip;
     }
 
-    // Replace label parameters with actual offset
-    for (size_t i = 0; i < basm->unresolved_jmp_size; i++) {
-        StringView label = basm->unresolved_jmps[i].label;
+    BrFiber *next = &br->fibers[id];
+    memcpy(br->stack, next->stack, next->stack_size * sizeof(br->stack[0]));
+    br->stack_size = next->stack_size;
+    br->fp = next->fp;
+    br->ip = next->ip;
+    next->state = BR_FIBER_RUNNING;
+    br->fiber = id;
+    return ERR_OK;
+}
 
-        if (!basm_resolve_label(basm, label, &basm->program[basm->unresolved_jmps[i].addr].operand)) {
-            fprintf(stderr, "%.*s: ERROR: Unknown label '%.*s'\n",
-                    (int) input_file_path.count,
-                    input_file_path.data,
-                    (int) label.count,
-                    label.data);
-            exit(1);
+static Err br_fiber_spawn(ByteRunner *br, InstAddr ip, Word argument, uint64_t *id) {
+    if (br->fibers_size == 0 || br->fibers_size == br->fibers_capacity) {
+        size_t capacity = br->fibers_capacity > 0 ? br->fibers_capacity * 2 : 16;
+        BrFiber *fibers = realloc(br->fibers, capacity * sizeof(fibers[0]));
+        if (fibers == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        br->fibers = fibers;
+        uint64_t *ready = malloc(capacity * sizeof(ready[0]));
+        if (ready == NULL) {
+            return ERR_OUT_OF_MEMORY;
         }
-    }
 
-    // Replace entry point label with instruction offset
-    if (!basm->has_entry && entry_label.count != 0) {
-        if (basm_resolve_label(basm, entry_label, &entry)) {
-            basm->entry = entry.as_u64;
-            basm->has_entry = 1;
-        } else {
-            fprintf(stderr, "%.*s: ERROR: Unknown label '%.*s'\n",
-                    (int) input_file_path.count,
-                    input_file_path.data,
-                    (int) entry_label.count,
-                    entry_label.data);
-            exit(1);
+        for (size_t i = 0; i < br->ready_size; i++) {
+            ready[i] = br->ready[(br->ready_begin + i) % br->fibers_capacity];
         }
+        free(br->ready);
+        br->ready = ready;
+        br->ready_begin = 0;
+        br->fibers_capacity = capacity;
+    }
+
+    if (br->fibers_size == 0) {
+        br->fibers[0] = (BrFiber) {
+                .state = BR_FIBER_RUNNING,
+                .joining = BR_FIBER_NONE,
+                .waiters = BR_FIBER_NONE,
+                .next_waiter = BR_FIBER_NONE,
+        };
+        br->fibers_size = 1;
+        br->fiber = 0;
+    }
+
+    Word *stack = malloc(4 * sizeof(stack[0]));
+    if (stack == NULL) {
+        return ERR_OUT_OF_MEMORY;
     }
+
+    *id = br->fibers_size++;
+    br->fibers[*id] = (BrFiber) {
+            .state = BR_FIBER_READY,
+            .ip = ip,
+            .joining = BR_FIBER_NONE,
+            .waiters = BR_FIBER_NONE,
+            .next_waiter = BR_FIBER_NONE,
+            .stack = stack,
+            .stack_size = 1,
+            .stack_capacity = 4,
+    };
+    stack[0] = argument;
+    br_fiber_enqueue(br, *id);
+
+    return ERR_OK;
 }
 
-int basm_resolve_label(const Basm *basm, StringView name, Word *output) {
-    for (size_t i = 0; i < basm->labels_size; i++) {
-        if (sv_eq(basm->labels[i].name, name)) {
-            *output = basm->labels[i].word;
+static int br_fiber_waits_for(const ByteRunner *br, uint64_t id, uint64_t other) {
+    for (; br->fibers[id].state == BR_FIBER_JOINING; id = br->fibers[id].joining) {
+        if (br->fibers[id].joining == other) {
             return 1;
         }
     }
@@ -1128,191 +4093,402 @@ int basm_resolve_label(const Basm *basm, StringView name, Word *output) {
     return 0;
 }
 
-int basm_bind_label(Basm *basm, StringView name, Word word) {
-    assert(basm->labels_size < BR_LABEL_CAPACITY);
-
-    Word ignore = {0};
-    if (basm_resolve_label(basm, name, &ignore)) {
-        return 0;
+static Err br_fiber_finish(ByteRunner *br) {
+    // The top of the stack is the result, every fiber joining this one gets it pushed and runs again
+    BrFiber *fiber = &br->fibers[br->fiber];
+    fiber->state = BR_FIBER_DONE;
+    br->channel_waits = 0;
+    fiber->result = br->stack_size > 0 ? br->stack[br->stack_size - 1] : (Word) {.as_u64 = 0};
+    free(fiber->stack);
+    fiber->stack = NULL;
+    fiber->stack_size = 0;
+    fiber->stack_capacity = 0;
+
+    for (uint64_t id = fiber->waiters; id != BR_FIBER_NONE; id = br->fibers[id].next_waiter) {
+        BrFiber *waiter = &br->fibers[id];
+        Err err = br_fiber_reserve(waiter, waiter->stack_size + 1);
+        if (err != ERR_OK) {
+            return err;
+        }
+        waiter->stack[waiter->stack_size++] = fiber->result;
+        waiter->state = BR_FIBER_READY;
+        waiter->joining = BR_FIBER_NONE;
+        br_fiber_enqueue(br, id);
     }
+    fiber->waiters = BR_FIBER_NONE;
 
-    basm->labels[basm->labels_size++] = (Label) {.name = name, .word = word};
-    return 1;
-}
-
-void basm_bind_unresolved(Basm *basm, InstAddr addr, StringView label) {
-    assert(basm->unresolved_jmp_size < BR_LABEL_CAPACITY);
-    basm->unresolved_jmps[basm->unresolved_jmp_size++] = (UnresolvedJmp) {.addr = addr, .label = label};
+    // Fiber 0 ends the program before the others, so somebody is always left to run
+    return br_fiber_switch(br, br_fiber_dequeue(br));
 }
 
-size_t basm_save_to_file(Basm *basm, const char *file_path) {
-    FILE *f = fopen(file_path, "wb");
-    size_t written_size = 0;
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
-        exit(1);
-    }
+#ifdef BR_THREADS
+static int br_thread_main(void *arg) {
+    BrThread *thread = arg;
+    thread->err = br_execute_program(&thread->br, -1);
 
-    BasmFileMeta meta = {
-            .magic = BR_FILE_MAGIC,
-            .version = BR_FILE_VERSION,
-            .program_size = basm->program_size,
-            .memory_size = basm->memory_size,
-            .memory_capacity = basm->memory_capacity,
-            .entry = basm->entry
-    };
+    // The threads a thread started end with it
+    br_release(&thread->br);
+    return 0;
+}
+#endif
 
-    written_size += fwrite(&meta, sizeof(meta), 1, f) * sizeof(meta);
-    if (ferror(f)) {
-        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
-        exit(1);
+static Err br_thread_start(ByteRunner *br, InstAddr ip, Word argument, uint64_t *id) {
+#ifdef BR_THREADS
+    if (br->threads_size == br->threads_capacity) {
+        size_t capacity = br->threads_capacity > 0 ? br->threads_capacity * 2 : 16;
+        BrThread **threads = realloc(br->threads, capacity * sizeof(threads[0]));
+        if (threads == NULL) {
+            return ERR_OUT_OF_MEMORY;
+        }
+        br->threads = threads;
+        br->threads_capacity = capacity;
     }
 
-    written_size += fwrite(basm->program, sizeof(basm->program[0]), basm->program_size, f) * sizeof(basm->program[0]);
-    if (ferror(f)) {
-        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
-        exit(1);
+    BrThread *thread = calloc(1, sizeof(*thread));
+    if (thread == NULL) {
+        return ERR_OUT_OF_MEMORY;
     }
-
-    written_size += fwrite(basm->memory, sizeof(basm->memory[0]), basm->memory_size, f) * sizeof(basm->memory[0]);
-    if (ferror(f)) {
-        fprintf(stderr, "ERROR: Could not write to file '%s' : %s\n", file_path, strerror(errno));
-        exit(1);
+    thread->br.program = br->program;
+    thread->br.program_size = br->program_size;
+    thread->br.memory = br->memory;
+    memcpy(thread->br.natives, br->natives, br->natives_size * sizeof(br->natives[0]));
+    memcpy(thread->br.native_contexts, br->native_contexts, br->natives_size * sizeof(br->native_contexts[0]));
+    thread->br.natives_size = br->natives_size;
+    memcpy(thread->br.channels, br->channels, br->channels_size * sizeof(br->channels[0]));
+    thread->br.channels_size = br->channels_size;
+    thread->br.ip = ip;
+    thread->br.stack[0] = argument;
+    thread->br.stack_size = 1;
+
+    if (thrd_create(&thread->handle, br_thread_main, thread) != thrd_success) {
+        free(thread);
+        return ERR_THREAD_FAILED;
     }
 
-    fclose(f);
-    return written_size;
+    *id = br->threads_size;
+    br->threads[br->threads_size++] = thread;
+    return ERR_OK;
+#else
+    (void) br;
+    (void) ip;
+    (void) argument;
+    (void) id;
+    return ERR_THREAD_FAILED;
+#endif
 }
 
+static Err br_thread_join(ByteRunner *br, uint64_t id, Word *result) {
+    if (id >= br->threads_size || br->threads[id] == NULL) {
+        return ERR_ILLEGAL_OPERAND;
+    }
+
+    BrThread *thread = br->threads[id];
+#ifdef BR_THREADS
+    thrd_join(thread->handle, NULL);
 #endif
-#ifdef BASM_VM
+    br->threads[id] = NULL;
 
-const char *err_as_cstr(Err err) {
-    switch (err) {
-        case ERR_OK:
-            return "ERR_OK";
-        case ERR_STACK_OVERFLOW:
-            return "ERR_STACK_OVERFLOW";
-        case ERR_STACK_UNDERFLOW:
-            return "ERR_STACK_UNDERFLOW";
-        case ERR_ILLEGAL_INS:
-            return "ERR_ILLEGAL_INS";
-        case ERR_DIV_BY_ZERO:
-            return "ERR_DIV_BY_ZERO";
-        case ERR_ILLEGAL_INS_ACCESS:
-            return "ERR_ILLEGAL_INS_ACCESS";
-        case ERR_ILLEGAL_OPERAND:
-            return "ERR_ILLEGAL_OPERAND";
-        case ERR_ILLEGAL_MEMORY_ACCESS:
-            return "ERR_ILLEGAL_MEMORY_ACCESS";
-        default:
-            assert(0 && "err_as_cstr: Unreachable");
-            break;
+    // An error in the thread becomes the error of the join
+    Err err = thread->err;
+    *result = thread->br.stack_size > 0 ? thread->br.stack[thread->br.stack_size - 1] : (Word) {.as_u64 = 0};
+    free(thread);
+    return err;
+}
+
+#define BR_ATOMIC_APPLY(type)                                                                   \
+    {                                                                                           \
+        _Atomic type *target = (_Atomic type *) (void *) location;                              \
+        type operand = (type) value;                                                            \
+        if (op == BR_ATOMIC_CAS) {                                                              \
+            atomic_compare_exchange_strong(target, &operand, (type) desired);                   \
+            return operand;                                                                     \
+        }                                                                                       \
+        return op == BR_ATOMIC_ADD ? atomic_fetch_add(target, operand) : atomic_exchange(target, operand); \
     }
 
-    return "";
+uint64_t br_atomic(BrAtomicOp op, uint8_t *location, uint64_t size, uint64_t value, uint64_t desired) {
+    // Returns the old value zero extended, a compare and swap only compares the low size bytes of value
+    switch (size) {
+        case 1: BR_ATOMIC_APPLY(uint8_t)
+        case 2: BR_ATOMIC_APPLY(uint16_t)
+        case 4: BR_ATOMIC_APPLY(uint32_t)
+        default: BR_ATOMIC_APPLY(uint64_t)
+    }
 }
 
-void br_load_program_from_file(ByteRunner *br, const char *file_path) {
-    FILE *f = fopen(file_path, "rb");
-    if (f == NULL) {
-        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", file_path, strerror(errno));
-        exit(1);
+#undef BR_ATOMIC_APPLY
+
+BrChannel *br_channel_new(uint64_t capacity) {
+    if (capacity > BR_CHANNEL_CAPACITY_MAX) {
+        return NULL;
     }
 
-    BasmFileMeta meta = {0};
-    size_t n = fread(&meta, sizeof(meta), 1, f);
-    if (n < 1) {
-        fprintf(stderr, "ERROR: Could not read meta data from file '%s': %s\n", file_path, strerror(errno));
-        exit(1);
+    uint64_t size = 2;
+    while (size < capacity) {
+        size *= 2;
     }
 
-    if (meta.magic != BR_FILE_MAGIC) {
-        fprintf(stderr, "ERROR: '%s' does not appear to be a valid file. "
-                        "Unexpected magic %04X. Expected %04X\n", file_path, meta.magic, BR_FILE_MAGIC);
-        exit(1);
+    BrChannel *channel = aligned_alloc(BR_CACHE_LINE_SIZE, sizeof(*channel));
+    if (channel == NULL) {
+        return NULL;
+    }
+    memset(channel, 0, sizeof(*channel));
+    channel->mask = size - 1;
+    channel->cells = malloc(size * sizeof(channel->cells[0]));
+    if (channel->cells == NULL) {
+        free(channel);
+        return NULL;
     }
 
-    if (meta.version != BR_FILE_VERSION) {
-        fprintf(stderr, "ERROR: Unsupported version %d, Expected version %d\n", meta.version, BR_FILE_VERSION);
-        exit(1);
+#ifdef BR_THREADS
+    if (mtx_init(&channel->lock, mtx_plain) != thrd_success) {
+        free(channel->cells);
+        free(channel);
+        return NULL;
+    }
+    if (cnd_init(&channel->changed) != thrd_success) {
+        mtx_destroy(&channel->lock);
+        free(channel->cells);
+        free(channel);
+        return NULL;
     }
+    atomic_init(&channel->sleepers, 0);
+#endif
 
-    if (meta.program_size > BR_PROGRAM_CAPACITY) {
-        fprintf(stderr,
-                "ERROR: '%s': program section is too large. The file contains %" PRIu64 " program instructions. But the capacity is %"  PRIu64 "\n",
-                file_path, meta.program_size, (uint64_t) BR_PROGRAM_CAPACITY);
-        exit(1);
+    for (uint64_t i = 0; i < size; i++) {
+        atomic_init(&channel->cells[i].sequence, i);
     }
+    atomic_init(&channel->head, 0);
+    atomic_init(&channel->tail, 0);
 
-    br->ip = meta.entry;
+    return channel;
+}
 
-    if (meta.memory_capacity > BR_MEMORY_CAPACITY) {
-        fprintf(stderr,
-                "ERROR: '%s': memory section is too large. The file wants %" PRIu64 "bytes. But the capacity is %"  PRIu64 "bytes \n",
-                file_path, meta.memory_capacity, (uint64_t) BR_MEMORY_CAPACITY);
-        exit(1);
-    }
+void br_channel_free(BrChannel *channel) {
+#ifdef BR_THREADS
+    cnd_destroy(&channel->changed);
+    mtx_destroy(&channel->lock);
+#endif
+    free(channel->cells);
+    free(channel);
+}
 
-    if (meta.memory_size > meta.memory_capacity) {
-        fprintf(stderr,
-                "ERROR: '%s': memory size %" PRIu64 " is greater than the declared memory capacity %" PRIu64 "\n",
-                file_path, meta.memory_size, meta.memory_capacity);
-        exit(1);
+static void br_channel_notify(BrChannel *channel) {
+#ifdef BR_THREADS
+    // Pairs with the fence in br_channel_park, either the sleeper sees this message or this sees the sleeper
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&channel->sleepers, memory_order_relaxed) > 0) {
+        mtx_lock(&channel->lock);
+        cnd_broadcast(&channel->changed);
+        mtx_unlock(&channel->lock);
     }
+#else
+    (void) channel;
+#endif
+}
 
-    br->program_size = fread(br->program, sizeof(br->program[0]), meta.program_size, f);
+int br_channel_try_send(BrChannel *channel, Word value) {
+    uint64_t tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+    for (;;) {
+        BrChannelCell *cell = &channel->cells[tail & channel->mask];
+        uint64_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+        if (sequence == tail) {
+            // The cell is free, it is ours once the tail moves past it
+            if (atomic_compare_exchange_weak_explicit(&channel->tail, &tail, tail + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                cell->value = value;
+                atomic_store_explicit(&cell->sequence, tail + 1, memory_order_release);
+                br_channel_notify(channel);
+                return 1;
+            }
+        } else if (sequence < tail) {
+            // The cell still holds the message from a lap ago, the channel is full
+            return 0;
+        } else {
+            tail = atomic_load_explicit(&channel->tail, memory_order_relaxed);
+        }
+    }
+}
 
-    if (br->program_size != meta.program_size) {
-        fprintf(stderr, "ERROR: '%s', read %zd program instructions, but expected %" PRIu64 "\n",
-                file_path, br->program_size, meta.program_size);
+int br_channel_try_recv(BrChannel *channel, Word *value) {
+    uint64_t head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+    for (;;) {
+        BrChannelCell *cell = &channel->cells[head & channel->mask];
+        uint64_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+
+        if (sequence == head + 1) {
+            if (atomic_compare_exchange_weak_explicit(&channel->head, &head, head + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                *value = cell->value;
+                // Frees the cell for the send one lap ahead
+                atomic_store_explicit(&cell->sequence, head + channel->mask + 1, memory_order_release);
+                br_channel_notify(channel);
+                return 1;
+            }
+        } else if (sequence < head + 1) {
+            // Nothing was sent into this cell yet, the channel is empty
+            return 0;
+        } else {
+            head = atomic_load_explicit(&channel->head, memory_order_relaxed);
+        }
     }
+}
 
-    n = fread(br->memory, sizeof(br->memory[0]), meta.memory_size, f);
+uint64_t br_attach_channel(ByteRunner *br, BrChannel *channel) {
+    assert(br->channels_size < BR_CHANNELS_CAPACITY);
+    br->channels[br->channels_size] = channel;
+    return br->channels_size++;
+}
 
-    if (n != meta.memory_size) {
-        fprintf(stderr, "ERROR: '%s', read %zd bytes of memory section, but expected %" PRIu64 " bytes\n",
-                file_path, n, meta.memory_size);
+void br_free_channels(ByteRunner *br) {
+    while (br->owned_channels != NULL) {
+        BrChannel *channel = br->owned_channels;
+        br->owned_channels = channel->next_owned;
+        br_channel_free(channel);
     }
+    br->channels_size = 0;
+}
 
-
-    fclose(f);
+void br_release(ByteRunner *br) {
+    br_free_threads(br);
+    br_free_fibers(br);
+    br_free_channels(br);
+    free(br->run_lengths);
+    br->run_lengths = NULL;
 }
 
-void br_push_native(ByteRunner *br, Br_Native native) {
-    assert(br->natives_size < BR_NATIVE_CAPACITY);
-    br->natives[br->natives_size++] = native;
+static Err br_channel_get(const ByteRunner *br, uint64_t id, BrChannel **channel) {
+    if (id >= br->channels_size) {
+        return ERR_ILLEGAL_OPERAND;
+    }
+
+    *channel = br->channels[id];
+    return ERR_OK;
 }
 
-void br_dump_stack(FILE *stream, const ByteRunner *br) {
-    fprintf(stream, "Stack:\n");
-    if (br->stack_size > 0) {
-        for (InstAddr i = 0; i < br->stack_size; i++) {
-            fprintf(stream, "  u64: %-20" PRIu64 "|   i64: %-20" PRId64 "|   f64: %-25lf|   ptr: %-20p\n",
-                    br->stack[i].as_u64,
-                    br->stack[i].as_i64,
-                    br->stack[i].as_f64,
-                    br->stack[i].as_ptr
-            );
+#ifdef BR_THREADS
+static void br_channel_park(BrChannel *channel, int sending) {
+    mtx_lock(&channel->lock);
+    atomic_fetch_add_explicit(&channel->sleepers, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+
+    // The cell the next send or recv goes through tells whether it would get through now
+    uint64_t position = atomic_load_explicit(sending ? &channel->tail : &channel->head, memory_order_relaxed);
+    uint64_t sequence = atomic_load_explicit(&channel->cells[position & channel->mask].sequence, memory_order_acquire);
+    if (sequence < position + (sending ? 0 : 1)) {
+        // The other fibers of the VM may wait on other channels, which do not wake this one
+        struct timespec deadline = {0};
+        timespec_get(&deadline, TIME_UTC);
+        deadline.tv_nsec += 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
         }
-    } else {
-        fprintf(stream, "  [EMPTY]\n");
+        cnd_timedwait(&channel->changed, &channel->lock, &deadline);
     }
 
+    atomic_fetch_sub_explicit(&channel->sleepers, 1, memory_order_relaxed);
+    mtx_unlock(&channel->lock);
 }
+#endif
 
-Err br_execute_program(ByteRunner *br, int limit) {
-    while (limit != 0 && !br->halt) {
-        Err err = br_execute_inst(br);
+static Err br_channel_wait(ByteRunner *br, BrChannel *channel, int sending) {
+    // The instruction runs again once the other fibers, and the thread on the other end, had the chance to make
+    // room. When every ready fiber waited since anything got anywhere, the thread sleeps until the channel
+    // changes instead of spinning
+    br->channel_waits++;
+#ifdef BR_THREADS
+    if (br->channel_waits > br->ready_size) {
+        br_channel_park(channel, sending);
+        br->channel_waits = 0;
+    }
+#else
+    (void) channel;
+    (void) sending;
+#endif
+
+    if (br->ready_size > 0) {
+        br->fibers[br->fiber].state = BR_FIBER_READY;
+        br_fiber_enqueue(br, br->fiber);
+        Err err = br_fiber_switch(br, br_fiber_dequeue(br));
         if (err != ERR_OK) {
             return err;
         }
+    }
+    return ERR_OK;
+}
 
-        if (limit > 0) {
-            limit--;
+static Err br_execute_atomic(ByteRunner *br, BrAtomicOp op, uint64_t size) {
+    uint64_t operands = op == BR_ATOMIC_CAS ? 3 : 2;
+    if (br->stack_size < operands) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    // Unlike the plain writes the whole location is checked, and it must be aligned to be updated atomically
+    Word *args = &br->stack[br->stack_size - operands];
+    if (args[0].as_u64 > BR_MEMORY_CAPACITY - size || args[0].as_u64 % size != 0) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    args[0].as_u64 = br_atomic(op, &br->memory[args[0].as_u64], size, args[1].as_u64,
+                               operands == 3 ? args[2].as_u64 : 0);
+    br->stack_size -= operands - 1;
+    br->ip++;
+    return ERR_OK;
+}
+
+static Err br_execute_addressed(ByteRunner *br, Inst inst) {
+    // The operands are the base, the index of the `.idx` forms and the value of the writes, in that order
+    uint64_t operands = inst_stack_pops(inst.type);
+    if (br->stack_size < operands) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    Word *args = &br->stack[br->stack_size - operands];
+    InstType form = inst_memory_form(inst.type);
+    uint64_t width = inst_memory_width(form);
+    MemoryAddr addr = args[0].as_u64 + inst.operand.as_u64;
+    if (inst.type == inst_indexed_form(form)) {
+        addr = args[0].as_u64 + (args[1].as_u64 << BR_INDEX_SHIFT(inst.operand.as_u64))
+               + BR_INDEX_DISP(inst.operand.as_u64);
+    }
+
+    if (form == INST_READ8 || form == INST_READ16 || form == INST_READ32 || form == INST_READ64) {
+        if (addr >= BR_MEMORY_CAPACITY - (width - 1)) {
+            return ERR_ILLEGAL_MEMORY_ACCESS;
+        }
+
+        if (width == 1) {
+            args[0].as_u64 = br->memory[addr];
+        } else if (width == 2) {
+            args[0].as_u64 = *(uint16_t *) &br->memory[addr];
+        } else if (width == 4) {
+            args[0].as_u64 = *(uint32_t *) &br->memory[addr];
+        } else {
+            args[0].as_u64 = *(uint64_t *) &br->memory[addr];
+        }
+        br->stack_size -= operands - 1;
+    } else {
+        // Like the plain writes only the first byte is checked
+        if (addr >= BR_MEMORY_CAPACITY) {
+            return ERR_ILLEGAL_MEMORY_ACCESS;
         }
+
+        uint64_t value = args[operands - 1].as_u64;
+        if (width == 1) {
+            br->memory[addr] = (uint8_t) value;
+        } else if (width == 2) {
+            *(uint16_t *) &br->memory[addr] = (uint16_t) value;
+        } else if (width == 4) {
+            *(uint32_t *) &br->memory[addr] = (uint32_t) value;
+        } else {
+            *(uint64_t *) &br->memory[addr] = value;
+        }
+        br->stack_size -= operands;
     }
 
+    br->ip++;
     return ERR_OK;
 }
 
@@ -1353,17 +4529,21 @@ Err br_execute_inst(ByteRunner *br) {
         case INST_ANDB: BINARY_OP(br, u64, u64, &)
         case INST_ORB: BINARY_OP(br, u64, u64, |)
         case INST_XOR: BINARY_OP(br, u64, u64, ^)
-        case INST_SHR: BINARY_OP(br, u64, u64, >>)
-        case INST_SHL: BINARY_OP(br, u64, u64, <<)
+        case INST_SHR: BINARY_BITS_OP(br, br_shr)
+        case INST_SHL: BINARY_BITS_OP(br, br_shl)
         case INST_PLUSI: BINARY_OP(br, u64, u64, +)
         case INST_MINUSI: BINARY_OP(br, u64, u64, -)
         case INST_MULTI: BINARY_OP(br, u64, u64, *)
         case INST_DIVI:
-            if (br->stack[br->stack_size - 1].as_u64 == 0) {
+            if (br->stack_size >= 2 && br->stack[br->stack_size - 1].as_u64 == 0) {
                 return ERR_DIV_BY_ZERO;
             }
             BINARY_OP(br, u64, u64, /)
-        case INST_MODI: BINARY_OP(br, u64, u64, %)
+        case INST_MODI:
+            if (br->stack_size >= 2 && br->stack[br->stack_size - 1].as_u64 == 0) {
+                return ERR_DIV_BY_ZERO;
+            }
+            BINARY_OP(br, u64, u64, %)
         case INST_EQI: BINARY_OP(br, u64, u64, ==)
         case INST_GEI: BINARY_OP(br, u64, u64, >=)
         case INST_GI: BINARY_OP(br, u64, u64, >)
@@ -1380,20 +4560,93 @@ Err br_execute_inst(ByteRunner *br) {
         case INST_LEF: BINARY_OP(br, f64, u64, <=)
         case INST_LF: BINARY_OP(br, f64, u64, <)
         case INST_NEF: BINARY_OP(br, f64, u64, !=)
+        case INST_ANDB_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, &)
+        case INST_ORB_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, |)
+        case INST_XOR_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, ^)
+        case INST_SHR_IMM: BINARY_IMM_OP(br, WORD_U64(inst.operand.as_u64 & 63), u64, u64, >>)
+        case INST_SHL_IMM: BINARY_IMM_OP(br, WORD_U64(inst.operand.as_u64 & 63), u64, u64, <<)
+        case INST_PLUSI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, +)
+        case INST_MINUSI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, -)
+        case INST_MULTI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, *)
+        case INST_DIVI_IMM:
+            if (inst.operand.as_u64 == 0) {
+                return ERR_DIV_BY_ZERO;
+            }
+            BINARY_IMM_OP(br, inst.operand, u64, u64, /)
+        case INST_MODI_IMM:
+            if (inst.operand.as_u64 == 0) {
+                return ERR_DIV_BY_ZERO;
+            }
+            BINARY_IMM_OP(br, inst.operand, u64, u64, %)
+        case INST_EQI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, ==)
+        case INST_GEI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, >=)
+        case INST_GI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, >)
+        case INST_LEI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, <=)
+        case INST_LI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, <)
+        case INST_NEI_IMM: BINARY_IMM_OP(br, inst.operand, u64, u64, !=)
+        case INST_PLUSF_IMM: BINARY_IMM_OP(br, inst.operand, f64, f64, +)
+        case INST_MINUSF_IMM: BINARY_IMM_OP(br, inst.operand, f64, f64, -)
+        case INST_MULTF_IMM: BINARY_IMM_OP(br, inst.operand, f64, f64, *)
+        case INST_DIVF_IMM: BINARY_IMM_OP(br, inst.operand, f64, f64, /)
+        case INST_EQF_IMM: BINARY_IMM_OP(br, inst.operand, f64, u64, ==)
+        case INST_GEF_IMM: BINARY_IMM_OP(br, inst.operand, f64, u64, >=)
+        case INST_GF_IMM: BINARY_IMM_OP(br, inst.operand, f64, u64, >)
+        case INST_LEF_IMM: BINARY_IMM_OP(br, inst.operand, f64, u64, <=)
+        case INST_LF_IMM: BINARY_IMM_OP(br, inst.operand, f64, u64, <)
+        case INST_NEF_IMM: BINARY_IMM_OP(br, inst.operand, f64, u64, !=)
         case INST_CALL:
             if (br->stack_size >= BR_STACK_CAPACITY) {
                 return ERR_STACK_OVERFLOW;
             }
 
-            br->stack[br->stack_size++].as_u64 = br->ip;
-            br->ip = inst.operand.as_u64;
+            br->stack[br->stack_size++].as_u64 = br->ip;
+            br->ip = inst.operand.as_u64;
+            break;
+        case INST_CALLR: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            // The target makes room for the return address
+            InstAddr target = br->stack[br->stack_size - 1].as_u64;
+            br->stack[br->stack_size - 1].as_u64 = br->ip;
+            br->ip = target;
+            break;
+        }
+        case INST_JMPTABLE: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+            MemoryAddr table = inst.operand.as_u64;
+            if (table >= BR_MEMORY_CAPACITY - 7) {
+                return ERR_ILLEGAL_MEMORY_ACCESS;
+            }
+
+            // An index past the entries falls through to the next instruction
+            uint64_t index = br->stack[br->stack_size - 1].as_u64;
+            if (index < *(uint64_t *) &br->memory[table]) {
+                if (index >= BR_JMPTABLE_LIMIT(table)) {
+                    return ERR_ILLEGAL_MEMORY_ACCESS;
+                }
+                br->ip = *(uint64_t *) &br->memory[table + BR_WORD_SIZE + index * BR_WORD_SIZE];
+            } else {
+                br->ip++;
+            }
+            br->stack_size--;
             break;
-        case INST_INT:
-            if (inst.operand.as_u64 > br->natives_size) {
+        }
+        case INST_INT: {
+            if (inst.operand.as_u64 >= br->natives_size) {
                 return ERR_ILLEGAL_OPERAND;
             }
-            br->natives[inst.operand.as_u64](br);
+
+            br->native_context = br->native_contexts[inst.operand.as_u64];
+            Err err = br->natives[inst.operand.as_u64](br);
+            if (err != ERR_OK) {
+                return err;
+            }
             br->ip++;
+        }
             break;
         case INST_JMP:
             br->ip = inst.operand.as_u64;
@@ -1452,8 +4705,252 @@ Err br_execute_inst(ByteRunner *br) {
             br->stack[b] = t;
             br->ip++;
             break;
+        case INST_ENTER:
+            if (inst.operand.as_u64 >= BR_STACK_CAPACITY - br->stack_size) {
+                return ERR_STACK_OVERFLOW;
+            }
+
+            br->stack[br->stack_size++].as_u64 = br->fp;
+            br->fp = br->stack_size;
+            memset(&br->stack[br->stack_size], 0, inst.operand.as_u64 * sizeof(br->stack[0]));
+            br->stack_size += inst.operand.as_u64;
+            br->ip++;
+            break;
+        case INST_LEAVE:
+            if (br->fp == 0 || br->fp > br->stack_size || br->stack[br->fp - 1].as_u64 >= br->fp) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            br->stack_size = br->fp - 1;
+            br->fp = br->stack[br->stack_size].as_u64;
+            br->ip++;
+            break;
+        case INST_LOAD_LOCAL: {
+            if (br->stack_size >= BR_STACK_CAPACITY) {
+                return ERR_STACK_OVERFLOW;
+            }
+
+            // The offset is signed, a slot below the stack wraps around and fails the same compare
+            const uint64_t index = br->fp + inst.operand.as_u64;
+            if (index >= br->stack_size) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            br->stack[br->stack_size] = br->stack[index];
+            br->stack_size++;
+            br->ip++;
+        }
+            break;
+        case INST_STORE_LOCAL: {
+            const uint64_t index = br->fp + inst.operand.as_u64;
+            if (br->stack_size < 1 || index >= br->stack_size - 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            br->stack[index] = br->stack[br->stack_size - 1];
+            br->stack_size--;
+            br->ip++;
+        }
+            break;
+        case INST_SPAWN: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            uint64_t id = 0;
+            Err err = br_fiber_spawn(br, inst.operand.as_u64, br->stack[br->stack_size - 1], &id);
+            if (err != ERR_OK) {
+                return err;
+            }
+            br->stack[br->stack_size - 1].as_u64 = id;
+            br->ip++;
+        }
+            break;
+        case INST_YIELD:
+            br->ip++;
+            br->channel_waits = 0;
+            if (br->ready_size > 0) {
+                br->fibers[br->fiber].state = BR_FIBER_READY;
+                br_fiber_enqueue(br, br->fiber);
+                return br_fiber_switch(br, br_fiber_dequeue(br));
+            }
+            break;
+        case INST_JOIN: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            uint64_t id = br->stack[br->stack_size - 1].as_u64;
+            if (id >= br->fibers_size) {
+                return id == 0 ? ERR_DEADLOCK : ERR_ILLEGAL_OPERAND;
+            }
+
+            if (br->fibers[id].state == BR_FIBER_DONE) {
+                br->stack[br->stack_size - 1] = br->fibers[id].result;
+                br->ip++;
+                break;
+            }
+
+            if (id == br->fiber || br_fiber_waits_for(br, id, br->fiber)) {
+                return ERR_DEADLOCK;
+            }
+
+            BrFiber *self = &br->fibers[br->fiber];
+            self->state = BR_FIBER_JOINING;
+            self->joining = id;
+            self->next_waiter = br->fibers[id].waiters;
+            br->fibers[id].waiters = br->fiber;
+
+            br->stack_size--;
+            br->ip++;
+            return br_fiber_switch(br, br_fiber_dequeue(br));
+        }
+        case INST_THREAD: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            uint64_t id = 0;
+            Err err = br_thread_start(br, inst.operand.as_u64, br->stack[br->stack_size - 1], &id);
+            if (err != ERR_OK) {
+                return err;
+            }
+
+            br->stack[br->stack_size - 1].as_u64 = id;
+            br->ip++;
+        }
+            break;
+        case INST_TJOIN: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            Err err = br_thread_join(br, br->stack[br->stack_size - 1].as_u64, &br->stack[br->stack_size - 1]);
+            if (err != ERR_OK) {
+                return err;
+            }
+
+            br->ip++;
+        }
+            break;
+        case INST_CAS8:
+            return br_execute_atomic(br, BR_ATOMIC_CAS, 1);
+        case INST_CAS16:
+            return br_execute_atomic(br, BR_ATOMIC_CAS, 2);
+        case INST_CAS32:
+            return br_execute_atomic(br, BR_ATOMIC_CAS, 4);
+        case INST_CAS64:
+            return br_execute_atomic(br, BR_ATOMIC_CAS, 8);
+        case INST_XADD8:
+            return br_execute_atomic(br, BR_ATOMIC_ADD, 1);
+        case INST_XADD16:
+            return br_execute_atomic(br, BR_ATOMIC_ADD, 2);
+        case INST_XADD32:
+            return br_execute_atomic(br, BR_ATOMIC_ADD, 4);
+        case INST_XADD64:
+            return br_execute_atomic(br, BR_ATOMIC_ADD, 8);
+        case INST_XCHG8:
+            return br_execute_atomic(br, BR_ATOMIC_XCHG, 1);
+        case INST_XCHG16:
+            return br_execute_atomic(br, BR_ATOMIC_XCHG, 2);
+        case INST_XCHG32:
+            return br_execute_atomic(br, BR_ATOMIC_XCHG, 4);
+        case INST_XCHG64:
+            return br_execute_atomic(br, BR_ATOMIC_XCHG, 8);
+        case INST_FENCE:
+            atomic_thread_fence(memory_order_seq_cst);
+            br->ip++;
+            break;
+        case INST_CHAN: {
+            if (br->stack_size >= BR_STACK_CAPACITY) {
+                return ERR_STACK_OVERFLOW;
+            }
+
+            if (inst.operand.as_u64 == 0 || inst.operand.as_u64 > BR_CHANNEL_CAPACITY_MAX
+                || br->channels_size >= BR_CHANNELS_CAPACITY) {
+                return ERR_ILLEGAL_OPERAND;
+            }
+
+            BrChannel *channel = br_channel_new(inst.operand.as_u64);
+            if (channel == NULL) {
+                return ERR_OUT_OF_MEMORY;
+            }
+            channel->next_owned = br->owned_channels;
+            br->owned_channels = channel;
+
+            br->stack[br->stack_size++].as_u64 = br_attach_channel(br, channel);
+            br->ip++;
+        }
+            break;
+        case INST_SEND:
+        case INST_TRYSEND: {
+            if (br->stack_size < 2) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            BrChannel *channel = NULL;
+            Err err = br_channel_get(br, br->stack[br->stack_size - 2].as_u64, &channel);
+            if (err != ERR_OK) {
+                return err;
+            }
+
+            int sent = br_channel_try_send(channel, br->stack[br->stack_size - 1]);
+            if (sent) {
+                br->channel_waits = 0;
+            }
+
+            if (inst.type == INST_TRYSEND) {
+                br->stack[br->stack_size - 2].as_u64 = (uint64_t) sent;
+                br->stack_size--;
+            } else if (sent) {
+                br->stack_size -= 2;
+            } else {
+                return br_channel_wait(br, channel, 1);
+            }
+
+            br->ip++;
+        }
+            break;
+        case INST_RECV:
+        case INST_TRYRECV: {
+            if (br->stack_size < 1) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            if (inst.type == INST_TRYRECV && br->stack_size >= BR_STACK_CAPACITY) {
+                return ERR_STACK_OVERFLOW;
+            }
+
+            BrChannel *channel = NULL;
+            Err err = br_channel_get(br, br->stack[br->stack_size - 1].as_u64, &channel);
+            if (err != ERR_OK) {
+                return err;
+            }
+
+            Word value = {0};
+            int received = br_channel_try_recv(channel, &value);
+            if (received) {
+                br->channel_waits = 0;
+            }
+
+            if (inst.type == INST_TRYRECV) {
+                br->stack[br->stack_size - 1] = value;
+                br->stack[br->stack_size++].as_u64 = (uint64_t) received;
+            } else if (received) {
+                br->stack[br->stack_size - 1] = value;
+            } else {
+                return br_channel_wait(br, channel, 0);
+            }
+
+            br->ip++;
+        }
+            break;
         case INST_HALT:
-            br->halt = 1;
+            if (br->fiber == 0) {
+                br->halt = 1;
+            } else {
+                return br_fiber_finish(br);
+            }
             break;
         case INST_READ8: {
             if (br->stack_size < 1) {
@@ -1563,12 +5060,85 @@ Err br_execute_inst(ByteRunner *br) {
             br->ip++;
             break;
         }
+        case INST_READ8_DISP:
+        case INST_READ16_DISP:
+        case INST_READ32_DISP:
+        case INST_READ64_DISP:
+        case INST_WRITE8_DISP:
+        case INST_WRITE16_DISP:
+        case INST_WRITE32_DISP:
+        case INST_WRITE64_DISP:
+        case INST_READ8_IDX:
+        case INST_READ16_IDX:
+        case INST_READ32_IDX:
+        case INST_READ64_IDX:
+        case INST_WRITE8_IDX:
+        case INST_WRITE16_IDX:
+        case INST_WRITE32_IDX:
+        case INST_WRITE64_IDX:
+            return br_execute_addressed(br, inst);
         case INST_I2F: CAST_OP(br, i64, f64, (double))
         case INST_I2U: CAST_OP(br, i64, u64, (uint64_t))
         case INST_U2F: CAST_OP(br, u64, f64, (double))
         case INST_U2I: CAST_OP(br, u64, i64, (int32_t))
         case INST_F2I: CAST_OP(br, f64, i64, (int64_t))
         case INST_F2U: CAST_OP(br, f64, u64, (uint64_t) (int64_t))
+        case INST_SQRTF: MATH_OP(br, sqrt)
+        case INST_ABSF: MATH_OP(br, fabs)
+        case INST_FLOORF: MATH_OP(br, floor)
+        case INST_CEILF: MATH_OP(br, ceil)
+        case INST_ROUNDF: MATH_OP(br, round)
+        case INST_SINF: MATH_OP(br, sin)
+        case INST_COSF: MATH_OP(br, cos)
+        case INST_EXPF: MATH_OP(br, exp)
+        case INST_LOGF: MATH_OP(br, log)
+        case INST_POPCNT: BITS_OP(br, br_popcnt)
+        case INST_CLZ: BITS_OP(br, br_clz)
+        case INST_CTZ: BITS_OP(br, br_ctz)
+        case INST_BSWAP: BITS_OP(br, br_bswap)
+        case INST_ROTL: BINARY_BITS_OP(br, br_rotl)
+        case INST_ROTR: BINARY_BITS_OP(br, br_rotr)
+        case INST_MULHU: BINARY_BITS_OP(br, br_mulhu)
+        case INST_MULHI: BINARY_BITS_OP(br, br_mulhi)
+        case INST_SEXT8: CAST_OP(br, u64, i64, (int8_t))
+        case INST_SEXT16: CAST_OP(br, u64, i64, (int16_t))
+        case INST_SEXT32: CAST_OP(br, u64, i64, (int32_t))
+        // minsd and maxsd return the second operand on a NaN or a tie, the VM matches them
+        case INST_MINF: {
+            if (br->stack_size < 2) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            const double lhs = br->stack[br->stack_size - 2].as_f64;
+            const double rhs = br->stack[br->stack_size - 1].as_f64;
+            br->stack[br->stack_size - 2].as_f64 = lhs < rhs ? lhs : rhs;
+            br->stack_size--;
+            br->ip++;
+            break;
+        }
+        case INST_MAXF: {
+            if (br->stack_size < 2) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            const double lhs = br->stack[br->stack_size - 2].as_f64;
+            const double rhs = br->stack[br->stack_size - 1].as_f64;
+            br->stack[br->stack_size - 2].as_f64 = lhs > rhs ? lhs : rhs;
+            br->stack_size--;
+            br->ip++;
+            break;
+        }
+        case INST_FMAF: {
+            if (br->stack_size < 3) {
+                return ERR_STACK_UNDERFLOW;
+            }
+
+            Word *args = &br->stack[br->stack_size - 3];
+            args[0].as_f64 = fma(args[0].as_f64, args[1].as_f64, args[2].as_f64);
+            br->stack_size -= 2;
+            br->ip++;
+            break;
+        }
         case SIZE:
         default:
             return ERR_ILLEGAL_INS;
@@ -1578,3 +5148,278 @@ Err br_execute_inst(ByteRunner *br) {
 }
 
 #endif
+
+#ifdef BASM_CACHE
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <utime.h>
+#include <unistd.h>
+
+typedef struct {
+    char name[64];
+    uint64_t size;
+    time_t mtime;
+} BasmCacheEntry;
+
+uint64_t basm_hash_source(Basm *basm, MManager *manager, StringView file_path, uint64_t hash, size_t level) {
+    StringView source = basm_slurp_file(basm, manager, file_path);
+    uint64_t count = source.count;
+    hash = basm_hash_bytes(hash, &count, sizeof(count));
+    hash = basm_hash_bytes(hash, source.data, source.count);
+
+    // Follow the includes the same way basm_translate_source does, translation reports the errors
+    while (source.count > 0) {
+        StringView line = sv_trim(sv_chop_line(&source));
+        StringView token = sv_trim(sv_chop_by_delim(&line, ' '));
+
+        if (sv_eq(token, cstr_as_sv("%include"))) {
+            line = sv_trim(line);
+            if (line.count >= 2 && *line.data == '"' && line.data[line.count - 1] == '"'
+                && level + 1 < BR_ASSEMBLY_MAX_INCLUDE_LEVEL) {
+                line.data++;
+                line.count -= 2;
+                hash = basm_hash_source(basm, manager, line, hash, level + 1);
+            }
+        }
+    }
+
+    return hash;
+}
+
+static long basm_cache_copy_file(const char *from, const char *to) {
+    FILE *in = fopen(from, "rb");
+    if (in == NULL) {
+        return -1;
+    }
+
+    FILE *out = fopen(to, "wb");
+    if (out == NULL) {
+        fclose(in);
+        return -1;
+    }
+
+    char buffer[64 * 1024];
+    long copied = 0;
+    size_t n = 0;
+    while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0) {
+        if (fwrite(buffer, 1, n, out) != n) {
+            copied = -1;
+            break;
+        }
+        copied += (long) n;
+    }
+
+    if (ferror(in)) {
+        copied = -1;
+    }
+
+    fclose(in);
+    if (fclose(out) != 0) {
+        copied = -1;
+    }
+
+    return copied;
+}
+
+static int basm_cache_entry_compare(const void *a, const void *b) {
+    const BasmCacheEntry *x = a;
+    const BasmCacheEntry *y = b;
+
+    if (x->mtime != y->mtime) {
+        return x->mtime < y->mtime ? -1 : 1;
+    }
+
+    return strcmp(x->name, y->name);
+}
+
+void basm_cache_open(BasmCache *cache, const char *dir, uint64_t limit) {
+    cache->dir = dir;
+    cache->limit = limit;
+    cache->hits = 0;
+    cache->misses = 0;
+    cache->bytes_saved = 0;
+
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "ERROR: Could not create cache directory '%s' : %s\n", dir, strerror(errno));
+        exit(1);
+    }
+
+    char path[BASM_CACHE_PATH_CAPACITY];
+    snprintf(path, sizeof(path), "%s/%s", dir, BASM_CACHE_STATS_FILE);
+
+    FILE *f = fopen(path, "r");
+    if (f != NULL) {
+        struct flock lock = {.l_type = F_RDLCK, .l_whence = SEEK_SET};
+        if (fcntl(fileno(f), F_SETLKW, &lock) < 0
+            || fscanf(f, "hits %" SCNu64 " misses %" SCNu64 " bytes_saved %" SCNu64,
+                      &cache->hits, &cache->misses, &cache->bytes_saved) != 3) {
+            cache->hits = 0;
+            cache->misses = 0;
+            cache->bytes_saved = 0;
+        }
+        fclose(f);
+    }
+
+    cache->opened_hits = cache->hits;
+    cache->opened_misses = cache->misses;
+    cache->opened_bytes_saved = cache->bytes_saved;
+}
+
+int basm_cache_fetch(BasmCache *cache, uint64_t key, const char *output_file_path, BasmFileMeta *meta) {
+    char path[BASM_CACHE_PATH_CAPACITY];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 ".br", cache->dir, key);
+
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        cache->misses++;
+        return 0;
+    }
+
+    size_t n = fread(meta, sizeof(*meta), 1, f);
+    fclose(f);
+    if (n < 1 || meta->magic != BR_FILE_MAGIC || meta->version != BR_FILE_VERSION) {
+        remove(path);
+        cache->misses++;
+        return 0;
+    }
+
+    long size = basm_cache_copy_file(path, output_file_path);
+    if (size < 0) {
+        fprintf(stderr, "ERROR: Could not copy cached file '%s' to '%s' : %s\n", path, output_file_path,
+                strerror(errno));
+        exit(1);
+    }
+
+    // Touch the entry so the eviction keeps recently used outputs
+    utime(path, NULL);
+
+    cache->hits++;
+    cache->bytes_saved += (uint64_t) size;
+    return 1;
+}
+
+void basm_cache_store(BasmCache *cache, uint64_t key, const char *output_file_path) {
+    char path[BASM_CACHE_PATH_CAPACITY];
+    char temp_path[BASM_CACHE_PATH_CAPACITY];
+    snprintf(path, sizeof(path), "%s/%016" PRIx64 ".br", cache->dir, key);
+    snprintf(temp_path, sizeof(temp_path), "%s/%016" PRIx64 ".%ld.tmp", cache->dir, key, (long) getpid());
+
+    // Write to a temporary file first, so concurrent runs never see a partial entry
+    if (basm_cache_copy_file(output_file_path, temp_path) < 0 || rename(temp_path, path) < 0) {
+        fprintf(stderr, "WARNING: Could not store '%s' in cache : %s\n", output_file_path, strerror(errno));
+        remove(temp_path);
+        return;
+    }
+
+    basm_cache_evict(cache);
+}
+
+void basm_cache_evict(BasmCache *cache) {
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL) {
+        return;
+    }
+
+    BasmCacheEntry *entries = NULL;
+    size_t entries_size = 0;
+    size_t entries_capacity = 0;
+    uint64_t total = 0;
+
+    struct dirent *dirent = NULL;
+    while ((dirent = readdir(dir)) != NULL) {
+        size_t len = strlen(dirent->d_name);
+        if (len < 3 || len >= sizeof(entries[0].name) || strcmp(dirent->d_name + len - 3, ".br") != 0) {
+            continue;
+        }
+
+        char path[BASM_CACHE_PATH_CAPACITY];
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, dirent->d_name);
+
+        struct stat st;
+        if (stat(path, &st) < 0) {
+            continue;
+        }
+
+        if (entries_size >= entries_capacity) {
+            entries_capacity = entries_capacity == 0 ? 64 : entries_capacity * 2;
+            entries = realloc(entries, entries_capacity * sizeof(entries[0]));
+            assert(entries != NULL);
+        }
+
+        BasmCacheEntry *entry = &entries[entries_size++];
+        memcpy(entry->name, dirent->d_name, len + 1);
+        entry->size = (uint64_t) st.st_size;
+        entry->mtime = st.st_mtime;
+        total += entry->size;
+    }
+    closedir(dir);
+
+    if (total > cache->limit) {
+        // Least recently used entries go first
+        qsort(entries, entries_size, sizeof(entries[0]), basm_cache_entry_compare);
+
+        for (size_t i = 0; i < entries_size && total > cache->limit; i++) {
+            char path[BASM_CACHE_PATH_CAPACITY];
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            if (remove(path) == 0) {
+                total -= entries[i].size;
+            }
+        }
+    }
+
+    free(entries);
+}
+
+void basm_cache_save_stats(BasmCache *cache) {
+    char path[BASM_CACHE_PATH_CAPACITY];
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, BASM_CACHE_STATS_FILE);
+
+    // The lock covers reading, adding and writing back, closing the file releases it
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct flock lock = {.l_type = F_WRLCK, .l_whence = SEEK_SET};
+    FILE *f = fd >= 0 && fcntl(fd, F_SETLKW, &lock) == 0 ? fdopen(fd, "r+") : NULL;
+    if (f == NULL) {
+        fprintf(stderr, "WARNING: Could not write cache statistics '%s' : %s\n", path, strerror(errno));
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t bytes_saved = 0;
+    if (fscanf(f, "hits %" SCNu64 " misses %" SCNu64 " bytes_saved %" SCNu64, &hits, &misses, &bytes_saved) != 3) {
+        hits = 0;
+        misses = 0;
+        bytes_saved = 0;
+    }
+
+    cache->hits = hits + cache->hits - cache->opened_hits;
+    cache->misses = misses + cache->misses - cache->opened_misses;
+    cache->bytes_saved = bytes_saved + cache->bytes_saved - cache->opened_bytes_saved;
+    cache->opened_hits = cache->hits;
+    cache->opened_misses = cache->misses;
+    cache->opened_bytes_saved = cache->bytes_saved;
+
+    rewind(f);
+    if (ftruncate(fd, 0) < 0
+        || fprintf(f, "hits %" PRIu64 "\nmisses %" PRIu64 "\nbytes_saved %" PRIu64 "\n",
+                   cache->hits, cache->misses, cache->bytes_saved) < 0) {
+        fprintf(stderr, "WARNING: Could not write cache statistics '%s' : %s\n", path, strerror(errno));
+    }
+    fclose(f);
+}
+
+void basm_cache_print_stats(FILE *stream, const BasmCache *cache) {
+    fprintf(stream, "Cache '%s':\n", cache->dir);
+    fprintf(stream, "  hits:        %" PRIu64 "\n", cache->hits);
+    fprintf(stream, "  misses:      %" PRIu64 "\n", cache->misses);
+    fprintf(stream, "  bytes saved: %" PRIu64 "\n", cache->bytes_saved);
+    fprintf(stream, "  size limit:  %" PRIu64 "\n", cache->limit);
+}
+
+#endif
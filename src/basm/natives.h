@@ -0,0 +1,485 @@
+// define BR_NATIVES for implementing the natives, it needs BASM_VM from libbasm.h
+// include libbasm.h before this header
+
+#ifndef BYTERUNNER_NATIVES_H
+#define BYTERUNNER_NATIVES_H
+
+/// ========================================
+/// region
+
+// The natives every runner provides, test/src/natives.hasm names them in this order
+#define BR_NATIVES_COUNT 14
+
+// Registers the natives in the order test/src/natives.hasm expects them
+void br_push_natives(ByteRunner *br);
+
+/// endregion
+/// ========================================
+
+#endif
+#ifdef BR_NATIVES
+
+#if defined(BASM_SSE2) && defined(__x86_64__)
+# define BR_TEXT_AVX2
+# include <immintrin.h>
+#endif
+
+static Err br_alloc(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    br->stack[br->stack_size - 1].as_ptr = malloc(br->stack[br->stack_size - 1].as_u64);
+
+    return ERR_OK;
+}
+
+static Err br_free(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    free(br->stack[br->stack_size - 1].as_ptr);
+    br->stack_size--;
+
+    return ERR_OK;
+}
+
+static Err br_print_f64(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    printf("%lf\n", br->stack[br->stack_size - 1].as_f64);
+    br->stack_size--;
+
+    return ERR_OK;
+}
+
+static Err br_print_i64(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    printf("%"PRIi64"\n", br->stack[br->stack_size - 1].as_i64);
+    br->stack_size--;
+
+    return ERR_OK;
+}
+
+static Err br_print_u64(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    printf("%"PRIu64"\n", br->stack[br->stack_size - 1].as_u64);
+    br->stack_size--;
+
+    return ERR_OK;
+}
+
+static Err br_print_ptr(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    printf("%p\n", br->stack[br->stack_size - 1].as_ptr);
+    br->stack_size--;
+
+    return ERR_OK;
+}
+
+static Err br_dump_memory(ByteRunner *br) {
+    if (br->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
+    uint64_t count = br->stack[br->stack_size - 1].as_u64;
+
+    if (addr >= BR_MEMORY_CAPACITY) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    if (addr + count < addr || addr + count >= BR_MEMORY_CAPACITY) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+
+    for (uint64_t i = 0; i < count; i++) {
+        printf("%02X ", br->memory[i]);
+    }
+    printf("\n");
+
+    br->stack_size -= 2;
+
+    return ERR_OK;
+}
+
+static Err br_write(ByteRunner *br) {
+    if (br->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
+    uint64_t count = br->stack[br->stack_size - 1].as_u64;
+
+    if (addr >= BR_MEMORY_CAPACITY) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    if (addr + count < addr || addr + count >= BR_MEMORY_CAPACITY) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    fwrite(&br->memory[addr], sizeof(br->memory[0]), count, stdout);
+    br->stack_size -= 2;
+
+    return ERR_OK;
+}
+
+/// ========================================
+/// TEXT
+/// ========================================
+/// region
+
+// The kernels behind the text natives, br_push_natives picks the widest set the CPU supports once and hands it to
+// them as their context. They all return the index of the first match, count when there is none
+typedef struct {
+    uint64_t (*find_byte)(const uint8_t *data, uint64_t count, uint8_t byte);
+    uint64_t (*find_any)(const uint8_t *data, uint64_t count, const uint8_t *set, uint64_t set_count);
+    // Flips the case of the bytes from first to first + 25
+    void (*flip_case)(uint8_t *data, uint64_t count, uint8_t first);
+} BrTextKernels;
+
+#define BR_TEXT_LETTERS 26
+
+static uint64_t br_find_byte_scalar(const uint8_t *data, uint64_t count, uint8_t byte) {
+    const uint8_t *found = memchr(data, byte, count);
+    return found == NULL ? count : (uint64_t) (found - data);
+}
+
+static uint64_t br_find_any_scalar(const uint8_t *data, uint64_t count, const uint8_t *set, uint64_t set_count) {
+    uint8_t member[256] = {0};
+    for (uint64_t i = 0; i < set_count; i++) {
+        member[set[i]] = 1;
+    }
+
+    for (uint64_t i = 0; i < count; i++) {
+        if (member[data[i]]) {
+            return i;
+        }
+    }
+    return count;
+}
+
+static void br_flip_case_scalar(uint8_t *data, uint64_t count, uint8_t first) {
+    for (uint64_t i = 0; i < count; i++) {
+        if ((uint8_t) (data[i] - first) < BR_TEXT_LETTERS) {
+            data[i] ^= 0x20;
+        }
+    }
+}
+
+#ifndef BASM_SSE2
+static const BrTextKernels br_text_scalar = {
+        br_find_byte_scalar,
+        br_find_any_scalar,
+        br_flip_case_scalar,
+};
+#else
+
+static uint64_t br_find_byte_sse2(const uint8_t *data, uint64_t count, uint8_t byte) {
+    const __m128i needle = _mm_set1_epi8((char) byte);
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return i + (uint64_t) __builtin_ctz((unsigned int) mask);
+        }
+    }
+    return i + br_find_byte_scalar(data + i, count - i, byte);
+}
+
+static uint64_t br_find_any_sse2(const uint8_t *data, uint64_t count, const uint8_t *set, uint64_t set_count) {
+    // One comparison per byte of the set, a larger set is faster through the lookup table
+    if (set_count > 16) {
+        return br_find_any_scalar(data, count, set, set_count);
+    }
+
+    __m128i needles[16];
+    for (uint64_t k = 0; k < set_count; k++) {
+        needles[k] = _mm_set1_epi8((char) set[k]);
+    }
+
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i hits = _mm_setzero_si128();
+        for (uint64_t k = 0; k < set_count; k++) {
+            hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, needles[k]));
+        }
+        int mask = _mm_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + (uint64_t) __builtin_ctz((unsigned int) mask);
+        }
+    }
+    return i + br_find_any_scalar(data + i, count - i, set, set_count);
+}
+
+static void br_flip_case_sse2(uint8_t *data, uint64_t count, uint8_t first) {
+    // There is only a signed byte comparison, moving first to -128 turns the range check into a single one
+    const __m128i base = _mm_set1_epi8((char) (first ^ 0x80));
+    const __m128i limit = _mm_set1_epi8((char) (BR_TEXT_LETTERS ^ 0x80));
+    const __m128i bit = _mm_set1_epi8(0x20);
+    uint64_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (data + i));
+        __m128i letters = _mm_cmplt_epi8(_mm_sub_epi8(chunk, base), limit);
+        _mm_storeu_si128((__m128i *) (data + i), _mm_xor_si128(chunk, _mm_and_si128(letters, bit)));
+    }
+    br_flip_case_scalar(data + i, count - i, first);
+}
+
+static const BrTextKernels br_text_sse2 = {
+        br_find_byte_sse2,
+        br_find_any_sse2,
+        br_flip_case_sse2,
+};
+
+#endif
+
+#ifdef BR_TEXT_AVX2
+
+__attribute__((target("avx2")))
+static uint64_t br_find_byte_avx2(const uint8_t *data, uint64_t count, uint8_t byte) {
+    const __m256i needle = _mm256_set1_epi8((char) byte);
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+        if (mask != 0) {
+            return i + (uint64_t) __builtin_ctz(mask);
+        }
+    }
+    return i + br_find_byte_sse2(data + i, count - i, byte);
+}
+
+__attribute__((target("avx2")))
+static uint64_t br_find_any_avx2(const uint8_t *data, uint64_t count, const uint8_t *set, uint64_t set_count) {
+    if (set_count > 16) {
+        return br_find_any_scalar(data, count, set, set_count);
+    }
+
+    __m256i needles[16];
+    for (uint64_t k = 0; k < set_count; k++) {
+        needles[k] = _mm256_set1_epi8((char) set[k]);
+    }
+
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i hits = _mm256_setzero_si256();
+        for (uint64_t k = 0; k < set_count; k++) {
+            hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, needles[k]));
+        }
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(hits);
+        if (mask != 0) {
+            return i + (uint64_t) __builtin_ctz(mask);
+        }
+    }
+    return i + br_find_any_sse2(data + i, count - i, set, set_count);
+}
+
+__attribute__((target("avx2")))
+static void br_flip_case_avx2(uint8_t *data, uint64_t count, uint8_t first) {
+    // AVX2 only compares for greater, so the operands of the range check are swapped
+    const __m256i base = _mm256_set1_epi8((char) (first ^ 0x80));
+    const __m256i limit = _mm256_set1_epi8((char) (BR_TEXT_LETTERS ^ 0x80));
+    const __m256i bit = _mm256_set1_epi8(0x20);
+    uint64_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (data + i));
+        __m256i letters = _mm256_cmpgt_epi8(limit, _mm256_sub_epi8(chunk, base));
+        _mm256_storeu_si256((__m256i *) (data + i), _mm256_xor_si256(chunk, _mm256_and_si256(letters, bit)));
+    }
+    br_flip_case_sse2(data + i, count - i, first);
+}
+
+static const BrTextKernels br_text_avx2 = {
+        br_find_byte_avx2,
+        br_find_any_avx2,
+        br_flip_case_avx2,
+};
+
+#endif
+
+static const BrTextKernels *br_text_kernels(void) {
+#ifdef BR_TEXT_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        return &br_text_avx2;
+    }
+#endif
+#ifdef BASM_SSE2
+    return &br_text_sse2;
+#else
+    return &br_text_scalar;
+#endif
+}
+
+// Whether the count bytes at addr all lie in the memory
+static int br_memory_range(MemoryAddr addr, uint64_t count) {
+    return addr < BR_MEMORY_CAPACITY && count <= BR_MEMORY_CAPACITY - addr;
+}
+
+// addr -> the number of bytes before the first 0 at addr, which has to lie in the memory
+static Err br_strlen(ByteRunner *br) {
+    if (br->stack_size < 1) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    const BrTextKernels *kernels = br->native_context;
+    MemoryAddr addr = br->stack[br->stack_size - 1].as_u64;
+    if (addr >= BR_MEMORY_CAPACITY) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    uint64_t length = kernels->find_byte(&br->memory[addr], BR_MEMORY_CAPACITY - addr, 0);
+    if (length == BR_MEMORY_CAPACITY - addr) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    br->stack[br->stack_size - 1].as_u64 = length;
+
+    return ERR_OK;
+}
+
+// addr count byte -> the index of the first byte equal to byte, count when there is none
+static Err br_memchr(ByteRunner *br) {
+    if (br->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    const BrTextKernels *kernels = br->native_context;
+    MemoryAddr addr = br->stack[br->stack_size - 3].as_u64;
+    uint64_t count = br->stack[br->stack_size - 2].as_u64;
+    if (!br_memory_range(addr, count)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    uint8_t byte = (uint8_t) br->stack[br->stack_size - 1].as_u64;
+    br->stack[br->stack_size - 3].as_u64 = kernels->find_byte(&br->memory[addr], count, byte);
+    br->stack_size -= 2;
+
+    return ERR_OK;
+}
+
+// addr count set set_count -> the index of the first byte that is one of the set_count bytes at set, count when
+// there is none
+static Err br_find_any(ByteRunner *br) {
+    if (br->stack_size < 4) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    const BrTextKernels *kernels = br->native_context;
+    MemoryAddr set = br->stack[br->stack_size - 2].as_u64;
+    uint64_t set_count = br->stack[br->stack_size - 1].as_u64;
+    if (!br_memory_range(set, set_count)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    MemoryAddr addr = br->stack[br->stack_size - 4].as_u64;
+    uint64_t count = br->stack[br->stack_size - 3].as_u64;
+    if (!br_memory_range(addr, count)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    br->stack[br->stack_size - 4].as_u64 = kernels->find_any(&br->memory[addr], count, &br->memory[set], set_count);
+    br->stack_size -= 3;
+
+    return ERR_OK;
+}
+
+static Err br_flip_case(ByteRunner *br, uint8_t first) {
+    if (br->stack_size < 2) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    const BrTextKernels *kernels = br->native_context;
+    MemoryAddr addr = br->stack[br->stack_size - 2].as_u64;
+    uint64_t count = br->stack[br->stack_size - 1].as_u64;
+    if (!br_memory_range(addr, count)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    kernels->flip_case(&br->memory[addr], count, first);
+    br->stack_size -= 2;
+
+    return ERR_OK;
+}
+
+// addr count -> nothing, the ASCII letters of the range become lower case
+static Err br_to_lower(ByteRunner *br) {
+    return br_flip_case(br, 'A');
+}
+
+// addr count -> nothing, the ASCII letters of the range become upper case
+static Err br_to_upper(ByteRunner *br) {
+    return br_flip_case(br, 'a');
+}
+
+// addr count table -> nothing, every byte of the range is replaced with the byte it indexes in the 256 bytes at
+// table. There is no byte gather in SSE2 or AVX2, so this one stays scalar
+static Err br_translate(ByteRunner *br) {
+    if (br->stack_size < 3) {
+        return ERR_STACK_UNDERFLOW;
+    }
+
+    MemoryAddr table = br->stack[br->stack_size - 1].as_u64;
+    if (!br_memory_range(table, 256)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    MemoryAddr addr = br->stack[br->stack_size - 3].as_u64;
+    uint64_t count = br->stack[br->stack_size - 2].as_u64;
+    if (!br_memory_range(addr, count)) {
+        return ERR_ILLEGAL_MEMORY_ACCESS;
+    }
+
+    // Byte by byte through the memory, the table may overlap the range
+    for (uint64_t i = 0; i < count; i++) {
+        br->memory[addr + i] = br->memory[table + br->memory[addr + i]];
+    }
+    br->stack_size -= 3;
+
+    return ERR_OK;
+}
+
+/// endregion
+static const Br_Native br_natives[BR_NATIVES_COUNT] = {
+        br_alloc,
+        br_free,
+        br_print_f64,
+        br_print_i64,
+        br_print_u64,
+        br_print_ptr,
+        br_dump_memory,
+        br_write,
+        br_strlen,
+        br_memchr,
+        br_find_any,
+        br_to_lower,
+        br_to_upper,
+        br_translate,
+};
+
+void br_push_natives(ByteRunner *br) {
+    // The text natives find the kernels in their context
+    const BrTextKernels *kernels = br_text_kernels();
+    for (size_t i = 0; i < BR_NATIVES_COUNT; i++) {
+        br_push_native_with_context(br, br_natives[i], (void *) kernels);
+    }
+}
+
+#endif
@@ -1,14 +1,74 @@
 #define BASM_UTILS
 #define BASM_CREATE
 #define BASM_VM
+#define BR_NATIVES
 
 #include "libbasm.h"
+#include "natives.h"
 #include "wrapper.h"
 
-MManager manager = {0};
-Basm basm = {0};
-
 void basm_translate_file(const char *input_file_path, const char *output_file_path) {
+    MManager manager = {0};
+    Basm basm = {0};
+
     basm_translate_source(cstr_as_sv(input_file_path), &basm, &manager);
+
+    BasmInlineStats inline_stats = {0};
+    basm_inline(&basm, 0, &inline_stats);
+    basm_fuse_immediates(&basm);
     basm_save_to_file(&basm, output_file_path);
+    basm_free(&basm);
+    basm_arena_free(&manager);
+}
+
+uint8_t *br_assemble(const char *name, const char *source, size_t source_size, size_t *image_size,
+                     char *error, size_t error_size) {
+    MManager manager = {0};
+    Basm basm = {0};
+    uint8_t *image = NULL;
+
+    StringView source_sv = {.count = source_size, .data = source};
+    if (basm_assemble_memory(cstr_as_sv(name), source_sv, &basm, &manager)) {
+        *image_size = basm_image_size(&basm);
+        image = malloc(*image_size);
+        if (image != NULL) {
+            basm_write_image(&basm, image);
+        } else {
+            snprintf(error, error_size, "ERROR: Could not allocate %zu bytes for the image", *image_size);
+        }
+    } else {
+        snprintf(error, error_size, "%s", basm.error);
+    }
+
+    basm_free(&basm);
+    basm_arena_free(&manager);
+    return image;
+}
+
+ByteRunner *br_vm_new(const uint8_t *image, size_t image_size, const char **message) {
+    ByteRunner *br = calloc(1, sizeof(*br));
+    uint8_t *memory = calloc(BR_MEMORY_CAPACITY + BR_WORD_SIZE, 1);
+    if (br == NULL || memory == NULL) {
+        free(br);
+        free(memory);
+        *message = "could not allocate the VM";
+        return NULL;
+    }
+
+    br->memory = memory;
+    *message = br_load_program_from_memory(br, image, image_size);
+    if (*message != NULL) {
+        free(memory);
+        free(br);
+        return NULL;
+    }
+
+    br_push_natives(br);
+    return br;
+}
+
+void br_vm_free(ByteRunner *br) {
+    br_release(br);
+    free(br->memory);
+    free(br);
 }
@@ -1,6 +1,20 @@
+// include libbasm.h before this header
+
 #ifndef BYTERUNNER_WRAPPER_H
 #define BYTERUNNER_WRAPPER_H
 
 void basm_translate_file(const char *input_file_path, const char *output_file_path);
 
+// Assembles source held in memory into an image laid out like a .br file, %include still reads from disk.
+// Returns NULL and copies the message into error on failure. The image is released with free
+uint8_t *br_assemble(const char *name, const char *source, size_t source_size, size_t *image_size,
+                     char *error, size_t error_size);
+
+// A VM with its own memory and the natives of natives.h that runs the image in place, so the image has to
+// outlive it. Returns NULL and points message at the reason when the image is broken
+ByteRunner *br_vm_new(const uint8_t *image, size_t image_size, const char **message);
+
+// Joins the threads the program started and releases everything the VM owns, the image stays
+void br_vm_free(ByteRunner *br);
+
 #endif
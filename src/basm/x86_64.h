@@ -0,0 +1,3953 @@
+// define X86_64_NASM for implementing the NASM code generator, it needs BASM_VM from libbasm.h
+// define X86_64_ELF for implementing the assembler that turns its output into an ELF executable
+// include libbasm.h before this header
+
+#ifndef BYTERUNNER_X86_64_H
+#define BYTERUNNER_X86_64_H
+
+/// ========================================
+/// region
+
+// Writes a NASM program for x86_64 Linux that behaves like running the program in br
+void x86_64_generate(FILE *stream, const Basm *basm);
+
+// Assembles the subset of NASM that x86_64_generate writes into a static ELF executable at output_path
+void x86_64_assemble(StringView source, const char *source_name, const char *output_path);
+
+/// endregion
+/// ========================================
+
+#endif
+#ifdef X86_64_NASM
+
+#define BR_NATIVES_COUNT 14
+#define OUT_CAPACITY (64 * 1024)
+
+static FILE *out = NULL;
+static const Basm *input = NULL;
+
+// Mirrors the natives registered by br.c, in the same order
+static const char *const natives[BR_NATIVES_COUNT] = {
+        "native_alloc",
+        "native_free",
+        "native_print_f64",
+        "native_print_i64",
+        "native_print_u64",
+        "native_print_ptr",
+        "native_dump_memory",
+        "native_write",
+        "native_strlen",
+        "native_memchr",
+        "native_find_any",
+        "native_to_lower",
+        "native_to_upper",
+        "native_translate",
+};
+
+// Output buffering, number formatting and the natives. Every routine only relies on r15,
+// which always points at the next free slot of the BM's stack
+static const char *const runtime[] = {
+        "out_flush:",
+        "    ;; write(STDOUT, out_buf, out_len), keeps every register",
+        "    push rax",
+        "    push rcx",
+        "    push rdx",
+        "    push rsi",
+        "    push rdi",
+        "    push r11",
+        "    mov rsi, out_buf",
+        "    mov rdx, [out_len]",
+        ".loop:",
+        "    test rdx, rdx",
+        "    jz .done",
+        "    mov eax, SYS_WRITE",
+        "    mov edi, STDOUT",
+        "    syscall",
+        "    test rax, rax",
+        "    jle .done",
+        "    add rsi, rax",
+        "    sub rdx, rax",
+        "    jmp .loop",
+        ".done:",
+        "    mov qword [out_len], 0",
+        "    pop r11",
+        "    pop rdi",
+        "    pop rsi",
+        "    pop rdx",
+        "    pop rcx",
+        "    pop rax",
+        "    ret",
+        "",
+        "out_char:",
+        "    ;; appends al to the output buffer, keeps every register",
+        "    push rcx",
+        "    mov rcx, [out_len]",
+        "    cmp rcx, OUT_CAPACITY",
+        "    jb .store",
+        "    call out_flush",
+        "    xor ecx, ecx",
+        ".store:",
+        "    mov [out_buf + rcx], al",
+        "    inc rcx",
+        "    mov [out_len], rcx",
+        "    pop rcx",
+        "    ret",
+        "",
+        "out_string:",
+        "    ;; rsi - string, rdx - length, keeps every register but rax",
+        "    push rsi",
+        "    push rdx",
+        ".loop:",
+        "    test rdx, rdx",
+        "    jz .done",
+        "    mov al, [rsi]",
+        "    call out_char",
+        "    inc rsi",
+        "    dec rdx",
+        "    jmp .loop",
+        ".done:",
+        "    pop rdx",
+        "    pop rsi",
+        "    ret",
+        "",
+        "out_decimal:",
+        "    ;; rax - unsigned value, rcx - minimum digits, keeps every register but rax",
+        "    push rbx",
+        "    push rcx",
+        "    push rdx",
+        "    push rsi",
+        "    sub rsp, 32",
+        "    lea rsi, [rsp + 32]",
+        "    mov rbx, 10",
+        ".digit:",
+        "    xor edx, edx",
+        "    div rbx",
+        "    add dl, '0'",
+        "    dec rsi",
+        "    mov [rsi], dl",
+        "    dec rcx",
+        "    test rax, rax",
+        "    jnz .digit",
+        "    test rcx, rcx",
+        "    jg .digit",
+        "    lea rdx, [rsp + 32]",
+        "    sub rdx, rsi",
+        "    call out_string",
+        "    add rsp, 32",
+        "    pop rsi",
+        "    pop rdx",
+        "    pop rcx",
+        "    pop rbx",
+        "    ret",
+        "",
+        "out_hex:",
+        "    ;; rax - value, rcx - minimum digits, rdi - digit table, keeps every register but rax",
+        "    push rbx",
+        "    push rcx",
+        "    push rdx",
+        "    push rsi",
+        "    sub rsp, 32",
+        "    lea rsi, [rsp + 32]",
+        ".digit:",
+        "    mov rbx, rax",
+        "    and ebx, 15",
+        "    mov bl, [rdi + rbx]",
+        "    dec rsi",
+        "    mov [rsi], bl",
+        "    dec rcx",
+        "    shr rax, 4",
+        "    jnz .digit",
+        "    test rcx, rcx",
+        "    jg .digit",
+        "    lea rdx, [rsp + 32]",
+        "    sub rdx, rsi",
+        "    call out_string",
+        "    add rsp, 32",
+        "    pop rsi",
+        "    pop rdx",
+        "    pop rcx",
+        "    pop rbx",
+        "    ret",
+        "",
+        "native_alloc:",
+        "    ;; malloc, the mapping keeps its own size in front of the returned pointer",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    mov rsi, [r15 - BR_WORD_SIZE]",
+        "    xor eax, eax",
+        "    bt rsi, 62",
+        "    jc .store",
+        "    add rsi, BR_WORD_SIZE",
+        "    mov eax, SYS_MMAP",
+        "    xor edi, edi",
+        "    mov edx, PROT_READ_WRITE",
+        "    mov r10d, MAP_PRIVATE_ANONYMOUS",
+        "    mov r8, -1",
+        "    xor r9d, r9d",
+        "    syscall",
+        "    cmp rax, -4095",
+        "    jae .failed",
+        "    mov [rax], rsi",
+        "    add rax, BR_WORD_SIZE",
+        "    jmp .store",
+        ".failed:",
+        "    xor eax, eax",
+        ".store:",
+        "    mov [r15 - BR_WORD_SIZE], rax",
+        ".done:",
+        "    ret",
+        "",
+        "native_free:",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    sub r15, BR_WORD_SIZE",
+        "    mov rdi, [r15]",
+        "    test rdi, rdi",
+        "    jz .done",
+        "    sub rdi, BR_WORD_SIZE",
+        "    mov rsi, [rdi]",
+        "    mov eax, SYS_MUNMAP",
+        "    syscall",
+        ".done:",
+        "    ret",
+        "",
+        "native_print_f64:",
+        "    ;; printf(\"%lf\\n\"), the value is split into mantissa * 2^exponent and printed exactly,",
+        "    ;; the six decimals are rounded half to even like glibc does",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    sub r15, BR_WORD_SIZE",
+        "    mov r12, [r15]",
+        "    mov rcx, r12",
+        "    btr rcx, 63",
+        "    mov rdx, 0x000FFFFFFFFFFFFF",
+        "    and rdx, rcx",
+        "    shr rcx, 52",
+        "    test r12, r12",
+        "    jns .unsigned",
+        "    mov al, '-'",
+        "    call out_char",
+        ".unsigned:",
+        "    cmp rcx, 0x7FF",
+        "    jne .number",
+        "    mov rsi, str_inf",
+        "    test rdx, rdx",
+        "    jz .special",
+        "    mov rsi, str_nan",
+        ".special:",
+        "    mov edx, 3",
+        "    call out_string",
+        "    jmp .newline",
+        ".number:",
+        "    test rcx, rcx",
+        "    jz .subnormal",
+        "    bts rdx, 52",
+        "    sub rcx, 1075",
+        "    jmp .split",
+        ".subnormal:",
+        "    mov rcx, -1074",
+        ".split:",
+        "    ;; value = rdx * 2^rcx",
+        "    test rcx, rcx",
+        "    js .fraction",
+        "    cmp rcx, 10",
+        "    jg .big",
+        "    shl rdx, cl",
+        "    mov rax, rdx",
+        "    mov ecx, 1",
+        "    call out_decimal",
+        "    xor eax, eax",
+        "    jmp .decimals",
+        ".big:",
+        "    ;; doubles the decimal digits of the mantissa rcx times",
+        "    mov rax, rdx",
+        "    xor r8d, r8d",
+        "    mov r9, 10",
+        ".big_init:",
+        "    xor edx, edx",
+        "    div r9",
+        "    mov [f64_digits + r8], dl",
+        "    inc r8",
+        "    test rax, rax",
+        "    jnz .big_init",
+        ".big_double:",
+        "    xor r10d, r10d",
+        "    xor r11d, r11d",
+        ".big_digit:",
+        "    movzx eax, byte [f64_digits + r11]",
+        "    lea eax, [rax * 2 + r10]",
+        "    xor r10d, r10d",
+        "    cmp eax, 10",
+        "    jb .big_store",
+        "    sub eax, 10",
+        "    mov r10d, 1",
+        ".big_store:",
+        "    mov [f64_digits + r11], al",
+        "    inc r11",
+        "    cmp r11, r8",
+        "    jb .big_digit",
+        "    test r10d, r10d",
+        "    jz .big_next",
+        "    mov byte [f64_digits + r8], 1",
+        "    inc r8",
+        ".big_next:",
+        "    dec rcx",
+        "    jnz .big_double",
+        ".big_print:",
+        "    dec r8",
+        "    movzx eax, byte [f64_digits + r8]",
+        "    add al, '0'",
+        "    call out_char",
+        "    test r8, r8",
+        "    jnz .big_print",
+        "    xor eax, eax",
+        "    jmp .decimals",
+        ".fraction:",
+        "    neg rcx",
+        "    xor r13d, r13d",
+        "    cmp rcx, 64",
+        "    jae .scale",
+        "    mov r13, rdx",
+        "    shr r13, cl",
+        "    mov r8, 1",
+        "    shl r8, cl",
+        "    dec r8",
+        "    and rdx, r8",
+        ".scale:",
+        "    ;; rdx:rax = fraction * 10^6, shifted back by rcx bits below",
+        "    mov rax, rdx",
+        "    mov r8, 1000000",
+        "    mul r8",
+        "    xor r8d, r8d",
+        "    xor r9d, r9d",
+        ".shift:",
+        "    test rcx, rcx",
+        "    jz .round",
+        "    or r9, r8",
+        "    mov r8, rax",
+        "    and r8, 1",
+        "    shrd rax, rdx, 1",
+        "    shr rdx, 1",
+        "    dec rcx",
+        "    jmp .shift",
+        ".round:",
+        "    ;; r8 - the first bit shifted out, r9 - any bit after it",
+        "    test r8, r8",
+        "    jz .carry",
+        "    test r9, r9",
+        "    jnz .up",
+        "    test rax, 1",
+        "    jz .carry",
+        ".up:",
+        "    inc rax",
+        ".carry:",
+        "    cmp rax, 1000000",
+        "    jb .integer",
+        "    sub rax, 1000000",
+        "    inc r13",
+        ".integer:",
+        "    mov r14, rax",
+        "    mov rax, r13",
+        "    mov ecx, 1",
+        "    call out_decimal",
+        "    mov rax, r14",
+        ".decimals:",
+        "    mov r14, rax",
+        "    mov al, '.'",
+        "    call out_char",
+        "    mov rax, r14",
+        "    mov ecx, 6",
+        "    call out_decimal",
+        ".newline:",
+        "    mov al, 10",
+        "    call out_char",
+        ".done:",
+        "    ret",
+        "",
+        "native_print_i64:",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    sub r15, BR_WORD_SIZE",
+        "    mov rbx, [r15]",
+        "    test rbx, rbx",
+        "    jns .digits",
+        "    mov al, '-'",
+        "    call out_char",
+        "    neg rbx",
+        ".digits:",
+        "    mov rax, rbx",
+        "    mov ecx, 1",
+        "    call out_decimal",
+        "    mov al, 10",
+        "    call out_char",
+        ".done:",
+        "    ret",
+        "",
+        "native_print_u64:",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    sub r15, BR_WORD_SIZE",
+        "    mov rax, [r15]",
+        "    mov ecx, 1",
+        "    call out_decimal",
+        "    mov al, 10",
+        "    call out_char",
+        ".done:",
+        "    ret",
+        "",
+        "native_print_ptr:",
+        "    ;; printf(\"%p\\n\")",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    sub r15, BR_WORD_SIZE",
+        "    mov rbx, [r15]",
+        "    test rbx, rbx",
+        "    jnz .hex",
+        "    mov rsi, str_nil",
+        "    mov edx, 5",
+        "    call out_string",
+        "    jmp .newline",
+        ".hex:",
+        "    mov al, '0'",
+        "    call out_char",
+        "    mov al, 'x'",
+        "    call out_char",
+        "    mov rax, rbx",
+        "    mov ecx, 1",
+        "    mov rdi, hex_lower",
+        "    call out_hex",
+        ".newline:",
+        "    mov al, 10",
+        "    call out_char",
+        ".done:",
+        "    ret",
+        "",
+        "native_dump_memory:",
+        "    ;; Like br_dump_memory the bytes are dumped from the beginning of the memory",
+        "    cmp r15, stack + BR_WORD_SIZE * 2",
+        "    jb err_stack_underflow",
+        "    mov rax, [r15 - BR_WORD_SIZE * 2]",
+        "    mov rbx, [r15 - BR_WORD_SIZE]",
+        "    cmp rax, BR_MEMORY_CAPACITY",
+        "    jae err_illegal_memory_access",
+        "    add rax, rbx",
+        "    jc err_illegal_memory_access",
+        "    cmp rax, BR_MEMORY_CAPACITY",
+        "    jae err_illegal_memory_access",
+        "    xor r12d, r12d",
+        "    mov ecx, 2",
+        "    mov rdi, hex_upper",
+        ".byte:",
+        "    cmp r12, rbx",
+        "    jae .end",
+        "    movzx eax, byte [memory + r12]",
+        "    call out_hex",
+        "    mov al, ' '",
+        "    call out_char",
+        "    inc r12",
+        "    jmp .byte",
+        ".end:",
+        "    mov al, 10",
+        "    call out_char",
+        "    sub r15, BR_WORD_SIZE * 2",
+        ".done:",
+        "    ret",
+        "",
+        "native_write:",
+        "    cmp r15, stack + BR_WORD_SIZE * 2",
+        "    jb err_stack_underflow",
+        "    mov rsi, [r15 - BR_WORD_SIZE * 2]",
+        "    mov rdx, [r15 - BR_WORD_SIZE]",
+        "    cmp rsi, BR_MEMORY_CAPACITY",
+        "    jae err_illegal_memory_access",
+        "    mov rax, rsi",
+        "    add rax, rdx",
+        "    jc err_illegal_memory_access",
+        "    cmp rax, BR_MEMORY_CAPACITY",
+        "    jae err_illegal_memory_access",
+        "    add rsi, memory",
+        "    call out_string",
+        "    sub r15, BR_WORD_SIZE * 2",
+        ".done:",
+        "    ret",
+        "",
+        "text_range:",
+        "    ;; rsi - address, rdx - count, fails unless every byte lies in the memory. Keeps every register but rax",
+        "    cmp rsi, BR_MEMORY_CAPACITY",
+        "    jae err_illegal_memory_access",
+        "    mov rax, BR_MEMORY_CAPACITY",
+        "    sub rax, rsi",
+        "    cmp rdx, rax",
+        "    ja err_illegal_memory_access",
+        "    ret",
+        "",
+        "text_find_byte:",
+        "    ;; rsi - address, rdx - count, al - byte. Returns the index of the first byte equal to al in rax, rdx when",
+        "    ;; there is none. Keeps rsi and rdx",
+        "    movzx r8d, al",
+        "    mov eax, r8d",
+        "    imul eax, 0x01010101",
+        "    movd xmm1, eax",
+        "    pshufd xmm1, xmm1, 0",
+        "    xor ecx, ecx",
+        ".block:",
+        "    mov rax, rdx",
+        "    sub rax, rcx",
+        "    cmp rax, 16",
+        "    jb .tail",
+        "    movdqu xmm0, [memory + rsi + rcx]",
+        "    pcmpeqb xmm0, xmm1",
+        "    pmovmskb eax, xmm0",
+        "    test eax, eax",
+        "    jnz .found",
+        "    add rcx, 16",
+        "    jmp .block",
+        ".found:",
+        "    bsf eax, eax",
+        "    add rax, rcx",
+        "    ret",
+        ".tail:",
+        "    cmp rcx, rdx",
+        "    jae .done",
+        "    cmp [memory + rsi + rcx], r8b",
+        "    je .done",
+        "    inc rcx",
+        "    jmp .tail",
+        ".done:",
+        "    mov rax, rcx",
+        "    ret",
+        "",
+        "native_strlen:",
+        "    ;; Like br_strlen the string has to end inside the memory",
+        "    cmp r15, stack + BR_WORD_SIZE",
+        "    jb err_stack_underflow",
+        "    mov rsi, [r15 - BR_WORD_SIZE]",
+        "    cmp rsi, BR_MEMORY_CAPACITY",
+        "    jae err_illegal_memory_access",
+        "    mov rdx, BR_MEMORY_CAPACITY",
+        "    sub rdx, rsi",
+        "    xor eax, eax",
+        "    call text_find_byte",
+        "    cmp rax, rdx",
+        "    jae err_illegal_memory_access",
+        "    mov [r15 - BR_WORD_SIZE], rax",
+        "    ret",
+        "",
+        "native_memchr:",
+        "    cmp r15, stack + BR_WORD_SIZE * 3",
+        "    jb err_stack_underflow",
+        "    mov rsi, [r15 - BR_WORD_SIZE * 3]",
+        "    mov rdx, [r15 - BR_WORD_SIZE * 2]",
+        "    call text_range",
+        "    mov rax, [r15 - BR_WORD_SIZE]",
+        "    call text_find_byte",
+        "    mov [r15 - BR_WORD_SIZE * 3], rax",
+        "    sub r15, BR_WORD_SIZE * 2",
+        "    ret",
+        "",
+        "native_find_any:",
+        "    ;; Every block is compared with each byte of the set, the set is checked before the range like in br_find_any",
+        "    cmp r15, stack + BR_WORD_SIZE * 4",
+        "    jb err_stack_underflow",
+        "    mov rsi, [r15 - BR_WORD_SIZE * 2]",
+        "    mov rdx, [r15 - BR_WORD_SIZE]",
+        "    call text_range",
+        "    mov rdi, rsi",
+        "    mov r8, rdx",
+        "    mov rsi, [r15 - BR_WORD_SIZE * 4]",
+        "    mov rdx, [r15 - BR_WORD_SIZE * 3]",
+        "    call text_range",
+        "    xor ecx, ecx",
+        ".block:",
+        "    mov rax, rdx",
+        "    sub rax, rcx",
+        "    cmp rax, 16",
+        "    jb .tail",
+        "    movdqu xmm0, [memory + rsi + rcx]",
+        "    pxor xmm2, xmm2",
+        "    xor r9d, r9d",
+        ".set:",
+        "    cmp r9, r8",
+        "    jae .test",
+        "    movzx eax, byte [memory + rdi + r9]",
+        "    imul eax, 0x01010101",
+        "    movd xmm1, eax",
+        "    pshufd xmm1, xmm1, 0",
+        "    pcmpeqb xmm1, xmm0",
+        "    por xmm2, xmm1",
+        "    inc r9",
+        "    jmp .set",
+        ".test:",
+        "    pmovmskb eax, xmm2",
+        "    test eax, eax",
+        "    jnz .found",
+        "    add rcx, 16",
+        "    jmp .block",
+        ".found:",
+        "    bsf eax, eax",
+        "    add rcx, rax",
+        "    jmp .done",
+        ".tail:",
+        "    cmp rcx, rdx",
+        "    jae .done",
+        "    movzx eax, byte [memory + rsi + rcx]",
+        "    xor r9d, r9d",
+        ".tail_set:",
+        "    cmp r9, r8",
+        "    jae .next",
+        "    cmp al, [memory + rdi + r9]",
+        "    je .done",
+        "    inc r9",
+        "    jmp .tail_set",
+        ".next:",
+        "    inc rcx",
+        "    jmp .tail",
+        ".done:",
+        "    mov [r15 - BR_WORD_SIZE * 4], rcx",
+        "    sub r15, BR_WORD_SIZE * 3",
+        "    ret",
+        "",
+        "text_flip_case:",
+        "    ;; eax - first letter, flips the case of the bytes from it to 25 above it in the two words on top of the",
+        "    ;; stack. pcmpgtb is signed, moving the first letter to -128 turns the range check into a single one",
+        "    cmp r15, stack + BR_WORD_SIZE * 2",
+        "    jb err_stack_underflow",
+        "    mov r8d, eax",
+        "    mov rsi, [r15 - BR_WORD_SIZE * 2]",
+        "    mov rdx, [r15 - BR_WORD_SIZE]",
+        "    call text_range",
+        "    mov eax, r8d",
+        "    xor eax, 0x80",
+        "    imul eax, 0x01010101",
+        "    movd xmm3, eax",
+        "    pshufd xmm3, xmm3, 0",
+        "    mov eax, 0x9A9A9A9A",
+        "    movd xmm4, eax",
+        "    pshufd xmm4, xmm4, 0",
+        "    mov eax, 0x20202020",
+        "    movd xmm5, eax",
+        "    pshufd xmm5, xmm5, 0",
+        "    xor ecx, ecx",
+        ".block:",
+        "    mov rax, rdx",
+        "    sub rax, rcx",
+        "    cmp rax, 16",
+        "    jb .tail",
+        "    movdqu xmm0, [memory + rsi + rcx]",
+        "    movdqa xmm1, xmm0",
+        "    psubb xmm1, xmm3",
+        "    movdqa xmm2, xmm4",
+        "    pcmpgtb xmm2, xmm1",
+        "    pand xmm2, xmm5",
+        "    pxor xmm0, xmm2",
+        "    movdqu [memory + rsi + rcx], xmm0",
+        "    add rcx, 16",
+        "    jmp .block",
+        ".tail:",
+        "    cmp rcx, rdx",
+        "    jae .done",
+        "    movzx eax, byte [memory + rsi + rcx]",
+        "    sub eax, r8d",
+        "    cmp eax, 26",
+        "    jae .next",
+        "    xor byte [memory + rsi + rcx], 0x20",
+        ".next:",
+        "    inc rcx",
+        "    jmp .tail",
+        ".done:",
+        "    sub r15, BR_WORD_SIZE * 2",
+        "    ret",
+        "",
+        "native_to_lower:",
+        "    mov eax, 'A'",
+        "    jmp text_flip_case",
+        "",
+        "native_to_upper:",
+        "    mov eax, 'a'",
+        "    jmp text_flip_case",
+        "",
+        "native_translate:",
+        "    ;; Byte by byte through the memory like br_translate, the table may overlap the range",
+        "    cmp r15, stack + BR_WORD_SIZE * 3",
+        "    jb err_stack_underflow",
+        "    mov rsi, [r15 - BR_WORD_SIZE]",
+        "    mov edx, 256",
+        "    call text_range",
+        "    mov rdi, rsi",
+        "    mov rsi, [r15 - BR_WORD_SIZE * 3]",
+        "    mov rdx, [r15 - BR_WORD_SIZE * 2]",
+        "    call text_range",
+        "    add rdi, memory",
+        "    add rsi, memory",
+        "    xor ecx, ecx",
+        ".byte:",
+        "    cmp rcx, rdx",
+        "    jae .done",
+        "    movzx eax, byte [rsi + rcx]",
+        "    mov al, [rdi + rax]",
+        "    mov [rsi + rcx], al",
+        "    inc rcx",
+        "    jmp .byte",
+        ".done:",
+        "    sub r15, BR_WORD_SIZE * 3",
+        "    ret",
+        "",
+        "float_sincos:",
+        "    ;; ecx - 0 for sinf, 1 for cosf. fsin and fcos reduce against a 66-bit pi, which loses the result near the",
+        "    ;; multiples of pi and gives up at 2^63. So x * 2/pi is reduced in integers first against the 1216 bits of",
+        "    ;; two_over_pi, leaving a quadrant and |r| <= pi/4, on which fsin and fcos are exact to the last bit",
+        "    mov rax, [r15 - BR_WORD_SIZE]",
+        "    mov rdx, rax",
+        "    shr rdx, 63",
+        "    btr rax, 63",
+        "    mov rsi, 0x3FE921FB54442D18",
+        "    cmp rax, rsi",
+        "    jb .small",
+        "    mov rsi, 0x7FF0000000000000",
+        "    cmp rax, rsi",
+        "    jae .nan",
+        "    ;; r9 - the quadrant, sin x = cos(x - pi/2) and sin -x = -sin x are one and two quadrants further",
+        "    mov r9d, ecx",
+        "    xor ecx, 1",
+        "    and edx, ecx",
+        "    add edx, edx",
+        "    add r9d, edx",
+        "    ;; |x| = m * 2^e, the bits of 2/pi before bit e - 1 only add multiples of 4 to x * 2/pi. two_over_pi",
+        "    ;; starts with a word of zeros, so the 192 bits from e - 1 on start at bit e + 62 = exponent - 1013",
+        "    mov rdi, rax",
+        "    shr rdi, 52",
+        "    mov rsi, 0x000FFFFFFFFFFFFF",
+        "    and rax, rsi",
+        "    bts rax, 52",
+        "    sub rdi, 1013",
+        "    mov ecx, edi",
+        "    and ecx, 63",
+        "    shr rdi, 6",
+        "    shl rdi, 3",
+        "    mov r8, rdi",
+        "    mov rdx, [two_over_pi + r8]",
+        "    mov rsi, [two_over_pi + r8 + 8]",
+        "    shld rdx, rsi, cl",
+        "    mov rdi, [two_over_pi + r8 + 16]",
+        "    shld rsi, rdi, cl",
+        "    mov r8, [two_over_pi + r8 + 24]",
+        "    shld rdi, r8, cl",
+        "    ;; m times rdx:rsi:rdi is x * 2/pi * 2^190, only its low 192 bits are needed",
+        "    mov rcx, rax",
+        "    imul rdx, rcx",
+        "    mov r8, rdx",
+        "    mov rax, rsi",
+        "    mul rcx",
+        "    add r8, rdx",
+        "    mov rsi, rax",
+        "    mov rax, rdi",
+        "    mul rcx",
+        "    add rsi, rdx",
+        "    adc r8, 0",
+        "    ;; The top two bits count quadrants, r8:rsi is the fraction f below them",
+        "    mov rdx, r8",
+        "    shr rdx, 62",
+        "    add r9d, edx",
+        "    shld r8, rsi, 2",
+        "    shld rsi, rax, 2",
+        "    ;; From f = 1/2 on it is the next quadrant with f - 1, which is r8:rsi read as signed",
+        "    mov r10, r8",
+        "    shr r10, 63",
+        "    add r9d, r10d",
+        "    test r10, r10",
+        "    jz .normalize",
+        "    not r8",
+        "    not rsi",
+        "    add rsi, 1",
+        "    adc r8, 0",
+        ".normalize:",
+        "    ;; r11 - the biased exponent of the scale that makes the top 63 bits of |f| into |f| * 2",
+        "    mov r11d, 959",
+        "    test r8, r8",
+        "    jnz .shift",
+        "    mov r8, rsi",
+        "    xor esi, esi",
+        "    sub r11d, 64",
+        "    test r8, r8",
+        "    jz .reduced",
+        ".shift:",
+        "    bsr rcx, r8",
+        "    xor ecx, 63",
+        "    shld r8, rsi, cl",
+        "    sub r11d, ecx",
+        "    shr r8, 1",
+        ".reduced:",
+        "    ;; r = f * pi/2 in the 64 bits of the x87 unit",
+        "    mov [r15 - BR_WORD_SIZE], r8",
+        "    fild qword [r15 - BR_WORD_SIZE]",
+        "    shl r11, 52",
+        "    mov [r15 - BR_WORD_SIZE], r11",
+        "    fmul qword [r15 - BR_WORD_SIZE]",
+        "    fldpi",
+        "    fmulp",
+        "    test r10, r10",
+        "    jz .quadrant",
+        "    fchs",
+        ".quadrant:",
+        "    ;; sin r, cos r, -sin r and -cos r for the quadrants 0 to 3",
+        "    test r9d, 1",
+        "    jnz .cos",
+        "    fsin",
+        "    jmp .sign",
+        ".cos:",
+        "    fcos",
+        ".sign:",
+        "    test r9d, 2",
+        "    jz .store",
+        "    fchs",
+        ".store:",
+        "    fstp qword [r15 - BR_WORD_SIZE]",
+        "    ret",
+        ".small:",
+        "    fld qword [r15 - BR_WORD_SIZE]",
+        "    test ecx, ecx",
+        "    jnz .small_cos",
+        "    fsin",
+        "    jmp .store",
+        ".small_cos:",
+        "    fcos",
+        "    jmp .store",
+        ".nan:",
+        "    ;; inf - inf is the NaN, a NaN stays one",
+        "    movsd xmm0, [r15 - BR_WORD_SIZE]",
+        "    subsd xmm0, xmm0",
+        "    movsd [r15 - BR_WORD_SIZE], xmm0",
+        "    ret",
+        "",
+        "fail:",
+        "    ;; rsi - message, rdx - length",
+        "    call out_flush",
+        "    mov eax, SYS_WRITE",
+        "    mov edi, STDERR",
+        "    syscall",
+        "    mov eax, SYS_EXIT",
+        "    mov edi, 1",
+        "    syscall",
+        "",
+        "exit:",
+        "    call out_flush",
+        "    mov eax, SYS_EXIT",
+        "    xor edi, edi",
+        "    syscall",
+};
+
+// The bits of 2/pi behind a word of zeros, float_sincos reads the 192 bits from any offset below 1034
+static const uint64_t two_over_pi[] = {
+        0x0000000000000000, 0xA2F9836E4E441529, 0xFC2757D1F534DDC0, 0xDB6295993C439041, 0xFE5163ABDEBBC561,
+        0xB7246E3A424DD2E0, 0x06492EEA09D1921C, 0xFE1DEB1CB129A73E, 0xE88235F52EBB4484, 0xE99C7026B45F7E41,
+        0x3991D639835339F4, 0x9C845F8BBDF9283B, 0x1FF897FFDE05980F, 0xEF2F118B5A0A6D1F, 0x6D367ECF27CB09B7,
+        0x4F463F669E5FEA2D, 0x7527BAC7EBE5F17B, 0x3D0739F78A5292EA, 0x6BFB5FB11F8D5D08, 0x56033046FC7B6BAB,
+};
+
+static const Err runtime_errors[] = {
+        ERR_STACK_OVERFLOW,
+        ERR_STACK_UNDERFLOW,
+        ERR_DIV_BY_ZERO,
+        ERR_ILLEGAL_INS_ACCESS,
+        ERR_ILLEGAL_OPERAND,
+        ERR_ILLEGAL_MEMORY_ACCESS,
+};
+
+static void print_err_label(Err err) {
+    const char *name = err_as_cstr(err);
+    for (size_t i = 0; name[i] != '\0'; i++) {
+        fputc(tolower((unsigned char) name[i]), out);
+    }
+}
+
+static void emit_jump(const char *mnemonic, InstAddr target) {
+    if (target > input->program_size) {
+        fprintf(out, "    %s err_illegal_ins_access\n", mnemonic);
+    } else {
+        fprintf(out, "    %s block_%"PRIu64"\n", mnemonic, target);
+    }
+}
+
+static void emit_require(uint64_t count) {
+    if (count > BR_STACK_CAPACITY) {
+        fprintf(out, "    jmp err_stack_underflow\n");
+    } else {
+        fprintf(out, "    cmp r15, stack + BR_WORD_SIZE * %"PRIu64"\n", count);
+        fprintf(out, "    jb err_stack_underflow\n");
+    }
+}
+
+static void emit_reserve(void) {
+    fprintf(out, "    cmp r15, stack + BR_WORD_SIZE * BR_STACK_CAPACITY\n");
+    fprintf(out, "    jae err_stack_overflow\n");
+}
+
+static void emit_binary(const char *op) {
+    emit_require(2);
+    fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+    fprintf(out, "    %s rax, [r15 - BR_WORD_SIZE]\n", op);
+    fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rax\n");
+    fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+}
+
+static void emit_binary_f64(const char *op) {
+    emit_require(2);
+    fprintf(out, "    movsd xmm0, [r15 - BR_WORD_SIZE * 2]\n");
+    fprintf(out, "    %s xmm0, [r15 - BR_WORD_SIZE]\n", op);
+    fprintf(out, "    movsd [r15 - BR_WORD_SIZE * 2], xmm0\n");
+    fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+}
+
+static void emit_compare(const char *set) {
+    emit_require(2);
+    fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+    fprintf(out, "    cmp rax, [r15 - BR_WORD_SIZE]\n");
+    fprintf(out, "    %s al\n", set);
+    fprintf(out, "    movzx eax, al\n");
+    fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rax\n");
+    fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+}
+
+static void emit_compare_f64(const char *set, int swapped) {
+    // ucomisd leaves CF set for unordered operands, so seta/setae are false for NaN like the C comparisons
+    emit_require(2);
+    fprintf(out, "    movsd xmm0, [r15 - BR_WORD_SIZE * %d]\n", swapped ? 1 : 2);
+    fprintf(out, "    ucomisd xmm0, [r15 - BR_WORD_SIZE * %d]\n", swapped ? 2 : 1);
+    fprintf(out, "    %s al\n", set);
+    fprintf(out, "    movzx eax, al\n");
+    fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rax\n");
+    fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+}
+
+// The float functions SSE has an instruction for work on xmm0, with rax, rcx and xmm1 as scratch
+static void emit_math_f64(InstType type) {
+    if (type == INST_SQRTF) {
+        fprintf(out, "    sqrtsd xmm0, xmm0\n");
+    } else if (type == INST_ABSF) {
+        fprintf(out, "    movq rax, xmm0\n");
+        fprintf(out, "    btr rax, 63\n");
+        fprintf(out, "    movq xmm0, rax\n");
+    } else if (type == INST_FLOORF) {
+        fprintf(out, "    roundsd xmm0, xmm0, 9\n");
+    } else if (type == INST_CEILF) {
+        fprintf(out, "    roundsd xmm0, xmm0, 10\n");
+    } else {
+        // roundsd has no mode for halves away from zero, adding the largest double below 0.5 with the sign of
+        // the operand and truncating gives the same result as round() without the double rounding of 0.5
+        fprintf(out, "    movq rax, xmm0\n");
+        fprintf(out, "    shr rax, 63\n");
+        fprintf(out, "    shl rax, 63\n");
+        fprintf(out, "    mov rcx, 0x3FDFFFFFFFFFFFFF\n");
+        fprintf(out, "    or rax, rcx\n");
+        fprintf(out, "    movq xmm1, rax\n");
+        fprintf(out, "    addsd xmm0, xmm1\n");
+        fprintf(out, "    roundsd xmm0, xmm0, 11\n");
+    }
+}
+
+static const char *shift_mnemonic(InstType type) {
+    if (type == INST_SHR) {
+        return "shr";
+    } else if (type == INST_SHL) {
+        return "shl";
+    } else if (type == INST_ROTL) {
+        return "rol";
+    }
+    return "ror";
+}
+
+// The unary bit instructions in place on one register, given by its 64, 32, 16 and 8-bit names. lzcnt and tzcnt
+// return 64 for 0 like the VM, they need a CPU with LZCNT and BMI1
+static void emit_bits(const char *reg, const char *reg32, const char *reg16, const char *reg8, InstType type) {
+    if (type == INST_POPCNT) {
+        fprintf(out, "    popcnt %s, %s\n", reg, reg);
+    } else if (type == INST_CLZ) {
+        fprintf(out, "    lzcnt %s, %s\n", reg, reg);
+    } else if (type == INST_CTZ) {
+        fprintf(out, "    tzcnt %s, %s\n", reg, reg);
+    } else if (type == INST_BSWAP) {
+        fprintf(out, "    bswap %s\n", reg);
+    } else if (type == INST_SEXT8) {
+        fprintf(out, "    movsx %s, %s\n", reg, reg8);
+    } else if (type == INST_SEXT16) {
+        fprintf(out, "    movsx %s, %s\n", reg, reg16);
+    } else {
+        fprintf(out, "    movsxd %s, %s\n", reg, reg32);
+    }
+}
+
+// The transcendental functions go through the x87 unit, which only loads and stores through memory
+static void emit_x87(InstType type) {
+    emit_require(1);
+    if (type == INST_EXPF) {
+        // The infinities would turn the reduction below into inf - inf, past +-1000 exp is inf or 0 anyway.
+        // minsd and maxsd return their source for a NaN, so it stays in the operand
+        fprintf(out, "    mov rax, 0x408F400000000000\n");
+        fprintf(out, "    movq xmm0, rax\n");
+        fprintf(out, "    minsd xmm0, [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    mov rax, 0xC08F400000000000\n");
+        fprintf(out, "    movq xmm1, rax\n");
+        fprintf(out, "    maxsd xmm1, xmm0\n");
+        fprintf(out, "    movsd [r15 - BR_WORD_SIZE], xmm1\n");
+        fprintf(out, "    ;; e^x = 2^(x * log2 e), split into the integer part for fscale and the rest for f2xm1\n");
+        // The product is recomputed instead of stored, a double would lose the low bits exp depends on
+        fprintf(out, "    fldl2e\n");
+        fprintf(out, "    fmul qword [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    fldl2e\n");
+        fprintf(out, "    fmul qword [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    frndint\n");
+        fprintf(out, "    fsubp\n");
+        fprintf(out, "    f2xm1\n");
+        fprintf(out, "    fld1\n");
+        fprintf(out, "    faddp\n");
+        fprintf(out, "    fldl2e\n");
+        fprintf(out, "    fmul qword [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    frndint\n");
+        fprintf(out, "    fxch\n");
+        fprintf(out, "    fscale\n");
+        fprintf(out, "    fxch\n");
+        fprintf(out, "    fstp qword [r15 - BR_WORD_SIZE]\n");
+    } else if (type == INST_LOGF) {
+        fprintf(out, "    fldln2\n");
+        fprintf(out, "    fld qword [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    fyl2x\n");
+    } else {
+        fprintf(out, "    mov ecx, %d\n", type == INST_COSF);
+        fprintf(out, "    call float_sincos\n");
+        return;
+    }
+    fprintf(out, "    fstp qword [r15 - BR_WORD_SIZE]\n");
+}
+
+static void emit_read(const char *load, uint64_t width) {
+    emit_require(1);
+    fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE]\n");
+    fprintf(out, "    cmp rax, BR_MEMORY_CAPACITY - %"PRIu64"\n", width - 1);
+    fprintf(out, "    jae err_illegal_memory_access\n");
+    fprintf(out, "    %s [memory + rax]\n", load);
+    fprintf(out, "    mov [r15 - BR_WORD_SIZE], rax\n");
+}
+
+static void emit_write(const char *reg) {
+    // Like the VM only the first byte is checked, memory has a word of slack behind it
+    emit_require(2);
+    fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+    fprintf(out, "    cmp rax, BR_MEMORY_CAPACITY\n");
+    fprintf(out, "    jae err_illegal_memory_access\n");
+    fprintf(out, "    mov rbx, [r15 - BR_WORD_SIZE]\n");
+    fprintf(out, "    mov [memory + rax], %s\n", reg);
+    fprintf(out, "    sub r15, BR_WORD_SIZE * 2\n");
+}
+
+static BrAtomicOp atomic_op(InstType type) {
+    if (type == INST_CAS8 || type == INST_CAS16 || type == INST_CAS32 || type == INST_CAS64) {
+        return BR_ATOMIC_CAS;
+    }
+    if (type == INST_XADD8 || type == INST_XADD16 || type == INST_XADD32 || type == INST_XADD64) {
+        return BR_ATOMIC_ADD;
+    }
+    return BR_ATOMIC_XCHG;
+}
+
+static uint64_t atomic_width(InstType type) {
+    if (type == INST_CAS8 || type == INST_XADD8 || type == INST_XCHG8) {
+        return 1;
+    }
+    if (type == INST_CAS16 || type == INST_XADD16 || type == INST_XCHG16) {
+        return 2;
+    }
+    if (type == INST_CAS32 || type == INST_XADD32 || type == INST_XCHG32) {
+        return 4;
+    }
+    return 8;
+}
+
+static void emit_atomic(BrAtomicOp op, uint64_t width) {
+    // Unlike the plain writes the whole location is checked, and it must be aligned like in the VM
+    static const char *const names[] = {"rdx", "dl", "dx", NULL, "edx", NULL, NULL, NULL, "rdx"};
+    static const char *const loads[] = {NULL, "movzx eax, al", "movzx eax, ax", NULL, "mov eax, eax"};
+    uint64_t operands = op == BR_ATOMIC_CAS ? 3 : 2;
+    emit_require(operands);
+    fprintf(out, "    mov rcx, [r15 - BR_WORD_SIZE * %"PRIu64"]\n", operands);
+    fprintf(out, "    cmp rcx, BR_MEMORY_CAPACITY - %"PRIu64"\n", width - 1);
+    fprintf(out, "    jae err_illegal_memory_access\n");
+    if (width > 1) {
+        fprintf(out, "    test ecx, %"PRIu64"\n", width - 1);
+        fprintf(out, "    jnz err_illegal_memory_access\n");
+    }
+
+    if (op == BR_ATOMIC_CAS) {
+        fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+        fprintf(out, "    mov rdx, [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    lock cmpxchg [memory + rcx], %s\n", names[width]);
+    } else {
+        fprintf(out, "    mov rdx, [r15 - BR_WORD_SIZE]\n");
+        fprintf(out, "    %s%s [memory + rcx], %s\n", op == BR_ATOMIC_ADD ? "lock " : "",
+                op == BR_ATOMIC_ADD ? "xadd" : "xchg", names[width]);
+        fprintf(out, "    mov rax, rdx\n");
+    }
+    // cmpxchg leaves rax alone when it succeeds, so the upper bits of the expected value are still there
+    if (width < 8) {
+        fprintf(out, "    %s\n", loads[width]);
+    }
+    fprintf(out, "    mov [r15 - BR_WORD_SIZE * %"PRIu64"], rax\n", operands);
+    fprintf(out, "    sub r15, BR_WORD_SIZE * %"PRIu64"\n", operands - 1);
+}
+
+// Numbers the local labels of the generated code, they only have to be unique below each instruction label
+static size_t local_labels = 0;
+
+// rbp points at the first local of the innermost frame, the word below it holds the saved frame pointer as an
+// index like in the VM. Returns 0 when the offset is outside of any stack and the access always fails
+static int emit_local_addr(uint64_t operand, const char *fail) {
+    int64_t offset = (int64_t) operand;
+    if (offset < -BR_STACK_CAPACITY || offset > BR_STACK_CAPACITY) {
+        fprintf(out, "    jmp %s\n", fail);
+        return 0;
+    }
+    if (offset < 0) {
+        fprintf(out, "    lea rax, [rbp - BR_WORD_SIZE * %"PRIi64"]\n", -offset);
+    } else {
+        fprintf(out, "    lea rax, [rbp + BR_WORD_SIZE * %"PRIi64"]\n", offset);
+    }
+    fprintf(out, "    cmp rax, stack\n");
+    fprintf(out, "    jb %s\n", fail);
+    return 1;
+}
+
+static void emit_enter(uint64_t size) {
+    if (size >= BR_STACK_CAPACITY) {
+        fprintf(out, "    jmp err_stack_overflow\n");
+        return;
+    }
+    fprintf(out, "    cmp r15, stack + BR_WORD_SIZE * (BR_STACK_CAPACITY - %"PRIu64")\n", size);
+    fprintf(out, "    jae err_stack_overflow\n");
+    fprintf(out, "    mov rax, rbp\n");
+    fprintf(out, "    sub rax, stack\n");
+    fprintf(out, "    shr rax, 3\n");
+    fprintf(out, "    mov [r15], rax\n");
+    fprintf(out, "    add r15, BR_WORD_SIZE\n");
+    fprintf(out, "    mov rbp, r15\n");
+    if (size == 0) {
+        return;
+    }
+
+    // The locals start out zeroed like in the VM
+    if (size <= 4) {
+        for (uint64_t k = 0; k < size; k++) {
+            fprintf(out, "    mov qword [r15 + BR_WORD_SIZE * %"PRIu64"], 0\n", k);
+        }
+        fprintf(out, "    add r15, BR_WORD_SIZE * %"PRIu64"\n", size);
+    } else {
+        size_t label = local_labels++;
+        fprintf(out, "    mov ecx, %"PRIu64"\n", size);
+        fprintf(out, ".zero_%zu:\n", label);
+        fprintf(out, "    mov qword [r15], 0\n");
+        fprintf(out, "    add r15, BR_WORD_SIZE\n");
+        fprintf(out, "    dec rcx\n");
+        fprintf(out, "    jnz .zero_%zu\n", label);
+    }
+}
+
+static void emit_leave(void) {
+    fprintf(out, "    cmp rbp, stack\n");
+    fprintf(out, "    je err_stack_underflow\n");
+    fprintf(out, "    cmp rbp, r15\n");
+    fprintf(out, "    ja err_stack_underflow\n");
+    fprintf(out, "    mov rax, [rbp - BR_WORD_SIZE]\n");
+    fprintf(out, "    mov rcx, rbp\n");
+    fprintf(out, "    sub rcx, stack\n");
+    fprintf(out, "    shr rcx, 3\n");
+    fprintf(out, "    cmp rax, rcx\n");
+    fprintf(out, "    jae err_stack_underflow\n");
+    fprintf(out, "    lea r15, [rbp - BR_WORD_SIZE]\n");
+    fprintf(out, "    shl rax, 3\n");
+    fprintf(out, "    add rax, stack\n");
+    fprintf(out, "    mov rbp, rax\n");
+}
+
+// Jumps to the instruction whose address the register holds. Every site has an indirect jump of its own, so the
+// branch predictor keeps the targets of a ret or callr apart from those of the others
+static void emit_indirect_jump(const char *reg) {
+    fprintf(out, "    cmp %s, %zu\n", reg, input->program_size);
+    fprintf(out, "    jae err_illegal_ins_access\n");
+    fprintf(out, "    jmp [inst_map + %s * BR_WORD_SIZE]\n", reg);
+}
+
+// Jumps through the entry rax indexes, or to the instruction behind the jmptable when rax is past the entries
+static void emit_table_jump(size_t i, uint64_t table) {
+    if (table >= BR_MEMORY_CAPACITY - 7) {
+        fprintf(out, "    jmp err_illegal_memory_access\n");
+        return;
+    }
+    fprintf(out, "    cmp rax, [memory + %"PRIu64"]\n", table);
+    emit_jump("jae", i + 1);
+    fprintf(out, "    cmp rax, %"PRIu64"\n", (uint64_t) BR_JMPTABLE_LIMIT(table));
+    fprintf(out, "    jae err_illegal_memory_access\n");
+    fprintf(out, "    mov rax, [memory + %"PRIu64" + rax * BR_WORD_SIZE]\n", table + BR_WORD_SIZE);
+    emit_indirect_jump("rax");
+}
+
+static void emit_checked_inst(size_t i, Inst inst) {
+    switch (inst.type) {
+        case INST_NOP:
+            break;
+        case INST_DUP:
+            fprintf(out, "    ;; dup %"PRIu64"\n", inst.operand.as_u64);
+            emit_reserve();
+            emit_require(inst.operand.as_u64 + 1);
+            if (inst.operand.as_u64 < BR_STACK_CAPACITY) {
+                fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * %"PRIu64"]\n", inst.operand.as_u64 + 1);
+                fprintf(out, "    mov [r15], rax\n");
+                fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            }
+            break;
+        case INST_SWAP:
+            fprintf(out, "    ;; swap %"PRIu64"\n", inst.operand.as_u64);
+            emit_require(inst.operand.as_u64 + 1);
+            if (inst.operand.as_u64 > 0 && inst.operand.as_u64 < BR_STACK_CAPACITY) {
+                fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE]\n");
+                fprintf(out, "    mov rbx, [r15 - BR_WORD_SIZE * %"PRIu64"]\n", inst.operand.as_u64 + 1);
+                fprintf(out, "    mov [r15 - BR_WORD_SIZE * %"PRIu64"], rax\n", inst.operand.as_u64 + 1);
+                fprintf(out, "    mov [r15 - BR_WORD_SIZE], rbx\n");
+            }
+            break;
+        case INST_ENTER:
+            fprintf(out, "    ;; enter %"PRIu64"\n", inst.operand.as_u64);
+            emit_enter(inst.operand.as_u64);
+            break;
+        case INST_LEAVE:
+            fprintf(out, "    ;; leave\n");
+            emit_leave();
+            break;
+        case INST_LOAD_LOCAL:
+            fprintf(out, "    ;; load.local %"PRIi64"\n", inst.operand.as_i64);
+            emit_reserve();
+            if (emit_local_addr(inst.operand.as_u64, "err_stack_underflow")) {
+                fprintf(out, "    cmp rax, r15\n");
+                fprintf(out, "    jae err_stack_underflow\n");
+                fprintf(out, "    mov rax, [rax]\n");
+                fprintf(out, "    mov [r15], rax\n");
+                fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            }
+            break;
+        case INST_STORE_LOCAL:
+            // With an empty stack the second compare fails too, as the slot is never below stack
+            fprintf(out, "    ;; store.local %"PRIi64"\n", inst.operand.as_i64);
+            if (emit_local_addr(inst.operand.as_u64, "err_stack_underflow")) {
+                fprintf(out, "    lea rcx, [r15 - BR_WORD_SIZE]\n");
+                fprintf(out, "    cmp rax, rcx\n");
+                fprintf(out, "    jae err_stack_underflow\n");
+                fprintf(out, "    mov rcx, [r15 - BR_WORD_SIZE]\n");
+                fprintf(out, "    mov [rax], rcx\n");
+                fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            }
+            break;
+        case INST_PUSH:
+            fprintf(out, "    ;; push %"PRIu64"\n", inst.operand.as_u64);
+            emit_reserve();
+            fprintf(out, "    mov rax, %"PRIu64"\n", inst.operand.as_u64);
+            fprintf(out, "    mov [r15], rax\n");
+            fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            break;
+        case INST_POP:
+            fprintf(out, "    ;; pop\n");
+            emit_require(1);
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            break;
+        case INST_PLUSI:
+            fprintf(out, "    ;; plusi\n");
+            emit_binary("add");
+            break;
+        case INST_MINUSI:
+            fprintf(out, "    ;; minusi\n");
+            emit_binary("sub");
+            break;
+        case INST_MULTI:
+            fprintf(out, "    ;; multi\n");
+            emit_binary("imul");
+            break;
+        case INST_DIVI:
+        case INST_MODI:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(2);
+            fprintf(out, "    mov rbx, [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    test rbx, rbx\n");
+            fprintf(out, "    jz err_div_by_zero\n");
+            fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+            fprintf(out, "    xor edx, edx\n");
+            fprintf(out, "    div rbx\n");
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], %s\n", inst.type == INST_DIVI ? "rax" : "rdx");
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            break;
+        case INST_GEI:
+            fprintf(out, "    ;; gei\n");
+            emit_compare("setae");
+            break;
+        case INST_LEI:
+            fprintf(out, "    ;; lei\n");
+            emit_compare("setbe");
+            break;
+        case INST_LI:
+            fprintf(out, "    ;; li\n");
+            emit_compare("setb");
+            break;
+        case INST_NEI:
+            fprintf(out, "    ;; nei\n");
+            emit_compare("setne");
+            break;
+        case INST_GI:
+            fprintf(out, "    ;; gi\n");
+            emit_compare("seta");
+            break;
+        case INST_EQI:
+            fprintf(out, "    ;; eqi\n");
+            emit_compare("sete");
+            break;
+        case INST_PLUSF:
+            fprintf(out, "    ;; plusf\n");
+            emit_binary_f64("addsd");
+            break;
+        case INST_MINUSF:
+            fprintf(out, "    ;; minusf\n");
+            emit_binary_f64("subsd");
+            break;
+        case INST_MULTF:
+            fprintf(out, "    ;; multf\n");
+            emit_binary_f64("mulsd");
+            break;
+        case INST_DIVF:
+            fprintf(out, "    ;; divf\n");
+            emit_binary_f64("divsd");
+            break;
+        case INST_GEF:
+            fprintf(out, "    ;; gef\n");
+            emit_compare_f64("setae", 0);
+            break;
+        case INST_GF:
+            fprintf(out, "    ;; gf\n");
+            emit_compare_f64("seta", 0);
+            break;
+        case INST_LEF:
+            fprintf(out, "    ;; lef\n");
+            emit_compare_f64("setae", 1);
+            break;
+        case INST_LF:
+            fprintf(out, "    ;; lf\n");
+            emit_compare_f64("seta", 1);
+            break;
+        case INST_NEF:
+        case INST_EQF:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(2);
+            fprintf(out, "    movsd xmm0, [r15 - BR_WORD_SIZE * 2]\n");
+            fprintf(out, "    ucomisd xmm0, [r15 - BR_WORD_SIZE]\n");
+            if (inst.type == INST_EQF) {
+                fprintf(out, "    sete al\n");
+                fprintf(out, "    setnp cl\n");
+                fprintf(out, "    and al, cl\n");
+            } else {
+                fprintf(out, "    setne al\n");
+                fprintf(out, "    setp cl\n");
+                fprintf(out, "    or al, cl\n");
+            }
+            fprintf(out, "    movzx eax, al\n");
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rax\n");
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            break;
+        case INST_ANDB:
+            fprintf(out, "    ;; andb\n");
+            emit_binary("and");
+            break;
+        case INST_ORB:
+            fprintf(out, "    ;; orb\n");
+            emit_binary("or");
+            break;
+        case INST_XOR:
+            fprintf(out, "    ;; xor\n");
+            emit_binary("xor");
+            break;
+        case INST_SHR:
+        case INST_SHL:
+        case INST_ROTL:
+        case INST_ROTR:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(2);
+            fprintf(out, "    mov rcx, [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+            fprintf(out, "    %s rax, cl\n", shift_mnemonic(inst.type));
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rax\n");
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            break;
+        case INST_NOTB:
+            fprintf(out, "    ;; notb\n");
+            emit_require(1);
+            fprintf(out, "    not qword [r15 - BR_WORD_SIZE]\n");
+            break;
+        case INST_CALL:
+            fprintf(out, "    ;; call %"PRIu64"\n", inst.operand.as_u64);
+            emit_reserve();
+            fprintf(out, "    mov rax, %zu\n", i);
+            fprintf(out, "    mov [r15], rax\n");
+            fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            emit_jump("jmp", inst.operand.as_u64);
+            break;
+        case INST_INT:
+            fprintf(out, "    ;; int %"PRIu64"\n", inst.operand.as_u64);
+            if (inst.operand.as_u64 < BR_NATIVES_COUNT) {
+                fprintf(out, "    call %s\n", natives[inst.operand.as_u64]);
+            } else {
+                fprintf(out, "    jmp err_illegal_operand\n");
+            }
+            break;
+        case INST_JMP:
+            fprintf(out, "    ;; jmp %"PRIu64"\n", inst.operand.as_u64);
+            emit_jump("jmp", inst.operand.as_u64);
+            break;
+        case INST_JMP_IF:
+            fprintf(out, "    ;; jmpif %"PRIu64"\n", inst.operand.as_u64);
+            emit_require(1);
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            fprintf(out, "    cmp qword [r15], 0\n");
+            emit_jump("jne", inst.operand.as_u64);
+            break;
+        case INST_RET:
+            fprintf(out, "    ;; ret\n");
+            emit_require(1);
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            fprintf(out, "    mov rax, [r15]\n");
+            fprintf(out, "    inc rax\n");
+            emit_indirect_jump("rax");
+            break;
+        case INST_CALLR:
+            fprintf(out, "    ;; callr\n");
+            emit_require(1);
+            fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    mov qword [r15 - BR_WORD_SIZE], %zu\n", i);
+            emit_indirect_jump("rax");
+            break;
+        case INST_JMPTABLE:
+            fprintf(out, "    ;; jmptable %"PRIu64"\n", inst.operand.as_u64);
+            emit_require(1);
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            fprintf(out, "    mov rax, [r15]\n");
+            emit_table_jump(i, inst.operand.as_u64);
+            break;
+        case INST_READ8:
+            fprintf(out, "    ;; read8\n");
+            emit_read("movzx eax, byte", 1);
+            break;
+        case INST_READ16:
+            fprintf(out, "    ;; read16\n");
+            emit_read("movzx eax, word", 2);
+            break;
+        case INST_READ32:
+            fprintf(out, "    ;; read32\n");
+            emit_read("mov eax, dword", 4);
+            break;
+        case INST_READ64:
+            fprintf(out, "    ;; read64\n");
+            emit_read("mov rax, qword", 8);
+            break;
+        case INST_WRITE8:
+            fprintf(out, "    ;; write8\n");
+            emit_write("bl");
+            break;
+        case INST_WRITE16:
+            fprintf(out, "    ;; write16\n");
+            emit_write("bx");
+            break;
+        case INST_WRITE32:
+            fprintf(out, "    ;; write32\n");
+            emit_write("ebx");
+            break;
+        case INST_WRITE64:
+            fprintf(out, "    ;; write64\n");
+            emit_write("rbx");
+            break;
+        case INST_READ8_DISP:
+        case INST_READ16_DISP:
+        case INST_READ32_DISP:
+        case INST_READ64_DISP:
+        case INST_WRITE8_DISP:
+        case INST_WRITE16_DISP:
+        case INST_WRITE32_DISP:
+        case INST_WRITE64_DISP:
+        case INST_READ8_IDX:
+        case INST_READ16_IDX:
+        case INST_READ32_IDX:
+        case INST_READ64_IDX:
+        case INST_WRITE8_IDX:
+        case INST_WRITE16_IDX:
+        case INST_WRITE32_IDX:
+        case INST_WRITE64_IDX: {
+            // The whole address replaces the base, then the plain read or write checks and accesses it
+            InstType form = inst_memory_form(inst.type);
+            uint64_t operands = inst_stack_pops(inst.type);
+            uint64_t disp = inst.operand.as_u64;
+            fprintf(out, "    ;; %s %"PRIu64"\n", inst_asm_name(inst.type), inst.operand.as_u64);
+            emit_require(operands);
+            if (inst.type == inst_indexed_form(form)) {
+                fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * %"PRIu64"]\n", operands - 1);
+                if (BR_INDEX_SHIFT(inst.operand.as_u64) > 0) {
+                    fprintf(out, "    shl rax, %"PRIu64"\n", BR_INDEX_SHIFT(inst.operand.as_u64));
+                }
+                fprintf(out, "    add [r15 - BR_WORD_SIZE * %"PRIu64"], rax\n", operands);
+                if (operands == 3) {
+                    fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE]\n");
+                    fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rax\n");
+                }
+                fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+                operands--;
+                disp = BR_INDEX_DISP(inst.operand.as_u64);
+            }
+            if (disp != 0) {
+                fprintf(out, "    mov rax, %"PRIu64"\n", disp);
+                fprintf(out, "    add [r15 - BR_WORD_SIZE * %"PRIu64"], rax\n", operands);
+            }
+            emit_checked_inst(i, (Inst) {.type = form});
+        }
+            break;
+        case INST_I2F:
+            fprintf(out, "    ;; i2f\n");
+            emit_require(1);
+            fprintf(out, "    cvtsi2sd xmm0, qword [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    movsd [r15 - BR_WORD_SIZE], xmm0\n");
+            break;
+        case INST_I2U:
+            fprintf(out, "    ;; i2u\n");
+            emit_require(1);
+            break;
+        case INST_U2F:
+            fprintf(out, "    ;; u2f\n");
+            emit_require(1);
+            fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    test rax, rax\n");
+            fprintf(out, "    js .halve\n");
+            fprintf(out, "    cvtsi2sd xmm0, rax\n");
+            fprintf(out, "    jmp .store\n");
+            fprintf(out, ".halve:\n");
+            fprintf(out, "    ;; keeps the lowest bit so the rounding matches a direct conversion\n");
+            fprintf(out, "    mov rcx, rax\n");
+            fprintf(out, "    shr rcx, 1\n");
+            fprintf(out, "    and eax, 1\n");
+            fprintf(out, "    or rcx, rax\n");
+            fprintf(out, "    cvtsi2sd xmm0, rcx\n");
+            fprintf(out, "    addsd xmm0, xmm0\n");
+            fprintf(out, ".store:\n");
+            fprintf(out, "    movsd [r15 - BR_WORD_SIZE], xmm0\n");
+            break;
+        case INST_U2I:
+            fprintf(out, "    ;; u2i\n");
+            emit_require(1);
+            fprintf(out, "    movsxd rax, dword [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE], rax\n");
+            break;
+        case INST_F2I:
+        case INST_F2U:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(1);
+            fprintf(out, "    cvttsd2si rax, qword [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE], rax\n");
+            break;
+        case INST_NOT:
+            fprintf(out, "    ;; not\n");
+            emit_require(1);
+            fprintf(out, "    cmp qword [r15 - BR_WORD_SIZE], 0\n");
+            fprintf(out, "    sete al\n");
+            fprintf(out, "    movzx eax, al\n");
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE], rax\n");
+            break;
+        case INST_HALT:
+            fprintf(out, "    ;; halt\n");
+            fprintf(out, "    jmp exit\n");
+            break;
+        case INST_CAS8:
+        case INST_CAS16:
+        case INST_CAS32:
+        case INST_CAS64:
+        case INST_XADD8:
+        case INST_XADD16:
+        case INST_XADD32:
+        case INST_XADD64:
+        case INST_XCHG8:
+        case INST_XCHG16:
+        case INST_XCHG32:
+        case INST_XCHG64:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_atomic(atomic_op(inst.type), atomic_width(inst.type));
+            break;
+        case INST_FENCE:
+            fprintf(out, "    ;; fence\n");
+            fprintf(out, "    mfence\n");
+            break;
+        case INST_SQRTF:
+        case INST_ABSF:
+        case INST_FLOORF:
+        case INST_CEILF:
+        case INST_ROUNDF:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(1);
+            fprintf(out, "    movsd xmm0, [r15 - BR_WORD_SIZE]\n");
+            emit_math_f64(inst.type);
+            fprintf(out, "    movsd [r15 - BR_WORD_SIZE], xmm0\n");
+            break;
+        case INST_MINF:
+            fprintf(out, "    ;; minf\n");
+            emit_binary_f64("minsd");
+            break;
+        case INST_MAXF:
+            fprintf(out, "    ;; maxf\n");
+            emit_binary_f64("maxsd");
+            break;
+        case INST_FMAF:
+            fprintf(out, "    ;; fmaf\n");
+            emit_require(3);
+            fprintf(out, "    movsd xmm0, [r15 - BR_WORD_SIZE]\n");
+            fprintf(out, "    movsd xmm1, [r15 - BR_WORD_SIZE * 3]\n");
+            fprintf(out, "    movsd xmm2, [r15 - BR_WORD_SIZE * 2]\n");
+            fprintf(out, "    vfmadd231sd xmm0, xmm1, xmm2\n");
+            fprintf(out, "    movsd [r15 - BR_WORD_SIZE * 3], xmm0\n");
+            fprintf(out, "    sub r15, BR_WORD_SIZE * 2\n");
+            break;
+        case INST_SINF:
+        case INST_COSF:
+        case INST_EXPF:
+        case INST_LOGF:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_x87(inst.type);
+            break;
+        case INST_POPCNT:
+        case INST_CLZ:
+        case INST_CTZ:
+        case INST_BSWAP:
+        case INST_SEXT8:
+        case INST_SEXT16:
+        case INST_SEXT32:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(1);
+            fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE]\n");
+            emit_bits("rax", "eax", "ax", "al", inst.type);
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE], rax\n");
+            break;
+        case INST_MULHU:
+        case INST_MULHI:
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+            emit_require(2);
+            fprintf(out, "    mov rax, [r15 - BR_WORD_SIZE * 2]\n");
+            fprintf(out, "    %s qword [r15 - BR_WORD_SIZE]\n", inst.type == INST_MULHU ? "mul" : "imul");
+            fprintf(out, "    mov [r15 - BR_WORD_SIZE * 2], rdx\n");
+            fprintf(out, "    sub r15, BR_WORD_SIZE\n");
+            break;
+        case INST_PLUSI_IMM:
+        case INST_MINUSI_IMM:
+        case INST_MULTI_IMM:
+        case INST_DIVI_IMM:
+        case INST_MODI_IMM:
+        case INST_GEI_IMM:
+        case INST_LEI_IMM:
+        case INST_LI_IMM:
+        case INST_NEI_IMM:
+        case INST_GI_IMM:
+        case INST_EQI_IMM:
+        case INST_PLUSF_IMM:
+        case INST_MINUSF_IMM:
+        case INST_MULTF_IMM:
+        case INST_DIVF_IMM:
+        case INST_GEF_IMM:
+        case INST_GF_IMM:
+        case INST_LEF_IMM:
+        case INST_LF_IMM:
+        case INST_NEF_IMM:
+        case INST_EQF_IMM:
+        case INST_ANDB_IMM:
+        case INST_ORB_IMM:
+        case INST_XOR_IMM:
+        case INST_SHR_IMM:
+        case INST_SHL_IMM:
+            // The operand goes into the slack word above the stack, so a full stack does not overflow here
+            fprintf(out, "    ;; %s %"PRIu64"\n", inst_asm_name(inst.type), inst.operand.as_u64);
+            emit_require(1);
+            fprintf(out, "    mov rax, %"PRIu64"\n", inst.operand.as_u64);
+            fprintf(out, "    mov [r15], rax\n");
+            fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            emit_checked_inst(i, (Inst) {.type = inst_binary_form(inst.type)});
+            break;
+        case INST_SPAWN:
+        case INST_YIELD:
+        case INST_JOIN:
+        case INST_THREAD:
+        case INST_TJOIN:
+        case INST_CHAN:
+        case INST_SEND:
+        case INST_RECV:
+        case INST_TRYSEND:
+        case INST_TRYRECV:
+        case SIZE:
+        default:
+            assert(0 && "Unknown instruction");
+            break;
+    }
+}
+
+// Instructions that start a basic block: jump and call targets, code addresses pushed as values,
+// return points and whatever follows a transfer of control or a native call
+static uint8_t *leaders = NULL;
+
+static void find_leaders(void) {
+    size_t n = input->program_size;
+    leaders = calloc(n + 1, sizeof(leaders[0]));
+    assert(leaders != NULL && "find_leaders: out of memory");
+
+    if (input->entry < n) {
+        leaders[input->entry] = 1;
+    }
+    for (size_t i = 0; i < n; i++) {
+        Inst inst = input->program[i];
+        if (inst_targets_code(inst.type) && inst.operand.as_u64 < n) {
+            leaders[inst.operand.as_u64] = 1;
+        }
+        // enter and leave move the stack by an amount the block bounds check does not know
+        if (inst_targets_code(inst.type) || inst.type == INST_RET || inst.type == INST_HALT
+            || inst.type == INST_INT || inst.type == INST_ENTER || inst.type == INST_LEAVE
+            || inst.type == INST_JMPTABLE || inst.type == INST_CALLR) {
+            leaders[i + 1] = 1;
+        }
+    }
+    for (size_t i = 0; i < input->code_refs_size; i++) {
+        uint64_t target = input->program[input->code_refs[i]].operand.as_u64;
+        if (target < n) {
+            leaders[target] = 1;
+        }
+    }
+    for (size_t i = 0; i < input->table_entries_size; i++) {
+        uint64_t target = basm_table_target(input, i);
+        if (target < n) {
+            leaders[target] = 1;
+        }
+    }
+    leaders[0] = 1;
+    leaders[n] = 1;
+}
+
+static size_t block_end(size_t start) {
+    size_t end = start + 1;
+    while (!leaders[end]) {
+        end++;
+    }
+    return end;
+}
+
+static int block_falls_through(InstType type) {
+    return type != INST_JMP && type != INST_CALL && type != INST_CALLR && type != INST_RET && type != INST_HALT;
+}
+
+// Registers that hold stack slots inside a block, rax, rcx and rdx stay free as scratch
+#define REGS_COUNT 10
+static const char *const regs64[REGS_COUNT] = {"rbx", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14"};
+static const char *const regs32[REGS_COUNT] = {"ebx", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d"};
+static const char *const regs16[REGS_COUNT] = {"bx", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w"};
+static const char *const regs8[REGS_COUNT] = {"bl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b"};
+
+#define VSTACK_CAPACITY 32
+
+typedef struct {
+    int reg; // index into regs64, negative for a constant
+    Word value;
+    int64_t home; // the stack slot below r15 the register was loaded from and still matches, 0 for none
+} Slot;
+
+// The top vstack_size values of the BM's stack while a block is compiled. They live in registers or are
+// known constants, and vstack_popped slots right below r15 are already taken off the stack
+static Slot vstack[VSTACK_CAPACITY];
+static size_t vstack_size = 0;
+static size_t vstack_popped = 0;
+static int regs_used[REGS_COUNT];
+
+static size_t regs_free(void) {
+    size_t count = 0;
+    for (size_t i = 0; i < REGS_COUNT; i++) {
+        count += !regs_used[i];
+    }
+    return count;
+}
+
+static int reg_alloc(void) {
+    for (int i = 0; i < REGS_COUNT; i++) {
+        if (!regs_used[i]) {
+            regs_used[i] = 1;
+            return i;
+        }
+    }
+    assert(0 && "reg_alloc: vstack_prepare must reserve the registers");
+    return -1;
+}
+
+static void slot_release(Slot slot) {
+    if (slot.reg >= 0) {
+        regs_used[slot.reg] = 0;
+    }
+}
+
+static int fits_i32(Word value) {
+    return value.as_i64 >= INT32_MIN && value.as_i64 <= INT32_MAX;
+}
+
+// Prints the address of the stack slot `words` words away from r15
+static void print_stack_addr(int64_t words) {
+    if (words == 0) {
+        fprintf(out, "[r15]");
+    } else if (words > 0) {
+        fprintf(out, "[r15 + BR_WORD_SIZE * %"PRIi64"]", words);
+    } else {
+        fprintf(out, "[r15 - BR_WORD_SIZE * %"PRIi64"]", -words);
+    }
+}
+
+// Returns the slot as a source operand, constants that do not fit an imm32 go through rax
+static const char *slot_operand(Slot slot) {
+    static char buffer[32];
+    if (slot.reg >= 0) {
+        return regs64[slot.reg];
+    }
+    if (fits_i32(slot.value)) {
+        snprintf(buffer, sizeof(buffer), "%"PRIi64, slot.value.as_i64);
+        return buffer;
+    }
+    fprintf(out, "    mov rax, %"PRIu64"\n", slot.value.as_u64);
+    return "rax";
+}
+
+static void store_slot(int64_t words, Slot slot) {
+    const char *operand = slot_operand(slot);
+    fprintf(out, "    mov qword ");
+    print_stack_addr(words);
+    fprintf(out, ", %s\n", operand);
+}
+
+static int slot_to_reg(Slot slot) {
+    if (slot.reg >= 0) {
+        return slot.reg;
+    }
+    int reg = reg_alloc();
+    fprintf(out, "    mov %s, %"PRIu64"\n", regs64[reg], slot.value.as_u64);
+    return reg;
+}
+
+static void load_xmm(int xmm, Slot slot) {
+    if (slot.reg >= 0) {
+        fprintf(out, "    movq xmm%d, %s\n", xmm, regs64[slot.reg]);
+    } else {
+        fprintf(out, "    mov rax, %"PRIu64"\n", slot.value.as_u64);
+        fprintf(out, "    movq xmm%d, rax\n", xmm);
+    }
+}
+
+// A register for a result computed in scratch registers, reusing one of the operands when possible
+static int result_reg(Slot a, Slot b) {
+    if (a.reg >= 0) {
+        slot_release(b);
+        return a.reg;
+    }
+    if (b.reg >= 0) {
+        return b.reg;
+    }
+    return reg_alloc();
+}
+
+static void vstack_push_reg(int reg) {
+    vstack[vstack_size++] = (Slot) {.reg = reg};
+}
+
+static void vstack_push_value(Word value) {
+    vstack[vstack_size++] = (Slot) {.reg = -1, .value = value};
+}
+
+static Slot vstack_pop(void) {
+    return vstack[--vstack_size];
+}
+
+// Writes the virtual stack back and moves r15 to where the VM's stack top is
+static void vstack_flush(void) {
+    for (size_t i = 0; i < vstack_size; i++) {
+        int64_t words = (int64_t) i - (int64_t) vstack_popped;
+        if (vstack[i].reg < 0 || vstack[i].home >= 0 || vstack[i].home != words) {
+            store_slot(words, vstack[i]);
+        }
+        slot_release(vstack[i]);
+    }
+    int64_t delta = (int64_t) vstack_size - (int64_t) vstack_popped;
+    if (delta > 0) {
+        fprintf(out, "    add r15, BR_WORD_SIZE * %"PRIi64"\n", delta);
+    } else if (delta < 0) {
+        fprintf(out, "    sub r15, BR_WORD_SIZE * %"PRIi64"\n", -delta);
+    }
+    vstack_size = 0;
+    vstack_popped = 0;
+}
+
+// Brings the top `operands` slots into the virtual stack and makes sure `extra` registers are free.
+// The bounds check at the block entry already guarantees the slots loaded from memory exist
+static void vstack_prepare(size_t operands, size_t extra) {
+    size_t missing = operands > vstack_size ? operands - vstack_size : 0;
+    if (regs_free() < missing + extra || vstack_size + missing + 1 >= VSTACK_CAPACITY) {
+        vstack_flush();
+        missing = operands;
+    }
+    for (; missing > 0; missing--) {
+        int reg = reg_alloc();
+        fprintf(out, "    mov %s, ", regs64[reg]);
+        print_stack_addr(-(int64_t) vstack_popped - 1);
+        fprintf(out, "\n");
+        memmove(vstack + 1, vstack, vstack_size * sizeof(vstack[0]));
+        vstack[0] = (Slot) {.reg = reg, .home = -(int64_t) vstack_popped - 1};
+        vstack_size++;
+        vstack_popped++;
+    }
+}
+
+static void emit_block_jump(const char *mnemonic, uint64_t target) {
+    if (target > input->program_size) {
+        fprintf(out, "    %s err_illegal_ins_access\n", mnemonic);
+    } else {
+        fprintf(out, "    %s %s_%"PRIu64"\n", mnemonic, leaders[target] ? "block" : "inst", target);
+    }
+}
+
+static void emit_fast_binary(const char *op) {
+    vstack_prepare(2, 1);
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    int dest = slot_to_reg(a);
+    const char *operand = slot_operand(b);
+    fprintf(out, "    %s %s, %s\n", op, regs64[dest], operand);
+    slot_release(b);
+    vstack_push_reg(dest);
+}
+
+static void emit_fast_compare(const char *set) {
+    vstack_prepare(2, 1);
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    int dest = slot_to_reg(a);
+    const char *operand = slot_operand(b);
+    fprintf(out, "    cmp %s, %s\n", regs64[dest], operand);
+    fprintf(out, "    %s al\n", set);
+    fprintf(out, "    movzx %s, al\n", regs32[dest]);
+    slot_release(b);
+    vstack_push_reg(dest);
+}
+
+static void emit_fast_binary_f64(const char *op) {
+    vstack_prepare(2, 1);
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    load_xmm(0, a);
+    load_xmm(1, b);
+    fprintf(out, "    %s xmm0, xmm1\n", op);
+    int dest = result_reg(a, b);
+    fprintf(out, "    movq %s, xmm0\n", regs64[dest]);
+    vstack_push_reg(dest);
+}
+
+static void emit_fast_math_f64(InstType type) {
+    vstack_prepare(1, 1);
+    Slot a = vstack_pop();
+    load_xmm(0, a);
+    emit_math_f64(type);
+    int dest = a.reg >= 0 ? a.reg : reg_alloc();
+    fprintf(out, "    movq %s, xmm0\n", regs64[dest]);
+    vstack_push_reg(dest);
+}
+
+static void emit_fast_fma(void) {
+    vstack_prepare(3, 1);
+    Slot c = vstack_pop();
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    load_xmm(0, c);
+    load_xmm(1, a);
+    load_xmm(2, b);
+    fprintf(out, "    vfmadd231sd xmm0, xmm1, xmm2\n");
+    int dest = result_reg(a, b);
+    slot_release(c);
+    fprintf(out, "    movq %s, xmm0\n", regs64[dest]);
+    vstack_push_reg(dest);
+}
+
+static void emit_fast_compare_f64(InstType type, const char *set, int swapped) {
+    vstack_prepare(2, 1);
+    Slot b = vstack_pop();
+    Slot a = vstack_pop();
+    load_xmm(0, swapped ? b : a);
+    load_xmm(1, swapped ? a : b);
+    fprintf(out, "    ucomisd xmm0, xmm1\n");
+    fprintf(out, "    %s al\n", set);
+    if (type == INST_EQF) {
+        fprintf(out, "    setnp cl\n");
+        fprintf(out, "    and al, cl\n");
+    } else if (type == INST_NEF) {
+        fprintf(out, "    setp cl\n");
+        fprintf(out, "    or al, cl\n");
+    }
+    int dest = result_reg(a, b);
+    fprintf(out, "    movzx %s, al\n", regs32[dest]);
+    vstack_push_reg(dest);
+}
+
+// Pops the operands the address of a read or write is made of, which vstack_prepare already brought in, and
+// returns the address as a constant or in the register of one of them
+static Slot emit_fast_address(Inst inst) {
+    InstType form = inst_memory_form(inst.type);
+    if (inst.type == form) {
+        return vstack_pop();
+    }
+
+    uint64_t disp = inst.operand.as_u64;
+    Slot base;
+    int dest;
+    if (inst.type == inst_indexed_form(form)) {
+        uint64_t shift = BR_INDEX_SHIFT(inst.operand.as_u64);
+        disp = BR_INDEX_DISP(inst.operand.as_u64);
+        Slot index = vstack_pop();
+        base = vstack_pop();
+        if (index.reg < 0) {
+            disp += index.value.as_u64 << shift;
+        } else {
+            dest = index.reg;
+            if (shift > 0) {
+                fprintf(out, "    shl %s, %"PRIu64"\n", regs64[dest], shift);
+            }
+            const char *operand = slot_operand(base);
+            fprintf(out, "    add %s, %s\n", regs64[dest], operand);
+            slot_release(base);
+            base = index;
+        }
+    } else {
+        base = vstack_pop();
+    }
+
+    if (base.reg < 0) {
+        base.value.as_u64 += disp;
+        return base;
+    }
+    dest = base.reg;
+    if (fits_i32((Word) {.as_u64 = disp})) {
+        if (disp != 0) {
+            fprintf(out, "    add %s, %"PRIi64"\n", regs64[dest], (int64_t) disp);
+        }
+    } else {
+        fprintf(out, "    mov rax, %"PRIu64"\n", disp);
+        fprintf(out, "    add %s, rax\n", regs64[dest]);
+    }
+    return (Slot) {.reg = dest};
+}
+
+static void emit_fast_read(Inst inst) {
+    uint64_t width = inst_memory_width(inst.type);
+    vstack_prepare(inst_stack_pops(inst.type), 1);
+    Slot a = emit_fast_address(inst);
+    if (a.reg < 0 && a.value.as_u64 >= BR_MEMORY_CAPACITY - (width - 1)) {
+        fprintf(out, "    jmp err_illegal_memory_access\n");
+        vstack_push_value(a.value);
+        return;
+    }
+
+    char addr[64];
+    int dest;
+    if (a.reg < 0) {
+        dest = reg_alloc();
+        snprintf(addr, sizeof(addr), "memory + %"PRIu64, a.value.as_u64);
+    } else {
+        dest = a.reg;
+        fprintf(out, "    cmp %s, BR_MEMORY_CAPACITY - %"PRIu64"\n", regs64[dest], width - 1);
+        fprintf(out, "    jae err_illegal_memory_access\n");
+        snprintf(addr, sizeof(addr), "memory + %s", regs64[dest]);
+    }
+    switch (width) {
+        case 1:
+            fprintf(out, "    movzx %s, byte [%s]\n", regs32[dest], addr);
+            break;
+        case 2:
+            fprintf(out, "    movzx %s, word [%s]\n", regs32[dest], addr);
+            break;
+        case 4:
+            fprintf(out, "    mov %s, dword [%s]\n", regs32[dest], addr);
+            break;
+        default:
+            fprintf(out, "    mov %s, qword [%s]\n", regs64[dest], addr);
+            break;
+    }
+    vstack_push_reg(dest);
+}
+
+static void emit_fast_write(Inst inst) {
+    // Like the VM only the first byte is checked, memory has a word of slack behind it
+    uint64_t width = inst_memory_width(inst.type);
+    vstack_prepare(inst_stack_pops(inst.type), 0);
+    Slot value = vstack_pop();
+    Slot a = emit_fast_address(inst);
+    slot_release(value);
+    slot_release(a);
+    if (a.reg < 0 && a.value.as_u64 >= BR_MEMORY_CAPACITY) {
+        fprintf(out, "    jmp err_illegal_memory_access\n");
+        return;
+    }
+
+    char addr[64];
+    if (a.reg < 0) {
+        snprintf(addr, sizeof(addr), "memory + %"PRIu64, a.value.as_u64);
+    } else {
+        fprintf(out, "    cmp %s, BR_MEMORY_CAPACITY\n", regs64[a.reg]);
+        fprintf(out, "    jae err_illegal_memory_access\n");
+        snprintf(addr, sizeof(addr), "memory + %s", regs64[a.reg]);
+    }
+    if (value.reg >= 0) {
+        const char *const *names = width == 1 ? regs8 : width == 2 ? regs16 : width == 4 ? regs32 : regs64;
+        fprintf(out, "    mov [%s], %s\n", addr, names[value.reg]);
+    } else if (width == 8) {
+        const char *operand = slot_operand(value);
+        fprintf(out, "    mov qword [%s], %s\n", addr, operand);
+    } else {
+        uint64_t mask = width == 1 ? 0xFF : width == 2 ? 0xFFFF : 0xFFFFFFFF;
+        const char *size = width == 1 ? "byte" : width == 2 ? "word" : "dword";
+        fprintf(out, "    mov %s [%s], %"PRIu64"\n", size, addr, value.value.as_u64 & mask);
+    }
+}
+
+static void emit_fast_inst(size_t i, Inst inst) {
+    Word folded;
+    if (vstack_size >= 2 && vstack[vstack_size - 2].reg < 0 && vstack[vstack_size - 1].reg < 0
+        && basm_fold_binary(inst.type, vstack[vstack_size - 2].value, vstack[vstack_size - 1].value, &folded)) {
+        vstack_size -= 2;
+        vstack_push_value(folded);
+        return;
+    }
+    if (vstack_size >= 1 && vstack[vstack_size - 1].reg < 0
+        && basm_fold_unary(inst.type, vstack[vstack_size - 1].value, &folded)) {
+        vstack[vstack_size - 1].value = folded;
+        return;
+    }
+
+    uint64_t operand = inst.operand.as_u64;
+    switch (inst.type) {
+        case INST_NOP:
+        case INST_I2U:
+            break;
+        case INST_DUP: {
+            vstack_prepare(0, 1);
+            if (operand < vstack_size) {
+                Slot source = vstack[vstack_size - 1 - operand];
+                if (source.reg < 0) {
+                    vstack_push_value(source.value);
+                } else {
+                    int reg = reg_alloc();
+                    fprintf(out, "    mov %s, %s\n", regs64[reg], regs64[source.reg]);
+                    vstack_push_reg(reg);
+                }
+            } else {
+                int reg = reg_alloc();
+                fprintf(out, "    mov %s, ", regs64[reg]);
+                print_stack_addr(-(int64_t) (vstack_popped + operand - vstack_size) - 1);
+                fprintf(out, "\n");
+                vstack_push_reg(reg);
+            }
+            break;
+        }
+        case INST_SWAP: {
+            if (operand == 0) {
+                break;
+            }
+            // Shallow swaps pull their slots into registers, deeper ones exchange the top with memory
+            vstack_prepare(operand < REGS_COUNT / 2 ? operand + 1 : 1, 1);
+            if (operand < vstack_size) {
+                Slot top = vstack[vstack_size - 1];
+                vstack[vstack_size - 1] = vstack[vstack_size - 1 - operand];
+                vstack[vstack_size - 1 - operand] = top;
+            } else {
+                int64_t words = -(int64_t) (vstack_popped + operand - vstack_size) - 1;
+                int reg = reg_alloc();
+                fprintf(out, "    mov %s, ", regs64[reg]);
+                print_stack_addr(words);
+                fprintf(out, "\n");
+                store_slot(words, vstack[vstack_size - 1]);
+                slot_release(vstack[vstack_size - 1]);
+                vstack[vstack_size - 1] = (Slot) {.reg = reg};
+            }
+            break;
+        }
+        case INST_LOAD_LOCAL: {
+            // The frame may hold values the virtual stack has not written back yet. The room for the result
+            // was checked at the block entry, a slot outside of the stack goes to the checked version
+            vstack_flush();
+            char fail[32];
+            snprintf(fail, sizeof(fail), "inst_%zu", i);
+            if (emit_local_addr(operand, fail)) {
+                fprintf(out, "    cmp rax, r15\n");
+                fprintf(out, "    jae %s\n", fail);
+                int reg = reg_alloc();
+                fprintf(out, "    mov %s, [rax]\n", regs64[reg]);
+                vstack_push_reg(reg);
+            }
+            break;
+        }
+        case INST_ENTER:
+        case INST_LEAVE:
+        case INST_STORE_LOCAL:
+            vstack_flush();
+            emit_checked_inst(i, inst);
+            break;
+        case INST_PUSH:
+            vstack_prepare(0, 0);
+            vstack_push_value(inst.operand);
+            break;
+        case INST_POP:
+            if (vstack_size > 0) {
+                slot_release(vstack_pop());
+            } else {
+                vstack_popped++;
+            }
+            break;
+        case INST_PLUSI:
+            emit_fast_binary("add");
+            break;
+        case INST_MINUSI:
+            emit_fast_binary("sub");
+            break;
+        case INST_MULTI:
+            emit_fast_binary("imul");
+            break;
+        case INST_ANDB:
+            emit_fast_binary("and");
+            break;
+        case INST_ORB:
+            emit_fast_binary("or");
+            break;
+        case INST_XOR:
+            emit_fast_binary("xor");
+            break;
+        case INST_DIVI:
+        case INST_MODI: {
+            vstack_prepare(2, 1);
+            Slot b = vstack_pop();
+            Slot a = vstack_pop();
+            if (b.reg < 0) {
+                if (b.value.as_u64 == 0) {
+                    fprintf(out, "    jmp err_div_by_zero\n");
+                }
+                fprintf(out, "    mov rcx, %"PRIu64"\n", b.value.as_u64);
+            } else {
+                fprintf(out, "    test %s, %s\n", regs64[b.reg], regs64[b.reg]);
+                fprintf(out, "    jz err_div_by_zero\n");
+                fprintf(out, "    mov rcx, %s\n", regs64[b.reg]);
+            }
+            if (a.reg < 0) {
+                fprintf(out, "    mov rax, %"PRIu64"\n", a.value.as_u64);
+            } else {
+                fprintf(out, "    mov rax, %s\n", regs64[a.reg]);
+            }
+            fprintf(out, "    xor edx, edx\n");
+            fprintf(out, "    div rcx\n");
+            int dest = result_reg(a, b);
+            fprintf(out, "    mov %s, %s\n", regs64[dest], inst.type == INST_DIVI ? "rax" : "rdx");
+            vstack_push_reg(dest);
+            break;
+        }
+        case INST_MULHU:
+        case INST_MULHI: {
+            vstack_prepare(2, 1);
+            Slot b = vstack_pop();
+            Slot a = vstack_pop();
+            if (a.reg < 0) {
+                fprintf(out, "    mov rax, %"PRIu64"\n", a.value.as_u64);
+            } else {
+                fprintf(out, "    mov rax, %s\n", regs64[a.reg]);
+            }
+            if (b.reg < 0) {
+                fprintf(out, "    mov rcx, %"PRIu64"\n", b.value.as_u64);
+            }
+            fprintf(out, "    %s %s\n", inst.type == INST_MULHU ? "mul" : "imul", b.reg < 0 ? "rcx" : regs64[b.reg]);
+            int dest = result_reg(a, b);
+            fprintf(out, "    mov %s, rdx\n", regs64[dest]);
+            vstack_push_reg(dest);
+            break;
+        }
+        case INST_SHR:
+        case INST_SHL:
+        case INST_ROTL:
+        case INST_ROTR: {
+            vstack_prepare(2, 1);
+            Slot b = vstack_pop();
+            Slot a = vstack_pop();
+            int dest = slot_to_reg(a);
+            if (b.reg < 0) {
+                fprintf(out, "    %s %s, %"PRIu64"\n", shift_mnemonic(inst.type), regs64[dest], b.value.as_u64 & 63);
+            } else {
+                fprintf(out, "    mov rcx, %s\n", regs64[b.reg]);
+                fprintf(out, "    %s %s, cl\n", shift_mnemonic(inst.type), regs64[dest]);
+                slot_release(b);
+            }
+            vstack_push_reg(dest);
+            break;
+        }
+        case INST_GEI:
+            emit_fast_compare("setae");
+            break;
+        case INST_LEI:
+            emit_fast_compare("setbe");
+            break;
+        case INST_LI:
+            emit_fast_compare("setb");
+            break;
+        case INST_NEI:
+            emit_fast_compare("setne");
+            break;
+        case INST_GI:
+            emit_fast_compare("seta");
+            break;
+        case INST_EQI:
+            emit_fast_compare("sete");
+            break;
+        case INST_PLUSF:
+            emit_fast_binary_f64("addsd");
+            break;
+        case INST_MINUSF:
+            emit_fast_binary_f64("subsd");
+            break;
+        case INST_MULTF:
+            emit_fast_binary_f64("mulsd");
+            break;
+        case INST_DIVF:
+            emit_fast_binary_f64("divsd");
+            break;
+        case INST_GEF:
+            emit_fast_compare_f64(inst.type, "setae", 0);
+            break;
+        case INST_GF:
+            emit_fast_compare_f64(inst.type, "seta", 0);
+            break;
+        case INST_LEF:
+            emit_fast_compare_f64(inst.type, "setae", 1);
+            break;
+        case INST_LF:
+            emit_fast_compare_f64(inst.type, "seta", 1);
+            break;
+        case INST_EQF:
+            emit_fast_compare_f64(inst.type, "sete", 0);
+            break;
+        case INST_NEF:
+            emit_fast_compare_f64(inst.type, "setne", 0);
+            break;
+        case INST_NOTB:
+        case INST_NOT:
+        case INST_I2F:
+        case INST_U2F:
+        case INST_U2I:
+        case INST_F2I:
+        case INST_F2U:
+        case INST_POPCNT:
+        case INST_CLZ:
+        case INST_CTZ:
+        case INST_BSWAP:
+        case INST_SEXT8:
+        case INST_SEXT16:
+        case INST_SEXT32: {
+            // Constant operands were folded above, so the top is always a register here
+            vstack_prepare(1, 0);
+            vstack[vstack_size - 1].home = 0;
+            const char *reg = regs64[vstack[vstack_size - 1].reg];
+            if (inst.type == INST_NOTB) {
+                fprintf(out, "    not %s\n", reg);
+            } else if (inst.type == INST_NOT) {
+                fprintf(out, "    test %s, %s\n", reg, reg);
+                fprintf(out, "    sete al\n");
+                fprintf(out, "    movzx %s, al\n", regs32[vstack[vstack_size - 1].reg]);
+            } else if (inst.type == INST_I2F) {
+                fprintf(out, "    cvtsi2sd xmm0, %s\n", reg);
+                fprintf(out, "    movq %s, xmm0\n", reg);
+            } else if (inst.type == INST_U2F) {
+                size_t label = local_labels++;
+                fprintf(out, "    test %s, %s\n", reg, reg);
+                fprintf(out, "    js .halve_%zu\n", label);
+                fprintf(out, "    cvtsi2sd xmm0, %s\n", reg);
+                fprintf(out, "    jmp .store_%zu\n", label);
+                fprintf(out, ".halve_%zu:\n", label);
+                fprintf(out, "    mov rax, %s\n", reg);
+                fprintf(out, "    shr rax, 1\n");
+                fprintf(out, "    mov rcx, %s\n", reg);
+                fprintf(out, "    and ecx, 1\n");
+                fprintf(out, "    or rax, rcx\n");
+                fprintf(out, "    cvtsi2sd xmm0, rax\n");
+                fprintf(out, "    addsd xmm0, xmm0\n");
+                fprintf(out, ".store_%zu:\n", label);
+                fprintf(out, "    movq %s, xmm0\n", reg);
+            } else if (inst.type == INST_U2I) {
+                fprintf(out, "    movsxd %s, %s\n", reg, regs32[vstack[vstack_size - 1].reg]);
+            } else if (inst.type != INST_F2I && inst.type != INST_F2U) {
+                int top = vstack[vstack_size - 1].reg;
+                emit_bits(reg, regs32[top], regs16[top], regs8[top], inst.type);
+            } else {
+                fprintf(out, "    movq xmm0, %s\n", reg);
+                fprintf(out, "    cvttsd2si %s, xmm0\n", reg);
+            }
+            break;
+        }
+        case INST_READ8:
+        case INST_READ16:
+        case INST_READ32:
+        case INST_READ64:
+        case INST_READ8_DISP:
+        case INST_READ16_DISP:
+        case INST_READ32_DISP:
+        case INST_READ64_DISP:
+        case INST_READ8_IDX:
+        case INST_READ16_IDX:
+        case INST_READ32_IDX:
+        case INST_READ64_IDX:
+            emit_fast_read(inst);
+            break;
+        case INST_WRITE8:
+        case INST_WRITE16:
+        case INST_WRITE32:
+        case INST_WRITE64:
+        case INST_WRITE8_DISP:
+        case INST_WRITE16_DISP:
+        case INST_WRITE32_DISP:
+        case INST_WRITE64_DISP:
+        case INST_WRITE8_IDX:
+        case INST_WRITE16_IDX:
+        case INST_WRITE32_IDX:
+        case INST_WRITE64_IDX:
+            emit_fast_write(inst);
+            break;
+        case INST_JMP:
+            vstack_flush();
+            emit_block_jump("jmp", operand);
+            break;
+        case INST_JMP_IF: {
+            vstack_prepare(1, 0);
+            Slot condition = vstack_pop();
+            if (condition.reg < 0) {
+                if (condition.value.as_u64 != 0) {
+                    vstack_flush();
+                    emit_block_jump("jmp", operand);
+                }
+            } else {
+                vstack_flush();
+                fprintf(out, "    test %s, %s\n", regs64[condition.reg], regs64[condition.reg]);
+                emit_block_jump("jnz", operand);
+                slot_release(condition);
+            }
+            break;
+        }
+        case INST_CALL:
+            vstack_flush();
+            fprintf(out, "    mov qword [r15], %zu\n", i);
+            fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            emit_block_jump("jmp", operand);
+            break;
+        case INST_RET: {
+            vstack_prepare(1, 0);
+            Slot addr = vstack_pop();
+            vstack_flush();
+            if (addr.reg < 0) {
+                emit_block_jump("jmp", addr.value.as_u64 + 1 < input->program_size ? addr.value.as_u64 + 1 : UINT64_MAX);
+            } else {
+                fprintf(out, "    lea rax, [%s + 1]\n", regs64[addr.reg]);
+                emit_indirect_jump("rax");
+                slot_release(addr);
+            }
+            break;
+        }
+        case INST_CALLR: {
+            // A target known at compile time, like a pushed label, becomes a direct jump
+            vstack_prepare(1, 0);
+            Slot target = vstack_pop();
+            vstack_flush();
+            fprintf(out, "    mov qword [r15], %zu\n", i);
+            fprintf(out, "    add r15, BR_WORD_SIZE\n");
+            if (target.reg < 0) {
+                emit_block_jump("jmp", target.value.as_u64);
+            } else {
+                emit_indirect_jump(regs64[target.reg]);
+                slot_release(target);
+            }
+            break;
+        }
+        case INST_JMPTABLE: {
+            vstack_prepare(1, 0);
+            Slot index = vstack_pop();
+            vstack_flush();
+            fprintf(out, "    mov rax, %s\n", slot_operand(index));
+            slot_release(index);
+            emit_table_jump(i, operand);
+            break;
+        }
+        case INST_INT:
+            vstack_flush();
+            if (operand < BR_NATIVES_COUNT) {
+                fprintf(out, "    call %s\n", natives[operand]);
+            } else {
+                fprintf(out, "    jmp err_illegal_operand\n");
+            }
+            break;
+        case INST_HALT:
+            fprintf(out, "    jmp exit\n");
+            break;
+        case INST_CAS8:
+        case INST_CAS16:
+        case INST_CAS32:
+        case INST_CAS64:
+        case INST_XADD8:
+        case INST_XADD16:
+        case INST_XADD32:
+        case INST_XADD64:
+        case INST_XCHG8:
+        case INST_XCHG16:
+        case INST_XCHG32:
+        case INST_XCHG64:
+            // The lock prefixed instructions want the operands in fixed registers, they go through the stack
+            vstack_flush();
+            emit_atomic(atomic_op(inst.type), atomic_width(inst.type));
+            break;
+        case INST_FENCE:
+            fprintf(out, "    mfence\n");
+            break;
+        case INST_SQRTF:
+        case INST_ABSF:
+        case INST_FLOORF:
+        case INST_CEILF:
+        case INST_ROUNDF:
+            emit_fast_math_f64(inst.type);
+            break;
+        case INST_MINF:
+            emit_fast_binary_f64("minsd");
+            break;
+        case INST_MAXF:
+            emit_fast_binary_f64("maxsd");
+            break;
+        case INST_FMAF:
+            emit_fast_fma();
+            break;
+        case INST_SINF:
+        case INST_COSF:
+        case INST_EXPF:
+        case INST_LOGF:
+            vstack_flush();
+            emit_x87(inst.type);
+            break;
+        case INST_PLUSI_IMM:
+        case INST_MINUSI_IMM:
+        case INST_MULTI_IMM:
+        case INST_DIVI_IMM:
+        case INST_MODI_IMM:
+        case INST_GEI_IMM:
+        case INST_LEI_IMM:
+        case INST_LI_IMM:
+        case INST_NEI_IMM:
+        case INST_GI_IMM:
+        case INST_EQI_IMM:
+        case INST_PLUSF_IMM:
+        case INST_MINUSF_IMM:
+        case INST_MULTF_IMM:
+        case INST_DIVF_IMM:
+        case INST_GEF_IMM:
+        case INST_GF_IMM:
+        case INST_LEF_IMM:
+        case INST_LF_IMM:
+        case INST_NEF_IMM:
+        case INST_EQF_IMM:
+        case INST_ANDB_IMM:
+        case INST_ORB_IMM:
+        case INST_XOR_IMM:
+        case INST_SHR_IMM:
+        case INST_SHL_IMM:
+            vstack_prepare(0, 0);
+            vstack_push_value(inst.operand);
+            emit_fast_inst(i, (Inst) {.type = inst_binary_form(inst.type)});
+            break;
+        case INST_SPAWN:
+        case INST_YIELD:
+        case INST_JOIN:
+        case INST_THREAD:
+        case INST_TJOIN:
+        case INST_CHAN:
+        case INST_SEND:
+        case INST_RECV:
+        case INST_TRYSEND:
+        case INST_TRYRECV:
+        case SIZE:
+        default:
+            assert(0 && "Unknown instruction");
+            break;
+    }
+}
+
+static void emit_block(size_t start, size_t end) {
+    // The deepest slot the block touches and the highest it grows the stack, relative to its entry
+    int64_t depth = 0;
+    int64_t need = 0;
+    int64_t grow = 0;
+    for (size_t i = start; i < end; i++) {
+        Inst inst = input->program[i];
+        int64_t required = (int64_t) inst_stack_pops(inst.type);
+        if (inst.type == INST_DUP || inst.type == INST_SWAP) {
+            required = inst.operand.as_u64 < BR_STACK_CAPACITY ? (int64_t) inst.operand.as_u64 + 1
+                                                               : BR_STACK_CAPACITY + 1;
+        }
+        if (required - depth > need) {
+            need = required - depth;
+        }
+        depth += (int64_t) inst_stack_pushes(inst.type) - (int64_t) inst_stack_pops(inst.type);
+        if (depth > grow) {
+            grow = depth;
+        }
+    }
+
+    fprintf(out, "block_%zu:\n", start);
+    if (need > BR_STACK_CAPACITY || grow > BR_STACK_CAPACITY) {
+        fprintf(out, "    jmp inst_%zu\n", start);
+        return;
+    }
+    if (need > 0) {
+        fprintf(out, "    cmp r15, stack + BR_WORD_SIZE * %"PRIi64"\n", need);
+        fprintf(out, "    jb inst_%zu\n", start);
+    }
+    if (grow > 0) {
+        fprintf(out, "    cmp r15, stack + BR_WORD_SIZE * (BR_STACK_CAPACITY - %"PRIi64")\n", grow);
+        fprintf(out, "    ja inst_%zu\n", start);
+    }
+
+    for (size_t i = start; i < end; i++) {
+        Inst inst = input->program[i];
+        if (inst_has_operand(inst.type)) {
+            fprintf(out, "    ;; %s %"PRIu64"\n", inst_asm_name(inst.type), inst.operand.as_u64);
+        } else {
+            fprintf(out, "    ;; %s\n", inst_asm_name(inst.type));
+        }
+        emit_fast_inst(i, inst);
+    }
+    if (block_falls_through(input->program[end - 1].type)) {
+        vstack_flush();
+    }
+}
+
+void x86_64_generate(FILE *stream, const Basm *basm) {
+    out = stream;
+    input = basm;
+
+    // Fibers and threads are scheduled by the VM and channels connect VMs, a native program has none of them
+    for (size_t i = 0; i < basm->program_size; i++) {
+        InstType type = basm->program[i].type;
+        if (type == INST_SPAWN || type == INST_YIELD || type == INST_JOIN || type == INST_THREAD
+            || type == INST_TJOIN || type == INST_CHAN || type == INST_SEND || type == INST_RECV
+            || type == INST_TRYSEND || type == INST_TRYRECV) {
+            fprintf(stderr, "ERROR: Instruction '%s' at %zu needs the VM, run the program with br\n",
+                    inst_asm_name(type), i);
+            exit(1);
+        }
+    }
+
+    fprintf(out, "bits 64\n\n");
+    fprintf(out, "%%define STDOUT 1\n");
+    fprintf(out, "%%define STDERR 2\n");
+    fprintf(out, "%%define SYS_WRITE 1\n");
+    fprintf(out, "%%define SYS_MMAP 9\n");
+    fprintf(out, "%%define SYS_MUNMAP 11\n");
+    fprintf(out, "%%define SYS_EXIT 60\n");
+    fprintf(out, "%%define PROT_READ_WRITE 3\n");
+    fprintf(out, "%%define MAP_PRIVATE_ANONYMOUS 34\n");
+    fprintf(out, "%%define BR_STACK_CAPACITY %d\n", BR_STACK_CAPACITY);
+    fprintf(out, "%%define BR_MEMORY_CAPACITY %d\n", BR_MEMORY_CAPACITY);
+    fprintf(out, "%%define BR_WORD_SIZE %d\n", BR_WORD_SIZE);
+    fprintf(out, "%%define OUT_CAPACITY %d\n", OUT_CAPACITY);
+    fprintf(out, "\nsegment .text\n");
+    fprintf(out, "global _start\n\n");
+    for (size_t i = 0; i < sizeof(runtime) / sizeof(runtime[0]); i++) {
+        fprintf(out, "%s\n", runtime[i]);
+    }
+
+    for (size_t i = 0; i < sizeof(runtime_errors) / sizeof(runtime_errors[0]); i++) {
+        print_err_label(runtime_errors[i]);
+        fprintf(out, ":\n");
+        fprintf(out, "    mov rsi, msg_");
+        print_err_label(runtime_errors[i]);
+        fprintf(out, "\n");
+        fprintf(out, "    mov edx, %zu\n", strlen("ERROR: \n") + strlen(err_as_cstr(runtime_errors[i])));
+        fprintf(out, "    jmp fail\n");
+    }
+
+    fprintf(out, "\n_start:\n");
+    fprintf(out, "    mov r15, stack\n");
+    fprintf(out, "    mov rbp, stack\n");
+    if (input->memory_size > 0) {
+        fprintf(out, "    ;; copying the static data into the BM's memory\n");
+        fprintf(out, "    mov rsi, data\n");
+        fprintf(out, "    mov rdi, memory\n");
+        fprintf(out, "    mov rcx, %zu\n", input->memory_size);
+        fprintf(out, "    rep movsb\n");
+    }
+    find_leaders();
+    emit_jump("jmp", input->entry);
+
+    // Every block is compiled twice: a register version guarded by a single stack bounds check at its entry
+    // and the checked version that mirrors the VM one instruction at a time and reports exact errors
+    for (size_t start = 0; start < input->program_size;) {
+        size_t end = block_end(start);
+        emit_block(start, end);
+        start = end;
+    }
+    fprintf(out, "block_%zu:\n", input->program_size);
+    fprintf(out, "inst_%zu:\n", input->program_size);
+    fprintf(out, "    jmp err_illegal_ins_access\n");
+
+    for (size_t start = 0; start < input->program_size;) {
+        size_t end = block_end(start);
+        for (size_t i = start; i < end; i++) {
+            fprintf(out, "inst_%zu:\n", i);
+            emit_checked_inst(i, input->program[i]);
+        }
+        if (block_falls_through(input->program[end - 1].type)) {
+            fprintf(out, "    jmp block_%zu\n", end);
+        }
+        start = end;
+    }
+
+    fprintf(out, "\nsegment .rodata\n");
+    fprintf(out, "hex_lower: db \"0123456789abcdef\"\n");
+    fprintf(out, "hex_upper: db \"0123456789ABCDEF\"\n");
+    fprintf(out, "str_nil: db \"(nil)\"\n");
+    fprintf(out, "str_inf: db \"inf\"\n");
+    fprintf(out, "str_nan: db \"nan\"\n");
+    fprintf(out, "two_over_pi:");
+    for (size_t i = 0; i < sizeof(two_over_pi) / sizeof(two_over_pi[0]); i++) {
+        fprintf(out, "%s 0x%016"PRIX64, i % 4 == 0 ? "\n    dq" : ",", two_over_pi[i]);
+    }
+    fprintf(out, "\n");
+    for (size_t i = 0; i < sizeof(runtime_errors) / sizeof(runtime_errors[0]); i++) {
+        fprintf(out, "msg_");
+        print_err_label(runtime_errors[i]);
+        fprintf(out, ": db \"ERROR: %s\", 10\n", err_as_cstr(runtime_errors[i]));
+    }
+    fprintf(out, "inst_map:");
+    for (size_t i = 0; i < input->program_size; i++) {
+        fprintf(out, "%s %s_%zu", i % 8 == 0 ? "\n    dq" : ",", leaders[i] ? "block" : "inst", i);
+    }
+    fprintf(out, "\n");
+
+    if (input->memory_size > 0) {
+        fprintf(out, "\nsegment .data\n");
+        fprintf(out, "data:");
+        for (size_t i = 0; i < input->memory_size; i++) {
+            fprintf(out, "%s %u", i % 16 == 0 ? "\n    db" : ",", input->memory[i]);
+        }
+        fprintf(out, "\n");
+    }
+
+    fprintf(out, "\nsegment .bss\n");
+    // One word of slack for the operand of an .imm instruction on a full stack
+    fprintf(out, "stack: resq BR_STACK_CAPACITY + 1\n");
+    fprintf(out, "memory: resb BR_MEMORY_CAPACITY + BR_WORD_SIZE\n");
+    fprintf(out, "out_buf: resb OUT_CAPACITY\n");
+    fprintf(out, "out_len: resq 1\n");
+    fprintf(out, "f64_digits: resb 320\n");
+
+    free(leaders);
+    leaders = NULL;
+}
+
+#endif
+#ifdef X86_64_ELF
+
+#define X86_BASE_ADDRESS 0x400000
+#define X86_PAGE_SIZE 0x1000
+#define X86_ELF_HEADER_SIZE 64
+#define X86_PROGRAM_HEADER_SIZE 56
+#define X86_PROGRAM_HEADERS_COUNT 3
+#define X86_HEADERS_SIZE (X86_ELF_HEADER_SIZE + X86_PROGRAM_HEADERS_COUNT * X86_PROGRAM_HEADER_SIZE)
+
+typedef enum {
+    X86_TEXT,
+    X86_RODATA,
+    X86_DATA,
+    X86_BSS,
+    X86_SECTIONS_COUNT,
+    X86_ABSOLUTE, // %define constants
+} X86Section;
+
+typedef struct {
+    StringView scope; // the global label a .local label belongs to, empty otherwise
+    StringView name;
+    X86Section section;
+    int64_t offset;
+} X86Symbol;
+
+typedef struct {
+    int64_t value;
+    int symbolic; // depends on an address, which is only known in the second pass
+} X86Value;
+
+typedef enum {
+    X86_OPERAND_REG,
+    X86_OPERAND_XMM,
+    X86_OPERAND_MEM,
+    X86_OPERAND_IMM,
+} X86OperandKind;
+
+typedef struct {
+    X86OperandKind kind;
+    int size; // in bytes, 0 when neither a register nor a size prefix tells it
+    int reg;
+    int base;
+    int index;
+    int scale;
+    X86Value value; // the immediate or the displacement
+} X86Operand;
+
+#define X86_OPERANDS_CAPACITY 3
+
+typedef struct {
+    const char *source_name;
+    int line_number;
+    int pass;
+    StringView scope;
+
+    X86Symbol *symbols;
+    size_t symbols_count;
+    size_t symbols_capacity;
+
+    X86Section section;
+    uint8_t *bytes[X86_SECTIONS_COUNT];
+    size_t sizes[X86_SECTIONS_COUNT];
+    size_t capacities[X86_SECTIONS_COUNT];
+    uint64_t addresses[X86_SECTIONS_COUNT];
+} X86Assembler;
+
+static const char *const x86_regs64[16] = {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+};
+static const char *const x86_regs32[16] = {
+        "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+};
+static const char *const x86_regs16[16] = {
+        "ax", "cx", "dx", "bx", "sp", "bp", "si", "di",
+        "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w",
+};
+static const char *const x86_regs8[16] = {
+        "al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil",
+        "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b",
+};
+
+// Indexed by the condition code of jcc and setcc
+static const char *const x86_conditions[16] = {
+        "o", "no", "b", "ae", "e", "ne", "be", "a", "s", "ns", "p", "np", "l", "ge", "le", "g",
+};
+
+static void x86_fail(const X86Assembler *as, const char *message, StringView subject) {
+    fprintf(stderr, "%s:%d: ERROR: %s '%.*s'\n", as->source_name, as->line_number, message,
+            (int) subject.count, subject.data);
+    exit(1);
+}
+
+static int x86_is(StringView sv, const char *cstr) {
+    return sv_eq(sv, cstr_as_sv(cstr));
+}
+
+static uint64_t x86_hash(StringView scope, StringView name) {
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (size_t i = 0; i < scope.count; i++) {
+        hash = (hash ^ (uint8_t) scope.data[i]) * 0x100000001B3ULL;
+    }
+    for (size_t i = 0; i < name.count; i++) {
+        hash = (hash ^ (uint8_t) name.data[i]) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+// Returns the slot of the symbol, an empty slot has a zero length name
+static X86Symbol *x86_find_symbol(const X86Assembler *as, StringView scope, StringView name) {
+    size_t mask = as->symbols_capacity - 1;
+    for (size_t i = x86_hash(scope, name) & mask;; i = (i + 1) & mask) {
+        X86Symbol *symbol = &as->symbols[i];
+        if (symbol->name.count == 0 || (sv_eq(symbol->name, name) && sv_eq(symbol->scope, scope))) {
+            return symbol;
+        }
+    }
+}
+
+static void x86_bind_symbol(X86Assembler *as, StringView name, X86Section section, int64_t offset) {
+    StringView scope = name.data[0] == '.' ? as->scope : cstr_as_sv("");
+    if (as->pass > 0) {
+        // Every instruction is encoded to the same size in both passes, so the symbols stay where they are
+        assert(x86_find_symbol(as, scope, name)->offset == offset && "x86_bind_symbol: symbol moved");
+        return;
+    }
+
+    if (as->symbols_count * 2 >= as->symbols_capacity) {
+        X86Symbol *symbols = as->symbols;
+        size_t capacity = as->symbols_capacity;
+        as->symbols_capacity = capacity == 0 ? 1024 : capacity * 2;
+        as->symbols = calloc(as->symbols_capacity, sizeof(as->symbols[0]));
+        assert(as->symbols != NULL && "x86_bind_symbol: out of memory");
+        for (size_t i = 0; i < capacity; i++) {
+            if (symbols[i].name.count > 0) {
+                *x86_find_symbol(as, symbols[i].scope, symbols[i].name) = symbols[i];
+            }
+        }
+        free(symbols);
+    }
+
+    X86Symbol *symbol = x86_find_symbol(as, scope, name);
+    if (symbol->name.count > 0) {
+        x86_fail(as, "Symbol is already defined", name);
+    }
+    *symbol = (X86Symbol) {.scope = scope, .name = name, .section = section, .offset = offset};
+    as->symbols_count++;
+}
+
+static void x86_byte(X86Assembler *as, uint8_t byte) {
+    if (as->section == X86_BSS) {
+        x86_fail(as, "Cannot put data into", cstr_as_sv(".bss"));
+    }
+    X86Section section = as->section;
+    as->bytes[section] = basm_reserve(NULL, as->bytes[section], &as->capacities[section], 1, as->sizes[section] + 1);
+    as->bytes[section][as->sizes[section]++] = byte;
+}
+
+static void x86_little_endian(X86Assembler *as, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        x86_byte(as, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+static uint64_t x86_here(const X86Assembler *as) {
+    return as->addresses[as->section] + as->sizes[as->section];
+}
+
+static int x86_is_ident_start(char c) {
+    return isalpha((unsigned char) c) || c == '_' || c == '.';
+}
+
+static StringView x86_chop_ident(StringView *sv) {
+    size_t i = 0;
+    while (i < sv->count && (x86_is_ident_start(sv->data[i]) || isdigit((unsigned char) sv->data[i]))) {
+        i++;
+    }
+    StringView ident = {.count = i, .data = sv->data};
+    sv->data += i;
+    sv->count -= i;
+    return ident;
+}
+
+static int x86_find_reg(StringView name, const char *const names[16]) {
+    for (int i = 0; i < 16; i++) {
+        if (x86_is(name, names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static X86Value x86_parse_expr(X86Assembler *as, StringView *sv);
+
+static X86Value x86_parse_primary(X86Assembler *as, StringView *sv) {
+    *sv = sv_trim_left(*sv);
+    if (sv->count == 0) {
+        x86_fail(as, "Expected a value at", *sv);
+    }
+
+    char c = sv->data[0];
+    if (c == '(') {
+        sv->data++;
+        sv->count--;
+        X86Value value = x86_parse_expr(as, sv);
+        *sv = sv_trim_left(*sv);
+        if (sv->count == 0 || sv->data[0] != ')') {
+            x86_fail(as, "Expected ')' at", *sv);
+        }
+        sv->data++;
+        sv->count--;
+        return value;
+    }
+    if (c == '-') {
+        sv->data++;
+        sv->count--;
+        X86Value value = x86_parse_primary(as, sv);
+        value.value = (int64_t) (0 - (uint64_t) value.value);
+        return value;
+    }
+    if (c == '\'') {
+        if (sv->count < 3 || sv->data[2] != '\'') {
+            x86_fail(as, "Invalid character literal", *sv);
+        }
+        X86Value value = {.value = (uint8_t) sv->data[1]};
+        sv->data += 3;
+        sv->count -= 3;
+        return value;
+    }
+    if (isdigit((unsigned char) c)) {
+        StringView digits = x86_chop_ident(sv);
+        uint64_t result = 0;
+        if (digits.count > 2 && digits.data[0] == '0' && (digits.data[1] == 'x' || digits.data[1] == 'X')) {
+            for (size_t i = 2; i < digits.count; i++) {
+                if (!isxdigit((unsigned char) digits.data[i])) {
+                    x86_fail(as, "Invalid number", digits);
+                }
+                char d = (char) tolower((unsigned char) digits.data[i]);
+                result = result * 16 + (uint64_t) (isdigit((unsigned char) d) ? d - '0' : d - 'a' + 10);
+            }
+        } else {
+            for (size_t i = 0; i < digits.count; i++) {
+                if (!isdigit((unsigned char) digits.data[i])) {
+                    x86_fail(as, "Invalid number", digits);
+                }
+                result = result * 10 + (uint64_t) (digits.data[i] - '0');
+            }
+        }
+        return (X86Value) {.value = (int64_t) result};
+    }
+    if (x86_is_ident_start(c)) {
+        StringView name = x86_chop_ident(sv);
+        X86Symbol *symbol = x86_find_symbol(as, name.data[0] == '.' ? as->scope : cstr_as_sv(""), name);
+        if (symbol->name.count == 0) {
+            if (as->pass == 0) {
+                return (X86Value) {.symbolic = 1};
+            }
+            x86_fail(as, "Unknown symbol", name);
+        }
+        if (symbol->section == X86_ABSOLUTE) {
+            return (X86Value) {.value = symbol->offset};
+        }
+        return (X86Value) {.value = (int64_t) as->addresses[symbol->section] + symbol->offset, .symbolic = 1};
+    }
+
+    x86_fail(as, "Unexpected character at", *sv);
+    return (X86Value) {0};
+}
+
+static X86Value x86_parse_term(X86Assembler *as, StringView *sv) {
+    X86Value value = x86_parse_primary(as, sv);
+    for (*sv = sv_trim_left(*sv); sv->count > 0 && sv->data[0] == '*'; *sv = sv_trim_left(*sv)) {
+        sv->data++;
+        sv->count--;
+        X86Value factor = x86_parse_primary(as, sv);
+        value.value = (int64_t) ((uint64_t) value.value * (uint64_t) factor.value);
+        value.symbolic |= factor.symbolic;
+    }
+    return value;
+}
+
+static X86Value x86_parse_expr(X86Assembler *as, StringView *sv) {
+    X86Value value = x86_parse_term(as, sv);
+    for (*sv = sv_trim_left(*sv); sv->count > 0 && (sv->data[0] == '+' || sv->data[0] == '-');
+         *sv = sv_trim_left(*sv)) {
+        char op = sv->data[0];
+        sv->data++;
+        sv->count--;
+        X86Value term = x86_parse_term(as, sv);
+        value.value = (int64_t) (op == '+' ? (uint64_t) value.value + (uint64_t) term.value
+                                           : (uint64_t) value.value - (uint64_t) term.value);
+        value.symbolic |= term.symbolic;
+    }
+    return value;
+}
+
+static X86Value x86_parse_value(X86Assembler *as, StringView sv) {
+    X86Value value = x86_parse_expr(as, &sv);
+    if (sv_trim(sv).count > 0) {
+        x86_fail(as, "Unexpected text after the value", sv);
+    }
+    return value;
+}
+
+// [base + index * scale + displacement], where the displacement may refer to symbols
+static void x86_parse_memory(X86Assembler *as, StringView sv, X86Operand *operand) {
+    int sign = 1;
+    for (;;) {
+        int reg = -1;
+        X86Value value = {.value = 1};
+        for (;;) {
+            sv = sv_trim_left(sv);
+            StringView rest = sv;
+            StringView ident = x86_is_ident_start(rest.count > 0 ? rest.data[0] : '\0') ? x86_chop_ident(&rest)
+                                                                                         : (StringView) {0};
+            int found = ident.count > 0 ? x86_find_reg(ident, x86_regs64) : -1;
+            if (found >= 0) {
+                if (reg >= 0) {
+                    x86_fail(as, "Two registers in one term of", sv);
+                }
+                reg = found;
+                sv = rest;
+            } else {
+                X86Value factor = x86_parse_primary(as, &sv);
+                value.value *= factor.value;
+                value.symbolic |= factor.symbolic;
+            }
+            sv = sv_trim_left(sv);
+            if (sv.count == 0 || sv.data[0] != '*') {
+                break;
+            }
+            sv.data++;
+            sv.count--;
+        }
+
+        if (reg >= 0) {
+            int64_t scale = value.value;
+            if (sign < 0 || value.symbolic || (scale != 1 && scale != 2 && scale != 4 && scale != 8)) {
+                x86_fail(as, "Invalid index register", cstr_as_sv(x86_regs64[reg]));
+            }
+            if (scale == 1 && operand->base < 0) {
+                operand->base = reg;
+            } else if (operand->index < 0 && reg != 4) {
+                operand->index = reg;
+                operand->scale = (int) scale;
+            } else {
+                x86_fail(as, "Too many registers in the address at", sv);
+            }
+        } else {
+            operand->value.value += sign * value.value;
+            operand->value.symbolic |= value.symbolic;
+        }
+
+        sv = sv_trim_left(sv);
+        if (sv.count == 0) {
+            return;
+        }
+        if (sv.data[0] != '+' && sv.data[0] != '-') {
+            x86_fail(as, "Unexpected text in the address at", sv);
+        }
+        sign = sv.data[0] == '+' ? 1 : -1;
+        sv.data++;
+        sv.count--;
+    }
+}
+
+static X86Operand x86_parse_operand(X86Assembler *as, StringView sv) {
+    X86Operand operand = {.base = -1, .index = -1, .scale = 1};
+    sv = sv_trim(sv);
+
+    static const char *const sizes[] = {"byte", "word", "dword", "qword"};
+    for (int i = 0; i < 4; i++) {
+        size_t length = strlen(sizes[i]);
+        if (sv.count > length && strncmp(sv.data, sizes[i], length) == 0 && isspace((unsigned char) sv.data[length])) {
+            operand.size = 1 << i;
+            sv.data += length;
+            sv.count -= length;
+            sv = sv_trim_left(sv);
+            break;
+        }
+    }
+
+    if (sv.count > 0 && sv.data[0] == '[') {
+        if (sv.data[sv.count - 1] != ']') {
+            x86_fail(as, "Unterminated address", sv);
+        }
+        operand.kind = X86_OPERAND_MEM;
+        x86_parse_memory(as, (StringView) {.count = sv.count - 2, .data = sv.data + 1}, &operand);
+        return operand;
+    }
+
+    const char *const *const tables[] = {x86_regs8, x86_regs16, x86_regs32, x86_regs64};
+    for (int i = 0; i < 4; i++) {
+        int reg = x86_find_reg(sv, tables[i]);
+        if (reg >= 0) {
+            operand.kind = X86_OPERAND_REG;
+            operand.size = 1 << i;
+            operand.reg = reg;
+            return operand;
+        }
+    }
+    if (sv.count >= 4 && strncmp(sv.data, "xmm", 3) == 0) {
+        operand.kind = X86_OPERAND_XMM;
+        operand.size = 8;
+        operand.reg = sv_to_int((StringView) {.count = sv.count - 3, .data = sv.data + 3});
+        return operand;
+    }
+
+    operand.kind = X86_OPERAND_IMM;
+    operand.value = x86_parse_value(as, sv);
+    return operand;
+}
+
+static int x86_fits_i8(X86Value value) {
+    return !value.symbolic && value.value >= INT8_MIN && value.value <= INT8_MAX;
+}
+
+static int x86_fits_i32(X86Value value) {
+    return value.value >= INT32_MIN && value.value <= INT32_MAX;
+}
+
+// A byte register numbered 4..7 means spl..dil only when a REX prefix is present
+static int x86_needs_rex(const X86Operand *operand) {
+    return operand->kind == X86_OPERAND_REG && operand->size == 1 && operand->reg >= 4 && operand->reg < 8;
+}
+
+// Emits the prefix, REX, opcode, ModRM, SIB and displacement, `reg` goes into ModRM.reg.
+// Opcodes longer than a byte are given most significant byte first, like 0x0FAF
+static void x86_encode(X86Assembler *as, uint8_t prefix, int wide, uint32_t opcode, int reg,
+                       const X86Operand *rm, int force_rex) {
+    uint8_t rex = (uint8_t) (0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0));
+    if (rm->kind == X86_OPERAND_MEM) {
+        rex |= (uint8_t) ((rm->index >= 0 && (rm->index & 8)) ? 2 : 0);
+        rex |= (uint8_t) ((rm->base >= 0 && (rm->base & 8)) ? 1 : 0);
+    } else {
+        rex |= (uint8_t) ((rm->reg & 8) ? 1 : 0);
+    }
+
+    if (prefix != 0) {
+        x86_byte(as, prefix);
+    }
+    if (rex != 0x40 || force_rex || x86_needs_rex(rm)) {
+        x86_byte(as, rex);
+    }
+    if (opcode > 0xFFFF) {
+        x86_byte(as, (uint8_t) (opcode >> 16));
+    }
+    if (opcode > 0xFF) {
+        x86_byte(as, (uint8_t) (opcode >> 8));
+    }
+    x86_byte(as, (uint8_t) opcode);
+
+    uint8_t field = (uint8_t) ((reg & 7) << 3);
+    if (rm->kind != X86_OPERAND_MEM) {
+        x86_byte(as, (uint8_t) (0xC0 | field | (rm->reg & 7)));
+        return;
+    }
+
+    X86Value disp = rm->value;
+    uint8_t scale = (uint8_t) (rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2 ? 1 : 0);
+    uint8_t index = (uint8_t) (rm->index >= 0 ? (rm->index & 7) << 3 : 4 << 3);
+    if (rm->base < 0) {
+        // An absolute address goes through a SIB byte without base, plain mod 00 rm 101 would be RIP relative
+        x86_byte(as, (uint8_t) (field | 4));
+        x86_byte(as, (uint8_t) ((scale << 6) | index | 5));
+        x86_little_endian(as, (uint64_t) disp.value, 4);
+        return;
+    }
+
+    uint8_t mod;
+    if (!disp.symbolic && disp.value == 0 && (rm->base & 7) != 5) {
+        mod = 0x00;
+    } else if (x86_fits_i8(disp)) {
+        mod = 0x40;
+    } else {
+        mod = 0x80;
+    }
+    if (rm->index >= 0 || (rm->base & 7) == 4) {
+        x86_byte(as, (uint8_t) (mod | field | 4));
+        x86_byte(as, (uint8_t) ((scale << 6) | index | (rm->base & 7)));
+    } else {
+        x86_byte(as, (uint8_t) (mod | field | (rm->base & 7)));
+    }
+    if (mod == 0x40) {
+        x86_byte(as, (uint8_t) disp.value);
+    } else if (mod == 0x80) {
+        if (!x86_fits_i32(disp)) {
+            x86_fail(as, "Displacement does not fit 32 bits", cstr_as_sv(""));
+        }
+        x86_little_endian(as, (uint64_t) disp.value, 4);
+    }
+}
+
+static void x86_immediate(X86Assembler *as, X86Value value, int size) {
+    if (size >= 4 && !x86_fits_i32(value) && !(size == 4 && value.value >= 0 && value.value <= UINT32_MAX)) {
+        x86_fail(as, "Immediate does not fit 32 bits", cstr_as_sv(""));
+    }
+    x86_little_endian(as, (uint64_t) value.value, size > 4 ? 4 : size);
+}
+
+static void x86_rel32(X86Assembler *as, uint32_t opcode, X86Value target) {
+    if (opcode > 0xFF) {
+        x86_byte(as, (uint8_t) (opcode >> 8));
+    }
+    x86_byte(as, (uint8_t) opcode);
+    int64_t rel = target.value - (int64_t) (x86_here(as) + 4);
+    if (as->pass > 0 && (rel < INT32_MIN || rel > INT32_MAX)) {
+        x86_fail(as, "Jump target is out of range", cstr_as_sv(""));
+    }
+    x86_little_endian(as, (uint64_t) rel, 4);
+}
+
+static int x86_condition(StringView sv) {
+    if (x86_is(sv, "c")) {
+        return 2;
+    }
+    if (x86_is(sv, "z")) {
+        return 4;
+    }
+    if (x86_is(sv, "nz")) {
+        return 5;
+    }
+    for (int i = 0; i < 16; i++) {
+        if (x86_is(sv, x86_conditions[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int x86_operation_size(const X86Assembler *as, StringView mnemonic, const X86Operand *a, const X86Operand *b) {
+    int size = a->size != 0 ? a->size : b != NULL ? b->size : 0;
+    if (size == 0) {
+        x86_fail(as, "Operation size is not specified for", mnemonic);
+    }
+    return size;
+}
+
+// add, or, and, sub, xor and cmp share their encodings, `digit` is the opcode extension of the group
+static void x86_alu(X86Assembler *as, StringView mnemonic, int digit, const X86Operand *a, const X86Operand *b) {
+    int size = x86_operation_size(as, mnemonic, a, b);
+    uint8_t prefix = size == 2 ? 0x66 : 0;
+    int wide = size == 8;
+    uint32_t base = (uint32_t) digit * 8;
+    if (b->kind == X86_OPERAND_IMM) {
+        if (size == 1) {
+            x86_encode(as, prefix, wide, 0x80, digit, a, 0);
+            x86_immediate(as, b->value, 1);
+        } else if (x86_fits_i8(b->value)) {
+            x86_encode(as, prefix, wide, 0x83, digit, a, 0);
+            x86_immediate(as, b->value, 1);
+        } else {
+            x86_encode(as, prefix, wide, 0x81, digit, a, 0);
+            x86_immediate(as, b->value, size);
+        }
+    } else if (b->kind == X86_OPERAND_REG) {
+        x86_encode(as, prefix, wide, base + (size == 1 ? 0 : 1), b->reg, a, x86_needs_rex(b));
+    } else if (a->kind == X86_OPERAND_REG && b->kind == X86_OPERAND_MEM) {
+        x86_encode(as, prefix, wide, base + (size == 1 ? 2 : 3), a->reg, b, x86_needs_rex(a));
+    } else {
+        x86_fail(as, "Invalid operands for", mnemonic);
+    }
+}
+
+
+// Forms that carry the register in the low bits of the opcode, like push r64 or mov r, imm
+static void x86_encode_short(X86Assembler *as, uint8_t prefix, int wide, uint8_t opcode, const X86Operand *reg) {
+    uint8_t rex = (uint8_t) (0x40 | (wide ? 8 : 0) | ((reg->reg & 8) ? 1 : 0));
+    if (prefix != 0) {
+        x86_byte(as, prefix);
+    }
+    if (rex != 0x40 || x86_needs_rex(reg)) {
+        x86_byte(as, rex);
+    }
+    x86_byte(as, (uint8_t) (opcode + (reg->reg & 7)));
+}
+
+static void x86_mov(X86Assembler *as, StringView mnemonic, const X86Operand *a, const X86Operand *b) {
+    int size = x86_operation_size(as, mnemonic, a, b);
+    uint8_t prefix = size == 2 ? 0x66 : 0;
+    int wide = size == 8;
+    if (b->kind == X86_OPERAND_IMM) {
+        X86Value value = b->value;
+        if (a->kind == X86_OPERAND_REG && size == 8 && !value.symbolic && !x86_fits_i32(value)) {
+            if (value.value >= 0 && value.value <= UINT32_MAX) {
+                // Writing the 32 bit register clears the upper half
+                x86_encode_short(as, 0, 0, 0xB8, a);
+                x86_little_endian(as, (uint64_t) value.value, 4);
+            } else {
+                x86_encode_short(as, 0, 1, 0xB8, a);
+                x86_little_endian(as, (uint64_t) value.value, 8);
+            }
+        } else if (a->kind == X86_OPERAND_REG && size < 8) {
+            x86_encode_short(as, prefix, 0, size == 1 ? 0xB0 : 0xB8, a);
+            x86_immediate(as, value, size);
+        } else {
+            // Symbols are addresses below 2GB, so the sign extended imm32 form covers them
+            x86_encode(as, prefix, wide, size == 1 ? 0xC6 : 0xC7, 0, a, 0);
+            x86_immediate(as, value, size);
+        }
+    } else if (b->kind == X86_OPERAND_REG) {
+        x86_encode(as, prefix, wide, size == 1 ? 0x88 : 0x89, b->reg, a, x86_needs_rex(b));
+    } else if (a->kind == X86_OPERAND_REG && b->kind == X86_OPERAND_MEM) {
+        x86_encode(as, prefix, wide, size == 1 ? 0x8A : 0x8B, a->reg, b, x86_needs_rex(a));
+    } else {
+        x86_fail(as, "Invalid operands for", mnemonic);
+    }
+}
+
+static void x86_expect(const X86Assembler *as, StringView mnemonic, size_t count, size_t expected) {
+    if (count != expected) {
+        x86_fail(as, "Wrong number of operands for", mnemonic);
+    }
+}
+
+static void x86_assemble_inst(X86Assembler *as, StringView mnemonic, const X86Operand *ops, size_t count) {
+    static const char *const alu[8] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+    for (int digit = 0; digit < 8; digit++) {
+        if (alu[digit] != NULL && x86_is(mnemonic, alu[digit])) {
+            x86_expect(as, mnemonic, count, 2);
+            x86_alu(as, mnemonic, digit, &ops[0], &ops[1]);
+            return;
+        }
+    }
+
+    static const char *const unary[8] = {NULL, NULL, "not", "neg", "mul", NULL, "div", NULL};
+    for (int digit = 0; digit < 8; digit++) {
+        if (unary[digit] != NULL && x86_is(mnemonic, unary[digit])) {
+            x86_expect(as, mnemonic, count, 1);
+            int size = x86_operation_size(as, mnemonic, &ops[0], NULL);
+            x86_encode(as, size == 2 ? 0x66 : 0, size == 8, size == 1 ? 0xF6 : 0xF7, digit, &ops[0], 0);
+            return;
+        }
+    }
+
+    // The scalar double instructions, all of them take xmm, xmm/m64
+    static const struct {
+        const char *name;
+        uint8_t prefix;
+        uint32_t opcode;
+    } sse[] = {
+            {"addsd", 0xF2, 0x0F58},
+            {"mulsd", 0xF2, 0x0F59},
+            {"subsd", 0xF2, 0x0F5C},
+            {"divsd", 0xF2, 0x0F5E},
+            {"sqrtsd", 0xF2, 0x0F51},
+            {"minsd", 0xF2, 0x0F5D},
+            {"maxsd", 0xF2, 0x0F5F},
+            {"ucomisd", 0x66, 0x0F2E},
+            // And the packed byte instructions of the text natives, pmovmskb takes r32, xmm
+            {"pcmpeqb", 0x66, 0x0F74},
+            {"pcmpgtb", 0x66, 0x0F64},
+            {"psubb", 0x66, 0x0FF8},
+            {"pand", 0x66, 0x0FDB},
+            {"por", 0x66, 0x0FEB},
+            {"pxor", 0x66, 0x0FEF},
+            {"pmovmskb", 0x66, 0x0FD7},
+            {"movdqa", 0x66, 0x0F6F},
+    };
+    for (size_t i = 0; i < sizeof(sse) / sizeof(sse[0]); i++) {
+        if (x86_is(mnemonic, sse[i].name)) {
+            x86_expect(as, mnemonic, count, 2);
+            x86_encode(as, sse[i].prefix, 0, sse[i].opcode, ops[0].reg, &ops[1], 0);
+            return;
+        }
+    }
+
+    // The x87 instructions the float functions use, the ones without operands work on st0 and st1
+    static const struct {
+        const char *name;
+        uint16_t opcode;
+    } x87[] = {
+            {"fsin", 0xD9FE},
+            {"fcos", 0xD9FF},
+            {"fldpi", 0xD9EB},
+            {"fchs", 0xD9E0},
+            {"fmulp", 0xDEC9},
+            {"fldln2", 0xD9ED},
+            {"fldl2e", 0xD9EA},
+            {"fld1", 0xD9E8},
+            {"fyl2x", 0xD9F1},
+            {"f2xm1", 0xD9F0},
+            {"frndint", 0xD9FC},
+            {"fscale", 0xD9FD},
+            {"fxch", 0xD9C9},
+            {"faddp", 0xDEC1},
+            {"fsubp", 0xDEE9},
+    };
+    for (size_t i = 0; i < sizeof(x87) / sizeof(x87[0]); i++) {
+        if (x86_is(mnemonic, x87[i].name)) {
+            x86_expect(as, mnemonic, count, 0);
+            x86_byte(as, (uint8_t) (x87[i].opcode >> 8));
+            x86_byte(as, (uint8_t) x87[i].opcode);
+            return;
+        }
+    }
+    // And the ones taking an m64, with the opcode and the digit in the ModRM byte
+    static const struct {
+        const char *name;
+        uint8_t opcode;
+        int digit;
+    } x87_m64[] = {
+            {"fld", 0xDD, 0},
+            {"fstp", 0xDD, 3},
+            {"fmul", 0xDC, 1},
+            {"fild", 0xDF, 5},
+    };
+    for (size_t i = 0; i < sizeof(x87_m64) / sizeof(x87_m64[0]); i++) {
+        if (x86_is(mnemonic, x87_m64[i].name)) {
+            x86_expect(as, mnemonic, count, 1);
+            if (ops[0].kind != X86_OPERAND_MEM || ops[0].size != 8) {
+                x86_fail(as, "Only qword memory operands are supported for", mnemonic);
+            }
+            x86_encode(as, 0, 0, x87_m64[i].opcode, x87_m64[i].digit, &ops[0], 0);
+            return;
+        }
+    }
+
+    if (mnemonic.count > 1 && mnemonic.data[0] == 'j' && !x86_is(mnemonic, "jmp")) {
+        int condition = x86_condition((StringView) {.count = mnemonic.count - 1, .data = mnemonic.data + 1});
+        if (condition >= 0) {
+            x86_expect(as, mnemonic, count, 1);
+            x86_rel32(as, 0x0F80 + (uint32_t) condition, ops[0].value);
+            return;
+        }
+    }
+    if (mnemonic.count > 3 && strncmp(mnemonic.data, "set", 3) == 0) {
+        int condition = x86_condition((StringView) {.count = mnemonic.count - 3, .data = mnemonic.data + 3});
+        if (condition >= 0) {
+            x86_expect(as, mnemonic, count, 1);
+            x86_encode(as, 0, 0, 0x0F90 + (uint32_t) condition, 0, &ops[0], 0);
+            return;
+        }
+    }
+
+    if (x86_is(mnemonic, "mov")) {
+        x86_expect(as, mnemonic, count, 2);
+        x86_mov(as, mnemonic, &ops[0], &ops[1]);
+    } else if (x86_is(mnemonic, "jmp") || x86_is(mnemonic, "call")) {
+        x86_expect(as, mnemonic, count, 1);
+        if (ops[0].kind == X86_OPERAND_IMM) {
+            x86_rel32(as, x86_is(mnemonic, "jmp") ? 0xE9 : 0xE8, ops[0].value);
+        } else {
+            x86_encode(as, 0, 0, 0xFF, x86_is(mnemonic, "jmp") ? 4 : 2, &ops[0], 0);
+        }
+    } else if (x86_is(mnemonic, "ret")) {
+        x86_byte(as, 0xC3);
+    } else if (x86_is(mnemonic, "syscall")) {
+        x86_byte(as, 0x0F);
+        x86_byte(as, 0x05);
+    } else if (x86_is(mnemonic, "movsb")) {
+        x86_byte(as, 0xA4);
+    } else if (x86_is(mnemonic, "mfence")) {
+        x86_byte(as, 0x0F);
+        x86_byte(as, 0xAE);
+        x86_byte(as, 0xF0);
+    } else if (x86_is(mnemonic, "cmpxchg") || x86_is(mnemonic, "xadd") || x86_is(mnemonic, "xchg")) {
+        x86_expect(as, mnemonic, count, 2);
+        if (ops[1].kind != X86_OPERAND_REG) {
+            x86_fail(as, "Invalid operands for", mnemonic);
+        }
+        int size = x86_operation_size(as, mnemonic, &ops[0], &ops[1]);
+        uint32_t opcode = x86_is(mnemonic, "cmpxchg") ? 0x0FB0 : x86_is(mnemonic, "xadd") ? 0x0FC0 : 0x86;
+        x86_encode(as, size == 2 ? 0x66 : 0, size == 8, size == 1 ? opcode : opcode + 1, ops[1].reg, &ops[0],
+                   x86_needs_rex(&ops[1]));
+    } else if (x86_is(mnemonic, "push") || x86_is(mnemonic, "pop")) {
+        x86_expect(as, mnemonic, count, 1);
+        x86_encode_short(as, 0, 0, x86_is(mnemonic, "push") ? 0x50 : 0x58, &ops[0]);
+    } else if (x86_is(mnemonic, "inc") || x86_is(mnemonic, "dec")) {
+        x86_expect(as, mnemonic, count, 1);
+        int size = x86_operation_size(as, mnemonic, &ops[0], NULL);
+        x86_encode(as, size == 2 ? 0x66 : 0, size == 8, size == 1 ? 0xFE : 0xFF, x86_is(mnemonic, "inc") ? 0 : 1,
+                   &ops[0], 0);
+    } else if (x86_is(mnemonic, "test")) {
+        x86_expect(as, mnemonic, count, 2);
+        int size = x86_operation_size(as, mnemonic, &ops[0], &ops[1]);
+        uint8_t prefix = size == 2 ? 0x66 : 0;
+        if (ops[1].kind == X86_OPERAND_IMM) {
+            x86_encode(as, prefix, size == 8, size == 1 ? 0xF6 : 0xF7, 0, &ops[0], 0);
+            x86_immediate(as, ops[1].value, size);
+        } else {
+            x86_encode(as, prefix, size == 8, size == 1 ? 0x84 : 0x85, ops[1].reg, &ops[0], x86_needs_rex(&ops[1]));
+        }
+    } else if (x86_is(mnemonic, "imul") && count == 1) {
+        // The one operand form multiplies rax into rdx:rax
+        int size = x86_operation_size(as, mnemonic, &ops[0], NULL);
+        x86_encode(as, size == 2 ? 0x66 : 0, size == 8, size == 1 ? 0xF6 : 0xF7, 5, &ops[0], 0);
+    } else if (x86_is(mnemonic, "imul")) {
+        x86_expect(as, mnemonic, count, 2);
+        int wide = ops[0].size == 8;
+        if (ops[1].kind == X86_OPERAND_IMM) {
+            int short_form = x86_fits_i8(ops[1].value);
+            x86_encode(as, 0, wide, short_form ? 0x6B : 0x69, ops[0].reg, &ops[0], 0);
+            x86_immediate(as, ops[1].value, short_form ? 1 : 4);
+        } else {
+            x86_encode(as, 0, wide, 0x0FAF, ops[0].reg, &ops[1], 0);
+        }
+    } else if (x86_is(mnemonic, "shl") || x86_is(mnemonic, "shr") || x86_is(mnemonic, "rol") || x86_is(mnemonic, "ror")) {
+        x86_expect(as, mnemonic, count, 2);
+        int digit = x86_is(mnemonic, "shl") ? 4 : x86_is(mnemonic, "shr") ? 5 : x86_is(mnemonic, "rol") ? 0 : 1;
+        int wide = x86_operation_size(as, mnemonic, &ops[0], NULL) == 8;
+        if (ops[1].kind == X86_OPERAND_REG) {
+            x86_encode(as, 0, wide, 0xD3, digit, &ops[0], 0);
+        } else {
+            x86_encode(as, 0, wide, 0xC1, digit, &ops[0], 0);
+            x86_immediate(as, ops[1].value, 1);
+        }
+    } else if (x86_is(mnemonic, "shrd") || x86_is(mnemonic, "shld")) {
+        x86_expect(as, mnemonic, count, 3);
+        uint32_t opcode = x86_is(mnemonic, "shrd") ? 0x0FAC : 0x0FA4;
+        if (ops[2].kind == X86_OPERAND_REG) {
+            x86_encode(as, 0, ops[0].size == 8, opcode + 1, ops[1].reg, &ops[0], 0);
+        } else {
+            x86_encode(as, 0, ops[0].size == 8, opcode, ops[1].reg, &ops[0], 0);
+            x86_immediate(as, ops[2].value, 1);
+        }
+    } else if (x86_is(mnemonic, "bt") || x86_is(mnemonic, "bts") || x86_is(mnemonic, "btr")) {
+        x86_expect(as, mnemonic, count, 2);
+        int digit = x86_is(mnemonic, "bt") ? 4 : x86_is(mnemonic, "bts") ? 5 : 6;
+        x86_encode(as, 0, x86_operation_size(as, mnemonic, &ops[0], NULL) == 8, 0x0FBA, digit, &ops[0], 0);
+        x86_immediate(as, ops[1].value, 1);
+    } else if (x86_is(mnemonic, "lea")) {
+        x86_expect(as, mnemonic, count, 2);
+        x86_encode(as, 0, ops[0].size == 8, 0x8D, ops[0].reg, &ops[1], 0);
+    } else if (x86_is(mnemonic, "movzx")) {
+        x86_expect(as, mnemonic, count, 2);
+        int source = ops[1].size;
+        if (source != 1 && source != 2) {
+            x86_fail(as, "Invalid source size for", mnemonic);
+        }
+        x86_encode(as, 0, ops[0].size == 8, source == 1 ? 0x0FB6 : 0x0FB7, ops[0].reg, &ops[1], x86_needs_rex(&ops[1]));
+    } else if (x86_is(mnemonic, "movsx")) {
+        x86_expect(as, mnemonic, count, 2);
+        int source = ops[1].size;
+        if (source != 1 && source != 2) {
+            x86_fail(as, "Invalid source size for", mnemonic);
+        }
+        x86_encode(as, 0, ops[0].size == 8, source == 1 ? 0x0FBE : 0x0FBF, ops[0].reg, &ops[1], x86_needs_rex(&ops[1]));
+    } else if (x86_is(mnemonic, "popcnt") || x86_is(mnemonic, "lzcnt") || x86_is(mnemonic, "tzcnt")) {
+        x86_expect(as, mnemonic, count, 2);
+        uint32_t opcode = x86_is(mnemonic, "popcnt") ? 0x0FB8 : x86_is(mnemonic, "lzcnt") ? 0x0FBD : 0x0FBC;
+        x86_encode(as, 0xF3, ops[0].size == 8, opcode, ops[0].reg, &ops[1], 0);
+    } else if (x86_is(mnemonic, "bswap")) {
+        // 0F C8+r, the register goes into the opcode behind the escape byte
+        x86_expect(as, mnemonic, count, 1);
+        if (ops[0].kind != X86_OPERAND_REG || ops[0].size < 4) {
+            x86_fail(as, "Invalid operand for", mnemonic);
+        }
+        uint8_t rex = (uint8_t) (0x40 | (ops[0].size == 8 ? 8 : 0) | ((ops[0].reg & 8) ? 1 : 0));
+        if (rex != 0x40) {
+            x86_byte(as, rex);
+        }
+        x86_byte(as, 0x0F);
+        x86_byte(as, (uint8_t) (0xC8 + (ops[0].reg & 7)));
+    } else if (x86_is(mnemonic, "movsxd")) {
+        x86_expect(as, mnemonic, count, 2);
+        x86_encode(as, 0, 1, 0x63, ops[0].reg, &ops[1], 0);
+    } else if (x86_is(mnemonic, "movq")) {
+        x86_expect(as, mnemonic, count, 2);
+        if (ops[0].kind == X86_OPERAND_XMM) {
+            x86_encode(as, 0x66, 1, 0x0F6E, ops[0].reg, &ops[1], 0);
+        } else {
+            x86_encode(as, 0x66, 1, 0x0F7E, ops[1].reg, &ops[0], 0);
+        }
+    } else if (x86_is(mnemonic, "movdqu")) {
+        x86_expect(as, mnemonic, count, 2);
+        if (ops[0].kind == X86_OPERAND_XMM) {
+            x86_encode(as, 0xF3, 0, 0x0F6F, ops[0].reg, &ops[1], 0);
+        } else {
+            x86_encode(as, 0xF3, 0, 0x0F7F, ops[1].reg, &ops[0], 0);
+        }
+    } else if (x86_is(mnemonic, "movd")) {
+        x86_expect(as, mnemonic, count, 2);
+        if (ops[0].kind == X86_OPERAND_XMM) {
+            x86_encode(as, 0x66, 0, 0x0F6E, ops[0].reg, &ops[1], 0);
+        } else {
+            x86_encode(as, 0x66, 0, 0x0F7E, ops[1].reg, &ops[0], 0);
+        }
+    } else if (x86_is(mnemonic, "pshufd")) {
+        x86_expect(as, mnemonic, count, 3);
+        x86_encode(as, 0x66, 0, 0x0F70, ops[0].reg, &ops[1], 0);
+        x86_immediate(as, ops[2].value, 1);
+    } else if (x86_is(mnemonic, "bsf") || x86_is(mnemonic, "bsr")) {
+        x86_expect(as, mnemonic, count, 2);
+        x86_encode(as, 0, ops[0].size == 8, x86_is(mnemonic, "bsf") ? 0x0FBC : 0x0FBD, ops[0].reg, &ops[1], 0);
+    } else if (x86_is(mnemonic, "movsd")) {
+        x86_expect(as, mnemonic, count, 2);
+        if (ops[0].kind == X86_OPERAND_XMM) {
+            x86_encode(as, 0xF2, 0, 0x0F10, ops[0].reg, &ops[1], 0);
+        } else {
+            x86_encode(as, 0xF2, 0, 0x0F11, ops[1].reg, &ops[0], 0);
+        }
+    } else if (x86_is(mnemonic, "cvtsi2sd")) {
+        x86_expect(as, mnemonic, count, 2);
+        x86_encode(as, 0xF2, ops[1].size != 4, 0x0F2A, ops[0].reg, &ops[1], 0);
+    } else if (x86_is(mnemonic, "roundsd")) {
+        x86_expect(as, mnemonic, count, 3);
+        x86_encode(as, 0x66, 0, 0x0F3A0B, ops[0].reg, &ops[1], 0);
+        x86_immediate(as, ops[2].value, 1);
+    } else if (x86_is(mnemonic, "vfmadd231sd")) {
+        // VEX.LIG.66.0F38.W1 B9 /r, only the register form with the first eight registers is needed
+        x86_expect(as, mnemonic, count, 3);
+        for (size_t i = 0; i < count; i++) {
+            if (ops[i].kind != X86_OPERAND_XMM || ops[i].reg >= 8) {
+                x86_fail(as, "Only xmm0 to xmm7 are supported for", mnemonic);
+            }
+        }
+        x86_byte(as, 0xC4);
+        x86_byte(as, 0xE2);
+        x86_byte(as, (uint8_t) (0x81 | (~ops[1].reg & 0xF) << 3));
+        x86_byte(as, 0xB9);
+        x86_byte(as, (uint8_t) (0xC0 | ops[0].reg << 3 | ops[2].reg));
+    } else if (x86_is(mnemonic, "cvttsd2si")) {
+        x86_expect(as, mnemonic, count, 2);
+        x86_encode(as, 0xF2, ops[0].size == 8, 0x0F2C, ops[0].reg, &ops[1], 0);
+    } else {
+        x86_fail(as, "Unknown instruction", mnemonic);
+    }
+}
+
+// Splits by commas that are neither inside an address nor inside a string
+static StringView x86_chop_operand(StringView *sv) {
+    size_t i = 0;
+    int depth = 0;
+    char quote = '\0';
+    for (; i < sv->count; i++) {
+        char c = sv->data[i];
+        if (quote != '\0') {
+            quote = c == quote ? '\0' : quote;
+        } else if (c == '"' || c == '\'' || c == '`') {
+            quote = c;
+        } else if (c == '[') {
+            depth++;
+        } else if (c == ']') {
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            break;
+        }
+    }
+    StringView operand = {.count = i, .data = sv->data};
+    sv->data += i < sv->count ? i + 1 : i;
+    sv->count -= i < sv->count ? i + 1 : i;
+    return sv_trim(operand);
+}
+
+static StringView x86_strip_comment(StringView line) {
+    char quote = '\0';
+    for (size_t i = 0; i < line.count; i++) {
+        char c = line.data[i];
+        if (quote != '\0') {
+            quote = c == quote ? '\0' : quote;
+        } else if (c == '"' || c == '\'' || c == '`') {
+            quote = c;
+        } else if (c == ';') {
+            line.count = i;
+            break;
+        }
+    }
+    return sv_trim(line);
+}
+
+static void x86_assemble_data(X86Assembler *as, char unit, int reserve, StringView operands) {
+    int size = unit == 'b' ? 1 : unit == 'w' ? 2 : unit == 'd' ? 4 : 8;
+    if (reserve) {
+        X86Value count = x86_parse_value(as, operands);
+        if (count.symbolic || count.value < 0) {
+            x86_fail(as, "Invalid reservation size", operands);
+        }
+        if (as->section == X86_BSS) {
+            as->sizes[X86_BSS] += (size_t) count.value * (size_t) size;
+        } else {
+            for (int64_t i = 0; i < count.value * size; i++) {
+                x86_byte(as, 0);
+            }
+        }
+        return;
+    }
+
+    while (operands.count > 0) {
+        StringView item = x86_chop_operand(&operands);
+        if (item.count >= 2 && (item.data[0] == '"' || item.data[0] == '`') && item.data[item.count - 1] == item.data[0]) {
+            for (size_t i = 1; i + 1 < item.count; i++) {
+                x86_byte(as, (uint8_t) item.data[i]);
+            }
+        } else {
+            x86_little_endian(as, (uint64_t) x86_parse_value(as, item).value, size);
+        }
+    }
+}
+
+static void x86_assemble_line(X86Assembler *as, StringView line) {
+    line = x86_strip_comment(line);
+    if (line.count == 0) {
+        return;
+    }
+
+    if (line.data[0] == '%') {
+        StringView directive = sv_chop_by_delim(&line, ' ');
+        if (!x86_is(directive, "%define")) {
+            x86_fail(as, "Unknown directive", directive);
+        }
+        line = sv_trim(line);
+        StringView name = x86_chop_ident(&line);
+        if (as->pass == 0) {
+            X86Value value = x86_parse_value(as, line);
+            if (value.symbolic) {
+                x86_fail(as, "Only constants can be defined, not", line);
+            }
+            x86_bind_symbol(as, name, X86_ABSOLUTE, value.value);
+        }
+        return;
+    }
+
+    StringView word = x86_chop_ident(&line);
+    line = sv_trim_left(line);
+    if (line.count > 0 && line.data[0] == ':') {
+        x86_bind_symbol(as, word, as->section, (int64_t) as->sizes[as->section]);
+        if (word.data[0] != '.') {
+            as->scope = word;
+        }
+        line.data++;
+        line.count--;
+        line = sv_trim_left(line);
+        if (line.count == 0) {
+            return;
+        }
+        word = x86_chop_ident(&line);
+        line = sv_trim_left(line);
+    }
+    if (word.count == 0) {
+        x86_fail(as, "Unexpected text", line);
+    }
+
+    if (x86_is(word, "bits") || x86_is(word, "global")) {
+        return;
+    }
+    if (x86_is(word, "segment") || x86_is(word, "section")) {
+        static const char *const names[X86_SECTIONS_COUNT] = {".text", ".rodata", ".data", ".bss"};
+        for (int i = 0; i < X86_SECTIONS_COUNT; i++) {
+            if (x86_is(line, names[i])) {
+                as->section = (X86Section) i;
+                return;
+            }
+        }
+        x86_fail(as, "Unknown section", line);
+    }
+    if (word.count == 2 && word.data[0] == 'd' && strchr("bwdq", word.data[1]) != NULL) {
+        x86_assemble_data(as, word.data[1], 0, line);
+        return;
+    }
+    if (word.count == 4 && strncmp(word.data, "res", 3) == 0 && strchr("bwdq", word.data[3]) != NULL) {
+        x86_assemble_data(as, word.data[3], 1, line);
+        return;
+    }
+    if (x86_is(word, "rep") || x86_is(word, "lock")) {
+        x86_byte(as, x86_is(word, "rep") ? 0xF3 : 0xF0);
+        word = x86_chop_ident(&line);
+        line = sv_trim_left(line);
+    }
+
+    X86Operand ops[X86_OPERANDS_CAPACITY];
+    size_t count = 0;
+    while (line.count > 0) {
+        if (count >= X86_OPERANDS_CAPACITY) {
+            x86_fail(as, "Too many operands for", word);
+        }
+        ops[count++] = x86_parse_operand(as, x86_chop_operand(&line));
+    }
+    x86_assemble_inst(as, word, ops, count);
+}
+
+static uint64_t x86_align(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+static void x86_put(uint8_t *buffer, size_t *position, uint64_t value, int size) {
+    for (int i = 0; i < size; i++) {
+        buffer[(*position)++] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+static void x86_put_program_header(uint8_t *buffer, size_t *position, uint32_t type, uint32_t flags,
+                                   uint64_t offset, uint64_t address, uint64_t file_size, uint64_t memory_size) {
+    x86_put(buffer, position, type, 4);
+    x86_put(buffer, position, flags, 4);
+    x86_put(buffer, position, offset, 8);
+    x86_put(buffer, position, address, 8);
+    x86_put(buffer, position, address, 8);
+    x86_put(buffer, position, file_size, 8);
+    x86_put(buffer, position, memory_size, 8);
+    x86_put(buffer, position, X86_PAGE_SIZE, 8);
+}
+
+static void x86_write_elf(const X86Assembler *as, uint64_t entry, const char *output_path) {
+    // The headers, .text and .rodata form a read-only executable segment, .data and .bss a writable one
+    // starting on the next page
+    uint64_t text_end = as->addresses[X86_RODATA] + as->sizes[X86_RODATA] - X86_BASE_ADDRESS;
+    uint64_t data_offset = as->addresses[X86_DATA] - X86_BASE_ADDRESS;
+    size_t file_size = data_offset + as->sizes[X86_DATA];
+    uint8_t *buffer = calloc(file_size, 1);
+    assert(buffer != NULL && "x86_write_elf: out of memory");
+
+    size_t position = 0;
+    const uint8_t ident[16] = {0x7F, 'E', 'L', 'F', 2, 1, 1};
+    memcpy(buffer, ident, sizeof(ident));
+    position += sizeof(ident);
+    x86_put(buffer, &position, 2, 2); // ET_EXEC
+    x86_put(buffer, &position, 62, 2); // EM_X86_64
+    x86_put(buffer, &position, 1, 4);
+    x86_put(buffer, &position, entry, 8);
+    x86_put(buffer, &position, X86_ELF_HEADER_SIZE, 8);
+    x86_put(buffer, &position, 0, 8);
+    x86_put(buffer, &position, 0, 4);
+    x86_put(buffer, &position, X86_ELF_HEADER_SIZE, 2);
+    x86_put(buffer, &position, X86_PROGRAM_HEADER_SIZE, 2);
+    x86_put(buffer, &position, X86_PROGRAM_HEADERS_COUNT, 2);
+    x86_put(buffer, &position, 64, 2);
+    x86_put(buffer, &position, 0, 2);
+    x86_put(buffer, &position, 0, 2);
+
+    x86_put_program_header(buffer, &position, 1, 5, 0, X86_BASE_ADDRESS, text_end, text_end);
+    x86_put_program_header(buffer, &position, 1, 6, data_offset, as->addresses[X86_DATA], as->sizes[X86_DATA],
+                           as->addresses[X86_BSS] + as->sizes[X86_BSS] - as->addresses[X86_DATA]);
+    x86_put_program_header(buffer, &position, 0x6474E551, 6, 0, 0, 0, 0); // PT_GNU_STACK, not executable
+    assert(position == X86_HEADERS_SIZE);
+
+    for (int i = 0; i < X86_BSS; i++) {
+        if (as->sizes[i] > 0) {
+            memcpy(buffer + (as->addresses[i] - X86_BASE_ADDRESS), as->bytes[i], as->sizes[i]);
+        }
+    }
+
+    FILE *file = fopen(output_path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "ERROR: Could not open file '%s' : %s\n", output_path, strerror(errno));
+        exit(1);
+    }
+    if (fwrite(buffer, 1, file_size, file) != file_size) {
+        fprintf(stderr, "ERROR: Could not write file '%s' : %s\n", output_path, strerror(errno));
+        exit(1);
+    }
+    fclose(file);
+    free(buffer);
+
+#ifdef BASM_MMAP
+    chmod(output_path, 0755);
+#endif
+}
+
+void x86_64_assemble(StringView source, const char *source_name, const char *output_path) {
+    X86Assembler as = {.source_name = source_name};
+    as.symbols_capacity = 1024;
+    as.symbols = calloc(as.symbols_capacity, sizeof(as.symbols[0]));
+    assert(as.symbols != NULL && "x86_64_assemble: out of memory");
+
+    size_t sizes[X86_SECTIONS_COUNT] = {0};
+    for (as.pass = 0; as.pass < 2; as.pass++) {
+        // The first pass only measures, every form is picked without knowing addresses so both passes agree
+        memset(as.sizes, 0, sizeof(as.sizes));
+        as.section = X86_TEXT;
+        as.scope = cstr_as_sv("");
+        as.line_number = 0;
+
+        StringView input = source;
+        while (input.count > 0) {
+            as.line_number++;
+            x86_assemble_line(&as, sv_chop_by_delim(&input, '\n'));
+        }
+
+        if (as.pass == 0) {
+            memcpy(sizes, as.sizes, sizeof(sizes));
+            as.addresses[X86_TEXT] = x86_align(X86_BASE_ADDRESS + X86_HEADERS_SIZE, 16);
+            as.addresses[X86_RODATA] = x86_align(as.addresses[X86_TEXT] + as.sizes[X86_TEXT], 16);
+            as.addresses[X86_DATA] = x86_align(as.addresses[X86_RODATA] + as.sizes[X86_RODATA], X86_PAGE_SIZE);
+            as.addresses[X86_BSS] = x86_align(as.addresses[X86_DATA] + as.sizes[X86_DATA], 16);
+        }
+    }
+    assert(memcmp(sizes, as.sizes, sizeof(sizes)) == 0 && "x86_64_assemble: passes disagree on the layout");
+
+    as.line_number = 0;
+    X86Symbol *start = x86_find_symbol(&as, cstr_as_sv(""), cstr_as_sv("_start"));
+    if (start->name.count == 0) {
+        x86_fail(&as, "No entry point", cstr_as_sv("_start"));
+    }
+    x86_write_elf(&as, as.addresses[start->section] + (uint64_t) start->offset, output_path);
+
+    for (int i = 0; i < X86_SECTIONS_COUNT; i++) {
+        free(as.bytes[i]);
+    }
+    free(as.symbols);
+}
+
+#endif
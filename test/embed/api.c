@@ -0,0 +1,184 @@
+// Drives the byterunner library the way a host does, the output is compared like the one of the programs in test/src
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "../../src/basm/libbasm.h"
+#include "../../src/basm/wrapper.h"
+
+// Adds the word on top of the stack to a counter in the memory of the VM and leaves the new counter there
+static const char counter_source[] =
+        "%entry main\n"
+        "%qword COUNTER 1000\n"
+        "main:\n"
+        "    push COUNTER\n"
+        "    read64\n"
+        "    plusi\n"
+        "    dup 0\n"
+        "    push COUNTER\n"
+        "    swap 1\n"
+        "    write64\n"
+        "    halt\n";
+
+// Spawns fibers until the VM cannot hold another one
+static const char spawn_source[] =
+        "%entry main\n"
+        "worker:\n"
+        "    halt\n"
+        "main:\n"
+        "    push 0\n"
+        "    spawn worker\n"
+        "    pop\n"
+        "    jmp main\n";
+
+static struct rlimit saved_limit;
+
+// Lets the process map only a little more than it already has, so the next large allocation fails
+static int limit_memory(size_t headroom) {
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long pages = 0;
+    if (statm == NULL || fscanf(statm, "%lu", &pages) != 1) {
+        return 0;
+    }
+    fclose(statm);
+
+    struct rlimit limit = {0};
+    getrlimit(RLIMIT_AS, &saved_limit);
+    limit.rlim_cur = pages * (size_t) sysconf(_SC_PAGESIZE) + headroom;
+    limit.rlim_max = saved_limit.rlim_max;
+    return setrlimit(RLIMIT_AS, &limit) == 0;
+}
+
+static void unlimit_memory(void) {
+    setrlimit(RLIMIT_AS, &saved_limit);
+}
+
+static void assemble_out_of_memory(void) {
+    // A million instructions need more than the headroom for the program alone
+    const char line[] = "    nop\n";
+    const char head[] = "%entry main\nmain:\n";
+    size_t lines = 1 << 20;
+    size_t source_size = sizeof(head) - 1 + lines * (sizeof(line) - 1);
+    char *source = malloc(source_size);
+    if (source == NULL) {
+        return;
+    }
+    memcpy(source, head, sizeof(head) - 1);
+    for (size_t i = 0; i < lines; i++) {
+        memcpy(source + sizeof(head) - 1 + i * (sizeof(line) - 1), line, sizeof(line) - 1);
+    }
+
+    char error[256] = {0};
+    size_t size = 0;
+    uint8_t *image = NULL;
+    if (limit_memory(4 << 20)) {
+        image = br_assemble("large.basm", source, source_size, &size, error, sizeof(error));
+        unlimit_memory();
+    }
+    const char *prefix = "ERROR: Could not allocate";
+    printf("large.basm: %s\n", image == NULL && strncmp(error, prefix, strlen(prefix)) == 0 ? prefix : "assembled");
+    free(image);
+    free(source);
+}
+
+static void spawn_out_of_memory(void) {
+    char error[256] = {0};
+    size_t size = 0;
+    uint8_t *image = br_assemble("spawn.basm", spawn_source, sizeof(spawn_source) - 1, &size, error, sizeof(error));
+    const char *message = NULL;
+    ByteRunner *br = image != NULL ? br_vm_new(image, size, &message) : NULL;
+    if (br == NULL) {
+        printf("spawn.basm: %s\n", image == NULL ? error : message);
+        free(image);
+        return;
+    }
+
+    Err err = ERR_OK;
+    if (limit_memory(4 << 20)) {
+        err = br_execute_program(br, -1);
+        unlimit_memory();
+    }
+    printf("spawn.basm: %s\n", err_as_cstr(err));
+    br_vm_free(br);
+    free(image);
+}
+
+static void assemble_error(const char *name, const char *source) {
+    char error[256] = {0};
+    size_t size = 0;
+    uint8_t *image = br_assemble(name, source, strlen(source), &size, error, sizeof(error));
+    printf("%s: %s\n", name, image == NULL ? error : "assembled");
+    free(image);
+}
+
+static void load_error(const char *name, const uint8_t *image, size_t size) {
+    const char *message = NULL;
+    ByteRunner *br = br_vm_new(image, size, &message);
+    printf("%s: %s\n", name, br == NULL ? message : "loaded");
+    if (br != NULL) {
+        br_vm_free(br);
+    }
+}
+
+int main(void) {
+    assemble_error("unknown.basm", "%entry main\nmain:\n    frobnicate 1\n    halt\n");
+    assemble_error("include.basm", "%include \"./test/embed/missing.hasm\"\n%entry main\nmain:\n    halt\n");
+
+    char error[256] = {0};
+    size_t size = 0;
+    uint8_t *image = br_assemble("counter.basm", counter_source, sizeof(counter_source) - 1, &size, error,
+                                 sizeof(error));
+    if (image == NULL) {
+        printf("counter.basm: %s\n", error);
+        return 1;
+    }
+
+    load_error("empty image", image, 0);
+    load_error("truncated image", image, size - 1);
+    load_error("half an image", image, size / 2);
+
+    assemble_out_of_memory();
+    spawn_out_of_memory();
+
+    // Every VM runs the same instructions in place, but the counter lives in the memory of each
+    ByteRunner *vms[3] = {0};
+    InstAddr entry = 0;
+    for (size_t i = 0; i < 3; i++) {
+        const char *message = NULL;
+        vms[i] = br_vm_new(image, size, &message);
+        if (vms[i] == NULL) {
+            printf("vm %zu: %s\n", i, message);
+            return 1;
+        }
+        entry = vms[i]->ip;
+    }
+
+    for (size_t round = 0; round < 2; round++) {
+        for (size_t i = 0; i < 3; i++) {
+            ByteRunner *br = vms[i];
+            br->ip = entry;
+            br->halt = 0;
+            br->stack_size = 0;
+            br->stack[br->stack_size++].as_u64 = i + 1;
+            Err err = br_execute_program(br, -1);
+            printf("vm %zu round %zu: %s %"PRIu64"\n", i, round, err_as_cstr(err), br->stack[br->stack_size - 1].as_u64);
+        }
+    }
+
+    // The table of natives is fixed, the host learns when it is full instead of writing past it
+    size_t pushed = 0;
+    Err err = ERR_OK;
+    while ((err = br_push_native(vms[0], NULL)) == ERR_OK) {
+        pushed++;
+    }
+    printf("natives: %s after %zu more\n", err_as_cstr(err), pushed);
+
+    for (size_t i = 0; i < 3; i++) {
+        br_vm_free(vms[i]);
+    }
+    free(image);
+    return 0;
+}
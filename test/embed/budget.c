@@ -0,0 +1,152 @@
+// Runs programs under small budgets until they stop and compares them with a run that was never interrupted
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../src/basm/libbasm.h"
+#include "../../src/basm/wrapper.h"
+
+// Two fibers log their countdowns into the memory while main runs a straight line longer than the small budgets,
+// so the runs get cut in the middle and the fiber switches land on the edges of the budgets
+static const char fibers_source[] =
+        "%entry main\n"
+        "%qword NEXT 0\n"
+        "countdown:\n"
+        "    push 0\n"
+        "countdown_loop:\n"
+        "    push NEXT\n"
+        "    read64\n"
+        "    dup 0\n"
+        "    push 1024\n"
+        "    plusi\n"
+        "    dup 3\n"
+        "    write64\n"
+        "    push 8\n"
+        "    plusi\n"
+        "    push NEXT\n"
+        "    swap 1\n"
+        "    write64\n"
+        "    yield\n"
+        "    dup 1\n"
+        "    plusi\n"
+        "    swap 1\n"
+        "    push 1\n"
+        "    minusi\n"
+        "    swap 1\n"
+        "    dup 1\n"
+        "    push 0\n"
+        "    eqi\n"
+        "    not\n"
+        "    jmpif countdown_loop\n"
+        "    halt\n"
+        "main:\n"
+        "    push 3\n"
+        "    spawn countdown\n"
+        "    push 5\n"
+        "    spawn countdown\n"
+        "    push 7\n"
+        "    dup 0\n"
+        "    multi\n"
+        "    push 3\n"
+        "    plusi\n"
+        "    dup 0\n"
+        "    push 5\n"
+        "    minusi\n"
+        "    multi\n"
+        "    push 11\n"
+        "    plusi\n"
+        "    dup 0\n"
+        "    push 2\n"
+        "    divi\n"
+        "    plusi\n"
+        "    push 13\n"
+        "    multi\n"
+        "    yield\n"
+        "    swap 2\n"
+        "    join\n"
+        "    swap 1\n"
+        "    join\n"
+        "    halt\n";
+
+// Fails in the middle of a straight line after a loop
+static const char divide_source[] =
+        "%entry main\n"
+        "main:\n"
+        "    push 4\n"
+        "main_loop:\n"
+        "    push 1\n"
+        "    minusi\n"
+        "    dup 0\n"
+        "    jmpif main_loop\n"
+        "    push 1\n"
+        "    push 2\n"
+        "    plusi\n"
+        "    swap 1\n"
+        "    divi\n"
+        "    halt\n";
+
+static ByteRunner *load(const uint8_t *image, size_t size) {
+    const char *message = NULL;
+    ByteRunner *br = br_vm_new(image, size, &message);
+    if (br == NULL) {
+        printf("ERROR: %s\n", message);
+        exit(1);
+    }
+    return br;
+}
+
+static int same_state(const ByteRunner *a, const ByteRunner *b) {
+    return a->halt == b->halt && a->ip == b->ip && a->stack_size == b->stack_size
+           && memcmp(a->stack, b->stack, a->stack_size * sizeof(a->stack[0])) == 0
+           && memcmp(a->memory, b->memory, BR_MEMORY_CAPACITY) == 0;
+}
+
+static void compare_budgets(const char *name, const char *source, size_t source_size) {
+    char error[256] = {0};
+    size_t size = 0;
+    uint8_t *image = br_assemble(name, source, source_size, &size, error, sizeof(error));
+    if (image == NULL) {
+        printf("%s\n", error);
+        exit(1);
+    }
+
+    // A budget that cannot run out behaves like an uninterrupted run and tells how many instructions it took
+    ByteRunner *reference = load(image, size);
+    uint64_t budget = UINT64_MAX;
+    Err expected = br_execute_budget(reference, &budget);
+    uint64_t instructions = UINT64_MAX - budget;
+    printf("%s: %s after %"PRIu64" instructions, stack", name, err_as_cstr(expected), instructions);
+    for (size_t i = 0; i < reference->stack_size; i++) {
+        printf(" %"PRIi64, reference->stack[i].as_i64);
+    }
+    printf("\n");
+
+    static const uint64_t budgets[] = {1, 2, 3, 5, 8, 13, 100};
+    for (size_t i = 0; i < sizeof(budgets) / sizeof(budgets[0]); i++) {
+        ByteRunner *br = load(image, size);
+        uint64_t used = 0;
+        size_t calls = 0;
+        Err err = ERR_YIELDED;
+        while (err == ERR_YIELDED) {
+            budget = budgets[i];
+            err = br_execute_budget(br, &budget);
+            used += budgets[i] - budget;
+            calls++;
+        }
+
+        printf("  budget %"PRIu64": %s after %"PRIu64" instructions in %zu calls, %s\n",
+               budgets[i], err_as_cstr(err), used, calls,
+               err == expected && used == instructions && same_state(br, reference) ? "same" : "DIFFERENT");
+        br_vm_free(br);
+    }
+
+    br_vm_free(reference);
+    free(image);
+}
+
+int main(void) {
+    compare_budgets("fibers.basm", fibers_source, sizeof(fibers_source) - 1);
+    compare_budgets("divide.basm", divide_source, sizeof(divide_source) - 1);
+    return 0;
+}